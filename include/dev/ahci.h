@@ -0,0 +1,40 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __NK_AHCI
+#define __NK_AHCI
+
+/*
+  AHCI SATA controllers
+
+  Each ATA disk on an AHCI port is registered as a block device
+  named ahci<controller>-<port>.   Transfers are DMA and complete
+  via interrupt, in any order.   If the controller and the drive
+  both support native command queuing, up to the drive's queue
+  depth of commands are outstanding at once, otherwise they are
+  still queued in the controller, but done one at a time.
+*/
+
+int  nk_ahci_init(struct naut_info *naut);
+void nk_ahci_deinit();
+
+// requests, queue depth, errors, and CPU cycles per MB for each disk
+void nk_ahci_dump(void);
+
+#endif
@@ -24,6 +24,7 @@
 #define __APIC_H__
 
 #include <nautilus/naut_types.h>
+#include <nautilus/trace.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -326,6 +327,7 @@ apic_ipi (struct apic_dev * apic,
           uint_t remote_id,
           uint_t vector)
 {
+    NK_TRACE(NK_TRACE_IPI, vector, remote_id, 0);
     apic_write_icr(apic,
 		   remote_id,
 		   APIC_DEL_MODE_FIXED | vector);
@@ -334,6 +336,7 @@ apic_ipi (struct apic_dev * apic,
 static inline void
 apic_bcast_ipi (struct apic_dev * apic, uint_t vector)
 {
+    NK_TRACE(NK_TRACE_IPI, vector, -1UL, 0);
     apic_write_icr(apic,
 		   0,
 		   APIC_IPI_OTHERS | APIC_DEL_MODE_FIXED | vector);
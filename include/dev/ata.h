@@ -30,12 +30,16 @@
   the first legacy-compatible controller.  The controller
   must support LBA48.   
 
-  And to be clear, "basic" here means PIO so both SLOW and 
-  BUSY WAITING
+  If it is a PCI IDE controller that can bus master, transfers
+  are DMA and interrupt driven.   Otherwise, "basic" here means
+  PIO so both SLOW and BUSY WAITING
 */
 
 int  nk_ata_init(struct naut_info *naut);
 void nk_ata_deinit();
 
+// requests, errors, and CPU cycles per MB for each drive
+void nk_ata_dump(void);
+
 
 #endif
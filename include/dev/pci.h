@@ -166,6 +166,7 @@ struct pci_cfg_space {
 
 struct pci_dev {
     uint32_t num;
+    uint32_t fun;   // each function of a multifunction device is a pci_dev
     struct pci_bus * bus;
     struct list_head dev_node;
     struct pci_cfg_space cfg;
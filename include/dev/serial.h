@@ -35,6 +35,8 @@
 void serial_putchar(unsigned char c);
 void serial_write(const char *buf);
 void serial_puts(const char *buf);
+// wait until everything queued has gone to the chip
+void serial_flush(void);
 void serial_print(const char * format, ...);
 
 void serial_printlevel(int level, const char * format, ...);
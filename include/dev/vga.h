@@ -67,6 +67,16 @@ static inline void vga_write_screen(uint8_t x, uint8_t y, uint16_t val)
   *(((uint16_t *)VGA_BASE_ADDR)+y*VGA_WIDTH+x) = val;
 }
 
+static inline void vga_write_span(uint8_t x, uint8_t y, uint16_t *src, uint8_t n)
+{
+  memcpy(((uint16_t *)VGA_BASE_ADDR)+y*VGA_WIDTH+x, src, n*sizeof(uint16_t));
+}
+
+static inline void vga_read_span(uint8_t x, uint8_t y, uint16_t *dest, uint8_t n)
+{
+  memcpy(dest, ((uint16_t *)VGA_BASE_ADDR)+y*VGA_WIDTH+x, n*sizeof(uint16_t));
+}
+
 static inline void vga_clear_screen(uint16_t val)
 {
   int i;
@@ -0,0 +1,9 @@
+#ifndef __VIRTIO_BLK
+#define __VIRTIO_BLK
+
+struct virtio_pci_dev;
+
+// bring up the block device found by virtio_pci_init()
+int virtio_blk_init(struct virtio_pci_dev *dev);
+
+#endif
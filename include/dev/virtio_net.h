@@ -0,0 +1,17 @@
+#ifndef __VIRTIO_NET
+#define __VIRTIO_NET
+
+struct virtio_pci_dev;
+
+// bring up the network device found by virtio_pci_init()
+int virtio_net_init(struct virtio_pci_dev *dev);
+
+// Busy-poll mode: a thread bound to cpu drains both queues and
+// batches the doorbell writes, and the device stops interrupting.
+// Intended for a core that has been set aside for the NIC.
+// cpu<0 returns the device to interrupt-driven operation.
+int virtio_net_poll(char *name, int cpu);
+
+void virtio_net_dump_stats(char *name);
+
+#endif
@@ -1,13 +1,86 @@
 #ifndef __VIRTIO_PCI
 #define __VIRTIO_PCI
 
+#include <nautilus/spinlock.h>
+
 #define MAX_VRINGS 2
 
 enum virtio_pci_dev_type { VIRTIO_PCI_NET, VIRTIO_PCI_BLOCK, VIRTIO_PCI_OTHER };
 
-struct virtio_pci_vring {
-  uint64_t size_bytes;
-  uint8_t data[0];
+// Legacy (0.9.5) register layout in the I/O BAR
+#define VIRTIO_PCI_HOST_FEATURES  0x00  // 32 bit
+#define VIRTIO_PCI_GUEST_FEATURES 0x04  // 32 bit
+#define VIRTIO_PCI_QUEUE_PFN      0x08  // 32 bit
+#define VIRTIO_PCI_QUEUE_NUM      0x0c  // 16 bit
+#define VIRTIO_PCI_QUEUE_SEL      0x0e  // 16 bit
+#define VIRTIO_PCI_QUEUE_NOTIFY   0x10  // 16 bit
+#define VIRTIO_PCI_STATUS         0x12  // 8 bit
+#define VIRTIO_PCI_ISR            0x13  // 8 bit, read clears
+#define VIRTIO_MSI_CONFIG_VECTOR  0x14  // 16 bit, only with MSI-X enabled
+#define VIRTIO_MSI_QUEUE_VECTOR   0x16  // 16 bit, only with MSI-X enabled
+#define VIRTIO_MSI_NO_VECTOR      0xffff
+
+// device-specific config follows the common header
+#define VIRTIO_PCI_CONFIG(dev) ((dev)->msix_enabled ? 0x18 : 0x14)
+
+#define VIRTIO_STATUS_ACK         0x01
+#define VIRTIO_STATUS_DRIVER      0x02
+#define VIRTIO_STATUS_DRIVER_OK   0x04
+#define VIRTIO_STATUS_FAILED      0x80
+
+#define VIRTIO_PCI_QUEUE_ADDR_SHIFT 12
+#define VIRTIO_PCI_VRING_ALIGN      4096
+
+struct virtq_desc {
+  uint64_t addr;
+  uint32_t len;
+#define VIRTQ_DESC_F_NEXT  1
+#define VIRTQ_DESC_F_WRITE 2   // device writes this buffer
+  uint16_t flags;
+  uint16_t next;
+} __packed;
+
+struct virtq_avail {
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+  uint16_t flags;
+  uint16_t idx;
+  uint16_t ring[];
+  // uint16_t used_event follows the ring
+} __packed;
+
+struct virtq_used_elem {
+  uint32_t id;   // head of the completed descriptor chain
+  uint32_t len;  // bytes written by the device
+} __packed;
+
+struct virtq_used {
+#define VIRTQ_USED_F_NO_NOTIFY 1
+  // written by the device
+  volatile uint16_t flags;
+  volatile uint16_t idx;
+  struct virtq_used_elem ring[];
+  // uint16_t avail_event follows the ring
+} __packed;
+
+struct virtio_pci_virtq {
+  uint16_t qidx;
+  uint16_t qsz;
+
+  void     *mem;         // as allocated
+  uint64_t size_bytes;   // of the page-aligned ring area
+
+  struct virtq_desc  *desc;
+  struct virtq_avail *avail;
+  struct virtq_used  *used;
+
+  // descriptors not in use are chained through next
+  uint16_t free_head;
+  uint16_t num_free;
+
+  // the used ring entry we will look at next
+  uint16_t last_used;
+
+  spinlock_t lock;
 };
 
 struct virtio_pci_dev {
@@ -23,17 +96,59 @@ struct virtio_pci_dev {
 
   // Where registers are mapped into the I/O address space
   uint16_t  ioport_start;
-  uint16_t  ioport_end;  
+  uint16_t  ioport_end;
 
   // Where registers are mapped into the physical memory address space
   uint64_t  mem_start;
   uint64_t  mem_end;
 
+  // MSI-X, if the device has it and we managed to turn it on
+  uint8_t   msix_enabled;
+  uint64_t  msix_table;
+
   // The number of vrings
   uint8_t num_vrings;
-  struct virtio_pci_dev_vring *vring[2];
+  struct virtio_pci_virtq vring[MAX_VRINGS];
 };
 
+// register access
+#define virtio_pci_read8(d,o)     inb((d)->ioport_start+(o))
+#define virtio_pci_read16(d,o)    inw((d)->ioport_start+(o))
+#define virtio_pci_read32(d,o)    inl((d)->ioport_start+(o))
+#define virtio_pci_write8(d,o,v)  outb((v),(d)->ioport_start+(o))
+#define virtio_pci_write16(d,o,v) outw((v),(d)->ioport_start+(o))
+#define virtio_pci_write32(d,o,v) outl((v),(d)->ioport_start+(o))
+
+// reset, then acknowledge and negotiate features
+// returns the features accepted, the subset of wanted the device offers
+uint32_t virtio_pci_negotiate(struct virtio_pci_dev *dev, uint32_t wanted);
+
+// tell the device we are ready to go
+void virtio_pci_driver_ok(struct virtio_pci_dev *dev);
+
+// set up virtqueue qidx at the size the device dictates
+int  virtio_pci_virtq_init(struct virtio_pci_dev *dev, uint16_t qidx);
+void virtio_pci_virtq_deinit(struct virtio_pci_dev *dev, uint16_t qidx);
+
+// descriptor management, called with the virtq lock held
+// alloc returns -1 if there are fewer than n free descriptors,
+// otherwise the head of a chain of n descriptors linked via next
+int  virtio_pci_desc_chain_alloc(struct virtio_pci_virtq *vq, int n);
+void virtio_pci_desc_chain_free(struct virtio_pci_virtq *vq, uint16_t head);
+
+// make a chain available to the device, called with the lock held
+void virtio_pci_virtq_submit(struct virtio_pci_virtq *vq, uint16_t head);
+
+// notify the device if it wants to hear about new buffers
+void virtio_pci_virtq_kick(struct virtio_pci_dev *dev, struct virtio_pci_virtq *vq);
+
+// completion interrupt, via MSI-X if possible, otherwise INTx
+// with INTx, the handler must read VIRTIO_PCI_ISR to find out if
+// the interrupt is ours and to deassert it
+int virtio_pci_setup_interrupt(struct virtio_pci_dev *dev,
+			       int (*handler)(excp_entry_t *, excp_vec_t, void *),
+			       void *state);
+
 int virtio_pci_init(struct naut_info * naut);
 int virtio_pci_deinit();
 
@@ -0,0 +1,111 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/naut_types.h>
+
+/*
+  Micro-benchmark harness.   A benchmark is a body that does one
+  iteration of the thing being measured, registered with NK_BENCH()
+  anywhere in the kernel.   Running it starts a thread bound to each
+  CPU of the chosen set, which calls setup, runs the body for warmup
+  iterations that are thrown away and then for iters iterations that
+  are each timed with the TSC, and calls teardown.   The cost of
+  reading the TSC, measured on that CPU just before, is subtracted
+  from every sample.   A body that has to time itself (because what
+  it measures ends on another CPU, say) is registered with
+  NK_BENCH_SELF_TIMED() and returns its sample in cycles, and is
+  expected to subtract ctx->tsc_overhead itself.
+
+  Results are min, median, p99, max and mean, in cycles, per CPU,
+  printed to the console or written over serial as CSV or JSON.
+*/
+
+struct nk_bench;
+
+struct nk_bench_ctx {
+    const struct nk_bench *bench;
+    int                    cpu;
+    uint64_t               iter;          // of the current phase
+    int                    warmup;        // in the warmup phase
+    uint64_t               tsc_overhead;  // cycles for back-to-back rdtsc
+    void                  *state;         // for setup, body and teardown
+};
+
+struct nk_bench {
+    const char *name;
+    const char *desc;
+    // exactly one of these
+    void      (*body)(struct nk_bench_ctx *ctx);
+    uint64_t  (*timed_body)(struct nk_bench_ctx *ctx);
+    // optional, nonzero from setup skips the CPU
+    int       (*setup)(struct nk_bench_ctx *ctx);
+    void      (*teardown)(struct nk_bench_ctx *ctx);
+    // optional defaults, 0 for the harness's
+    uint64_t    iters;
+    uint64_t    warmup;
+} __attribute__((aligned(8)));
+
+#define NK_BENCH_DEFINE(var, ...)                                       \
+    static const struct nk_bench var                                    \
+    __attribute__((used, section("_nk_benchmarks"), aligned(8))) = { __VA_ARGS__ }
+
+// NK_BENCH(spinlock, "uncontended lock+unlock", spinlock_body, .iters=100000)
+#define NK_BENCH(n, d, f, ...)                                          \
+    NK_BENCH_DEFINE(_nk_bench_##n, .name = #n, .desc = d, .body = f, ##__VA_ARGS__)
+
+#define NK_BENCH_SELF_TIMED(n, d, f, ...)                               \
+    NK_BENCH_DEFINE(_nk_bench_##n, .name = #n, .desc = d, .timed_body = f, ##__VA_ARGS__)
+
+enum nk_bench_format {
+    NK_BENCH_TEXT = 0,   // console
+    NK_BENCH_CSV,        // serial
+    NK_BENCH_JSON,       // serial, one object per line
+};
+
+struct nk_bench_config {
+    uint64_t             iters;    // 0 for the benchmark's default
+    uint64_t             warmup;   // -1 for the benchmark's default
+    uint64_t             cpus[NAUT_CONFIG_MAX_CPUS / 64 + 1];  // bitmap, empty for the current CPU
+    enum nk_bench_format format;
+};
+
+void nk_bench_config_init(struct nk_bench_config *cfg);
+
+// "0-3,6" style, returns -1 on a malformed list or absent CPU
+int  nk_bench_parse_cpus(struct nk_bench_config *cfg, char *list);
+
+const struct nk_bench *nk_bench_find(char *name);
+void nk_bench_map(void (*f)(const struct nk_bench *b, void *state), void *state);
+void nk_bench_list(void);
+
+// name "all" runs every benchmark
+int  nk_bench_run(char *name, struct nk_bench_config *cfg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
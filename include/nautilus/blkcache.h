@@ -0,0 +1,135 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __BLKCACHE_H__
+#define __BLKCACHE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/list.h>
+#include <nautilus/mutex.h>
+#include <nautilus/blkdev.h>
+
+/*
+ * Block buffer cache
+ *
+ * Sits between a filesystem and its block device.  The unit of
+ * caching is the filesystem's choice (its block, or the device's
+ * block), and must be a multiple of the device block size.
+ * Buffers live in a hash table keyed by block number, and on an
+ * LRU list that drives replacement.
+ *
+ * nk_bcache_get() returns a referenced buffer, read in if needed,
+ * which cannot be evicted until it is released by nk_bcache_put().
+ * This lets metadata such as inodes and group descriptors be
+ * updated in place.  nk_bcache_read() and nk_bcache_write() copy
+ * runs of whole blocks, and turn runs of misses into single
+ * device requests.  nk_bcache_read() drops the cache lock while
+ * it waits for such a request, so readers overlap their I/O.
+ *
+ * Writes mark buffers dirty, and they reach the device when they
+ * are evicted, when too many are dirty, or on nk_bcache_flush(),
+ * which writes them in block order, coalescing adjacent blocks.
+ * A cache created with NK_BCACHE_WRITE_THROUGH writes immediately.
+ * Runs much longer than the cache could usefully hold, in either
+ * direction, go straight between the caller and the device.
+ *
+ * All operations may block, so none can be used in interrupt
+ * context.
+ */
+
+#define NK_BCACHE_WRITE_THROUGH 0x1
+
+// what filesystems ask for, per the configured policy
+#ifdef NAUT_CONFIG_BLOCK_CACHE_WRITE_THROUGH
+#define NK_BCACHE_DEFAULT_FLAGS NK_BCACHE_WRITE_THROUGH
+#else
+#define NK_BCACHE_DEFAULT_FLAGS 0
+#endif
+
+struct nk_bcache_buf {
+    uint64_t          blocknum;
+    uint32_t          refcount;
+    uint32_t          flags;
+#define NK_BCACHE_BUF_VALID 0x1   // data is that of blocknum, and we are hashed
+#define NK_BCACHE_BUF_DIRTY 0x2   // data is newer than the device's
+    struct list_head  hash_node;
+    struct list_head  lru_node;
+    uint8_t          *data;
+};
+
+struct nk_bcache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t writebacks;   // dirty blocks written
+    uint64_t dev_reads;    // device requests
+    uint64_t dev_writes;
+};
+
+struct nk_bcache {
+    char                 name[32];
+    struct nk_block_dev *dev;
+    uint64_t             flags;
+
+    uint32_t             block_size;     // of the cache unit, in bytes
+    uint32_t             dev_per_block;  // device blocks per cache unit
+
+    uint64_t             max_bufs;
+    uint64_t             num_bufs;
+    uint64_t             num_dirty;
+
+    uint64_t             wgen;           // bumped by every nk_bcache_write()
+
+    uint64_t             hash_bits;
+    struct list_head    *hash;
+    struct list_head     lru;            // most recently used first
+
+    nk_mutex_t           lock;
+    struct list_head     cache_node;
+
+    struct nk_bcache_stats stats;
+};
+
+// size in bytes, 0 for the configured default
+struct nk_bcache *nk_bcache_create(char *name, struct nk_block_dev *dev, uint32_t block_size,
+                                   uint64_t size, uint64_t flags);
+// writes back anything dirty first
+int  nk_bcache_destroy(struct nk_bcache *c);
+
+// referenced access, put with dirty!=0 if the data was changed
+struct nk_bcache_buf *nk_bcache_get(struct nk_bcache *c, uint64_t blocknum);
+int  nk_bcache_put(struct nk_bcache *c, struct nk_bcache_buf *b, int dirty);
+
+// copy whole blocks in and out
+int  nk_bcache_read(struct nk_bcache *c, uint64_t blocknum, uint64_t count, void *dest);
+int  nk_bcache_write(struct nk_bcache *c, uint64_t blocknum, uint64_t count, void *src);
+
+int  nk_bcache_flush(struct nk_bcache *c);
+int  nk_bcache_flush_all(void);
+
+void nk_bcache_dump(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -39,9 +39,11 @@ struct nk_block_dev_int {
     // blockdev-specific interface - set to zero if not available
     // an interface either succeeds (returns zero) or fails (returns -1) 
     // in any case, it returns immediately
+    // a transfer that was started calls back with a status of zero if
+    // it completed, and -1 if it failed
     int (*get_characteristics)(void *state, struct nk_block_dev_characteristics *c);
-    int (*read_blocks)(void *state, uint64_t blocknum, uint64_t count, uint8_t *dest, void (*callback)(void *), void *context);
-    int (*write_blocks)(void *state, uint64_t blocknum, uint64_t count, uint8_t *src, void (*callback)(void *), void *context);
+    int (*read_blocks)(void *state, uint64_t blocknum, uint64_t count, uint8_t *dest, void (*callback)(void *, int), void *context);
+    int (*write_blocks)(void *state, uint64_t blocknum, uint64_t count, uint8_t *src, void (*callback)(void *, int), void *context);
 };
 
 
@@ -66,7 +68,7 @@ int nk_block_dev_read(struct nk_block_dev *dev,
 		      uint64_t count, 
 		      void   *dest, 
 		      nk_dev_request_type_t type,
-		      void (*callback)(void *), 
+		      void (*callback)(void *, int), 
 		      void *state);
 
 int nk_block_dev_write(struct nk_block_dev *dev, 
@@ -74,7 +76,7 @@ int nk_block_dev_write(struct nk_block_dev *dev,
 		       uint64_t count, 
 		       void   *src,  
 		       nk_dev_request_type_t type,
-		       void (*callback)(void *), 
+		       void (*callback)(void *, int), 
 		       void *state);
 
 
@@ -0,0 +1,84 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __BRLOCK_H__
+#define __BRLOCK_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/spinlock.h>
+#include <nautilus/ticketlock.h>
+#include <nautilus/mutex.h>
+#include <nautilus/thread.h>
+
+/*
+ * Scalable ("big reader") reader-writer lock
+ *
+ * Readers announce themselves by incrementing a counter in their
+ * own cache line, either one per CPU or one per NUMA domain, so
+ * concurrent readers on different CPUs never share a line.  A
+ * writer raises an intent flag, which turns away new readers
+ * (writer preference), and then waits for the reader counters to
+ * drain.  Writers are serialized FIFO among themselves.
+ *
+ * Because a reader's increment and decrement may occur on different
+ * CPUs (the thread can migrate while holding the lock), individual
+ * counters may go negative.  Only their sum is meaningful.
+ *
+ * With NK_BRLOCK_BLOCKING, readers turned away by a writer and
+ * writers waiting on each other sleep instead of spinning, and a
+ * writer waiting for readers to drain yields after a bounded spin.
+ * Blocking locks must not be used from interrupt context.
+ */
+
+#define NK_BRLOCK_PER_NODE 0x1   // one reader counter per NUMA domain, not per CPU
+#define NK_BRLOCK_BLOCKING 0x2   // sleep rather than spin when waiting
+
+struct nk_brlock_reader {
+    volatile sint64_t count;
+} __align(64);
+
+typedef struct nk_brlock {
+    volatile uint32_t         writer;     // a writer holds or is acquiring the lock
+    int                       flags;
+    int                       nslots;
+    struct nk_brlock_reader * readers;    // nslots cache-line-sized counters
+    void *                    readers_mem;
+    nk_ticket_lock_t          wticket;    // writer serialization, spinning
+    nk_mutex_t                wmutex;     // writer serialization, blocking
+    nk_thread_queue_t         waitq;      // readers blocked behind a writer
+} nk_brlock_t;
+
+int  nk_brlock_init(nk_brlock_t * l, int flags);
+int  nk_brlock_deinit(nk_brlock_t * l);
+
+void nk_brlock_rd_lock(nk_brlock_t * l);
+void nk_brlock_rd_unlock(nk_brlock_t * l);
+void nk_brlock_wr_lock(nk_brlock_t * l);
+void nk_brlock_wr_unlock(nk_brlock_t * l);
+
+void nk_brlock_test(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -41,6 +41,9 @@ struct nk_char_dev_int {
     // returns 1 on success, 0 for would block, -1 for error
     int (*read)(void *state, uint8_t *dest);
     int (*write)(void *state, uint8_t *src);
+    // optional, write up to count bytes at once
+    // returns the number written, 0 for would block, -1 for error
+    int (*write_buf)(void *state, uint8_t *src, uint64_t count);
 };
 
 
@@ -0,0 +1,87 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __COHORT_LOCK_H__
+#define __COHORT_LOCK_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/naut_types.h>
+#include <nautilus/intrinsics.h>
+
+/*
+ * NUMA-aware cohort lock
+ *
+ * Contenders first queue, MCS-style, on a local queue belonging to
+ * their NUMA domain, and only the head of each local queue competes
+ * for the global lock.  On release, the holder passes the lock to
+ * its local successor without ever releasing the global lock, up to
+ * NK_COHORT_BATCH times in a row, so the lock and the data it
+ * protects stay in one socket's caches while there is local demand.
+ *
+ * Queue nodes come from a small per-CPU pool rather than from the
+ * caller, so the lock has the same interface as the other NK_LOCK_T
+ * candidates, and a zeroed lock is a valid unlocked lock.  The lock
+ * may be released on a different CPU than it was acquired on.  If a
+ * CPU's pool is exhausted, the contender takes the global lock
+ * directly and forgoes local hand-off for that acquisition.
+ *
+ * The lock must not be used from interrupt context.
+ */
+
+#ifdef NAUT_CONFIG_COHORT_LOCK_DOMAINS
+#define NK_COHORT_DOMAINS NAUT_CONFIG_COHORT_LOCK_DOMAINS
+#else
+#define NK_COHORT_DOMAINS 4
+#endif
+
+#ifdef NAUT_CONFIG_COHORT_LOCK_BATCH
+#define NK_COHORT_BATCH NAUT_CONFIG_COHORT_LOCK_BATCH
+#else
+#define NK_COHORT_BATCH 64
+#endif
+
+struct nk_cohort_qnode {
+    struct nk_cohort_qnode * volatile next;
+    volatile uint32_t                 status;
+    uint16_t                          domain;  // local queue we are on
+    uint16_t                          slot;    // position in our CPU's pool
+    uint32_t                          cpu;     // CPU whose pool we came from
+} __align(64);
+
+typedef struct nk_cohort_lock {
+    volatile uint32_t                 global;
+    uint32_t                          batch;   // consecutive local hand-offs
+    struct nk_cohort_qnode * volatile owner;   // holder's queue node, if it has one
+    struct nk_cohort_qnode * volatile tail[NK_COHORT_DOMAINS];
+} nk_cohort_lock_t;
+
+void nk_cohort_lock_init(nk_cohort_lock_t * l);
+void nk_cohort_lock_deinit(nk_cohort_lock_t * l);
+void nk_cohort_lock(nk_cohort_lock_t * l);
+void nk_cohort_unlock(nk_cohort_lock_t * l);
+int  nk_cohort_trylock(nk_cohort_lock_t * l);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
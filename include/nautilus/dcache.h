@@ -0,0 +1,104 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __DCACHE_H__
+#define __DCACHE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/list.h>
+#include <nautilus/mutex.h>
+
+/*
+ * Name and attribute cache for the fs layer
+ *
+ * Remembers what each path component resolved to, per directory,
+ * as an ino, the filesystem's own handle for a file or directory.
+ * Components that did not resolve are remembered too, as negative
+ * entries.  Attributes (stat) are cached per ino alongside.  Once
+ * warm, resolving a path costs no calls into the filesystem at all.
+ *
+ * A filesystem opts in by providing the root, lookup, stat_ino and
+ * open_ino members of its nk_fs_int.  Everything else is done by
+ * the fs layer, which tells the cache about creates, removes, and
+ * changes to files through open descriptors.
+ *
+ * The cache lock is not held across calls into the filesystem.
+ * Instead, every invalidation bumps a generation number, and the
+ * result of a lookup is only inserted if no invalidation happened
+ * while it was in flight.
+ */
+
+struct nk_fs;
+struct nk_fs_stat;
+
+#define NK_DCACHE_NAME_LEN 64   // longer components are never cached
+
+struct nk_fs_dcache_stats {
+    uint64_t hits;
+    uint64_t neg_hits;        // hits on negative entries
+    uint64_t misses;          // component lookups that went to the fs
+    uint64_t attr_hits;
+    uint64_t attr_misses;
+    uint64_t invalidations;
+    uint64_t evictions;
+};
+
+struct nk_fs_dcache {
+    struct nk_fs      *fs;
+    uint64_t           root;
+
+    uint64_t           gen;
+
+    uint64_t           max_entries;
+    uint64_t           num_entries;
+
+    uint64_t           hash_bits;
+    struct list_head  *hash;
+    struct list_head   lru;        // most recently used first
+
+    nk_mutex_t         lock;
+
+    struct nk_fs_dcache_stats stats;
+};
+
+// max_entries 0 for the configured default
+struct nk_fs_dcache *nk_fs_dcache_create(struct nk_fs *fs, uint64_t max_entries);
+void nk_fs_dcache_destroy(struct nk_fs_dcache *c);
+
+// 0 if found and *ino is set, 1 if the path does not exist, -1 on error
+int  nk_fs_dcache_resolve(struct nk_fs_dcache *c, char *path, uint64_t *ino);
+int  nk_fs_dcache_stat(struct nk_fs_dcache *c, uint64_t ino, struct nk_fs_stat *st);
+
+// path was just created
+void nk_fs_dcache_created(struct nk_fs_dcache *c, char *path);
+// the attributes of ino have changed
+void nk_fs_dcache_changed(struct nk_fs_dcache *c, uint64_t ino);
+// forget everything, for removes and renames
+void nk_fs_dcache_purge(struct nk_fs_dcache *c);
+
+void nk_fs_dcache_dump(struct nk_fs_dcache *c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -77,6 +77,8 @@ int            nk_dev_unregister(struct nk_dev *);
 struct nk_dev *nk_dev_find(char *name);
 
 void nk_dev_wait(struct nk_dev *);
+// as above, but do not sleep if cond_check(state) is already true
+void nk_dev_wait_cond(struct nk_dev *, int (*cond_check)(void *state), void *state);
 void nk_dev_signal(struct nk_dev *);
 
 void nk_dev_dump_devices();
@@ -30,6 +30,8 @@
 #include <nautilus/printk.h>
 #include <nautilus/list.h>
 #include <nautilus/spinlock.h>
+#include <nautilus/mutex.h>
+#include <nautilus/brlock.h>
 
 #include <fs/ext2/ext2.h>
 
@@ -56,6 +58,16 @@ struct nk_fs_int {
     ssize_t  (*read_file)(void *state, void *file, void *dest, off_t offset, size_t n);
     ssize_t  (*write_file)(void *state, void *file, void *src, off_t offset, size_t n);
     void  (*close_file)(void *state, void *file);
+    int   (*sync)(void *state);   // optional, write out anything cached
+
+    // Optional, for cached path resolution (see dcache.h).  An ino
+    // is a nonzero handle that names a file or directory until it is
+    // removed.  lookup finds name in directory dir, and returns 0 if
+    // found, 1 if not, and -1 on error.
+    int   (*root)(void *state, uint64_t *ino);
+    int   (*lookup)(void *state, uint64_t dir, char *name, uint64_t *ino);
+    int   (*stat_ino)(void *state, uint64_t ino, struct nk_fs_stat *st);
+    void *(*open_ino)(void *state, uint64_t ino);
 };
 
 // This is the class for a filesystem.  It should be the first
@@ -70,7 +82,13 @@ struct nk_fs {
 
     void             *state;  // internal FS state
     struct nk_fs_int *interface;
-    
+
+    struct nk_fs_dcache *dcache;  // if the interface supports it
+
+    // Held shared by lookups, stats and reads, so readers on one
+    // filesystem do not wait on each other, and exclusive by anything
+    // that changes the filesystem (creation, removal, writes, truncation)
+    nk_brlock_t       lock;
 };
 
 int nk_fs_init();
@@ -116,8 +134,40 @@ off_t      nk_fs_seek(nk_fs_fd_t fd, off_t position, int whence);
 ssize_t    nk_fs_tell(nk_fs_fd_t fd);
 ssize_t    nk_fs_read(nk_fs_fd_t fd, void *buf, size_t len);
 ssize_t    nk_fs_write(nk_fs_fd_t fd, void *buf, size_t len);
+ssize_t    nk_fs_pread(nk_fs_fd_t fd, void *buf, size_t len, off_t offset);
+ssize_t    nk_fs_pwrite(nk_fs_fd_t fd, void *buf, size_t len, off_t offset);
+// as above, but leaving the descriptor's stream alone, for the
+// stream's own I/O
+ssize_t    _nk_fs_pread(nk_fs_fd_t fd, void *buf, size_t len, off_t offset);
+ssize_t    _nk_fs_pwrite(nk_fs_fd_t fd, void *buf, size_t len, off_t offset);
+int        nk_fs_fsync(nk_fs_fd_t fd);
 int        nk_fs_close(nk_fs_fd_t fd);
 
+//
+// Every open file is installed in a file descriptor table, at the
+// lowest free index, its file number.  A thread uses the table it was
+// bound to, which threads it creates inherit, and otherwise a default
+// table shared by everyone.  Giving a thread group, or any other set of
+// threads doing independent I/O, a table of its own means its opens and
+// closes do not contend with anyone else's.  A table must not be
+// destroyed while threads are still bound to it.  Destroying it closes
+// whatever is still open.
+//
+// nk_fs_fd_get finds an open file by number in the current table and
+// takes a reference on it, which keeps it alive across a concurrent
+// close.  It must be dropped with nk_fs_fd_put.
+//
+struct nk_fs_fd_table;
+
+struct nk_fs_fd_table *nk_fs_fd_table_create(void);
+int                    nk_fs_fd_table_destroy(struct nk_fs_fd_table *table);
+// returns the previous table, null => the default table
+struct nk_fs_fd_table *nk_fs_fd_table_bind(struct nk_fs_fd_table *table);
+
+int        nk_fs_fileno(nk_fs_fd_t fd);
+nk_fs_fd_t nk_fs_fd_get(int fileno);
+int        nk_fs_fd_put(nk_fs_fd_t fd);
+
 
 void test_fs(void);
 void init_fs(void);
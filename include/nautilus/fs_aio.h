@@ -0,0 +1,130 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __FS_AIO_H__
+#define __FS_AIO_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/spinlock.h>
+#include <nautilus/fs.h>
+
+/*
+ * Asynchronous file I/O
+ *
+ * A context has a submission ring and a completion ring.  Submitting
+ * a batch of operations returns at once, and the context's worker
+ * threads carry them out, as many at a time as there are workers, so
+ * that their device requests overlap.  The submitter keeps running.
+ *
+ * An operation completes either by having its callback invoked, or,
+ * without a callback, by posting to the completion ring, from which
+ * nk_fs_aio_reap() collects, optionally waiting.  Callbacks normally
+ * run on the worker that did the I/O.  A context created with
+ * NK_FS_AIO_COMPLETION_THREAD instead hands them to a thread of its
+ * own, so a slow callback never delays I/O.
+ *
+ * A context may be used by one thread, or shared by the members of a
+ * thread group.  At most entries operations can be outstanding, that
+ * is, submitted but not yet reaped or called back.  Operations on the
+ * same open file are carried out one at a time, operations on
+ * different files run concurrently.
+ */
+
+#define NK_FS_AIO_READ  0
+#define NK_FS_AIO_WRITE 1
+
+struct nk_fs_aio_cqe {
+    void    *priv;
+    ssize_t  result;   // bytes transferred, -1 on error
+};
+
+struct nk_fs_aio_op {
+    int          opcode;
+    nk_fs_fd_t   fd;
+    void        *buf;
+    size_t       len;
+    off_t        offset;
+    void       (*callback)(struct nk_fs_aio_cqe *cqe);  // optional
+    void        *priv;
+    int          flags;
+#define NK_FS_AIO_NO_STREAM 0x1   // leave the descriptor's stream alone
+};
+
+struct nk_fs_aio_stats {
+    uint64_t submitted;
+    uint64_t completed;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t max_inflight;   // most operations seen in progress at once
+};
+
+struct nk_fs_aio_ctx {
+    uint32_t                entries;     // power of two
+    uint64_t                flags;
+#define NK_FS_AIO_COMPLETION_THREAD 0x1
+
+    struct nk_fs_aio_op    *sq;          // waiting for a worker
+    uint32_t                sq_head;
+    uint32_t                sq_tail;
+
+    struct nk_fs_aio_cqe   *cq;          // waiting to be reaped
+    uint32_t                cq_head;
+    uint32_t                cq_tail;
+
+    struct nk_fs_aio_op    *cbq;         // waiting for the completion thread
+    uint32_t                cbq_head;
+    uint32_t                cbq_tail;
+
+    uint32_t                outstanding;
+    uint32_t                cq_owed;     // outstanding, and will post to cq
+    uint32_t                inflight;    // held by workers
+
+    uint32_t                threads;     // live workers and completion thread
+    int                     stopping;
+
+    spinlock_t              lock;
+    nk_thread_queue_t      *work_wq;     // workers sleep here
+    nk_thread_queue_t      *done_wq;     // reapers, the completion thread, and destroy
+
+    struct nk_fs_aio_stats  stats;
+};
+
+// entries is rounded up to a power of two, workers is the
+// number of operations that can be in progress at once
+struct nk_fs_aio_ctx *nk_fs_aio_create(uint32_t entries, uint32_t workers, uint64_t flags);
+// waits for everything outstanding
+int  nk_fs_aio_destroy(struct nk_fs_aio_ctx *ctx);
+
+// returns how many of the n operations were queued, -1 on error
+int  nk_fs_aio_submit(struct nk_fs_aio_ctx *ctx, struct nk_fs_aio_op *ops, int n);
+
+// collects up to max completions, waiting until there are at least
+// min of them (or fewer, if fewer can still arrive)
+int  nk_fs_aio_reap(struct nk_fs_aio_ctx *ctx, struct nk_fs_aio_cqe *cqes, int max, int min);
+
+void nk_fs_aio_dump(struct nk_fs_aio_ctx *ctx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
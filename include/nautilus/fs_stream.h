@@ -0,0 +1,121 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __FS_STREAM_H__
+#define __FS_STREAM_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/mutex.h>
+#include <nautilus/fs.h>
+
+/*
+ * Readahead and write-behind for open files
+ *
+ * nk_fs_read() and nk_fs_write() on a descriptor go through its
+ * stream.  Reads that continue where the last one left off are
+ * served from a readahead buffer, and while one buffer is being
+ * consumed, the next window of the file is already being read into
+ * the other.  The window starts small and doubles with every
+ * sequential refill, up to a maximum.  Any other read resets it.
+ *
+ * Small sequential writes are gathered into a buffer which is
+ * written asynchronously once full, while the next one fills.  At
+ * most one such write is in flight per stream, so they reach the
+ * filesystem in order.  Buffered data is written out on
+ * nk_fs_fsync(), nk_fs_close(), and before any read, truncate,
+ * stat, nk_fs_pread() or nk_fs_pwrite() through the same descriptor,
+ * and the readahead buffers are dropped before the latter two.  An error in an asynchronous
+ * write is reported by the next call on the stream.
+ *
+ * Other descriptors see buffered writes only once they are written
+ * out, and a readahead buffer is not refreshed by writes through
+ * other descriptors.  The background I/O is done by a shared aio
+ * context.
+ */
+
+struct nk_fs_stream_buf {
+    uint8_t          *data;
+    uint64_t          start;    // file offset of data[0]
+    uint64_t          len;      // valid (read) or buffered (write) bytes
+    volatile int      busy;     // I/O in flight
+    ssize_t           result;
+};
+
+struct nk_fs_stream {
+    nk_mutex_t              lock;
+
+    uint64_t                ra_size;   // capacity of each readahead buffer
+    uint64_t                wb_size;   // and of each write-behind buffer
+
+    uint64_t                next;      // where a sequential read would start
+    uint64_t                window;
+    struct nk_fs_stream_buf ra[2];
+
+    int                     cur_wb;    // the one being filled
+    struct nk_fs_stream_buf wb[2];
+
+    int                     error;     // from an asynchronous write
+};
+
+struct nk_fs_stream_stats {
+    uint64_t ra_hits;        // reads served entirely from readahead
+    uint64_t ra_misses;      // reads that had to wait for, or do, I/O
+    uint64_t ra_resets;      // non-sequential reads
+    uint64_t ra_fills;       // readahead I/Os
+    uint64_t ra_bytes;
+    uint64_t wb_writes;      // write-behind I/Os
+    uint64_t wb_bytes;
+    uint64_t wb_waits;       // writers that had to wait for one
+    uint64_t wb_errors;
+};
+
+// tuning, in bytes, applies to streams created afterwards
+// ra_max of zero disables readahead, wb of zero write-behind
+struct nk_fs_stream_tuning {
+    uint64_t ra_min;
+    uint64_t ra_max;
+    uint64_t wb;
+    uint32_t workers;        // background I/O threads, fixed at first use
+};
+
+int  nk_fs_stream_init(void);
+
+void nk_fs_stream_get_tuning(struct nk_fs_stream_tuning *t);
+int  nk_fs_stream_set_tuning(struct nk_fs_stream_tuning *t);
+
+// null if both readahead and write-behind are off
+struct nk_fs_stream *nk_fs_stream_create(int flags);
+// flushes first, returns any write error
+int     nk_fs_stream_destroy(struct nk_fs_stream *s, nk_fs_fd_t fd);
+
+ssize_t nk_fs_stream_read(struct nk_fs_stream *s, nk_fs_fd_t fd, void *buf, size_t len, off_t pos);
+ssize_t nk_fs_stream_write(struct nk_fs_stream *s, nk_fs_fd_t fd, void *buf, size_t len, off_t pos);
+// write out everything buffered, wait for it, and forget readahead
+int     nk_fs_stream_flush(struct nk_fs_stream *s, nk_fs_fd_t fd);
+
+void nk_fs_stream_dump(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,59 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __FUTEX_H__
+#define __FUTEX_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/naut_types.h>
+
+/*
+ * Futex-style wait/wake on arbitrary 32 bit words
+ *
+ * Waiters are kept in a fixed hash table of buckets keyed by the
+ * word's address, so waiting on a word needs no per-object queue.
+ * nk_futex_wait() compares the word against the expected value and
+ * goes to sleep while holding the bucket lock, so a waker that
+ * changes the word and then calls nk_futex_wake() cannot slip in
+ * between the compare and the sleep.
+ *
+ * Waiting must not be done from interrupt context.  Waking may be.
+ */
+
+#define NK_FUTEX_NO_TIMEOUT 0
+
+// returns 0 when woken, -EAGAIN if *addr != expected,
+// -ETIMEDOUT if timeout_ns (if nonzero) passed first
+int nk_futex_wait(volatile uint32_t * addr, uint32_t expected, uint64_t timeout_ns);
+
+// wakes up to n waiters on addr, returns the number woken
+int nk_futex_wake(volatile uint32_t * addr, int n);
+
+#define nk_futex_wake_all(addr) nk_futex_wake(addr, 0x7fffffff)
+
+void nk_futex_test(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
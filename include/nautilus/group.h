@@ -26,6 +26,8 @@
 #ifndef _GROUP_H_
 #define _GROUP_H_
 
+#include <nautilus/histogram.h>
+
 #define MAX_GROUP_NAME 32
 
 typedef struct nk_thread_group nk_thread_group_t;
@@ -81,4 +83,47 @@ int nk_thread_group_delete(nk_thread_group_t *group);
 // return the size of a group
 uint64_t nk_thread_group_get_size(nk_thread_group_t *group);
 
+// return the id of a group
+uint64_t nk_thread_group_get_id(nk_thread_group_t *group);
+
+// return the name of a group
+char *nk_thread_group_get_name(nk_thread_group_t *group);
+
+// apply f to every group, with the group list locked
+void nk_thread_group_map(void (*f)(nk_thread_group_t *group, void *state), void *state);
+
+// telemetry, times are in ns
+struct nk_thread_group_member_stats {
+  struct nk_hist barrier_wait;   // time spent in nk_thread_group_barrier
+  struct nk_hist change;         // nk_group_sched_change_constraints, rollbacks included
+  uint64_t       change_fails;   // changes that had to be rolled back
+  uint64_t       change_defaults;// ... all the way to the default constraints
+  struct nk_hist slice_util;     // periodic only, per mille of the slice used each period
+};
+
+struct nk_thread_group_stats {
+  // spread of the first-run times of the members within a period,
+  // recorded only for periods in which every member ran
+  struct nk_hist gang_skew;
+  uint64_t       gang_partial;   // periods in which some member was never seen
+  // current members, plus those that have left
+  struct nk_thread_group_member_stats members;
+};
+
+int  nk_thread_group_get_stats(nk_thread_group_t *group, struct nk_thread_group_stats *stats);
+// apply f to each current member's stats, with the group locked
+void nk_thread_group_map_member_stats(nk_thread_group_t *group,
+                                      void (*f)(uint64_t tid, struct nk_thread_group_member_stats *stats, void *state),
+                                      void *state);
+void nk_thread_group_reset_stats(nk_thread_group_t *group);
+void nk_thread_group_dump_stats(nk_thread_group_t *group, int members);
+
+// called by the scheduler, with interrupts off, for threads with t->group set
+// t starts to run in its period number period
+void nk_thread_group_note_start(struct nk_thread *t, uint64_t period, uint64_t now);
+// t is done with a period in which it ran for run of its slice
+void nk_thread_group_note_period(struct nk_thread *t, uint64_t run, uint64_t slice);
+// called by group_sched after the current thread has changed constraints
+void nk_thread_group_note_change(nk_thread_group_t *group, uint64_t ns, int failed, int defaulted);
+
 #endif /* _GROUP_H */
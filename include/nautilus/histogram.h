@@ -0,0 +1,104 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/naut_types.h>
+
+/*
+  Log-bucketed histogram of 64 bit values, cheap enough to update
+  on every context switch.   Each power of two is split in half, so
+  a bucket is at most half as wide as its lower bound.   0 and 1 get
+  their own buckets, and everything at or above 2^48 lands in the last.
+*/
+
+#define NK_HIST_BUCKETS 96
+
+struct nk_hist {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint32_t bucket[NK_HIST_BUCKETS];
+};
+
+static inline int
+nk_hist_bucket (uint64_t v)
+{
+    int msb, b;
+
+    if (v < 2) {
+        return (int)v;
+    }
+
+    msb = 63 - __builtin_clzl(v);
+    b = 2*msb + ((v >> (msb - 1)) & 1);
+
+    return b < NK_HIST_BUCKETS ? b : NK_HIST_BUCKETS - 1;
+}
+
+// smallest value that lands in bucket b
+static inline uint64_t
+nk_hist_bucket_low (int b)
+{
+    if (b < 2) {
+        return b;
+    }
+    return (1UL << (b/2)) + (uint64_t)(b & 1) * (1UL << (b/2 - 1));
+}
+
+static inline void
+nk_hist_add (struct nk_hist *h, uint64_t v)
+{
+    if (!h->count || v < h->min) {
+        h->min = v;
+    }
+    if (v > h->max) {
+        h->max = v;
+    }
+    h->count++;
+    h->sum += v;
+    h->bucket[nk_hist_bucket(v)]++;
+}
+
+void nk_hist_reset(struct nk_hist *h);
+
+// dst += src
+void nk_hist_merge(struct nk_hist *dst, struct nk_hist *src);
+
+// estimate of the value at or below which permille/1000 of
+// the samples fall, interpolated within its bucket
+uint64_t nk_hist_percentile(struct nk_hist *h, uint32_t permille);
+
+// one line: count, mean, min, p50, p90, p99, p99.9, max
+void nk_hist_print_summary(struct nk_hist *h, char *name);
+
+// one line per non-empty bucket
+void nk_hist_print_buckets(struct nk_hist *h);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -125,6 +125,12 @@ int setup_idt(void);
 int idt_assign_entry(ulong_t entry, ulong_t handler_addr, ulong_t state_addr);
 int idt_get_entry(ulong_t entry, ulong_t *handler_addr, ulong_t *state_addr);
 
+// range searched for dynamically assigned vectors
+#define IDT_DYN_VEC_START 0x50
+#define IDT_DYN_VEC_END   0xdf
+
+int idt_find_and_reserve(ulong_t handler_addr, ulong_t state_addr, ulong_t *vec);
+
 int null_excp_handler(excp_entry_t * excp, excp_vec_t vec, addr_t fault_addr, void * state_addr);
 int null_irq_handler(excp_entry_t * excp, excp_vec_t vector, void * state_addr);
 
@@ -46,7 +46,31 @@ extern "C" {
 #define NK_MALLOC_PROF_EXIT()
 #endif
 
-struct nk_hashtable;
+/*
+  Functions are timed on a shadow call stack kept in each thread,
+  so nesting and context switches are accounted for correctly.
+  Frames deeper than this are counted but not timed.
+*/
+#define NK_INSTR_SHADOW_DEPTH 64
+
+struct nk_instr_frame {
+    const void * key;      // function address, or __func__ for the macros
+    const char * name;     // known without a symbol table, or null
+    uint64_t     start;    // tsc at entry
+    uint64_t     off_cpu;  // thread's switched-out cycles at entry
+    uint64_t     child;    // inclusive cycles of callees
+};
+
+struct nk_instr_shadow {
+    uint64_t epoch;        // instrumentation run the frames belong to
+    uint32_t depth;
+    uint64_t off_cpu;      // cycles spent switched out
+    uint64_t switched_out; // tsc when last switched out, 0 if running
+    struct nk_instr_frame frames[NK_INSTR_SHADOW_DEPTH];
+};
+
+// one slot of a per-cpu function table
+struct nk_instr_func;
 
 struct malloc_data {
     uint64_t count;
@@ -73,7 +97,8 @@ struct thread_switch_data {
 };
 
 struct nk_instr_data {
-    struct nk_hashtable * func_htable;
+    struct nk_instr_func * funcs;
+    uint64_t funcs_dropped;   // calls that found the table full
     struct irq_data irqstat;
     struct malloc_data mallocstat;
     struct thread_switch_data thr_switch;
@@ -82,6 +107,8 @@ struct nk_instr_data {
 
 void nk_profile_func_enter(const char * func);
 void nk_profile_func_exit(const char * func);
+struct nk_thread;
+void nk_instr_thread_switch(struct nk_thread * prev, struct nk_thread * next);
 void nk_thr_switch_prof_enter(void);
 void nk_thr_switch_prof_exit(void);
 void nk_irq_prof_enter(void);
@@ -0,0 +1,65 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __KLOG_H__
+#define __KLOG_H__
+
+#include <stdarg.h>
+
+/*
+ * Kernel log rings
+ *
+ * Once nk_klog_init() has run, printk() and the log console
+ * (nk_vc_log(), and so INFO/DEBUG/ERROR) no longer write to the
+ * console and serial port themselves.  A message is instead formatted
+ * straight into a ring belonging to the CPU it is written on, which
+ * takes time proportional to its length and no locks, and is safe in
+ * interrupt context.  A low-priority drain thread periodically moves
+ * the rings' contents, in timestamp order, to where they would have
+ * gone.  A message that finds its ring full is dropped and counted.
+ *
+ * panic() first empties the rings synchronously, and from then on
+ * output goes directly to the console again.
+ */
+
+#define NK_KLOG_LOG     1   // for the log console
+#define NK_KLOG_CONSOLE 2   // printk, for the console
+
+int  nk_klog_init(void);
+
+// returns the length of the message, 0 if it was dropped, and -1,
+// without touching args, if the rings cannot take it (not up yet,
+// or after a panic), in which case the caller prints it itself
+int  nk_klog_vwrite(int kind, const char *fmt, va_list args);
+
+// drain the rings now, in the caller
+int  nk_klog_flush(void);
+
+// while held, the drain thread leaves the rings alone
+void nk_klog_hold(int hold);
+
+// drain the rings to the caller's console, with CPU and timestamp
+int  nk_klog_dump(void);
+
+void nk_klog_stats(void);
+
+// called by panic()
+void nk_klog_panic(void);
+
+#endif
@@ -0,0 +1,47 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __KSYMS_H__
+#define __KSYMS_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct multiboot_tag_elf_sections;
+
+/*
+  Kernel function symbols, taken at boot from the ELF symbol table
+  that the boot loader loads along with the section headers.  Only
+  the boot allocator is used, so this can run from multiboot_parse().
+*/
+int nk_ksyms_boot_init(struct multiboot_tag_elf_sections *elf);
+
+// name of the function containing addr, or NULL if not known
+// *start, if not NULL, is set to the function's first address
+const char *nk_ksym_lookup(addr_t addr, addr_t *start);
+
+// number of function symbols known
+uint64_t nk_ksyms_count(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
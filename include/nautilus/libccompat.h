@@ -114,6 +114,14 @@ char * gettext(const char * msgid);
 
 int printf(const char *, ...);
 
+// pthread mutexes are backed by nk_mutex_t, which fits inside
+// the pthread_mutex_t a runtime allocates for them
+int pthread_mutex_init(void * mutex, const void * attr);
+int pthread_mutex_destroy(void * mutex);
+int pthread_mutex_lock(void * mutex);
+int pthread_mutex_trylock(void * mutex);
+int pthread_mutex_unlock(void * mutex);
+
 #define GEN_HDR(x) int x (void);
 
 GEN_HDR(writev)
@@ -161,9 +169,6 @@ GEN_HDR(__towupper_l)
 GEN_HDR(__uselocale)
 GEN_HDR(__strftime_l)
 GEN_HDR(mbsnrtowcs)
-GEN_HDR(pthread_mutex_init)
-GEN_HDR(pthread_mutex_unlock)
-GEN_HDR(pthread_mutex_lock)
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,96 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __MUTEX_H__
+#define __MUTEX_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/thread.h>
+
+/*
+ * Sleeping mutex
+ *
+ * The uncontended acquire and release are a single atomic each.
+ * A contended acquirer spins for a bounded time as long as the
+ * owner is running on some other CPU, and otherwise blocks on the
+ * mutex's wait queue.  Release to a blocked waiter is a direct
+ * hand-off: ownership passes to the waiter without the mutex ever
+ * becoming free, so waiters are served in FIFO order.
+ *
+ * A zeroed nk_mutex_t is a valid unlocked mutex.  Mutexes must
+ * not be used from interrupt context.
+ */
+
+#define NK_MUTEX_UNLOCKED  0
+#define NK_MUTEX_LOCKED    1   // held, no waiters
+#define NK_MUTEX_CONTENDED 2   // held, waiters may be queued
+
+typedef struct nk_mutex {
+    volatile uint32_t           state;
+    uint32_t                    pad;
+    struct nk_thread * volatile owner;
+    nk_thread_queue_t           waitq;  // embedded so static init is free
+} nk_mutex_t;
+
+#define NK_MUTEX_INITIALIZER { 0 }
+
+int  nk_mutex_init(nk_mutex_t * m);
+int  nk_mutex_deinit(nk_mutex_t * m);
+
+void nk_mutex_lock_slow(nk_mutex_t * m);
+void nk_mutex_unlock_slow(nk_mutex_t * m);
+
+static inline void
+nk_mutex_lock (nk_mutex_t * m)
+{
+    if (!__sync_bool_compare_and_swap(&m->state, NK_MUTEX_UNLOCKED, NK_MUTEX_LOCKED)) {
+        nk_mutex_lock_slow(m);
+        return;
+    }
+    m->owner = get_cur_thread();
+}
+
+// returns zero on successful lock acquisition, -1 otherwise
+static inline int
+nk_mutex_trylock (nk_mutex_t * m)
+{
+    if (!__sync_bool_compare_and_swap(&m->state, NK_MUTEX_UNLOCKED, NK_MUTEX_LOCKED)) {
+        return -1;
+    }
+    m->owner = get_cur_thread();
+    return 0;
+}
+
+static inline void
+nk_mutex_unlock (nk_mutex_t * m)
+{
+    m->owner = 0;
+    if (!__sync_bool_compare_and_swap(&m->state, NK_MUTEX_LOCKED, NK_MUTEX_UNLOCKED)) {
+        nk_mutex_unlock_slow(m);
+    }
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -26,7 +26,8 @@
 #include <nautilus/naut_types.h>
 
 
-#define NUM_PERF_SLOTS AMD_PERF_SLOTS
+// the most general-purpose slots we handle on any vendor
+#define NUM_PERF_SLOTS 8
 
 #define PMC_SLOT_FREE 0
 #define PMC_SLOT_USED 1
@@ -50,8 +51,48 @@
 #define PERF_CTR_MSR_N(n) (AMD_PERF_CTR0_MSR + 2*(n))
 
 
+/* 
+   Intel architectural performance monitoring, version 2 and up, 
+   as enumerated by CPUID leaf 0xa
+*/
+#define INTEL_PMC0_MSR                 0xc1
+#define INTEL_PERFEVTSEL0_MSR          0x186
+#define INTEL_FIXED_CTR0_MSR           0x309
+#define INTEL_FIXED_CTR_CTRL_MSR       0x38d
+#define INTEL_PERF_GLOBAL_STATUS_MSR   0x38e
+#define INTEL_PERF_GLOBAL_CTRL_MSR     0x38f
+#define INTEL_PERF_GLOBAL_OVF_CTRL_MSR 0x390
+
+#define INTEL_MAX_FIXED 3
+#define INTEL_FIXED_INSTR_RETIRED 0
+#define INTEL_FIXED_CORE_CYCLES   1
+#define INTEL_FIXED_REF_CYCLES    2
+
+// per fixed counter, 4 bits in FIXED_CTR_CTRL
+#define INTEL_FIXED_CTRL_OS  0x1
+#define INTEL_FIXED_CTRL_USR 0x2
+#define INTEL_FIXED_CTRL_PMI 0x8
+
+// rdpmc selects a fixed counter with this bit
+#define RDPMC_FIXED (1U<<30)
+
+
 /* EVENTS */
 
+/* Intel architectural events, select in [7:0], unit mask in [15:8] */
+#define INTEL_PMC_CORE_CYCLES    0x003c
+#define INTEL_PMC_INSTR_RETIRED  0x00c0
+#define INTEL_PMC_REF_CYCLES     0x013c
+#define INTEL_PMC_LLC_REF        0x4f2e
+#define INTEL_PMC_LLC_MISS       0x412e
+#define INTEL_PMC_BRANCH_RETIRED 0x00c4
+#define INTEL_PMC_BRANCH_MISS    0x00c5
+
+/* AMD events used for per-thread counting */
+#define AMD_PMC_CORE_CYCLES   0x76 // PERF_CTL[5:0]
+#define AMD_PMC_INSTR_RETIRED 0xc0 // PERF_CTL[5:0]
+
+
 #define AMD_PMC_DCACHE_MISS  0x41 // PERF_CTL[5:0]
 #define AMD_PMC_ICACHE_MISS  0x81 // PERF_CTL[2:0]
 #define AMD_PMC_L2_MISS      0x7e // PERF_CTL[2:0]
@@ -127,6 +168,75 @@ typedef struct pmc_ctl {
 } __attribute__((packed)) pmc_ctl_t;
 
 
+enum nk_pmc_vendor { NK_PMC_NONE=0, NK_PMC_AMD, NK_PMC_INTEL };
+
+struct nk_pmc_info {
+    enum nk_pmc_vendor vendor;
+    uint8_t  version;      // Intel architectural perfmon version
+    uint8_t  num_gp;       // general-purpose counters
+    uint8_t  gp_width;     // bits
+    uint8_t  num_fixed;    // Intel fixed-function counters
+    uint8_t  fixed_width;  // bits
+    uint32_t unavail;      // Intel: architectural events not available (CPUID.0xa:EBX)
+};
+
+/*
+  Per-thread counters.   When enabled, each CPU counts these events
+  at all times, and the scheduler charges the counts accumulated
+  since the last context switch to the thread being switched out.
+  The counters needed are taken from the top of the general-purpose
+  slots, so assign_perf_event() still has the low ones.
+*/
+enum nk_pmc_thread_event {
+    NK_PMC_INSTRUCTIONS=0,
+    NK_PMC_CYCLES,
+    NK_PMC_CACHE_MISSES,  // LLC misses on Intel, L1D misses on AMD
+    NK_PMC_BRANCH_MISSES,
+    NK_PMC_NUM_THREAD_EVENTS
+};
+
+struct nk_pmc_counts {
+    uint64_t count[NK_PMC_NUM_THREAD_EVENTS];
+};
+
+struct nk_thread;
+struct nk_thread_group;
+struct excp_entry_state;
+
+extern int nk_pmc_thread_active;
+
+void _nk_pmc_thread_switch(struct nk_thread * prev);
+
+// called by the scheduler, interrupts off, just before a switch
+static inline void nk_pmc_thread_switch(struct nk_thread * prev)
+{
+    if (nk_pmc_thread_active) {
+        _nk_pmc_thread_switch(prev);
+    }
+}
+
+int  nk_pmc_thread_enable(void);
+int  nk_pmc_thread_disable(void);
+// counts for thread so far; for a thread running elsewhere, this 
+// lags by whatever it has accumulated since it was switched in
+void nk_pmc_thread_read(struct nk_thread * t, struct nk_pmc_counts * counts);
+// sum of the counts of the group's current members, returns how
+// many there are; threads that have left the group are not included
+int  nk_pmc_group_read(struct nk_thread_group * group, struct nk_pmc_counts * counts);
+const char * nk_pmc_thread_event_name(enum nk_pmc_thread_event e);
+
+struct nk_pmc_info * nk_pmc_get_info(void);
+
+/*
+  Sampling.   A general-purpose counter on each CPU counts the event
+  and interrupts every period occurrences, at which point handler
+  is called in interrupt context with the interrupted state.
+  period must be below 2^31.
+*/
+int nk_pmc_sample_start(enum nk_pmc_thread_event e, uint64_t period,
+                        void (*handler)(struct excp_entry_state * excp));
+int nk_pmc_sample_stop(void);
+
 perf_event_t * assign_perf_event(uint8_t event_id, uint8_t unit_mask);
 void release_perf_event(perf_event_t * event);
 
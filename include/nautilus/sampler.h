@@ -0,0 +1,78 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __SAMPLER_H__
+#define __SAMPLER_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+  Statistical profiler.   Every CPU is interrupted every period
+  events of the source, and the interrupted RIP, the thread, its
+  group and the CPU go into that CPU's ring, which keeps the most
+  recent 2^NAUT_CONFIG_SAMPLER_RING_ORDER samples.  The timer source
+  piggybacks on the APIC timer, and takes every period-th tick.
+*/
+
+enum nk_sampler_source {
+    NK_SAMPLER_CYCLES=0,
+    NK_SAMPLER_CACHE_MISSES,
+    NK_SAMPLER_TIMER,
+};
+
+#define NK_SAMPLE_NO_GROUP (-1UL)
+
+struct nk_sample {
+    uint64_t rip;
+    uint64_t tid;
+    uint64_t group;    // group id, or NK_SAMPLE_NO_GROUP
+    uint32_t cpu;
+    uint32_t rsvd;
+};
+
+struct excp_entry_state;
+
+extern int nk_sampler_timer_active;
+
+void _nk_sampler_record(struct excp_entry_state *excp);
+
+// called from the APIC timer interrupt
+static inline void nk_sampler_timer_tick(struct excp_entry_state *excp)
+{
+    if (nk_sampler_timer_active) {
+        _nk_sampler_record(excp);
+    }
+}
+
+// period 0 picks a default for the source
+int  nk_sampler_start(enum nk_sampler_source source, uint64_t period);
+int  nk_sampler_stop(void);
+
+// the n functions with the most samples, over all CPUs
+void nk_sampler_dump(int n);
+// samples by thread and group
+void nk_sampler_dump_threads(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
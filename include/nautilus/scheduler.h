@@ -171,6 +171,11 @@ uint64_t nk_sched_get_realtime();
 // -1 => all CPUs
 void nk_sched_dump_threads(int cpu);
 
+// Apply func to each thread on cpu, with the scheduler's global
+// lock held, so func must not block
+// -1 => all CPUs
+void nk_sched_map_threads(int cpu, void (func)(struct nk_thread *t, void *state), void *state);
+
 // print out scheduler info on the cpu
 // -1 => all CPUs
 void nk_sched_dump_cores(int cpu);
@@ -212,6 +217,28 @@ void ipi_sample_dump(void);
 int ipi_complete_check();
 void interrupt_inc();
 void interrupt_dump();
+// now resets / dumps the latency histograms below
 int nk_sched_observe_context_switch();
 int nk_sched_context_switch_stamp_dump();
+
+// Latency histograms, kept per CPU and per thread, in ns
+enum nk_sched_lat {
+    NK_SCHED_LAT_WAKEUP=0,  // made runnable to chosen to run (aperiodic)
+    NK_SCHED_LAT_IRQ,       // interrupt entry to the switch it causes
+    NK_SCHED_LAT_SWITCH,    // the context switch itself
+    NK_SCHED_LAT_JITTER,    // periodic arrival to first run in the period
+    NK_SCHED_LAT_MISS,      // lateness at deadline misses
+    NK_SCHED_LAT_NUM
+};
+
+struct nk_hist;
+
+const char *nk_sched_latency_name(enum nk_sched_lat which);
+// copies of the current histograms
+int  nk_sched_cpu_latency(int cpu, enum nk_sched_lat which, struct nk_hist *h);
+int  nk_sched_thread_latency(struct nk_thread *t, enum nk_sched_lat which, struct nk_hist *h);
+void nk_sched_latency_reset();
+// percentile summaries for one CPU, or all combined if cpu<0
+void nk_sched_latency_dump(int cpu, int buckets);
+void nk_sched_thread_latency_dump(struct nk_thread *t, int buckets);
 #endif /* _SCHEDULER_H */
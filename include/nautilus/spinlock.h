@@ -103,6 +103,16 @@ spin_unlock_irq_restore (volatile spinlock_t * lock, uint8_t flags)
 #define NK_TRY_LOCK(l)    nk_ticket_trylock(l)
 #define NK_UNLOCK(l)      nk_ticket_unlock(l)
 #define NK_LOCK_DEINIT(l) nk_ticket_lock_deinit(l)
+#elif defined(NAUT_CONFIG_USE_COHORTLOCKS)
+#include <nautilus/cohortlock.h>
+// this expects the struct, not the pointer to it
+#define NK_LOCK_GLBINIT(l) nk_cohort_lock_init(&(l))
+#define NK_LOCK_T         nk_cohort_lock_t
+#define NK_LOCK_INIT(l)   nk_cohort_lock_init(l)
+#define NK_LOCK(l)        nk_cohort_lock(l)
+#define NK_TRY_LOCK(l)    nk_cohort_trylock(l)
+#define NK_UNLOCK(l)      nk_cohort_unlock(l)
+#define NK_LOCK_DEINIT(l) nk_cohort_lock_deinit(l)
 #else
 // this expects the struct, not the pointer to it
 #define NK_LOCK_GLBINIT(l) ((l) = SPINLOCK_INITIALIZER) 
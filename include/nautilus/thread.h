@@ -33,6 +33,10 @@ extern "C" {
 #include <nautilus/queue.h>
 #include <nautilus/intrinsics.h>
 #include <nautilus/scheduler.h>
+#include <nautilus/pmc.h>
+#ifdef NAUT_CONFIG_PROFILE
+#include <nautilus/instrument.h>
+#endif
 
 #define CPU_ANY       -1
 
@@ -198,10 +202,24 @@ struct nk_thread {
 
     struct nk_virtual_console *vc;
 
+    // open files, null for the default table, inherited by children
+    struct nk_fs_fd_table *fd_table;
+
+    // the thread group last joined, if still a member
+    struct nk_thread_group *group;
+    struct group_member    *group_member;  // our membership record in it
+
     char name[MAX_THREAD_NAME];
 
     const void * tls[TLS_MAX_KEYS];
 
+    // hardware event counts, while per-thread counting is on
+    struct nk_pmc_counts pmc;
+
+#ifdef NAUT_CONFIG_PROFILE
+    struct nk_instr_shadow instr_shadow;
+#endif
+
     uint8_t fpu_state[FPSTATE_SIZE] __align(FPSTATE_ALIGN);
 } ;
 
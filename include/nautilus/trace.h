@@ -0,0 +1,116 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/naut_types.h>
+
+/*
+  Binary event trace.   While tracing, each enabled event appends a
+  fixed-size record to a ring belonging to the CPU it happens on,
+  which keeps the most recent 2^NAUT_CONFIG_TRACE_RING_ORDER records.
+  Recording costs a TSC read and a 32 byte store with interrupts
+  briefly off, and nothing at all beyond a test of nk_trace_mask
+  when the event is not being traced.
+
+  Once stopped, the rings can be exported over the serial port or to
+  a file through nk_fs, as a header, a record naming each thread, and
+  then every CPU's records oldest first.   Over serial, the same bytes
+  are hex encoded between NKTRACE-BEGIN and NKTRACE-END lines so that
+  they survive in a console capture.   tools/nktrace2json.py turns
+  either form into Chrome trace / Perfetto JSON.
+*/
+
+enum nk_trace_event {
+    NK_TRACE_NAME = 0,       // a0=tid       a1,a2=first 16 bytes of its name
+    NK_TRACE_SWITCH,         // a0=prev status  a1=prev tid  a2=next tid
+    NK_TRACE_WAKEUP,         // a0=target cpu   a1=tid
+    NK_TRACE_MIGRATE,        // a0=from cpu     a1=tid      a2=to cpu
+    NK_TRACE_IPI,            // a0=vector       a1=dest apic id, -1 for all others
+    NK_TRACE_TIMER,          // a0=0 for the APIC timer, 1 for an nk_timer (a1) expiring
+    NK_TRACE_BARRIER_ENTER,  // a1=group id  a2=tid
+    NK_TRACE_BARRIER_EXIT,   // a0=1 if last in  a1=group id  a2=tid
+    NK_TRACE_CHANGE_BEGIN,   // a0=constraint type  a1=tid
+    NK_TRACE_CHANGE_END,     // a0=constraint type  a1=tid  a2=0 if admitted
+    NK_TRACE_NUM_EVENTS
+};
+
+#define NK_TRACE_ALL ((1U << NK_TRACE_NUM_EVENTS) - 1)
+
+// exported little-endian, as laid out here
+struct nk_trace_rec {
+    uint64_t tsc;
+    uint16_t event;
+    uint16_t cpu;
+    uint32_t a0;
+    uint64_t a1;
+    uint64_t a2;
+} __attribute__((packed));
+
+#define NK_TRACE_MAGIC   "NKTRACE1"
+#define NK_TRACE_VERSION 1
+
+struct nk_trace_header {
+    char     magic[8];
+    uint32_t version;
+    uint32_t rec_size;
+    uint32_t num_cpus;
+    uint32_t mask;       // events that were traced
+    uint64_t tsc_hz;
+    uint64_t tsc_mult;   // ns = (tsc * tsc_mult) >> 32, as nk_tsc_cycles_to_ns()
+    uint64_t num_recs;   // following the header, names included
+    uint64_t lost;       // overwritten before the export
+} __attribute__((packed));
+
+extern volatile uint32_t nk_trace_mask;
+
+void _nk_trace_record(enum nk_trace_event event, uint32_t a0, uint64_t a1, uint64_t a2);
+
+#ifdef NAUT_CONFIG_TRACE
+#define NK_TRACE(event, a0, a1, a2)                                     \
+    do {                                                                \
+        if (__builtin_expect(nk_trace_mask & (1U << (event)), 0)) {     \
+            _nk_trace_record((event), (a0), (a1), (a2));                \
+        }                                                               \
+    } while (0)
+#else
+#define NK_TRACE(event, a0, a1, a2)
+#endif
+
+// mask is of 1<<event, 0 for everything, and the rings are cleared
+int  nk_trace_start(uint32_t mask);
+int  nk_trace_stop(void);
+void nk_trace_stats(void);
+
+const char *nk_trace_event_name(enum nk_trace_event event);
+
+// only while stopped
+int  nk_trace_export_serial(void);
+int  nk_trace_export_file(char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,97 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#ifndef __TSC_H__
+#define __TSC_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <nautilus/naut_types.h>
+#include <nautilus/cpu.h>
+
+/*
+ * Kernel time source
+ *
+ * The TSC is calibrated once on the BSP at boot and then
+ * synchronized across all cores when the schedulers start
+ * (see nk_sched_start()).   After that, converting a TSC
+ * reading to nanoseconds is a single 64x64->128 multiply
+ * and shift, which makes nk_tsc_get_ns() cheap enough for
+ * profilers, clock_gettime(), and the scheduler's notion
+ * of real time, all of which share this one source.
+ */
+
+// fixed-point scale factors:  ns = (cycles * mult) >> NK_TSC_SHIFT
+#define NK_TSC_SHIFT      32
+#define NK_TSC_INV_SHIFT  24
+
+struct nk_tsc_info {
+    uint64_t hz;              // calibrated TSC frequency
+    uint64_t mult;            // cycles -> ns
+    uint64_t inv_mult;        // ns -> cycles
+    uint8_t  invariant;       // CPUID reports an invariant TSC
+    uint8_t  calibrated;
+    uint8_t  synced;          // all cores have been synchronized
+    uint8_t  reliable;        // invariant and cross-core warp acceptable
+    uint64_t max_warp_cycles; // worst backward step seen across cores
+};
+
+extern struct nk_tsc_info nk_tsc_info;
+
+static inline uint64_t
+nk_tsc_cycles_to_ns (uint64_t cycles)
+{
+    return (uint64_t)(((unsigned __int128)cycles * nk_tsc_info.mult) >> NK_TSC_SHIFT);
+}
+
+static inline uint64_t
+nk_tsc_ns_to_cycles (uint64_t ns)
+{
+    return (uint64_t)(((unsigned __int128)ns * nk_tsc_info.inv_mult) >> NK_TSC_INV_SHIFT);
+}
+
+// nanoseconds since the cores were synchronized (monotonic)
+static inline uint64_t
+nk_tsc_get_ns (void)
+{
+    return nk_tsc_cycles_to_ns(rdtsc());
+}
+
+// true if the TSC can be used as a system-wide clock
+static inline int
+nk_tsc_reliable (void)
+{
+    return nk_tsc_info.reliable;
+}
+
+// BSP only, after the APIC is initialized
+int  nk_tsc_init (void);
+
+// all CPUs, interrupts off, invoked by the scheduler at startup
+void nk_tsc_sync (void);
+
+void nk_tsc_dump (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -58,6 +58,8 @@ int nk_vc_print(char *s);
 int nk_vc_puts(char *s);
 int nk_vc_printf(char *fmt, ...);
 int nk_vc_log(char *fmt, ...);
+// an already formatted log message, bypassing any log ring
+int nk_vc_log_print(char *s);
 
 int nk_vc_printf_specific(struct nk_virtual_console *vc, char *fmt, ...);
 
@@ -68,6 +70,10 @@ int nk_vc_clear(uint8_t attr);
 int nk_vc_clear_specific(struct nk_virtual_console *vc, uint8_t attr);
 int nk_vc_scrollup(void);
 int nk_vc_scrollup_specific(struct nk_virtual_console *vc);
+// move the view lines back (>0) or forward (<0) in the scrollback
+// any new output returns the view to the live screen
+int nk_vc_scrollback(int lines);
+int nk_vc_scrollback_specific(struct nk_virtual_console *vc, int lines);
 int nk_vc_setpos(uint8_t x, uint8_t y);
 int nk_vc_setpos_specific(struct nk_virtual_console *vc, uint8_t x, uint8_t y);
 int nk_vc_display_char(uint8_t c, uint8_t attr, uint8_t x, uint8_t y);
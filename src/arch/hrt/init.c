@@ -35,6 +35,7 @@
 #include <nautilus/irq.h>
 #include <nautilus/thread.h>
 #include <nautilus/timer.h>
+#include <nautilus/tsc.h>
 #include <nautilus/idle.h>
 #include <nautilus/percpu.h>
 #include <nautilus/errno.h>
@@ -228,6 +229,8 @@ hrt_bsp_init (unsigned long mbd,
 
     apic_init(naut->sys.cpus[0]);
 
+    nk_tsc_init();
+
     fpu_init(naut);
 
     nk_rand_init(naut->sys.cpus[0]);
@@ -344,6 +347,8 @@ default_init (unsigned long mbd,
 
     apic_init(naut->sys.cpus[0]);
 
+    nk_tsc_init();
+
     fpu_init(naut);
 
     nk_rand_init(naut->sys.cpus[0]);
@@ -33,6 +33,7 @@
 #include <nautilus/irq.h>
 #include <nautilus/thread.h>
 #include <nautilus/timer.h>
+#include <nautilus/tsc.h>
 #include <nautilus/idle.h>
 #include <nautilus/percpu.h>
 #include <nautilus/errno.h>
@@ -176,6 +177,8 @@ init (unsigned long mbd, unsigned long magic)
 
     apic_init(naut->sys.cpus[naut->sys.bsp_id]);
 
+    nk_tsc_init();
+
     fpu_init(naut);
 
     nk_rand_init(naut->sys.cpus[naut->sys.bsp_id]);
@@ -36,6 +36,7 @@
 #include <nautilus/group.h>
 #include <nautilus/group_sched.h>
 #include <nautilus/timer.h>
+#include <nautilus/tsc.h>
 #include <nautilus/idle.h>
 #include <nautilus/percpu.h>
 #include <nautilus/errno.h>
@@ -47,6 +48,8 @@
 #include <nautilus/libccompat.h>
 #include <nautilus/barrier.h>
 #include <nautilus/vc.h>
+#include <nautilus/klog.h>
+#include <nautilus/pmc.h>
 #include <nautilus/dev.h>
 #include <nautilus/chardev.h>
 #include <nautilus/blkdev.h>
@@ -72,6 +75,9 @@
 #ifdef NAUT_CONFIG_ATA
 #include <dev/ata.h>
 #endif
+#ifdef NAUT_CONFIG_AHCI
+#include <dev/ahci.h>
+#endif
 #ifdef NAUT_CONFIG_EXT2_FILESYSTEM_DRIVER
 #include <fs/ext2/ext2.h>
 #endif
@@ -319,6 +325,8 @@ init (unsigned long mbd,
 
     apic_init(naut->sys.cpus[0]);
 
+    nk_tsc_init();
+
     fpu_init(naut);
 
     nk_rand_init(naut->sys.cpus[0]);
@@ -381,6 +389,11 @@ init (unsigned long mbd,
 
     nk_vc_init();
 
+    pmc_init();
+
+#ifdef NAUT_CONFIG_KLOG
+    nk_klog_init();
+#endif
 
 #ifdef NAUT_CONFIG_VIRTUAL_CONSOLE_CHARDEV_CONSOLE
     nk_vc_start_chardev_console(NAUT_CONFIG_VIRTUAL_CONSOLE_CHARDEV_CONSOLE_NAME);
@@ -394,6 +407,10 @@ init (unsigned long mbd,
     nk_ata_init(naut);
 #endif
 
+#ifdef NAUT_CONFIG_AHCI
+    nk_ahci_init(naut);
+#endif
+
 #ifdef NAUT_CONFIG_VIRTIO_PCI
     virtio_pci_init(naut);
 #endif
@@ -0,0 +1,869 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/blkdev.h>
+#include <nautilus/irq.h>
+#include <nautilus/idt.h>
+#include <nautilus/cpu.h>
+#include <nautilus/paging.h>
+#include <dev/apic.h>
+#include <dev/pci.h>
+#include <dev/ahci.h>
+
+#ifndef NAUT_CONFIG_DEBUG_AHCI
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...) 
+#endif
+
+#define ERROR(fmt, args...) ERROR_PRINT("ahci: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("ahci: " fmt, ##args)
+#define INFO(fmt, args...) INFO_PRINT("ahci: " fmt, ##args)
+
+#define PORT_LOCK_CONF uint8_t _port_lock_flags
+#define PORT_LOCK(p) _port_lock_flags = spin_lock_irq_save(&(p)->lock)
+#define PORT_UNLOCK(p) spin_unlock_irq_restore(&(p)->lock, _port_lock_flags)
+
+#define AHCI_MAX_CONTROLLERS 4
+#define AHCI_MAX_PORTS       32
+#define AHCI_MAX_SLOTS       32
+#define AHCI_SECTOR_SIZE     512
+#define AHCI_MAX_PRD         8         // 65536 sectors at 4 MB per region
+#define AHCI_PRD_MAX_BYTES   (4*1024*1024)
+#define AHCI_POLL_LIMIT      10000000  // register polls before giving up
+
+// generic host control
+#define HBA_CAP   0x00
+#define HBA_GHC   0x04
+#define HBA_IS    0x08
+#define HBA_PI    0x0c
+#define HBA_VS    0x10
+
+#define HBA_CAP_S64A       (1U<<31)
+#define HBA_CAP_SNCQ       (1U<<30)
+#define HBA_CAP_NCS(c)     ((((c)>>8)&0x1f)+1)
+#define HBA_GHC_AE         (1U<<31)
+#define HBA_GHC_IE         (1U<<1)
+
+// per port, at 0x100 + port*0x80
+#define PORT_BASE(n) (0x100 + (n)*0x80)
+#define PxCLB   0x00
+#define PxCLBU  0x04
+#define PxFB    0x08
+#define PxFBU   0x0c
+#define PxIS    0x10
+#define PxIE    0x14
+#define PxCMD   0x18
+#define PxTFD   0x20
+#define PxSIG   0x24
+#define PxSSTS  0x28
+#define PxSERR  0x30
+#define PxSACT  0x34
+#define PxCI    0x38
+
+#define PxCMD_ST  (1U<<0)
+#define PxCMD_FRE (1U<<4)
+#define PxCMD_FR  (1U<<14)
+#define PxCMD_CR  (1U<<15)
+
+#define PxIS_DHRS (1U<<0)   // D2H register FIS, non-queued completion
+#define PxIS_PSS  (1U<<1)   // PIO setup FIS
+#define PxIS_DSS  (1U<<2)   // DMA setup FIS
+#define PxIS_SDBS (1U<<3)   // set device bits FIS, queued completion
+#define PxIS_IFS  (1U<<27)
+#define PxIS_HBDS (1U<<28)
+#define PxIS_HBFS (1U<<29)
+#define PxIS_TFES (1U<<30)
+#define PxIS_ERRORS (PxIS_IFS | PxIS_HBDS | PxIS_HBFS | PxIS_TFES)
+
+#define PxTFD_BSY 0x80
+#define PxTFD_DRQ 0x08
+#define PxTFD_ERR 0x01
+
+#define SSTS_DET_PRESENT 0x3
+#define SIG_ATA          0x00000101
+
+#define FIS_TYPE_REG_H2D 0x27
+
+#define ATA_CMD_IDENTIFY       0xec
+#define ATA_CMD_READ_DMA_EXT   0x25
+#define ATA_CMD_WRITE_DMA_EXT  0x35
+#define ATA_CMD_READ_FPDMA     0x60
+#define ATA_CMD_WRITE_FPDMA    0x61
+
+#define PCI_CMD_MEM_ENABLE    0x2
+#define PCI_CMD_MASTER_ENABLE 0x4
+#define PCI_STATUS_CAP_LIST   0x10
+#define PCI_CAP_PTR           0x34
+#define PCI_CAP_ID_MSI        0x05
+#define MSI_CTRL_ENABLE       0x0001
+#define MSI_CTRL_64BIT        0x0080
+#define MSI_MSG_ADDR_BASE     0xfee00000
+
+
+struct ahci_cmd_hdr {
+    uint16_t flags;
+#define CMD_HDR_CFL(dw) ((dw) & 0x1f)   // command FIS length
+#define CMD_HDR_WRITE   (1<<6)
+    uint16_t prdtl;                     // regions in the table
+    volatile uint32_t prdbc;            // bytes transferred
+    uint64_t ctba;                      // 128 byte aligned
+    uint32_t rsvd[4];
+} __packed;
+
+struct ahci_prd {
+    uint64_t dba;       // even
+    uint32_t rsvd;
+    uint32_t dbc;       // bytes - 1, must be odd
+} __packed;
+
+struct ahci_cmd_table {
+    uint8_t         cfis[64];
+    uint8_t         acmd[16];
+    uint8_t         rsvd[48];
+    struct ahci_prd prdt[AHCI_MAX_PRD];
+} __packed;
+
+struct ahci_slot {
+    void    (*callback)(void *, int);
+    void     *context;
+    uint64_t  count;
+    int       status;   // of the finished command
+};
+
+struct ahci_controller_state;
+
+struct ahci_port_state {
+    struct nk_block_dev          *blkdev;
+    struct ahci_controller_state *hba;
+
+    spinlock_t  lock;
+    int         num;
+    uint64_t    regs;
+
+    void                  *mem;     // as allocated
+    struct ahci_cmd_hdr   *cl;      // 1 KB aligned command list
+    uint8_t               *fis;     // 256 byte aligned receive area
+    struct ahci_cmd_table *tables;  // one per slot
+
+    uint64_t    num_blocks;
+    int         ncq;
+    uint32_t    slots;     // usable
+    uint32_t    busy;      // issued and not yet complete
+
+    struct ahci_slot slot[AHCI_MAX_SLOTS];
+
+    uint64_t    requests;
+    uint64_t    blocks;
+    uint64_t    errors;
+    uint64_t    interrupts;
+    uint64_t    cycles;    // spent by the CPU driving transfers
+    uint32_t    max_busy;  // most commands outstanding at once
+};
+
+struct ahci_controller_state {
+    int             num;
+    struct pci_dev *pci;
+    uint64_t        abar;
+    uint32_t        cap;
+    int             msi;
+    uint8_t         intr_vec;
+
+    struct ahci_port_state *ports[AHCI_MAX_PORTS];
+};
+
+static struct ahci_controller_state *controllers[AHCI_MAX_CONTROLLERS];
+static int num_controllers = 0;
+
+
+static inline uint32_t hba_read(struct ahci_controller_state *h, uint32_t off)
+{
+    return *(volatile uint32_t *)(h->abar + off);
+}
+
+static inline void hba_write(struct ahci_controller_state *h, uint32_t off, uint32_t val)
+{
+    *(volatile uint32_t *)(h->abar + off) = val;
+}
+
+static inline uint32_t port_read(struct ahci_port_state *p, uint32_t off)
+{
+    return *(volatile uint32_t *)(p->regs + off);
+}
+
+static inline void port_write(struct ahci_port_state *p, uint32_t off, uint32_t val)
+{
+    *(volatile uint32_t *)(p->regs + off) = val;
+}
+
+static inline int popcount(uint32_t x)
+{
+    return __builtin_popcount(x);
+}
+
+// the controller can reach any memory if it does 64 bit addresses
+static inline int dma_reachable(struct ahci_controller_state *h, void *buf, uint64_t len)
+{
+    return !((uint64_t)buf & 0x1) &&
+	((h->cap & HBA_CAP_S64A) || ((uint64_t)buf + len) <= 0x100000000ULL);
+}
+
+static int wait_clear(struct ahci_port_state *p, uint32_t off, uint32_t bits)
+{
+    uint64_t i;
+
+    for (i=0;i<AHCI_POLL_LIMIT;i++) {
+	if (!(port_read(p,off) & bits)) {
+	    return 0;
+	}
+    }
+
+    return -1;
+}
+
+static int port_stop(struct ahci_port_state *p)
+{
+    port_write(p,PxCMD,port_read(p,PxCMD) & ~PxCMD_ST);
+    if (wait_clear(p,PxCMD,PxCMD_CR)) {
+	ERROR("Port %d command list will not stop\n",p->num);
+	return -1;
+    }
+    port_write(p,PxCMD,port_read(p,PxCMD) & ~PxCMD_FRE);
+    if (wait_clear(p,PxCMD,PxCMD_FR)) {
+	ERROR("Port %d FIS receive will not stop\n",p->num);
+	return -1;
+    }
+    return 0;
+}
+
+static void port_start(struct ahci_port_state *p)
+{
+    port_write(p,PxCMD,port_read(p,PxCMD) | PxCMD_FRE);
+    port_write(p,PxCMD,port_read(p,PxCMD) | PxCMD_ST);
+}
+
+// fill in a command in slot tag, returns the number of regions
+static int build_cmd(struct ahci_port_state *p, int tag, uint8_t cmd, uint64_t lba,
+		     uint64_t count, uint8_t *buf, uint64_t len, int write)
+{
+    struct ahci_cmd_table *t = &p->tables[tag];
+    struct ahci_cmd_hdr *h = &p->cl[tag];
+    uint8_t *f = t->cfis;
+    uint64_t n;
+    int i = 0;
+
+    memset(f,0,20);
+    f[0] = FIS_TYPE_REG_H2D;
+    f[1] = 0x80;                // this is a command
+    f[2] = cmd;
+    f[4] = lba & 0xff;
+    f[5] = (lba >> 8) & 0xff;
+    f[6] = (lba >> 16) & 0xff;
+    f[8] = (lba >> 24) & 0xff;
+    f[9] = (lba >> 32) & 0xff;
+    f[10] = (lba >> 40) & 0xff;
+
+    if (cmd == ATA_CMD_READ_FPDMA || cmd == ATA_CMD_WRITE_FPDMA) {
+	// the count goes in the features, the tag in the count
+	f[3] = count & 0xff;
+	f[11] = (count >> 8) & 0xff;
+	f[12] = tag << 3;
+	f[7] = 0x40;
+    } else if (cmd != ATA_CMD_IDENTIFY) {
+	f[12] = count & 0xff;
+	f[13] = (count >> 8) & 0xff;
+	f[7] = 0x40;
+    }
+
+    while (len) {
+	n = len < AHCI_PRD_MAX_BYTES ? len : AHCI_PRD_MAX_BYTES;
+	t->prdt[i].dba = (uint64_t)buf;
+	t->prdt[i].rsvd = 0;
+	t->prdt[i].dbc = n - 1;
+	buf += n;
+	len -= n;
+	i++;
+    }
+
+    h->flags = CMD_HDR_CFL(5) | (write ? CMD_HDR_WRITE : 0);
+    h->prdtl = i;
+    h->prdbc = 0;
+    h->ctba = (uint64_t)t;
+
+    return i;
+}
+
+static int port_identify(struct ahci_port_state *p, uint16_t *id)
+{
+    uint64_t i;
+
+    build_cmd(p,0,ATA_CMD_IDENTIFY,0,0,(uint8_t *)id,512,0);
+
+    port_write(p,PxIS,0xffffffff);
+    port_write(p,PxCI,0x1);
+
+    for (i=0;i<AHCI_POLL_LIMIT;i++) {
+	if (port_read(p,PxIS) & PxIS_ERRORS) {
+	    ERROR("Identify failed on port %d (tfd 0x%x)\n",p->num,port_read(p,PxTFD));
+	    return -1;
+	}
+	if (!(port_read(p,PxCI) & 0x1)) {
+	    port_write(p,PxIS,0xffffffff);
+	    return 0;
+	}
+    }
+
+    ERROR("Identify timed out on port %d\n",p->num);
+    return -1;
+}
+
+static int has_room(void *state)
+{
+    struct ahci_port_state *p = (struct ahci_port_state *)state;
+    return (p->slots & ~p->busy) != 0;
+}
+
+static int submit(struct ahci_port_state *p, int write, uint64_t blocknum, uint64_t count,
+		  uint8_t *buf, void (*callback)(void *, int), void *context)
+{
+    PORT_LOCK_CONF;
+    uint64_t start;
+    uint8_t cmd;
+    int tag;
+
+    DEBUG("%s on port %d start %lu numblocks %lu\n",
+	  write ? "write" : "read", p->num, blocknum, count);
+
+    if (blocknum+count > p->num_blocks) {
+	ERROR("Illegal access past end of disk\n");
+	return -1;
+    }
+
+    if (!count || count > 65536) {
+	ERROR("Cannot transfer %lu blocks at once\n", count);
+	return -1;
+    }
+
+    if (!dma_reachable(p->hba, buf, count*AHCI_SECTOR_SIZE)) {
+	ERROR("Buffer %p cannot be reached by the controller\n", buf);
+	return -1;
+    }
+
+    while (1) {
+	PORT_LOCK(p);
+	if (has_room(p)) {
+	    break;
+	}
+	PORT_UNLOCK(p);
+	// all slots are in use, wait for some completions
+	if (in_interrupt_context()) {
+	    ERROR("No free command slot in interrupt context\n");
+	    return -1;
+	}
+	nk_dev_wait_cond((struct nk_dev *)p->blkdev, has_room, p);
+    }
+
+    start = rdtsc();
+
+    tag = __builtin_ctz(p->slots & ~p->busy);
+
+    if (p->ncq) {
+	cmd = write ? ATA_CMD_WRITE_FPDMA : ATA_CMD_READ_FPDMA;
+    } else {
+	cmd = write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT;
+    }
+
+    // a count of 65536 is encoded as 0, which the masks do
+    build_cmd(p,tag,cmd,blocknum,count,buf,count*AHCI_SECTOR_SIZE,write);
+
+    p->slot[tag].callback = callback;
+    p->slot[tag].context = context;
+    p->slot[tag].count = count;
+
+    p->busy |= 1U << tag;
+    if (popcount(p->busy) > p->max_busy) {
+	p->max_busy = popcount(p->busy);
+    }
+    p->requests++;
+
+    if (p->ncq) {
+	port_write(p,PxSACT,1U << tag);
+    }
+    port_write(p,PxCI,1U << tag);
+
+    p->cycles += rdtsc() - start;
+
+    PORT_UNLOCK(p);
+
+    return 0;
+}
+
+static int read_blocks(void *state, uint64_t blocknum, uint64_t count, uint8_t *dest, void (*callback)(void *, int), void *context)
+{
+    return submit((struct ahci_port_state *)state, 0, blocknum, count, dest, callback, context);
+}
+
+static int write_blocks(void *state, uint64_t blocknum, uint64_t count, uint8_t *src, void (*callback)(void *, int), void *context)
+{
+    return submit((struct ahci_port_state *)state, 1, blocknum, count, src, callback, context);
+}
+
+static int get_characteristics(void *state, struct nk_block_dev_characteristics *c)
+{
+    struct ahci_port_state *p = (struct ahci_port_state *)state;
+
+    c->block_size = AHCI_SECTOR_SIZE;
+    c->num_blocks = p->num_blocks;
+
+    return 0;
+}
+
+static struct nk_block_dev_int inter = 
+{
+    .get_characteristics = get_characteristics,
+    .read_blocks = read_blocks,
+    .write_blocks = write_blocks,
+};
+
+static void port_intr(struct ahci_port_state *p)
+{
+    PORT_LOCK_CONF;
+    struct ahci_slot done[AHCI_MAX_SLOTS];
+    uint64_t start = rdtsc();
+    uint32_t is, active, finished;
+    int i, n = 0, status = 0;
+
+    PORT_LOCK(p);
+
+    p->interrupts++;
+
+    is = port_read(p,PxIS);
+    port_write(p,PxIS,is);
+
+    if (is & PxIS_ERRORS) {
+	// everything outstanding is lost, restart the port
+	ERROR("Port %d error (is 0x%x, tfd 0x%x, serr 0x%x), failing %d commands\n",
+	      p->num, is, port_read(p,PxTFD), port_read(p,PxSERR), popcount(p->busy));
+	finished = p->busy;
+	status = -1;
+	p->errors += popcount(finished);
+	port_stop(p);
+	port_write(p,PxSERR,0xffffffff);
+	port_write(p,PxIS,0xffffffff);
+	port_start(p);
+    } else {
+	active = port_read(p,PxCI);
+	if (p->ncq) {
+	    active |= port_read(p,PxSACT);
+	}
+	finished = p->busy & ~active;
+	for (i=0;i<AHCI_MAX_SLOTS;i++) {
+	    if (finished & (1U << i)) {
+		p->blocks += p->slot[i].count;
+	    }
+	}
+    }
+
+    p->busy &= ~finished;
+
+    for (i=0;i<AHCI_MAX_SLOTS;i++) {
+	if (finished & (1U << i)) {
+	    done[n] = p->slot[i];
+	    done[n++].status = status;
+	}
+    }
+
+    p->cycles += rdtsc() - start;
+
+    PORT_UNLOCK(p);
+
+    // callbacks run without the lock held
+    for (i=0;i<n;i++) {
+	if (done[i].callback) {
+	    done[i].callback(done[i].context, done[i].status);
+	}
+    }
+
+    if (n) {
+	nk_dev_signal((struct nk_dev *)p->blkdev);
+    }
+}
+
+static int handler(excp_entry_t *excp, excp_vec_t vec, void *state)
+{
+    struct ahci_controller_state *h = (struct ahci_controller_state *)state;
+    uint32_t is = hba_read(h,HBA_IS);
+    int i;
+
+    if (!is) {
+	IRQ_HANDLER_END();
+	return 0;
+    }
+
+    for (i=0;i<AHCI_MAX_PORTS;i++) {
+	if ((is & (1U << i)) && h->ports[i]) {
+	    port_intr(h->ports[i]);
+	}
+    }
+
+    // port status is cleared first, then this
+    hba_write(h,HBA_IS,is);
+
+    IRQ_HANDLER_END();
+
+    return 0;
+}
+
+static uint8_t find_cap(struct pci_dev *pdev, uint8_t id)
+{
+    uint8_t bus = pdev->bus->num;
+    uint8_t ptr;
+    int guard = 48;
+
+    if (!(pci_cfg_readw(bus,pdev->num,pdev->fun,0x6) & PCI_STATUS_CAP_LIST)) {
+	return 0;
+    }
+
+    ptr = pci_cfg_readw(bus,pdev->num,pdev->fun,PCI_CAP_PTR) & 0xfc;
+
+    while (ptr && guard--) {
+	uint16_t hdr = pci_cfg_readw(bus,pdev->num,pdev->fun,ptr);
+	if ((hdr & 0xff) == id) {
+	    return ptr;
+	}
+	ptr = (hdr >> 8) & 0xfc;
+    }
+
+    return 0;
+}
+
+static int setup_msi(struct ahci_controller_state *h)
+{
+    struct pci_dev *pdev = h->pci;
+    uint8_t bus = pdev->bus->num;
+    uint8_t cap = find_cap(pdev,PCI_CAP_ID_MSI);
+    uint16_t ctrl;
+    ulong_t vec;
+
+    if (!cap) {
+	DEBUG("No MSI capability\n");
+	return -1;
+    }
+
+    if (idt_find_and_reserve((ulong_t)handler,(ulong_t)h,&vec)) {
+	ERROR("Cannot allocate MSI vector\n");
+	return -1;
+    }
+
+    ctrl = pci_cfg_readw(bus,pdev->num,pdev->fun,cap+2);
+
+    pci_cfg_writel(bus,pdev->num,pdev->fun,cap+4,MSI_MSG_ADDR_BASE | (per_cpu_get(apic)->id << 12));
+    if (ctrl & MSI_CTRL_64BIT) {
+	pci_cfg_writel(bus,pdev->num,pdev->fun,cap+8,0);
+	pci_cfg_writew(bus,pdev->num,pdev->fun,cap+12,vec);  // fixed delivery, edge
+    } else {
+	pci_cfg_writew(bus,pdev->num,pdev->fun,cap+8,vec);
+    }
+
+    // a single message
+    ctrl = (ctrl & ~0x70) | MSI_CTRL_ENABLE;
+    pci_cfg_writew(bus,pdev->num,pdev->fun,cap+2,ctrl);
+
+    h->intr_vec = vec;
+    h->msi = 1;
+
+    return 0;
+}
+
+static int setup_interrupt(struct ahci_controller_state *h)
+{
+    uint8_t pin = h->pci->cfg.dev_cfg.intr_pin;
+    uint8_t irq;
+
+    if (!setup_msi(h)) {
+	return 0;
+    }
+
+    if (!pin) {
+	ERROR("Controller has neither MSI nor a PCI interrupt pin\n");
+	return -1;
+    }
+
+    // the IOAPIC setup maps PCI INTA..INTD to IRQs 16..19
+    irq = 16 + ((pin - 1) & 0x3);
+
+    if (register_irq_handler(irq,handler,h)) {
+	ERROR("Cannot register handler for IRQ %u\n", irq);
+	return -1;
+    }
+
+    h->intr_vec = irq_to_vec(irq);
+
+    nk_unmask_irq(irq);
+
+    return 0;
+}
+
+static int port_init(struct ahci_controller_state *h, int num)
+{
+    struct ahci_port_state *p;
+    uint16_t *id = 0;
+    uint64_t addr;
+    uint32_t depth;
+    char name[32];
+
+    p = malloc(sizeof(*p));
+    if (!p) {
+	ERROR("Cannot allocate port state\n");
+	return -1;
+    }
+    memset(p,0,sizeof(*p));
+
+    spinlock_init(&p->lock);
+    p->hba = h;
+    p->num = num;
+    p->regs = h->abar + PORT_BASE(num);
+
+    // command list, FIS area, and tables, page aligned
+    p->mem = malloc(2048 + AHCI_MAX_SLOTS*sizeof(struct ahci_cmd_table) + PAGE_SIZE_4KB);
+    id = malloc(512);
+
+    if (!p->mem || !id) {
+	ERROR("Cannot allocate port memory\n");
+	goto fail;
+    }
+
+    addr = ((uint64_t)p->mem + PAGE_SIZE_4KB - 1) & ~(uint64_t)(PAGE_SIZE_4KB - 1);
+    memset((void*)addr,0,2048 + AHCI_MAX_SLOTS*sizeof(struct ahci_cmd_table));
+    p->cl = (struct ahci_cmd_hdr *)addr;
+    p->fis = (uint8_t *)(addr + 1024);
+    p->tables = (struct ahci_cmd_table *)(addr + 2048);
+
+    if (!dma_reachable(h,(void*)addr,2048 + AHCI_MAX_SLOTS*sizeof(struct ahci_cmd_table)) ||
+	!dma_reachable(h,id,512)) {
+	ERROR("Port memory cannot be reached by the controller\n");
+	goto fail;
+    }
+
+    if (port_stop(p)) {
+	goto fail;
+    }
+
+    port_write(p,PxCLB,(uint32_t)(uint64_t)p->cl);
+    port_write(p,PxCLBU,(uint32_t)((uint64_t)p->cl >> 32));
+    port_write(p,PxFB,(uint32_t)(uint64_t)p->fis);
+    port_write(p,PxFBU,(uint32_t)((uint64_t)p->fis >> 32));
+    port_write(p,PxSERR,0xffffffff);
+    port_write(p,PxIS,0xffffffff);
+    port_write(p,PxIE,0);
+
+    port_start(p);
+
+    if (port_identify(p,id)) {
+	goto fail_stop;
+    }
+
+    if (!((id[83] >> 10) & 0x1)) {
+	ERROR("LBA48 not supported on port %d\n",num);
+	goto fail_stop;
+    }
+
+    p->num_blocks =
+	(((uint64_t) id[103]) << 48) +
+	(((uint64_t) id[102]) << 32) +
+	(((uint64_t) id[101]) << 16) +
+	(((uint64_t) id[100]) <<  0) ;
+
+    depth = HBA_CAP_NCS(h->cap);
+
+    if ((h->cap & HBA_CAP_SNCQ) && ((id[76] >> 8) & 0x1)) {
+	p->ncq = 1;
+	if ((id[75] & 0x1f) + 1U < depth) {
+	    depth = (id[75] & 0x1f) + 1;
+	}
+    }
+
+    p->slots = depth >= 32 ? 0xffffffff : (1U << depth) - 1;
+
+    sprintf(name,"ahci%d-%d",h->num,num);
+
+    p->blkdev = nk_block_dev_register(name,0,&inter,p);
+
+    if (!p->blkdev) {
+	ERROR("Cannot register %s\n",name);
+	goto fail_stop;
+    }
+
+    h->ports[num] = p;
+
+    port_write(p,PxIE,PxIS_DHRS | PxIS_PSS | PxIS_DSS | PxIS_SDBS | PxIS_ERRORS);
+
+    INFO("Added %s: %lu blocks (%lu MB), %s, %u commands outstanding\n",
+	 name, p->num_blocks, (p->num_blocks*AHCI_SECTOR_SIZE)>>20,
+	 p->ncq ? "NCQ" : "no NCQ", depth);
+
+    free(id);
+
+    return 0;
+
+ fail_stop:
+    port_stop(p);
+ fail:
+    free(id);
+    free(p->mem);
+    free(p);
+    return -1;
+}
+
+static int controller_init(struct pci_dev *pdev)
+{
+    struct ahci_controller_state *h;
+    uint8_t bus = pdev->bus->num;
+    uint32_t pi;
+    uint16_t cmd;
+    int i;
+
+    if (num_controllers >= AHCI_MAX_CONTROLLERS) {
+	ERROR("Too many controllers\n");
+	return -1;
+    }
+
+    if (pdev->cfg.dev_cfg.bars[5] & 0x1) {
+	ERROR("ABAR is not a memory bar\n");
+	return -1;
+    }
+
+    h = malloc(sizeof(*h));
+    if (!h) {
+	ERROR("Cannot allocate controller state\n");
+	return -1;
+    }
+    memset(h,0,sizeof(*h));
+
+    h->num = num_controllers;
+    h->pci = pdev;
+    h->abar = pdev->cfg.dev_cfg.bars[5] & 0xfffffff0;
+
+    // the registers span a bit more than a page with all ports
+    if (nk_map_page_nocache(ROUND_DOWN_TO_PAGE(h->abar), PTE_PRESENT_BIT|PTE_WRITABLE_BIT, PS_4K) ||
+	nk_map_page_nocache(ROUND_DOWN_TO_PAGE(h->abar) + PAGE_SIZE_4KB, PTE_PRESENT_BIT|PTE_WRITABLE_BIT, PS_4K)) {
+	ERROR("Cannot map ABAR at %p\n",(void*)h->abar);
+	free(h);
+	return -1;
+    }
+
+    cmd = pci_cfg_readw(bus,pdev->num,pdev->fun,0x4);
+    pci_cfg_writew(bus,pdev->num,pdev->fun,0x4,cmd | PCI_CMD_MEM_ENABLE | PCI_CMD_MASTER_ENABLE);
+
+    hba_write(h,HBA_GHC,hba_read(h,HBA_GHC) | HBA_GHC_AE);
+
+    h->cap = hba_read(h,HBA_CAP);
+    pi = hba_read(h,HBA_PI);
+
+    INFO("Controller %d (%x:%x) version 0x%x, %u ports, %u slots%s%s\n",
+	 h->num, pdev->cfg.vendor_id, pdev->cfg.device_id, hba_read(h,HBA_VS),
+	 popcount(pi), HBA_CAP_NCS(h->cap),
+	 h->cap & HBA_CAP_SNCQ ? ", NCQ" : "",
+	 h->cap & HBA_CAP_S64A ? ", 64 bit" : "");
+
+    if (setup_interrupt(h)) {
+	free(h);
+	return -1;
+    }
+
+    controllers[num_controllers++] = h;
+
+    for (i=0;i<AHCI_MAX_PORTS;i++) {
+	struct ahci_port_state tmp = { .regs = h->abar + PORT_BASE(i), .num = i };
+	uint32_t ssts, sig;
+
+	if (!(pi & (1U << i))) {
+	    continue;
+	}
+
+	ssts = port_read(&tmp,PxSSTS);
+	sig = port_read(&tmp,PxSIG);
+
+	if ((ssts & 0xf) != SSTS_DET_PRESENT || sig != SIG_ATA) {
+	    DEBUG("Skipping port %d (ssts 0x%x, sig 0x%x)\n",i,ssts,sig);
+	    continue;
+	}
+
+	port_init(h,i);
+    }
+
+    hba_write(h,HBA_IS,0xffffffff);
+    hba_write(h,HBA_GHC,hba_read(h,HBA_GHC) | HBA_GHC_IE);
+
+    INFO("Controller %d using %s vector 0x%x\n", h->num, h->msi ? "MSI" : "INTx", h->intr_vec);
+
+    return 0;
+}
+
+int nk_ahci_init(struct naut_info *naut)
+{
+    struct pci_info *pci = naut->sys.pci;
+    struct list_head *curbus, *curdev;
+
+    INFO("init\n");
+
+    if (!pci) {
+	ERROR("No PCI info\n");
+	return -1;
+    }
+
+    list_for_each(curbus,&(pci->bus_list)) { 
+	struct pci_bus *bus = list_entry(curbus,struct pci_bus,bus_node);
+	list_for_each(curdev, &(bus->dev_list)) { 
+	    struct pci_dev *pdev = list_entry(curdev,struct pci_dev,dev_node);
+	    if (pdev->cfg.class_code==PCI_CLASS_STORAGE &&
+		pdev->cfg.subclass==0x06 && pdev->cfg.prog_if==0x01) {
+		controller_init(pdev);
+	    }
+	}
+    }
+
+    return 0;
+}
+
+void nk_ahci_dump(void)
+{
+    struct ahci_port_state *p;
+    uint64_t mb;
+    int i, j;
+
+    for (i=0;i<num_controllers;i++) {
+	for (j=0;j<AHCI_MAX_PORTS;j++) {
+	    p = controllers[i]->ports[j];
+	    if (!p) {
+		continue;
+	    }
+	    mb = (p->blocks * AHCI_SECTOR_SIZE) >> 20;
+	    nk_vc_printf("%s: %s, %lu requests, %lu blocks, %lu errors, %lu interrupts, %u max outstanding, %lu cycles/MB\n",
+			 p->blkdev->dev.name, p->ncq ? "ncq" : "dma",
+			 p->requests, p->blocks, p->errors, p->interrupts,
+			 p->max_busy, mb ? p->cycles / mb : 0);
+	}
+    }
+}
+
+void nk_ahci_deinit()
+{
+    INFO("deinit\n");
+}
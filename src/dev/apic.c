@@ -34,6 +34,9 @@
 #include <dev/apic.h>
 #include <dev/i8254.h>
 #include <lib/bitops.h>
+#ifdef NAUT_CONFIG_SAMPLER
+#include <nautilus/sampler.h>
+#endif
 
 #ifndef NAUT_CONFIG_DEBUG_APIC
 #undef DEBUG_PRINT
@@ -375,6 +378,7 @@ apic_read_timer (struct apic_dev * apic)
 void
 apic_self_ipi (struct apic_dev * apic, uint_t vector)
 {
+    NK_TRACE(NK_TRACE_IPI, vector, apic->id, 0);
     if (apic->mode==APIC_X2APIC) {
 	uint8_t flags = irq_disable_save();
 	apic_write(apic, APIC_REG_SELF_IPI, vector);
@@ -1215,6 +1219,12 @@ static int apic_timer_handler(excp_entry_t * excp, excp_vec_t vec, void *state)
 
     apic->timer_count++;
 
+    NK_TRACE(NK_TRACE_TIMER, 0, 0, 0);
+
+#ifdef NAUT_CONFIG_SAMPLER
+    nk_sampler_timer_tick(excp);
+#endif
+
     apic->timer_set = 0;
 
     // do all our callbacks
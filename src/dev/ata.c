@@ -23,6 +23,9 @@
 
 #include <nautilus/nautilus.h>
 #include <nautilus/blkdev.h>
+#include <nautilus/irq.h>
+#include <nautilus/cpu.h>
+#include <dev/pci.h>
 #include <dev/ata.h>
 
 #ifndef NAUT_CONFIG_DEBUG_ATA
@@ -41,33 +44,93 @@
 
 
 /*
-  This is a hideous first-pass implementation using PIO mode
-  and the legacy controller interface.   It is both extremely slow,
-  blocking, and not even interrupt driven, much less DMA.
-
-  The goal here is to have the functionality.   
-  This is not a performance path... 
+  This was a hideous first-pass implementation using PIO mode
+  and the legacy controller interface, extremely slow, blocking,
+  and not even interrupt driven.   That is still what happens
+  if there is no PCI IDE controller that can do bus mastering.
+
+  If there is one, and every drive on a channel can do DMA, the
+  channel uses bus-master DMA instead.   Requests are queued per
+  channel, since a channel can only do one command at a time,
+  and each completes via interrupt, which starts the next.  A
+  request larger than a command can carry is done as a series
+  of commands.   Only compatibility mode is handled, that is,
+  the legacy ports and IRQs 14 and 15.
  */
 
+#define ATA_SECTOR_SIZE      512
+#define ATA_MAX_PRD          32
+#define ATA_DMA_MAX_SECTORS  2048   // per command, 1 MB, 17 PRDs at most
+#define ATA_QUEUE_LEN        32     // requests waiting per channel
+
+// physical region descriptor, the table is 4 byte aligned
+// and may not cross a 64 KB boundary, neither may a region
+struct ata_prd {
+    uint32_t addr;
+    uint16_t count;   // bytes, 0 means 64 KB
+    uint16_t flags;
+#define ATA_PRD_EOT 0x8000
+} __packed;
+
+struct ata_req {
+    struct ata_blkdev_state *dev;
+    int       write;
+    uint64_t  blocknum;
+    uint64_t  count;
+    uint8_t  *buf;
+    uint64_t  done;     // blocks finished by earlier commands
+    uint64_t  cur;      // blocks in the command in flight
+    int       bounce;   // the command uses the bounce buffer
+    int       failed;
+    void    (*callback)(void *, int);
+    void     *context;
+};
+
 struct ata_blkdev_state {
     struct nk_block_dev *blkdev;
 
     spinlock_t lock;
     
     struct ata_controller_state *controller;
+    struct ata_channel_state    *chan;
     
     enum {NONE=0, HD, CD} type;
     uint64_t            block_size;
     uint64_t            num_blocks;
     uint8_t             channel; // 0/1 on controller (primary/secondary)
     uint8_t             id;      // 0/1 on channel (master/slave)
+    uint8_t             dma_capable;
+
+    uint64_t            requests;
+    uint64_t            blocks;
+    uint64_t            errors;
+    uint64_t            cycles;  // spent by the CPU driving transfers
 };
 
+struct ata_channel_state {
+    spinlock_t          lock;
+    uint8_t             num;
+    uint16_t            bm;      // bus master registers, 0 means PIO
+
+    struct ata_prd     *prdt;
+    void               *prdt_mem;
+    uint8_t            *bounce;  // for buffers the controller cannot reach
+
+    // head is in flight when busy
+    struct ata_req      queue[ATA_QUEUE_LEN];
+    uint32_t            head;
+    uint32_t            tail;
+    int                 busy;
+
+    uint64_t            interrupts;
+};
 
 struct ata_controller_state {
     // devices 0,1 are master/slave on primary
     // devices 2,3 are master/slave on secondary
     struct ata_blkdev_state devices[4];
+    struct ata_channel_state channels[2];
+    struct pci_dev          *pci;   // null for the bare legacy ports
 };
 
 #define LEGACY_BUS_IOSTART(devnum) (((devnum)<2) ? 0x1f0 : 0x170)
@@ -83,6 +146,22 @@ struct ata_controller_state {
 #define DRIVEHEAD(devnum) (LEGACY_BUS_IOSTART(devnum)+6)
 #define CMDSTATUS(devnum) (LEGACY_BUS_IOSTART(devnum)+7)
 #define ALTCMDSTATUS(devnum) (LEGACY_ALT_IOSTART(devnum))
+#define DEVCTRL(devnum) (LEGACY_ALT_IOSTART(devnum))  // on write
+
+// bus master registers, relative to channel's base
+#define BM_CMD(c)    ((c)->bm+0)
+#define BM_STATUS(c) ((c)->bm+2)
+#define BM_PRDT(c)   ((c)->bm+4)
+
+#define BM_CMD_START   0x1
+#define BM_CMD_READ    0x8   // the controller writes memory
+#define BM_STATUS_ACTIVE 0x1
+#define BM_STATUS_ERR    0x2
+#define BM_STATUS_IRQ    0x4
+
+#define CHAN_LOCK_CONF uint8_t _chan_lock_flags
+#define CHAN_LOCK(c) _chan_lock_flags = spin_lock_irq_save(&(c)->lock)
+#define CHAN_UNLOCK(c) spin_unlock_irq_restore(&(c)->lock, _chan_lock_flags)
 
 typedef union ata_status_reg {
     uint8_t val;
@@ -247,6 +326,8 @@ static int ata_drive_identify(struct ata_blkdev_state *s)
 	buf[j] = inw(DATA(devnum));
     }
 
+    s->dma_capable = (buf[49] >> 8) & 0x1;
+
     if (!((buf[83] >> 10) & 0x1)) { 
 	ERROR("LBA48 not supported on this drive\n");
 	return -1;
@@ -264,21 +345,17 @@ static int ata_drive_identify(struct ata_blkdev_state *s)
     }
 }
 
-static int ata_lba48_read_write(struct ata_blkdev_state *s,
-				 uint64_t block_num, 
-				 uint64_t count, 
-				 uint8_t  *srcdest, 
-				 int write)
+// select the drive and load the LBA and sector count, for
+// a command that is issued next
+static int ata_lba48_setup(struct ata_blkdev_state *s,
+			   uint64_t block_num, 
+			   uint64_t count)
 {
     uint64_t atacount;
     uint8_t devnum = s->channel * 2 + s->id;
     uint8_t sectcnt[2];
     uint8_t lba[7]; // we use 1..6 as per convention...
 
-    DEBUG("%s on device %u start %lu numblocks %lu\n",
-	  write ? "write" : "read",
-	  devnum, block_num, count);
- 
     // count is encoded with 0 == 64K sectors
     if (count==65536) { 
 	atacount=0;
@@ -316,9 +393,27 @@ static int ata_lba48_read_write(struct ata_blkdev_state *s,
     outb(lba[3],LBAHI(devnum));
 
     DEBUG("LBA and sector count completed\n");
- 
+
+    return 0;
+}
+
+static int ata_lba48_read_write(struct ata_blkdev_state *s,
+				 uint64_t block_num, 
+				 uint64_t count, 
+				 uint8_t  *srcdest, 
+				 int write)
+{
+    uint8_t devnum = s->channel * 2 + s->id;
     uint64_t i,j;
 
+    DEBUG("%s on device %u start %lu numblocks %lu\n",
+	  write ? "write" : "read",
+	  devnum, block_num, count);
+
+    if (ata_lba48_setup(s, block_num, count)) {
+	return -1;
+    }
+
     if (write) { 
 	outb(0x34,CMDSTATUS(devnum)); // WRITE SECTORS EXT
     } else {
@@ -355,54 +450,342 @@ static int ata_lba48_read_write(struct ata_blkdev_state *s,
 	
 
 
-static int read_blocks(void *state, uint64_t blocknum, uint64_t count, uint8_t *dest,void (*callback)(void *), void *context)
+/*
+  Bus-master DMA
+*/
+
+struct ata_done {
+    void (*callback)(void *, int);
+    void  *context;
+    int    status;
+};
+
+static int chan_has_room(void *state)
 {
-    STATE_LOCK_CONF;
-    struct ata_blkdev_state *s = (struct ata_blkdev_state *)state;
+    struct ata_channel_state *c = (struct ata_channel_state *)state;
+    return c->tail - c->head < ATA_QUEUE_LEN;
+}
 
-    DEBUG("read_blocks on device %s starting at %lu for %lu blocks\n",
-	  s->blkdev->dev.name, blocknum, count);
+// the controller does 32 bit addresses of even bytes
+static inline int dma_reachable(uint8_t *buf, uint64_t len)
+{
+    return !((uint64_t)buf & 0x1) && ((uint64_t)buf + len) <= 0x100000000ULL;
+}
 
-    STATE_LOCK(s);
-    if (blocknum+count >= s->num_blocks) { 
-	STATE_UNLOCK(s);
-	ERROR("Illegal access past end of disk\n");
+static void build_prdt(struct ata_channel_state *c, uint8_t *buf, uint64_t len)
+{
+    uint64_t addr = (uint64_t)buf;
+    uint64_t n;
+    int i = 0;
+
+    while (len) {
+	// a region may not cross a 64 KB boundary
+	n = 0x10000 - (addr & 0xffff);
+	if (n > len) {
+	    n = len;
+	}
+	c->prdt[i].addr = (uint32_t)addr;
+	c->prdt[i].count = (uint16_t)n;   // 64 KB wraps to 0, as it should
+	c->prdt[i].flags = 0;
+	addr += n;
+	len -= n;
+	i++;
+    }
+
+    c->prdt[i-1].flags = ATA_PRD_EOT;
+}
+
+// start the next command of the request at the head of the queue
+// called with the channel locked
+static int dma_start(struct ata_channel_state *c)
+{
+    struct ata_req *r = &c->queue[c->head % ATA_QUEUE_LEN];
+    struct ata_blkdev_state *s = r->dev;
+    uint8_t devnum = s->channel * 2 + s->id;
+    uint64_t start = rdtsc();
+    uint8_t *buf;
+    uint64_t n;
+
+    n = r->count - r->done;
+    if (n > ATA_DMA_MAX_SECTORS) {
+	n = ATA_DMA_MAX_SECTORS;
+    }
+
+    buf = r->buf + r->done * ATA_SECTOR_SIZE;
+
+    r->bounce = !dma_reachable(buf, n * ATA_SECTOR_SIZE);
+    if (r->bounce) {
+	if (r->write) {
+	    memcpy(c->bounce, buf, n * ATA_SECTOR_SIZE);
+	}
+	buf = c->bounce;
+    }
+
+    build_prdt(c, buf, n * ATA_SECTOR_SIZE);
+
+    outb(0, BM_CMD(c));
+    outl((uint32_t)(uint64_t)c->prdt, BM_PRDT(c));
+    outb(inb(BM_STATUS(c)) | BM_STATUS_ERR | BM_STATUS_IRQ, BM_STATUS(c));
+
+    if (ata_lba48_setup(s, r->blocknum + r->done, n)) {
+	ERROR("Cannot start DMA on device %u\n", devnum);
+	s->cycles += rdtsc() - start;
 	return -1;
+    }
+
+    outb(r->write ? 0x35 : 0x25, CMDSTATUS(devnum)); // WRITE/READ DMA EXT
+    outb(r->write ? BM_CMD_START : BM_CMD_START | BM_CMD_READ, BM_CMD(c));
+
+    r->cur = n;
+    c->busy = 1;
+
+    DEBUG("DMA %s on device %u start %lu numblocks %lu%s\n",
+	  r->write ? "write" : "read", devnum, r->blocknum + r->done, n,
+	  r->bounce ? " (bounced)" : "");
+
+    s->cycles += rdtsc() - start;
+
+    return 0;
+}
+
+// get the next request going, failing any that cannot be started
+// called with the channel locked, returns the number failed
+static int dma_kick(struct ata_channel_state *c, struct ata_done *failed)
+{
+    struct ata_req *r;
+    int n = 0;
+
+    while (!c->busy && c->head != c->tail) {
+	if (!dma_start(c)) {
+	    break;
+	}
+	r = &c->queue[c->head % ATA_QUEUE_LEN];
+	r->dev->errors++;
+	failed[n].callback = r->callback;
+	failed[n].context = r->context;
+	failed[n].status = -1;
+	n++;
+	c->head++;
+    }
+
+    return n;
+}
+
+static void dma_signal(struct ata_channel_state *c, struct ata_done *done, int n)
+{
+    int i;
+
+    for (i=0;i<n;i++) {
+	if (done[i].callback) {
+	    done[i].callback(done[i].context, done[i].status);
+	}
+    }
+
+    // whoever waits for room may be waiting on either drive
+    for (i=0;i<2;i++) {
+	if (controller.devices[c->num*2+i].blkdev) {
+	    nk_dev_signal((struct nk_dev *)controller.devices[c->num*2+i].blkdev);
+	}
+    }
+}
+
+static int dma_irq_handler(excp_entry_t *excp, excp_vec_t vec, void *state)
+{
+    CHAN_LOCK_CONF;
+    struct ata_channel_state *c = (struct ata_channel_state *)state;
+    struct ata_done done[ATA_QUEUE_LEN+1];
+    struct ata_blkdev_state *s;
+    struct ata_req *r;
+    ata_status_reg_t stat;
+    uint8_t bmstat;
+    uint64_t start = rdtsc();
+    int n = 0;
+
+    CHAN_LOCK(c);
+
+    bmstat = inb(BM_STATUS(c));
+
+    if (!(bmstat & BM_STATUS_IRQ)) {
+	CHAN_UNLOCK(c);
+	IRQ_HANDLER_END();
+	return 0;
+    }
+
+    c->interrupts++;
+
+    outb(0, BM_CMD(c));
+    // clears the interrupt, for whichever drive raised it
+    stat.val = inb(CMDSTATUS(c->num*2));
+    outb(bmstat | BM_STATUS_ERR | BM_STATUS_IRQ, BM_STATUS(c));
+
+    if (!c->busy) {
+	DEBUG("Spurious interrupt on channel %u\n", c->num);
+	CHAN_UNLOCK(c);
+	IRQ_HANDLER_END();
+	return 0;
+    }
+
+    r = &c->queue[c->head % ATA_QUEUE_LEN];
+    s = r->dev;
+
+    c->busy = 0;
+
+    if ((bmstat & BM_STATUS_ERR) || stat.err || stat.df) {
+	ERROR("DMA %s failed on device %u at block %lu (bm 0x%x, status 0x%x)\n",
+	      r->write ? "write" : "read", c->num*2 + s->id,
+	      r->blocknum + r->done, bmstat, stat.val);
+	s->errors++;
+	r->failed = 1;
+	r->done = r->count;
     } else {
-	int rc = ata_lba48_read_write(s,blocknum, count, dest, 0);
-	STATE_UNLOCK(s);
-	nk_dev_signal((struct nk_dev*)(s->blkdev));
-	if (callback) {
-	    callback(context);
+	if (r->bounce && !r->write) {
+	    memcpy(r->buf + r->done * ATA_SECTOR_SIZE, c->bounce, r->cur * ATA_SECTOR_SIZE);
 	}
-	return rc;
+	r->done += r->cur;
+	s->blocks += r->cur;
     }
+
+    if (r->done < r->count) {
+	// the rest of a large request
+	if (dma_start(c)) {
+	    s->errors++;
+	    r->failed = 1;
+	    r->done = r->count;
+	}
+    }
+
+    if (r->done == r->count) {
+	done[n].callback = r->callback;
+	done[n].context = r->context;
+	done[n].status = r->failed ? -1 : 0;
+	n++;
+	c->head++;
+	n += dma_kick(c, done + n);
+    }
+
+    s->cycles += rdtsc() - start;
+
+    CHAN_UNLOCK(c);
+
+    // callbacks run without the lock held
+    dma_signal(c, done, n);
+
+    IRQ_HANDLER_END();
+
+    return 0;
 }
 
-static int write_blocks(void *state, uint64_t blocknum, uint64_t count, uint8_t *src,void (*callback)(void *), void *context)
+static int dma_submit(struct ata_blkdev_state *s, uint64_t blocknum, uint64_t count,
+		      uint8_t *buf, int write, void (*callback)(void *, int), void *context)
 {
-    STATE_LOCK_CONF;
-    struct ata_blkdev_state *s = (struct ata_blkdev_state *)state;
+    CHAN_LOCK_CONF;
+    struct ata_channel_state *c = s->chan;
+    struct ata_done failed[ATA_QUEUE_LEN];
+    struct ata_req *r;
+    int n;
+
+    while (1) {
+	CHAN_LOCK(c);
+	if (chan_has_room(c)) {
+	    break;
+	}
+	CHAN_UNLOCK(c);
+	// queue is full, wait for some completions
+	if (in_interrupt_context()) {
+	    ERROR("Queue full in interrupt context\n");
+	    return -1;
+	}
+	nk_dev_wait_cond((struct nk_dev *)s->blkdev, chan_has_room, c);
+    }
+
+    r = &c->queue[c->tail % ATA_QUEUE_LEN];
+    memset(r,0,sizeof(*r));
+    r->dev = s;
+    r->write = write;
+    r->blocknum = blocknum;
+    r->count = count;
+    r->buf = buf;
+    r->callback = callback;
+    r->context = context;
+    c->tail++;
+
+    s->requests++;
+
+    if (c->busy) {
+	CHAN_UNLOCK(c);
+	return 0;
+    }
+
+    // an idle channel has an empty queue, so ours is the only
+    // request that can fail here, and that we report by returning
+    n = dma_kick(c, failed);
+
+    CHAN_UNLOCK(c);
+
+    if (n) {
+	dma_signal(c, 0, 0);
+	return -1;
+    }
+
+    return 0;
+}
 
-    DEBUG("write_blocks on device %s starting at %lu for %lu blocks\n",
-	  s->blkdev->dev.name, blocknum, count);
+static int pio_read_write(struct ata_blkdev_state *s, uint64_t blocknum, uint64_t count, uint8_t *buf, int write, void (*callback)(void *, int), void *context)
+{
+    STATE_LOCK_CONF;
+    uint64_t start;
+    int rc;
 
     STATE_LOCK(s);
-    if (blocknum+count >= s->num_blocks) { 
-	STATE_UNLOCK(s);
+    start = rdtsc();
+    rc = ata_lba48_read_write(s,blocknum, count, buf, write);
+    s->cycles += rdtsc() - start;
+    s->requests++;
+    if (rc) {
+	s->errors++;
+    } else {
+	s->blocks += count;
+    }
+    STATE_UNLOCK(s);
+    nk_dev_signal((struct nk_dev*)(s->blkdev));
+    if (callback) {
+	callback(context, rc ? -1 : 0);
+    }
+    return rc;
+}
+
+static int read_write(struct ata_blkdev_state *s, uint64_t blocknum, uint64_t count, uint8_t *buf, int write, void (*callback)(void *, int), void *context)
+{
+    DEBUG("%s_blocks on device %s starting at %lu for %lu blocks\n",
+	  write ? "write" : "read", s->blkdev->dev.name, blocknum, count);
+
+    if (blocknum+count > s->num_blocks) { 
 	ERROR("Illegal access past end of disk\n");
 	return -1;
+    }
+
+    if (!count || count > 65536) {
+	ERROR("Cannot transfer %lu blocks at once\n", count);
+	return -1;
+    }
+
+    if (s->chan->bm) {
+	return dma_submit(s, blocknum, count, buf, write, callback, context);
     } else {
-	int rc = ata_lba48_read_write(s,blocknum, count, src, 1);
-	STATE_UNLOCK(s);
-	nk_dev_signal((struct nk_dev*)(s->blkdev));
-	if (callback) {
-	    callback(context);
-	}
-	return rc;
+	return pio_read_write(s, blocknum, count, buf, write, callback, context);
     }
 }
 
+static int read_blocks(void *state, uint64_t blocknum, uint64_t count, uint8_t *dest,void (*callback)(void *, int), void *context)
+{
+    return read_write((struct ata_blkdev_state *)state, blocknum, count, dest, 0, callback, context);
+}
+
+static int write_blocks(void *state, uint64_t blocknum, uint64_t count, uint8_t *src,void (*callback)(void *, int), void *context)
+{
+    return read_write((struct ata_blkdev_state *)state, blocknum, count, src, 1, callback, context);
+}
+
 static int get_characteristics(void *state, struct nk_block_dev_characteristics *c)
 {
     STATE_LOCK_CONF;
@@ -435,6 +818,7 @@ static void discover_device(int channel, int id)
     s->channel=channel;
     s->id=id;
     s->controller = &controller;
+    s->chan = &controller.channels[channel];
 
     ata_drive_detect(s);
     if (s->type!=NONE) { 
@@ -458,25 +842,180 @@ static void discover_device(int channel, int id)
 }
 	
 
-static int discover_ata_drives()
+#ifdef NAUT_CONFIG_ATA_DMA
+static struct pci_dev *find_ide_controller(struct naut_info *naut)
+{
+    struct pci_info *pci = naut->sys.pci;
+    struct list_head *curbus, *curdev;
+
+    if (!pci) {
+	return 0;
+    }
+
+    list_for_each(curbus,&(pci->bus_list)) { 
+	struct pci_bus *bus = list_entry(curbus,struct pci_bus,bus_node);
+	list_for_each(curdev, &(bus->dev_list)) { 
+	    struct pci_dev *pdev = list_entry(curdev,struct pci_dev,dev_node);
+	    if (pdev->cfg.class_code==PCI_CLASS_STORAGE && pdev->cfg.subclass==0x01) {
+		return pdev;
+	    }
+	}
+    }
+
+    return 0;
+}
+
+static int setup_channel_dma(struct ata_channel_state *c, uint16_t bm)
+{
+    struct ata_blkdev_state *d = &controller.devices[c->num*2];
+    uint64_t addr;
+    int i, present=0;
+
+    for (i=0;i<2;i++) {
+	if (d[i].blkdev) {
+	    if (!d[i].dma_capable) {
+		INFO("Device %d on channel %u cannot do DMA, channel stays PIO\n", i, c->num);
+		return -1;
+	    }
+	    present++;
+	}
+    }
+
+    if (!present) {
+	return 0;
+    }
+
+    c->prdt_mem = malloc(2*PAGE_SIZE_4KB);
+    c->bounce = malloc(ATA_DMA_MAX_SECTORS*ATA_SECTOR_SIZE);
+
+    if (!c->prdt_mem || !c->bounce ||
+	!dma_reachable(c->prdt_mem, 2*PAGE_SIZE_4KB) ||
+	!dma_reachable(c->bounce, ATA_DMA_MAX_SECTORS*ATA_SECTOR_SIZE)) {
+	ERROR("Cannot allocate DMA memory below 4 GB for channel %u\n", c->num);
+	goto fail;
+    }
+
+    // a page holds the table without crossing a 64 KB boundary
+    addr = ((uint64_t)c->prdt_mem + PAGE_SIZE_4KB - 1) & ~(uint64_t)(PAGE_SIZE_4KB - 1);
+    c->prdt = (struct ata_prd *)addr;
+
+    if (register_irq_handler(LEGACY_IRQ(c->num*2), dma_irq_handler, c)) {
+	ERROR("Cannot register handler for IRQ %u\n", LEGACY_IRQ(c->num*2));
+	goto fail;
+    }
+
+    // drop anything left over from identification, and let the
+    // drives interrupt
+    outb(0, bm);
+    inb(CMDSTATUS(c->num*2));
+    outb(inb(bm+2) | BM_STATUS_ERR | BM_STATUS_IRQ, bm+2);
+    outb(0, DEVCTRL(c->num*2));
+
+    c->bm = bm;
+
+    nk_unmask_irq(LEGACY_IRQ(c->num*2));
+
+    INFO("Channel %u uses bus-master DMA at 0x%x, IRQ %u\n", c->num, bm, LEGACY_IRQ(c->num*2));
+
+    return 0;
+
+ fail:
+    free(c->prdt_mem);
+    free(c->bounce);
+    c->prdt_mem = 0;
+    c->bounce = 0;
+    return -1;
+}
+
+static void setup_dma(struct naut_info *naut)
 {
-    int i=0;
+    struct pci_dev *pdev = find_ide_controller(naut);
+    uint8_t bus, num, fun;
+    uint32_t bar;
+    uint16_t cmd;
+    int i;
+
+    if (!pdev) {
+	INFO("No PCI IDE controller, using PIO\n");
+	return;
+    }
+
+    bus = pdev->bus->num;
+    num = pdev->num;
+    fun = pdev->fun;
+
+    // we only drive the legacy ports
+    if (!(pdev->cfg.prog_if & 0x80) || (pdev->cfg.prog_if & 0x5)) {
+	INFO("IDE controller %x:%x is not a bus-master controller in compatibility mode (0x%x), using PIO\n",
+	     pdev->cfg.vendor_id, pdev->cfg.device_id, pdev->cfg.prog_if);
+	return;
+    }
+
+    bar = pdev->cfg.dev_cfg.bars[4];
+
+    if (!(bar & 0x1) || !(bar & 0xfffc)) {
+	INFO("IDE controller has no bus master I/O ports, using PIO\n");
+	return;
+    }
+
+    cmd = pci_cfg_readw(bus,num,fun,0x4);
+    pci_cfg_writew(bus,num,fun,0x4,cmd | 0x5);  // I/O, bus master
+
+    controller.pci = pdev;
+
+    for (i=0;i<2;i++) {
+	setup_channel_dma(&controller.channels[i], (bar & 0xfffc) + 8*i);
+    }
+}
+#endif
+
+static int discover_ata_drives(struct naut_info *naut)
+{
+    int i;
 
     memset((void*)&controller,0,sizeof(controller));
 
+    for (i=0;i<2;i++) {
+	spinlock_init(&controller.channels[i].lock);
+	controller.channels[i].num = i;
+    }
+
     discover_device(0,0);
     discover_device(0,1);
     discover_device(1,0);
     discover_device(1,1);
 
+#ifdef NAUT_CONFIG_ATA_DMA
+    setup_dma(naut);
+#endif
+
     return 0;
     
 }
 
+void nk_ata_dump(void)
+{
+    struct ata_blkdev_state *s;
+    uint64_t mb;
+    int i;
+
+    for (i=0;i<4;i++) {
+	s = &controller.devices[i];
+	if (!s->blkdev) {
+	    continue;
+	}
+	mb = (s->blocks * s->block_size) >> 20;
+	nk_vc_printf("%s: %s, %lu requests, %lu blocks, %lu errors, %lu cycles/MB, %lu interrupts on channel\n",
+		     s->blkdev->dev.name, s->chan->bm ? "dma" : "pio",
+		     s->requests, s->blocks, s->errors,
+		     mb ? s->cycles / mb : 0, s->chan->interrupts);
+    }
+}
+
 int nk_ata_init(struct naut_info *naut)
 {
     INFO("init\n");
-    return discover_ata_drives();
+    return discover_ata_drives(naut);
 }
 
 void nk_ata_deinit()
@@ -200,13 +200,13 @@ pci_copy_cfg_space(struct pci_dev *dev, struct pci_bus *bus)
   uint32_t i;
   // 4 bytes at a time
   for (i=0;i<sizeof(dev->cfg);i+=4) {
-    ((uint32_t*)(&dev->cfg))[i/4] = pci_cfg_readl(bus->num,dev->num,0,i);
+    ((uint32_t*)(&dev->cfg))[i/4] = pci_cfg_readl(bus->num,dev->num,dev->fun,i);
   }
 }
 
 
 static struct pci_dev*
-pci_dev_create (uint32_t num, struct pci_bus * bus)
+pci_dev_create (uint32_t num, uint32_t fun, struct pci_bus * bus)
 {
     struct pci_dev * dev = NULL;
     dev = malloc(sizeof(struct pci_dev));
@@ -217,6 +217,7 @@ pci_dev_create (uint32_t num, struct pci_bus * bus)
     memset(dev, 0, sizeof(struct pci_dev));
 
     dev->num = num;
+    dev->fun = fun;
 
     pci_copy_cfg_space(dev,bus);
 
@@ -286,7 +287,7 @@ pci_dev_probe (struct pci_bus * bus, uint8_t dev)
             pci_get_rev_id(bus->num, dev, fun));
 
     /* create a logical representation of the device */
-    if (pci_dev_create(dev, bus) == NULL) {
+    if (pci_dev_create(dev, 0, bus) == NULL) {
         PCI_ERROR("Could not create PCI device\n");
         return;
     }
@@ -306,6 +307,10 @@ pci_dev_probe (struct pci_bus * bus, uint8_t dev)
         for (fun = 1; fun < PCI_MAX_FUN; fun++) {
             if (pci_get_vendor_id(bus->num, dev, fun) != 0xffff) {
                 PCI_DEBUG("[%04d:%02d.%d] Probing function %02d\n", bus->num, dev, fun, fun);
+                if (pci_dev_create(dev, fun, bus) == NULL) {
+                    PCI_ERROR("Could not create PCI device function\n");
+                    continue;
+                }
                 pci_fun_probe(bus->pci, bus->num, dev, fun);
             }
         }
@@ -61,7 +61,7 @@ static int get_characteristics(void *state, struct nk_block_dev_characteristics
     return 0;
 }
 
-static int read_blocks(void *state, uint64_t blocknum, uint64_t count, uint8_t *dest,void (*callback)(void *), void *context)
+static int read_blocks(void *state, uint64_t blocknum, uint64_t count, uint8_t *dest,void (*callback)(void *, int), void *context)
 {
     STATE_LOCK_CONF;
     struct ramdisk_state *s = (struct ramdisk_state *)state;
@@ -80,13 +80,13 @@ static int read_blocks(void *state, uint64_t blocknum, uint64_t count, uint8_t *
 	//nk_dump_mem(dest,s->block_size*count);
 	nk_dev_signal((struct nk_dev *)s->blkdev);
 	if (callback) {
-	    callback(context);
+	    callback(context, 0);
 	}
 	return 0;
     }
 }
 
-static int write_blocks(void *state, uint64_t blocknum, uint64_t count, uint8_t *src,void (*callback)(void *), void *context)
+static int write_blocks(void *state, uint64_t blocknum, uint64_t count, uint8_t *src,void (*callback)(void *, int), void *context)
 {
     STATE_LOCK_CONF;
     struct ramdisk_state *s = (struct ramdisk_state *)state;
@@ -104,7 +104,7 @@ static int write_blocks(void *state, uint64_t blocknum, uint64_t count, uint8_t
 	STATE_UNLOCK(s);
 	nk_dev_signal((struct nk_dev *)(s->blkdev));
 	if (callback) { 
-	    callback(context);
+	    callback(context, 0);
 	}
 	return 0;
     }
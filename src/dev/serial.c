@@ -51,12 +51,19 @@
 
   Additional serial devices can be initialized via serial_init_one().
 
+  Output to an initialized device is interrupt-driven.  Writers
+  queue bytes in the device's output ring, and whenever the
+  transmitter is empty a full FIFO's worth is moved to it at once,
+  either by the writer or by the transmit holding register empty
+  interrupt.  Only a writer that finds the ring full and cannot
+  sleep (interrupts off) waits on the chip.  Once serial_init() has
+  promoted the early port, the serial_ functions queue in its ring
+  as well, so console mirroring no longer polls per byte.
+
   We expect that every serial port is at least a 16550. 
   We run all serial ports at 115200 N81. 
   
 */
-#define PATCH   1
-
 #define COM1_3_IRQ 4
 #define COM2_4_IRQ 3
 #define COM1_ADDR 0x3F8
@@ -79,6 +86,25 @@ static struct serial_state *early_dev = 0;
 /* The following state is for late output */
 
 #define BUFSIZE 512
+#define OUTPUT_BUFSIZE 4096
+
+// bytes the transmit FIFO of a 16550 takes once it is empty
+#define TX_FIFO_DEPTH 16
+
+#define DLL  0   // divisor latch low
+#define DLM  1   // divisor latch high
+#define RBR  0   // read data
+#define THR  0   // write data
+#define IER  1   // interrupt enable
+#define IIR  2   // interrupt identify (read)
+#define FCR  2   // FIFO control (write)
+#define LCR  3   // line control
+#define MCR  4   // modem control
+#define LSR  5   // line status
+#define MSR  6   // modem status
+#define SCR  7   // scratch
+
+#define LSR_THRE 0x20  // line status: transmitter (FIFO) empty
   
 struct serial_state {
     struct nk_char_dev *dev;
@@ -90,7 +116,9 @@ struct serial_state {
     uint32_t    input_buf_head, input_buf_tail;
     uint8_t     input_buf[BUFSIZE];
     uint32_t    output_buf_head, output_buf_tail;
-    uint8_t     output_buf[BUFSIZE];
+    uint8_t     output_buf[OUTPUT_BUFSIZE];
+    uint8_t     ier;    // shadow of the interrupt enable register
+    uint64_t    dropped;  // console output lost to a full ring
 };
 
 
@@ -120,7 +148,12 @@ static int serial_input_full(struct serial_state *s)
 
 static int serial_output_full(struct serial_state *s) 
 {
-    return ((s->output_buf_tail + 1) % BUFSIZE) == s->output_buf_head;
+    return ((s->output_buf_tail + 1) % OUTPUT_BUFSIZE) == s->output_buf_head;
+}
+
+static uint32_t serial_output_space(struct serial_state *s)
+{
+    return (s->output_buf_head + OUTPUT_BUFSIZE - s->output_buf_tail - 1) % OUTPUT_BUFSIZE;
 }
 
 static void serial_input_push(struct serial_state *s, uint8_t data)
@@ -139,14 +172,14 @@ static uint8_t serial_input_pull(struct serial_state *s)
 static void serial_output_push(struct serial_state *s, uint8_t data)
 {
     s->output_buf[s->output_buf_tail] = data;
-    s->output_buf_tail = (s->output_buf_tail + 1) % BUFSIZE;
+    s->output_buf_tail = (s->output_buf_tail + 1) % OUTPUT_BUFSIZE;
 }
 
 
 static uint8_t serial_output_pull(struct serial_state *s)
 {
     uint8_t temp = s->output_buf[s->output_buf_head];
-    s->output_buf_head = (s->output_buf_head + 1) % BUFSIZE;
+    s->output_buf_head = (s->output_buf_head + 1) % OUTPUT_BUFSIZE;
     return temp;
 }
 
@@ -172,47 +205,138 @@ static int serial_do_read(void *state, uint8_t *dest)
     return rc;
 }
 
-static void kick_output(struct serial_state *s);
+static uint64_t kick_output(struct serial_state *s);
+static void wake_writers(struct serial_state *s);
 
-static void serial_putchar_early (uchar_t c);
+static uint8_t serial_read_reg(struct serial_state *s, uint8_t offset);
 
-static int serial_do_write(void *state, uint8_t *src)
+// queue as much of src as fits, translating lf to crlf if asked
+// returns the number of bytes of src consumed, output lock held
+static uint64_t serial_output_enqueue(struct serial_state *s, const uint8_t *src, uint64_t count, int crlf)
 {
-    struct serial_state *s = (struct serial_state *)state;
+    uint64_t i;
 
-#if PATCH
-    serial_putchar(*src); //pathces
+    for (i=0;i<count;i++) {
+	if (crlf && src[i]=='\n') {
+	    if (serial_output_space(s) < 2) {
+		break;
+	    }
+	    serial_output_push(s,'\r');
+	} else if (serial_output_full(s)) {
+	    break;
+	}
+	serial_output_push(s,src[i]);
+    }
 
-    return 1;
-#endif
+    return i;
+}
 
-    int rc = -1;
+/*
+ * Queue all of src.  A writer that finds the ring full normally gets
+ * back a short count and can sleep until the interrupt handler makes
+ * room.  With interrupts off, or when asked to, the writer instead
+ * waits for the chip itself and moves bytes to it.
+ */
+static uint64_t serial_output_write(struct serial_state *s, const uint8_t *src, uint64_t count, int crlf, int poll)
+{
+    uint64_t num = 0, sent = 0;
     int flags;
 
-    serial_putchar(*src);
+    poll |= !irqs_enabled();
 
-    return 1;
- 
     flags = spin_lock_irq_save(&s->output_lock);
 
-    if (serial_output_full(s)) {
+    while (1) {
+	num += serial_output_enqueue(s, src+num, count-num, crlf);
+	sent += kick_output(s);
+	if (num==count || !poll) {
+	    break;
+	}
+	while (!(serial_read_reg(s,LSR) & LSR_THRE)) {
+	    // wait for the FIFO to empty
+	}
+    }
+
+    spin_unlock_irq_restore(&s->output_lock, flags);
+
+    if (sent) {
+	wake_writers(s);
+    }
+
+    return num;
+}
+
+// queue all of a note or none of it
+static int serial_output_note(struct serial_state *s, const char *note)
+{
+    uint64_t len = strlen(note), sent = 0;
+    int flags, rc = -1;
+
+    flags = spin_lock_irq_save(&s->output_lock);
+
+    // lf->crlf at most doubles it
+    if (serial_output_space(s) >= 2*len) {
+	serial_output_enqueue(s, (const uint8_t *)note, len, 1);
+	sent = kick_output(s);
 	rc = 0;
-	goto out;
-    } 
+    }
 
-    serial_output_push(s,*src);
-    rc = 1;
-    
- out:
-    kick_output(s);
     spin_unlock_irq_restore(&s->output_lock, flags);
+
+    if (sent) {
+	wake_writers(s);
+    }
+
     return rc;
 }
 
+/*
+ * Console output.  This is called from printk with arbitrary locks
+ * held, so rather than wait for a full ring, it drops what does not
+ * fit, and says how much once there is room again.  With interrupts
+ * off, serial_output_write() still polls the chip.
+ */
+static void serial_console_write(struct serial_state *s, const uint8_t *src, uint64_t count)
+{
+    uint64_t lost = s->dropped;
+
+    if (lost) {
+	char note[64];
+	snprintf(note, sizeof(note), "\n[serial: %lu bytes dropped]\n", lost);
+	if (!serial_output_note(s, note)) {
+	    __sync_fetch_and_sub(&s->dropped, lost);
+	}
+    }
+
+    lost = count - serial_output_write(s, src, count, 1, 0);
+
+    if (lost) {
+	__sync_fetch_and_add(&s->dropped, lost);
+    }
+}
+
+static void serial_putchar_early (uchar_t c);
+
+static int serial_do_write(void *state, uint8_t *src)
+{
+    struct serial_state *s = (struct serial_state *)state;
+
+    return serial_output_write(s,src,1,0,0);
+}
+
+// returns the number of bytes written, 0 for would block
+static int serial_do_write_buf(void *state, uint8_t *src, uint64_t count)
+{
+    struct serial_state *s = (struct serial_state *)state;
+
+    return serial_output_write(s,src,count,0,0);
+}
+
 static struct nk_char_dev_int chardevops = {
     .get_characteristics = serial_do_get_characteristics,
     .read = serial_do_read,
-    .write = serial_do_write
+    .write = serial_do_write,
+    .write_buf = serial_do_write_buf
 };
 
 
@@ -242,18 +366,6 @@ static uint8_t serial_read_reg(struct serial_state *s, uint8_t offset)
     }
 }
 
-#define DLL  0   // divisor latch low
-#define DLM  1   // divisor latch high
-#define RBR  0   // read data
-#define THR  0   // write data
-#define IER  1   // interrupt enable
-#define IIR  2   // interrupt identify (read)
-#define FCR  2   // FIFO control (write)
-#define LCR  3   // line control
-#define MCR  4   // modem control
-#define LSR  5   // line status
-#define MSR  6   // modem status
-#define SCR  7   // scratch
 
 #define USE_FIFOS 1
 
@@ -288,7 +400,8 @@ static int serial_setup(struct serial_state *s)
     // start off not getting interrupt on transmit hoilding register empty
     // this is turned on/off in kick_output()
     // ignore line status update and modem status update
-    serial_write_reg(s,IER,0x01);
+    s->ier = 0x01;
+    serial_write_reg(s,IER,s->ier);
 
 #if !USE_FIFOS
     // FIFO control register
@@ -340,41 +453,39 @@ static int serial_init_one(char *name, uint64_t addr, uint8_t irq, int mmio, str
     return 0;
 }
 
+// anyone waiting for room in the output ring, called without the lock
+static void wake_writers(struct serial_state *s)
+{
+    if (s->dev) {
+	nk_dev_signal((struct nk_dev*)(s->dev));
+    }
+}
+
 // assumes this is being done while lock held
-static void kick_output(struct serial_state *s)
+// returns the number of bytes moved to the chip
+static uint64_t kick_output(struct serial_state *s)
 {
     uint64_t count=0;
+    uint8_t ier;
 
-    while (!serial_output_empty(s)) { 
-    	uint8_t ls =  serial_read_reg(s,LSR);
-    	if (ls & 0x20) { 
-    	    // transmit holding register is empty
-    	    // drive a byte to the device
-    	    uint8_t data = serial_output_pull(s);
-    	    serial_write_reg(s,THR,data);
-    	    count++;
-    	} else {
-    	    // chip is full, stop sending to it
-    	    // but since we have more data, have it
-    	    // interrupt us when it has room
-    	    uint8_t ier = serial_read_reg(s,IER);
-    	    ier |= 0x2;
-    	    serial_write_reg(s,IER,ier);
-    	    goto out;
-    	}
+    // when the transmitter is empty, its whole FIFO can be filled
+    // without looking at the line status between bytes
+    if (!serial_output_empty(s) && (serial_read_reg(s,LSR) & LSR_THRE)) {
+	while (count<TX_FIFO_DEPTH && !serial_output_empty(s)) {
+	    serial_write_reg(s,THR,serial_output_pull(s));
+	    count++;
+	}
     }
-    
-    // the chip has room, but we have no data for it, so
-    // disable the transmit interrupt for now
-    uint8_t ier = serial_read_reg(s,IER);
-    ier &= ~0x2;
-    serial_write_reg(s,IER,ier);
- 
- out:
-    if (count>0) {
-      nk_dev_signal((struct nk_dev*)(s->dev));
+
+    // interrupt us when the chip has room only while we have more
+    // data for it
+    ier = serial_output_empty(s) ? s->ier & ~0x2 : s->ier | 0x2;
+    if (ier != s->ier) {
+	s->ier = ier;
+	serial_write_reg(s,IER,ier);
     }
-    return;
+
+    return count;
 }
 
 // assumes this is being done while lock held
@@ -555,6 +666,7 @@ static int serial_irq_handler_late(struct serial_state *s,excp_entry_t * excp,ex
 {
     uint8_t iir;
     int done = 0;
+    uint64_t sent = 0;
     
     do {
     	iir = serial_read_reg(s,IIR);
@@ -565,7 +677,7 @@ static int serial_irq_handler_late(struct serial_state *s,excp_entry_t * excp,ex
     	    break;
     	case 2: // THR empty (can send more data)
     	    spin_lock(&s->output_lock);
-    	    kick_output(s);
+    	    sent += kick_output(s);
     	    spin_unlock(&s->output_lock);
     	    break;
     	case 4:  // received data available 
@@ -580,7 +692,7 @@ static int serial_irq_handler_late(struct serial_state *s,excp_entry_t * excp,ex
     	    break;
     	case 1:   // done
     	    spin_lock(&s->output_lock);
-    	    kick_output(s);
+    	    sent += kick_output(s);
     	    spin_unlock(&s->output_lock);
     	    spin_lock(&s->input_lock);
     	    kick_input(s);
@@ -591,6 +703,10 @@ static int serial_irq_handler_late(struct serial_state *s,excp_entry_t * excp,ex
     	}
 
     } while ((iir & 0xf) != 1); //try comment out this do while loop
+
+    if (sent) {
+	wake_writers(s);
+    }
     
     return 0;
 }
@@ -704,19 +820,11 @@ static void serial_putchar_early (uchar_t c)
 
 void serial_putchar(uchar_t c)
 {
-#if PATCH
-  if (0 && early_dev) { // patch
-#else
-  if (early_dev){
-#endif
-  	if (c=='\n') { 
-  	    serial_do_write(early_dev,"\r");
-  	}
-  	serial_do_write(early_dev,&c);
+  if (early_dev) {
+      serial_console_write(early_dev,&c,1);
   } else {
-  	serial_putchar_early(c);
+      serial_putchar_early(c);
   }
-	
 }
 
 
@@ -724,12 +832,31 @@ void serial_putchar(uchar_t c)
 void 
 serial_write (const char *buf) 
 {
+  if (early_dev) {
+      // the whole string goes into the ring under one lock
+      serial_console_write(early_dev,(const uint8_t *)buf,strlen(buf));
+      return;
+  }
   while (*buf) {
       serial_putchar(*buf);
       ++buf;
   }
 }
 
+// get everything queued out to the chip, for a panic
+void 
+serial_flush (void)
+{
+  if (early_dev) {
+      // the lock may be held by whoever was interrupted by the panic
+      while (!serial_output_empty(early_dev)) {
+	  while (!(serial_read_reg(early_dev,LSR) & LSR_THRE)) {
+	  }
+	  kick_output(early_dev);
+      }
+  }
+}
+
 void 
 serial_puts( const char *buf)
 {
@@ -949,5 +1076,9 @@ void serial_init()
 #else
 #error Invalid serial port
 #endif
+    if (!early_dev->dev) {
+	// the port is not there after all, keep polling
+	early_dev = 0;
+    }
 #endif
 }
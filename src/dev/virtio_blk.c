@@ -0,0 +1,317 @@
+#include <nautilus/nautilus.h>
+#include <nautilus/blkdev.h>
+#include <nautilus/irq.h>
+#include <dev/pci.h>
+#include <dev/virtio_pci.h>
+#include <dev/virtio_blk.h>
+
+#ifndef NAUT_CONFIG_DEBUG_VIRTIO_PCI
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif 
+
+#define INFO(fmt, args...) printk("VIRTIO_BLK: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("VIRTIO_BLK: DEBUG: " fmt, ##args)
+#define ERROR(fmt, args...) printk("VIRTIO_BLK: ERROR: " fmt, ##args)
+
+#define STATE_LOCK_CONF uint8_t _state_lock_flags
+#define STATE_LOCK(state) _state_lock_flags = spin_lock_irq_save(&(state)->vq->lock)
+#define STATE_UNLOCK(state) spin_unlock_irq_restore(&((state)->vq->lock), _state_lock_flags)
+
+/*
+  Each request is a three descriptor chain: a header the device
+  reads, the data buffer, and a status byte the device writes.
+  Any number of requests can be outstanding, up to a third of the
+  queue size. Requests are tracked by the index of their head
+  descriptor, and complete in any order via interrupt.
+*/
+
+#define VIRTIO_BLK_SECTOR_SIZE 512
+
+#define VIRTIO_BLK_T_IN  0   // read
+#define VIRTIO_BLK_T_OUT 1   // write
+
+#define VIRTIO_BLK_S_OK     0
+#define VIRTIO_BLK_S_IOERR  1
+#define VIRTIO_BLK_S_UNSUPP 2
+
+// config space
+#define VIRTIO_BLK_CFG_CAPACITY 0x00  // 64 bit, in sectors
+
+struct virtio_blk_req_hdr {
+  uint32_t type;
+  uint32_t reserved;
+  uint64_t sector;
+} __packed;
+
+struct virtio_blk_req {
+  struct virtio_blk_req_hdr hdr;
+  volatile uint8_t          status;
+  void                    (*callback)(void *, int);
+  void                     *context;
+};
+
+struct virtio_blk_state {
+  struct nk_block_dev     *blkdev;
+  struct virtio_pci_dev   *vdev;
+  struct virtio_pci_virtq *vq;
+
+  uint64_t num_blocks;
+
+  // indexed by head descriptor
+  struct virtio_blk_req *reqs;
+
+  uint64_t submitted;
+  uint64_t completed;
+  uint64_t errors;
+  uint64_t interrupts;
+};
+
+static int dev_count = 0;
+
+
+static int has_room(void *state)
+{
+  struct virtio_blk_state *s = (struct virtio_blk_state *)state;
+  return s->vq->num_free >= 3;
+}
+
+
+static int submit(struct virtio_blk_state *s, uint32_t type, uint64_t blocknum, uint64_t count, 
+		  uint8_t *buf, void (*callback)(void *, int), void *context)
+{
+  STATE_LOCK_CONF;
+  struct virtio_pci_virtq *vq = s->vq;
+  struct virtio_blk_req *r;
+  int head;
+  uint16_t d;
+
+  if (blocknum+count > s->num_blocks) { 
+    ERROR("Illegal access past end of disk\n");
+    return -1;
+  }
+
+  while (1) { 
+    STATE_LOCK(s);
+    head = virtio_pci_desc_chain_alloc(vq,3);
+    if (head>=0) { 
+      break;
+    }
+    STATE_UNLOCK(s);
+    // queue is full, wait for some completions
+    if (in_interrupt_context()) { 
+      ERROR("Queue full in interrupt context\n");
+      return -1;
+    }
+    nk_dev_wait_cond((struct nk_dev *)s->blkdev, has_room, s);
+  }
+
+  r = &s->reqs[head];
+  r->hdr.type = type;
+  r->hdr.reserved = 0;
+  r->hdr.sector = blocknum;
+  r->status = 0xff;
+  r->callback = callback;
+  r->context = context;
+
+  d = head;
+  vq->desc[d].addr = (uint64_t)&r->hdr;
+  vq->desc[d].len = sizeof(r->hdr);
+
+  d = vq->desc[d].next;
+  vq->desc[d].addr = (uint64_t)buf;
+  vq->desc[d].len = count * VIRTIO_BLK_SECTOR_SIZE;
+  if (type == VIRTIO_BLK_T_IN) { 
+    vq->desc[d].flags |= VIRTQ_DESC_F_WRITE;
+  }
+
+  d = vq->desc[d].next;
+  vq->desc[d].addr = (uint64_t)&r->status;
+  vq->desc[d].len = 1;
+  vq->desc[d].flags |= VIRTQ_DESC_F_WRITE;
+
+  virtio_pci_virtq_submit(vq,head);
+  s->submitted++;
+
+  virtio_pci_virtq_kick(s->vdev,vq);
+
+  STATE_UNLOCK(s);
+
+  DEBUG("Submitted %s of %lu blocks at %lu as request %d\n",
+	type==VIRTIO_BLK_T_IN ? "read" : "write", count, blocknum, head);
+
+  return 0;
+}
+
+
+static int read_blocks(void *state, uint64_t blocknum, uint64_t count, uint8_t *dest, void (*callback)(void *, int), void *context)
+{
+  return submit((struct virtio_blk_state *)state, VIRTIO_BLK_T_IN, blocknum, count, dest, callback, context);
+}
+
+
+static int write_blocks(void *state, uint64_t blocknum, uint64_t count, uint8_t *src, void (*callback)(void *, int), void *context)
+{
+  return submit((struct virtio_blk_state *)state, VIRTIO_BLK_T_OUT, blocknum, count, src, callback, context);
+}
+
+
+static int get_characteristics(void *state, struct nk_block_dev_characteristics *c)
+{
+  struct virtio_blk_state *s = (struct virtio_blk_state *)state;
+
+  c->block_size = VIRTIO_BLK_SECTOR_SIZE;
+  c->num_blocks = s->num_blocks;
+
+  return 0;
+}
+
+
+static struct nk_block_dev_int inter = 
+{
+  .get_characteristics = get_characteristics,
+  .read_blocks = read_blocks,
+  .write_blocks = write_blocks,
+};
+
+
+// drain the used ring, running callbacks without the lock held
+static int process_completions(struct virtio_blk_state *s)
+{
+  STATE_LOCK_CONF;
+  struct virtio_pci_virtq *vq = s->vq;
+  struct virtio_blk_req *r;
+  void (*callback)(void *, int);
+  void *context;
+  uint16_t head;
+  int count = 0, status;
+
+  STATE_LOCK(s);
+
+  while (vq->last_used != vq->used->idx) { 
+    head = vq->used->ring[vq->last_used % vq->qsz].id;
+    vq->last_used++;
+
+    r = &s->reqs[head];
+
+    if (r->status != VIRTIO_BLK_S_OK) { 
+      ERROR("Request %u (sector %lu) failed with status %u\n", head, r->hdr.sector, r->status);
+      s->errors++;
+      status = -1;
+    } else {
+      status = 0;
+    }
+
+    callback = r->callback;
+    context = r->context;
+
+    virtio_pci_desc_chain_free(vq,head);
+    s->completed++;
+    count++;
+
+    if (callback) { 
+      STATE_UNLOCK(s);
+      callback(context, status);
+      STATE_LOCK(s);
+    }
+  }
+
+  STATE_UNLOCK(s);
+
+  if (count) { 
+    nk_dev_signal((struct nk_dev *)s->blkdev);
+  }
+
+  return count;
+}
+
+
+static int handler(excp_entry_t *excp, excp_vec_t vec, void *state)
+{
+  struct virtio_blk_state *s = (struct virtio_blk_state *)state;
+
+  // with INTx, reading the ISR tells us if it is ours and deasserts it
+  if (!s->vdev->msix_enabled && !(virtio_pci_read8(s->vdev,VIRTIO_PCI_ISR) & 0x1)) { 
+    IRQ_HANDLER_END();
+    return 0;
+  }
+
+  s->interrupts++;
+
+  process_completions(s);
+
+  IRQ_HANDLER_END();
+
+  return 0;
+}
+
+
+int virtio_blk_init(struct virtio_pci_dev *dev)
+{
+  struct virtio_blk_state *s;
+  char name[32];
+  uint64_t cfg;
+
+  s = malloc(sizeof(*s));
+  if (!s) { 
+    ERROR("Cannot allocate state\n");
+    return -1;
+  }
+
+  memset(s,0,sizeof(*s));
+
+  s->vdev = dev;
+  s->vq = &dev->vring[0];
+
+  // we need nothing beyond the basic read/write interface
+  virtio_pci_negotiate(dev,0);
+
+  if (virtio_pci_setup_interrupt(dev,handler,s)) { 
+    ERROR("Cannot set up interrupt\n");
+    virtio_pci_write8(dev,VIRTIO_PCI_STATUS,VIRTIO_STATUS_FAILED);
+    free(s);
+    return -1;
+  }
+
+  if (virtio_pci_virtq_init(dev,0)) { 
+    ERROR("Cannot set up virtqueue\n");
+    goto fail_intr;
+  }
+
+  s->reqs = malloc(sizeof(struct virtio_blk_req)*s->vq->qsz);
+  if (!s->reqs) { 
+    ERROR("Cannot allocate request tracking\n");
+    goto fail_vq;
+  }
+  memset(s->reqs,0,sizeof(struct virtio_blk_req)*s->vq->qsz);
+
+  cfg = VIRTIO_PCI_CONFIG(dev) + VIRTIO_BLK_CFG_CAPACITY;
+  s->num_blocks = virtio_pci_read32(dev,cfg) | 
+    ((uint64_t)virtio_pci_read32(dev,cfg+4) << 32);
+
+  virtio_pci_driver_ok(dev);
+
+  sprintf(name,"virtio-blk%d",__sync_fetch_and_add(&dev_count,1));
+
+  s->blkdev = nk_block_dev_register(name,0,&inter,s);
+
+  if (!s->blkdev) { 
+    ERROR("Cannot register %s\n",name);
+    goto fail_reqs;
+  }
+
+  INFO("Added %s: %lu blocks (%lu MB), %u entry virtqueue, %s interrupts\n",
+       name, s->num_blocks, (s->num_blocks*VIRTIO_BLK_SECTOR_SIZE)>>20, s->vq->qsz,
+       dev->msix_enabled ? "MSI-X" : "INTx");
+
+  return 0;
+
+ fail_reqs:
+  free(s->reqs);
+ fail_vq:
+  virtio_pci_virtq_deinit(dev,0);
+ fail_intr:
+  // the interrupt handler still refers to s, so it stays
+  virtio_pci_write8(dev,VIRTIO_PCI_STATUS,VIRTIO_STATUS_FAILED);
+  return -1;
+}
@@ -0,0 +1,602 @@
+#include <nautilus/nautilus.h>
+#include <nautilus/netdev.h>
+#include <nautilus/thread.h>
+#include <nautilus/irq.h>
+#include <dev/pci.h>
+#include <dev/virtio_pci.h>
+#include <dev/virtio_net.h>
+
+#ifndef NAUT_CONFIG_DEBUG_VIRTIO_PCI
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif
+
+#define INFO(fmt, args...) printk("VIRTIO_NET: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("VIRTIO_NET: DEBUG: " fmt, ##args)
+#define ERROR(fmt, args...) printk("VIRTIO_NET: ERROR: " fmt, ##args)
+
+#define QUEUE_LOCK_CONF uint8_t _queue_lock_flags
+#define QUEUE_LOCK(q) _queue_lock_flags = spin_lock_irq_save(&(q)->vq->lock)
+#define QUEUE_UNLOCK(q) spin_unlock_irq_restore(&((q)->vq->lock), _queue_lock_flags)
+
+/*
+  Queue 0 receives, queue 1 transmits.  Every packet is a two
+  descriptor chain: a virtio_net_hdr owned by the driver, and the
+  caller's buffer, which the device reads or writes directly, so
+  nothing is copied.  Receive buffers are posted ahead of time by
+  the caller and held by the device until a packet arrives.
+
+  Completions normally arrive by interrupt.  In busy-poll mode a
+  thread bound to a chosen core drains both used rings instead,
+  the device is asked not to interrupt, and doorbell writes from
+  post_send/post_receive are deferred to the poller so that a
+  burst of packets costs one exit.
+*/
+
+#define VIRTIO_NET_F_CSUM       0   // device can complete partial tx checksums
+#define VIRTIO_NET_F_GUEST_CSUM 1   // device may hand us partial rx checksums
+#define VIRTIO_NET_F_MAC        5   // device has a mac address in config
+
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM 1
+#define VIRTIO_NET_HDR_F_DATA_VALID 2
+
+#define VIRTIO_NET_HDR_GSO_NONE 0
+
+// config space
+#define VIRTIO_NET_CFG_MAC 0x00  // 6 bytes
+
+#define VIRTIO_NET_RXQ 0
+#define VIRTIO_NET_TXQ 1
+
+#define ETH_HDR_LEN 14
+#define ETH_MIN_TU  60
+#define ETH_MAX_TU  1514
+
+// legacy layout, as we do not negotiate mergeable rx buffers
+struct virtio_net_hdr {
+  uint8_t  flags;
+  uint8_t  gso_type;
+  uint16_t hdr_len;
+  uint16_t gso_size;
+  uint16_t csum_start;
+  uint16_t csum_offset;
+} __packed;
+
+struct virtio_net_req {
+  struct virtio_net_hdr hdr;
+  uint8_t              *buf;
+  void                (*callback)(void *);
+  void                 *context;
+};
+
+struct virtio_net_queue {
+  struct virtio_pci_virtq *vq;
+  // indexed by head descriptor
+  struct virtio_net_req   *reqs;
+  // a doorbell write the poller owes the device
+  int                      kick_pending;
+  uint64_t                 posted;
+  uint64_t                 completed;
+  uint64_t                 bytes;
+  uint64_t                 full;
+};
+
+struct virtio_net_state {
+  struct nk_net_dev     *netdev;
+  struct virtio_pci_dev *vdev;
+  char                   name[32];
+
+  struct virtio_net_queue rx;
+  struct virtio_net_queue tx;
+
+  uint32_t features;
+  uint8_t  mac[6];
+
+  // busy-poll mode
+  volatile int poll_cpu;   // -1 when interrupt driven
+  volatile int poll_stop;
+  volatile int poll_running;
+
+  uint64_t interrupts;
+  uint64_t polls;          // poll iterations that found work
+  uint64_t kicks;
+  uint64_t rx_csum_fixed;
+  uint64_t rx_csum_valid;
+};
+
+static int dev_count = 0;
+
+
+static inline int polling(struct virtio_net_state *s)
+{
+  return s->poll_cpu >= 0;
+}
+
+
+// called with the queue lock held
+static void kick(struct virtio_net_state *s, struct virtio_net_queue *q)
+{
+  if (polling(s)) {
+    q->kick_pending = 1;
+  } else {
+    virtio_pci_virtq_kick(s->vdev,q->vq);
+    s->kicks++;
+  }
+}
+
+
+static int post(struct virtio_net_state *s, struct virtio_net_queue *q, uint8_t *buf, uint64_t len,
+		void (*callback)(void *), void *context)
+{
+  QUEUE_LOCK_CONF;
+  struct virtio_pci_virtq *vq = q->vq;
+  struct virtio_net_req *r;
+  uint16_t flags = q==&s->rx ? VIRTQ_DESC_F_WRITE : 0;
+  int head;
+  uint16_t d;
+
+  QUEUE_LOCK(q);
+
+  head = virtio_pci_desc_chain_alloc(vq,2);
+  if (head<0) {
+    q->full++;
+    QUEUE_UNLOCK(q);
+    DEBUG("%s queue full\n", q==&s->rx ? "receive" : "send");
+    return -1;
+  }
+
+  r = &q->reqs[head];
+  memset(&r->hdr,0,sizeof(r->hdr));
+  r->hdr.gso_type = VIRTIO_NET_HDR_GSO_NONE;
+  r->buf = buf;
+  r->callback = callback;
+  r->context = context;
+
+  d = head;
+  vq->desc[d].addr = (uint64_t)&r->hdr;
+  vq->desc[d].len = sizeof(r->hdr);
+  vq->desc[d].flags |= flags;
+
+  d = vq->desc[d].next;
+  vq->desc[d].addr = (uint64_t)buf;
+  vq->desc[d].len = len;
+  vq->desc[d].flags |= flags;
+
+  virtio_pci_virtq_submit(vq,head);
+  q->posted++;
+
+  kick(s,q);
+
+  QUEUE_UNLOCK(q);
+
+  return 0;
+}
+
+
+static int post_receive(void *state, uint8_t *dest, uint64_t len, void (*callback)(void *), void *context)
+{
+  struct virtio_net_state *s = (struct virtio_net_state *)state;
+
+  // without mergeable buffers, every posted buffer must fit any packet
+  if (len < ETH_MAX_TU) {
+    ERROR("Receive buffer of %lu bytes is smaller than %d\n", len, ETH_MAX_TU);
+    return -1;
+  }
+
+  return post(s,&s->rx,dest,len,callback,context);
+}
+
+
+static int post_send(void *state, uint8_t *src, uint64_t len, void (*callback)(void *), void *context)
+{
+  struct virtio_net_state *s = (struct virtio_net_state *)state;
+
+  if (len < ETH_HDR_LEN || len > ETH_MAX_TU) {
+    ERROR("Cannot send packet of %lu bytes\n", len);
+    return -1;
+  }
+
+  return post(s,&s->tx,src,len,callback,context);
+}
+
+
+static int get_characteristics(void *state, struct nk_net_dev_characteristics *c)
+{
+  struct virtio_net_state *s = (struct virtio_net_state *)state;
+
+  memcpy(c->mac,s->mac,6);
+  c->min_tu = ETH_MIN_TU;
+  c->max_tu = ETH_MAX_TU;
+
+  return 0;
+}
+
+
+static struct nk_net_dev_int inter =
+{
+  .get_characteristics = get_characteristics,
+  .post_receive = post_receive,
+  .post_send = post_send,
+};
+
+
+/*
+  With GUEST_CSUM, a packet that originated on this host may arrive
+  with only the pseudo-header sum in its checksum field.  Consumers
+  expect a complete checksum, so finish the job here.
+*/
+static void rx_csum_complete(struct virtio_net_state *s, struct virtio_net_req *r, uint32_t len)
+{
+  uint32_t start = r->hdr.csum_start;
+  uint32_t off = start + r->hdr.csum_offset;
+  uint64_t sum = 0;
+  uint32_t i;
+
+  if (!(r->hdr.flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+    if (r->hdr.flags & VIRTIO_NET_HDR_F_DATA_VALID) {
+      s->rx_csum_valid++;
+    }
+    return;
+  }
+
+  if (off+2 > len) {
+    ERROR("Bogus checksum location %u in %u byte packet\n", off, len);
+    return;
+  }
+
+  for (i=start; i+1<len; i+=2) {
+    sum += ((uint32_t)r->buf[i] << 8) | r->buf[i+1];
+  }
+  if (i<len) {
+    sum += (uint32_t)r->buf[i] << 8;
+  }
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  sum = ~sum & 0xffff;
+
+  r->buf[off] = sum >> 8;
+  r->buf[off+1] = sum & 0xff;
+
+  s->rx_csum_fixed++;
+}
+
+
+// drain a used ring, running callbacks without the lock held
+static int process_queue(struct virtio_net_state *s, struct virtio_net_queue *q)
+{
+  QUEUE_LOCK_CONF;
+  struct virtio_pci_virtq *vq = q->vq;
+  struct virtio_net_req *r;
+  void (*callback)(void *);
+  void *context;
+  uint16_t head;
+  uint32_t len;
+  int count = 0;
+
+  // cheap check, as the poller hits this constantly
+  if (vq->last_used == vq->used->idx) {
+    return 0;
+  }
+
+  QUEUE_LOCK(q);
+
+  while (vq->last_used != vq->used->idx) {
+    head = vq->used->ring[vq->last_used % vq->qsz].id;
+    len = vq->used->ring[vq->last_used % vq->qsz].len;
+    vq->last_used++;
+
+    r = &q->reqs[head];
+
+    if (q==&s->rx) {
+      // the device counts the header it wrote
+      len = len > sizeof(r->hdr) ? len - sizeof(r->hdr) : 0;
+      rx_csum_complete(s,r,len);
+      q->bytes += len;
+    } else {
+      q->bytes += vq->desc[vq->desc[head].next].len;
+    }
+
+    callback = r->callback;
+    context = r->context;
+
+    virtio_pci_desc_chain_free(vq,head);
+    q->completed++;
+    count++;
+
+    if (callback) {
+      QUEUE_UNLOCK(q);
+      callback(context);
+      QUEUE_LOCK(q);
+    }
+  }
+
+  QUEUE_UNLOCK(q);
+
+  return count;
+}
+
+
+static int process_completions(struct virtio_net_state *s)
+{
+  int count;
+
+  count = process_queue(s,&s->rx);
+  count += process_queue(s,&s->tx);
+
+  if (count) {
+    nk_dev_signal((struct nk_dev *)s->netdev);
+  }
+
+  return count;
+}
+
+
+static int handler(excp_entry_t *excp, excp_vec_t vec, void *state)
+{
+  struct virtio_net_state *s = (struct virtio_net_state *)state;
+
+  // with INTx, reading the ISR tells us if it is ours and deasserts it
+  if (!s->vdev->msix_enabled && !(virtio_pci_read8(s->vdev,VIRTIO_PCI_ISR) & 0x1)) {
+    IRQ_HANDLER_END();
+    return 0;
+  }
+
+  s->interrupts++;
+
+  process_completions(s);
+
+  IRQ_HANDLER_END();
+
+  return 0;
+}
+
+
+// force when leaving poll mode, as a poster may be about to set kick_pending
+static void flush_kick(struct virtio_net_state *s, struct virtio_net_queue *q, int force)
+{
+  QUEUE_LOCK_CONF;
+
+  if (!force && !q->kick_pending) {
+    return;
+  }
+
+  QUEUE_LOCK(q);
+  if (force || q->kick_pending) {
+    q->kick_pending = 0;
+    virtio_pci_virtq_kick(s->vdev,q->vq);
+    s->kicks++;
+  }
+  QUEUE_UNLOCK(q);
+}
+
+
+static void set_interrupts(struct virtio_net_state *s, int on)
+{
+  uint16_t f = on ? 0 : VIRTQ_AVAIL_F_NO_INTERRUPT;
+
+  s->rx.vq->avail->flags = f;
+  s->tx.vq->avail->flags = f;
+
+  __asm__ __volatile__ ("mfence" : : : "memory");
+}
+
+
+static void poller(void *in, void **out)
+{
+  struct virtio_net_state *s = (struct virtio_net_state *)in;
+  char name[32];
+
+  snprintf(name,32,"%s-poll",s->name);
+  nk_thread_name(get_cur_thread(),name);
+
+  INFO("%s polling on cpu %d\n", s->name, my_cpu_id());
+
+  s->poll_running = 1;
+
+  while (!s->poll_stop) {
+    // doorbells first, so the device gets to work while we reap
+    flush_kick(s,&s->tx,0);
+    flush_kick(s,&s->rx,0);
+    if (process_completions(s)) {
+      s->polls++;
+    } else {
+      __asm__ __volatile__ ("pause");
+    }
+  }
+
+  s->poll_running = 0;
+}
+
+
+static struct virtio_net_state *find_state(char *name)
+{
+  struct nk_dev *d = nk_dev_find(name);
+
+  if (!d || d->type!=NK_DEV_NET || d->interface!=(struct nk_dev_int *)&inter) {
+    return 0;
+  }
+
+  return (struct virtio_net_state *)d->state;
+}
+
+
+int virtio_net_poll(char *name, int cpu)
+{
+  struct virtio_net_state *s = find_state(name);
+
+  if (!s) {
+    ERROR("No virtio network device %s\n", name);
+    return -1;
+  }
+
+  if (cpu >= (int)nk_get_num_cpus()) {
+    ERROR("No cpu %d\n", cpu);
+    return -1;
+  }
+
+  if (polling(s)) {
+    s->poll_stop = 1;
+    while (s->poll_running) {
+      nk_yield();
+    }
+    // stop deferring doorbells before sending the ones we owe
+    s->poll_cpu = -1;
+    flush_kick(s,&s->tx,1);
+    flush_kick(s,&s->rx,1);
+    set_interrupts(s,1);
+    // anything that completed while interrupts were off
+    process_completions(s);
+    INFO("%s is interrupt driven\n", s->name);
+  }
+
+  if (cpu < 0) {
+    return 0;
+  }
+
+  s->poll_stop = 0;
+  s->poll_running = 1;
+  s->poll_cpu = cpu;
+  set_interrupts(s,0);
+
+  if (nk_thread_start(poller,s,0,1,TSTACK_DEFAULT,0,cpu)) {
+    ERROR("Cannot start poller\n");
+    s->poll_running = 0;
+    s->poll_cpu = -1;
+    set_interrupts(s,1);
+    process_completions(s);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+void virtio_net_dump_stats(char *name)
+{
+  struct virtio_net_state *s = find_state(name);
+
+  if (!s) {
+    nk_vc_printf("No virtio network device %s\n", name);
+    return;
+  }
+
+  nk_vc_printf("%s: %02x:%02x:%02x:%02x:%02x:%02x %s%s%s\n", s->name,
+	       s->mac[0], s->mac[1], s->mac[2], s->mac[3], s->mac[4], s->mac[5],
+	       s->vdev->msix_enabled ? "MSI-X" : "INTx",
+	       s->features & (1<<VIRTIO_NET_F_GUEST_CSUM) ? " rx-csum" : "",
+	       polling(s) ? " polling" : "");
+  nk_vc_printf("  rx: posted=%lu completed=%lu bytes=%lu full=%lu csum_fixed=%lu csum_valid=%lu\n",
+	       s->rx.posted, s->rx.completed, s->rx.bytes, s->rx.full, s->rx_csum_fixed, s->rx_csum_valid);
+  nk_vc_printf("  tx: posted=%lu completed=%lu bytes=%lu full=%lu\n",
+	       s->tx.posted, s->tx.completed, s->tx.bytes, s->tx.full);
+  nk_vc_printf("  interrupts=%lu kicks=%lu polls=%lu\n",
+	       s->interrupts, s->kicks, s->polls);
+}
+
+
+static int queue_init(struct virtio_net_state *s, struct virtio_net_queue *q, uint16_t qidx)
+{
+  if (virtio_pci_virtq_init(s->vdev,qidx)) {
+    ERROR("Cannot set up virtqueue %u\n", qidx);
+    return -1;
+  }
+
+  q->vq = &s->vdev->vring[qidx];
+
+  q->reqs = malloc(sizeof(struct virtio_net_req)*q->vq->qsz);
+  if (!q->reqs) {
+    ERROR("Cannot allocate request tracking for virtqueue %u\n", qidx);
+    virtio_pci_virtq_deinit(s->vdev,qidx);
+    return -1;
+  }
+  memset(q->reqs,0,sizeof(struct virtio_net_req)*q->vq->qsz);
+
+  return 0;
+}
+
+
+static void queue_deinit(struct virtio_net_state *s, struct virtio_net_queue *q, uint16_t qidx)
+{
+  free(q->reqs);
+  virtio_pci_virtq_deinit(s->vdev,qidx);
+}
+
+
+int virtio_net_init(struct virtio_pci_dev *dev)
+{
+  struct virtio_net_state *s;
+  uint64_t cfg;
+  int i;
+
+  s = malloc(sizeof(*s));
+  if (!s) {
+    ERROR("Cannot allocate state\n");
+    return -1;
+  }
+
+  memset(s,0,sizeof(*s));
+
+  s->vdev = dev;
+  s->poll_cpu = -1;
+
+  // We take complete checksums from the device, and finish any partial
+  // ones it hands us.  Transmit offload (F_CSUM) is not requested,
+  // as nk_net_dev_int has no way to say where a packet's checksum lives.
+  s->features = virtio_pci_negotiate(dev,
+				     (1<<VIRTIO_NET_F_MAC) |
+				     (1<<VIRTIO_NET_F_GUEST_CSUM));
+
+  if (virtio_pci_setup_interrupt(dev,handler,s)) {
+    ERROR("Cannot set up interrupt\n");
+    virtio_pci_write8(dev,VIRTIO_PCI_STATUS,VIRTIO_STATUS_FAILED);
+    free(s);
+    return -1;
+  }
+
+  if (queue_init(s,&s->rx,VIRTIO_NET_RXQ)) {
+    goto fail_intr;
+  }
+
+  if (queue_init(s,&s->tx,VIRTIO_NET_TXQ)) {
+    goto fail_rx;
+  }
+
+  if (s->features & (1<<VIRTIO_NET_F_MAC)) {
+    cfg = VIRTIO_PCI_CONFIG(dev) + VIRTIO_NET_CFG_MAC;
+    for (i=0;i<6;i++) {
+      s->mac[i] = virtio_pci_read8(dev,cfg+i);
+    }
+  } else {
+    // locally administered, unicast
+    s->mac[0] = 0x02;
+    s->mac[5] = dev_count;
+  }
+
+  virtio_pci_driver_ok(dev);
+
+  sprintf(s->name,"virtio-net%d",__sync_fetch_and_add(&dev_count,1));
+
+  s->netdev = nk_net_dev_register(s->name,0,&inter,s);
+
+  if (!s->netdev) {
+    ERROR("Cannot register %s\n",s->name);
+    goto fail_tx;
+  }
+
+  INFO("Added %s: %02x:%02x:%02x:%02x:%02x:%02x, %u/%u entry rx/tx virtqueues, %s interrupts%s\n",
+       s->name, s->mac[0], s->mac[1], s->mac[2], s->mac[3], s->mac[4], s->mac[5],
+       s->rx.vq->qsz, s->tx.vq->qsz, dev->msix_enabled ? "MSI-X" : "INTx",
+       s->features & (1<<VIRTIO_NET_F_GUEST_CSUM) ? ", rx checksum offload" : "");
+
+  return 0;
+
+ fail_tx:
+  queue_deinit(s,&s->tx,VIRTIO_NET_TXQ);
+ fail_rx:
+  queue_deinit(s,&s->rx,VIRTIO_NET_RXQ);
+ fail_intr:
+  // the interrupt handler still refers to s, so it stays
+  virtio_pci_write8(dev,VIRTIO_PCI_STATUS,VIRTIO_STATUS_FAILED);
+  return -1;
+}
@@ -1,6 +1,16 @@
 #include <nautilus/nautilus.h>
+#include <nautilus/irq.h>
+#include <nautilus/idt.h>
+#include <nautilus/paging.h>
+#include <dev/apic.h>
 #include <dev/pci.h>
 #include <dev/virtio_pci.h>
+#ifdef NAUT_CONFIG_VIRTIO_BLK
+#include <dev/virtio_blk.h>
+#endif
+#ifdef NAUT_CONFIG_VIRTIO_NET
+#include <dev/virtio_net.h>
+#endif
 
 #ifndef NAUT_CONFIG_DEBUG_VIRTIO_PCI
 #undef DEBUG_PRINT
@@ -15,10 +25,370 @@
 static struct list_head dev_list;
 
 
+#define PCI_CMD_IO_ENABLE     0x1
+#define PCI_CMD_MEM_ENABLE    0x2
+#define PCI_CMD_MASTER_ENABLE 0x4
+
+#define PCI_STATUS_CAP_LIST   0x10
+#define PCI_CAP_PTR           0x34
+#define PCI_CAP_ID_MSIX       0x11
+
+#define MSIX_CTRL_ENABLE      0x8000
+#define MSIX_CTRL_MASK        0x4000
+#define MSIX_CTRL_SIZE_MASK   0x07ff
+
+#define MSIX_MSG_ADDR_BASE    0xfee00000
+
+
+static inline uint8_t pci_bus_num(struct virtio_pci_dev *dev)
+{
+  return dev->pci_dev->bus->num;
+}
+
+static inline uint8_t pci_dev_num(struct virtio_pci_dev *dev)
+{
+  return dev->pci_dev->num;
+}
+
+
+uint32_t virtio_pci_negotiate(struct virtio_pci_dev *dev, uint32_t wanted)
+{
+  uint16_t cmd;
+  uint32_t offered, accepted;
+
+  // we need the I/O bar decoded and the device able to DMA
+  cmd = pci_cfg_readw(pci_bus_num(dev),pci_dev_num(dev),0,0x4);
+  cmd |= PCI_CMD_IO_ENABLE | PCI_CMD_MEM_ENABLE | PCI_CMD_MASTER_ENABLE;
+  pci_cfg_writew(pci_bus_num(dev),pci_dev_num(dev),0,0x4,cmd);
+
+  // reset
+  virtio_pci_write8(dev,VIRTIO_PCI_STATUS,0);
+
+  virtio_pci_write8(dev,VIRTIO_PCI_STATUS,VIRTIO_STATUS_ACK);
+  virtio_pci_write8(dev,VIRTIO_PCI_STATUS,VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER);
+
+  offered = virtio_pci_read32(dev,VIRTIO_PCI_HOST_FEATURES);
+  accepted = offered & wanted;
+
+  virtio_pci_write32(dev,VIRTIO_PCI_GUEST_FEATURES,accepted);
+
+  DEBUG("Features offered=0x%x wanted=0x%x accepted=0x%x\n", offered, wanted, accepted);
+
+  return accepted;
+}
+
+
+void virtio_pci_driver_ok(struct virtio_pci_dev *dev)
+{
+  virtio_pci_write8(dev,VIRTIO_PCI_STATUS,
+		    VIRTIO_STATUS_ACK | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+}
+
+
+// bytes needed for the legacy ring layout of a queue of qsz entries
+static uint64_t vring_size(uint16_t qsz)
+{
+  uint64_t first, second;
+
+  first = sizeof(struct virtq_desc)*qsz + sizeof(uint16_t)*(3+qsz);
+  first = (first + VIRTIO_PCI_VRING_ALIGN - 1) & ~(uint64_t)(VIRTIO_PCI_VRING_ALIGN - 1);
+  second = sizeof(uint16_t)*3 + sizeof(struct virtq_used_elem)*qsz;
+
+  return first + second;
+}
+
+
+int virtio_pci_virtq_init(struct virtio_pci_dev *dev, uint16_t qidx)
+{
+  struct virtio_pci_virtq *vq;
+  uint64_t addr;
+  uint16_t qsz;
+  int i;
+
+  if (qidx >= MAX_VRINGS) { 
+    ERROR("Cannot support virtqueue %u\n", qidx);
+    return -1;
+  }
+
+  vq = &dev->vring[qidx];
+
+  virtio_pci_write16(dev,VIRTIO_PCI_QUEUE_SEL,qidx);
+
+  qsz = virtio_pci_read16(dev,VIRTIO_PCI_QUEUE_NUM);
+
+  if (!qsz) { 
+    ERROR("Virtqueue %u does not exist\n", qidx);
+    return -1;
+  }
+
+  memset(vq,0,sizeof(*vq));
+
+  vq->qidx = qidx;
+  vq->qsz = qsz;
+  vq->size_bytes = vring_size(qsz);
+
+  // the legacy interface wants a page frame number, so align
+  vq->mem = malloc(vq->size_bytes + VIRTIO_PCI_VRING_ALIGN);
+  if (!vq->mem) { 
+    ERROR("Cannot allocate virtqueue %u (%lu bytes)\n", qidx, vq->size_bytes);
+    return -1;
+  }
+
+  addr = ((uint64_t)vq->mem + VIRTIO_PCI_VRING_ALIGN - 1) & ~(uint64_t)(VIRTIO_PCI_VRING_ALIGN - 1);
+
+  memset((void*)addr,0,vq->size_bytes);
+
+  vq->desc = (struct virtq_desc *)addr;
+  vq->avail = (struct virtq_avail *)(addr + sizeof(struct virtq_desc)*qsz);
+  vq->used = (struct virtq_used *)
+    ((addr + sizeof(struct virtq_desc)*qsz + sizeof(uint16_t)*(3+qsz) + VIRTIO_PCI_VRING_ALIGN - 1)
+     & ~(uint64_t)(VIRTIO_PCI_VRING_ALIGN - 1));
+
+  for (i=0;i<qsz-1;i++) { 
+    vq->desc[i].next = i+1;
+  }
+  vq->free_head = 0;
+  vq->num_free = qsz;
+  vq->last_used = 0;
+
+  spinlock_init(&vq->lock);
+
+  if (dev->msix_enabled) { 
+    // all queues share MSI-X table entry 0
+    virtio_pci_write16(dev,VIRTIO_MSI_QUEUE_VECTOR,0);
+    if (virtio_pci_read16(dev,VIRTIO_MSI_QUEUE_VECTOR)!=0) { 
+      ERROR("Device refused MSI-X vector for virtqueue %u\n", qidx);
+      free(vq->mem);
+      vq->mem = 0;
+      return -1;
+    }
+  }
+
+  virtio_pci_write32(dev,VIRTIO_PCI_QUEUE_PFN,addr >> VIRTIO_PCI_QUEUE_ADDR_SHIFT);
+
+  if (qidx >= dev->num_vrings) { 
+    dev->num_vrings = qidx + 1;
+  }
+
+  DEBUG("Virtqueue %u: %u entries at %p (desc=%p avail=%p used=%p)\n",
+	qidx, qsz, (void*)addr, vq->desc, vq->avail, vq->used);
+
+  return 0;
+}
+
+
+void virtio_pci_virtq_deinit(struct virtio_pci_dev *dev, uint16_t qidx)
+{
+  struct virtio_pci_virtq *vq = &dev->vring[qidx];
+
+  virtio_pci_write16(dev,VIRTIO_PCI_QUEUE_SEL,qidx);
+  virtio_pci_write32(dev,VIRTIO_PCI_QUEUE_PFN,0);
+
+  if (vq->mem) { 
+    free(vq->mem);
+  }
+
+  memset(vq,0,sizeof(*vq));
+}
+
+
+int virtio_pci_desc_chain_alloc(struct virtio_pci_virtq *vq, int n)
+{
+  uint16_t head, cur;
+  int i;
+
+  if (n < 1 || vq->num_free < n) { 
+    return -1;
+  }
+
+  head = cur = vq->free_head;
+
+  for (i=0;i<n-1;i++) { 
+    vq->desc[cur].flags = VIRTQ_DESC_F_NEXT;
+    cur = vq->desc[cur].next;
+  }
+
+  vq->desc[cur].flags = 0;
+  vq->free_head = vq->desc[cur].next;
+  vq->num_free -= n;
+
+  return head;
+}
+
+
+void virtio_pci_desc_chain_free(struct virtio_pci_virtq *vq, uint16_t head)
+{
+  uint16_t cur = head;
+
+  while (1) { 
+    vq->num_free++;
+    if (!(vq->desc[cur].flags & VIRTQ_DESC_F_NEXT)) { 
+      break;
+    }
+    cur = vq->desc[cur].next;
+  }
+
+  vq->desc[cur].next = vq->free_head;
+  vq->free_head = head;
+}
+
+
+void virtio_pci_virtq_submit(struct virtio_pci_virtq *vq, uint16_t head)
+{
+  vq->avail->ring[vq->avail->idx % vq->qsz] = head;
+
+  // ring entry must be visible before the index moves
+  __asm__ __volatile__ ("" : : : "memory");
+
+  vq->avail->idx++;
+}
+
+
+void virtio_pci_virtq_kick(struct virtio_pci_dev *dev, struct virtio_pci_virtq *vq)
+{
+  // the index update must be visible before we check flags
+  __asm__ __volatile__ ("mfence" : : : "memory");
+
+  if (!(vq->used->flags & VIRTQ_USED_F_NO_NOTIFY)) { 
+    virtio_pci_write16(dev,VIRTIO_PCI_QUEUE_NOTIFY,vq->qidx);
+  }
+}
+
+
+static uint8_t find_cap(struct virtio_pci_dev *dev, uint8_t id)
+{
+  uint8_t bus = pci_bus_num(dev);
+  uint8_t num = pci_dev_num(dev);
+  uint8_t ptr;
+  int guard = 48;
+
+  if (!(pci_cfg_readw(bus,num,0,0x6) & PCI_STATUS_CAP_LIST)) { 
+    return 0;
+  }
+
+  ptr = pci_cfg_readw(bus,num,0,PCI_CAP_PTR) & 0xfc;
+
+  while (ptr && guard--) { 
+    uint16_t hdr = pci_cfg_readw(bus,num,0,ptr);
+    if ((hdr & 0xff) == id) { 
+      return ptr;
+    }
+    ptr = (hdr >> 8) & 0xfc;
+  }
+
+  return 0;
+}
+
+
+static int setup_msix(struct virtio_pci_dev *dev,
+		      int (*handler)(excp_entry_t *, excp_vec_t, void *),
+		      void *state)
+{
+  uint8_t bus = pci_bus_num(dev);
+  uint8_t num = pci_dev_num(dev);
+  uint8_t cap;
+  uint16_t ctrl;
+  uint32_t table, bar;
+  uint64_t entry;
+  ulong_t vec;
+  int i;
+
+  cap = find_cap(dev,PCI_CAP_ID_MSIX);
+
+  if (!cap) { 
+    DEBUG("No MSI-X capability\n");
+    return -1;
+  }
+
+  ctrl = pci_cfg_readw(bus,num,0,cap+2);
+  table = pci_cfg_readl(bus,num,0,cap+4);
+
+  bar = pci_cfg_readl(bus,num,0,0x10 + (table & 0x7)*4);
+
+  if (bar & 0x1) { 
+    ERROR("MSI-X table is not in a memory bar\n");
+    return -1;
+  }
+
+  dev->msix_table = (bar & 0xfffffff0) + (table & ~0x7);
+
+  DEBUG("MSI-X capability at 0x%x, %u entries, table at %p\n",
+	cap, (ctrl & MSIX_CTRL_SIZE_MASK) + 1, (void*)dev->msix_table);
+
+  if (nk_map_page_nocache(ROUND_DOWN_TO_PAGE(dev->msix_table), PTE_PRESENT_BIT|PTE_WRITABLE_BIT, PS_4K)) { 
+    ERROR("Cannot map MSI-X table\n");
+    return -1;
+  }
+
+  if (idt_find_and_reserve((ulong_t)handler,(ulong_t)state,&vec)) { 
+    ERROR("Cannot allocate MSI-X vector\n");
+    return -1;
+  }
+
+  dev->intr_vec = vec;
+
+  // mask everything, then fill in and unmask entry 0
+  for (i=0;i<=(ctrl & MSIX_CTRL_SIZE_MASK);i++) { 
+    *(volatile uint32_t *)(dev->msix_table + i*16 + 12) = 1;
+  }
+
+  entry = dev->msix_table;
+  *(volatile uint32_t *)(entry + 0) = MSIX_MSG_ADDR_BASE | (per_cpu_get(apic)->id << 12);
+  *(volatile uint32_t *)(entry + 4) = 0;
+  *(volatile uint32_t *)(entry + 8) = vec;   // fixed delivery, edge
+  *(volatile uint32_t *)(entry + 12) = 0;
+
+  ctrl = (ctrl | MSIX_CTRL_ENABLE) & ~MSIX_CTRL_MASK;
+  pci_cfg_writew(bus,num,0,cap+2,ctrl);
+
+  dev->msix_enabled = 1;
+
+  // we do not care about configuration changes
+  virtio_pci_write16(dev,VIRTIO_MSI_CONFIG_VECTOR,VIRTIO_MSI_NO_VECTOR);
+
+  return 0;
+}
+
+
+int virtio_pci_setup_interrupt(struct virtio_pci_dev *dev,
+			       int (*handler)(excp_entry_t *, excp_vec_t, void *),
+			       void *state)
+{
+  uint8_t irq;
+
+  if (!setup_msix(dev,handler,state)) { 
+    INFO("Using MSI-X vector 0x%x\n", dev->intr_vec);
+    return 0;
+  }
+
+  if (!dev->pci_intr) { 
+    ERROR("Device has neither MSI-X nor a PCI interrupt pin\n");
+    return -1;
+  }
+
+  // the IOAPIC setup maps PCI INTA..INTD to IRQs 16..19
+  irq = 16 + ((dev->pci_intr - 1) & 0x3);
+
+  if (register_irq_handler(irq,handler,state)) { 
+    ERROR("Cannot register handler for IRQ %u\n", irq);
+    return -1;
+  }
+
+  dev->intr_vec = irq_to_vec(irq);
+
+  nk_unmask_irq(irq);
+
+  INFO("Using legacy IRQ %u (vector 0x%x)\n", irq, dev->intr_vec);
+
+  return 0;
+}
+
+
 int virtio_pci_init(struct naut_info * naut)
 {
   struct pci_info *pci = naut->sys.pci;
   struct list_head *curbus, *curdev;
+  struct virtio_pci_dev *vdev;
 
   INFO("init\n");
 
@@ -42,9 +412,9 @@ int virtio_pci_init(struct naut_info * naut)
 
       DEBUG("Device %u is a %x:%x\n", pdev->num, cfg->vendor_id, cfg->device_id);
 
-      if (cfg->vendor_id==0x1af4) {
+      // config space accesses here assume function 0
+      if (cfg->vendor_id==0x1af4 && !pdev->fun) {
 	DEBUG("Virtio Device Found\n");
-	struct virtio_pci_dev *vdev;
 
 	vdev = malloc(sizeof(struct virtio_pci_dev));
 	if (!vdev) {
@@ -76,22 +446,17 @@ int virtio_pci_init(struct naut_info * naut)
 	// Figure out mapping here or look at capabilities for MSI-X
 	// vdev->intr_vec = ...
 
-	// we expect two bars exist, one for memory, one for i/o
-	// and these will be bar 0 and 1
-	// check to see if there are no others
+	// legacy virtio has an I/O bar (0) and, with MSI-X, a memory bar (1)
+	// for the MSI-X table. Transitional devices add a 64 bit memory
+	// bar for the modern interface, which we do not use
 	for (int i=0;i<6;i++) { 
 	  uint32_t bar = pci_cfg_readl(bus->num,pdev->num, 0, 0x10 + i*4);
 	  uint32_t size;
+	  uint8_t  mem_bar_type = 0;
 	  DEBUG("bar %d: 0x%0x\n",i, bar);
-	  if (i>=2 && bar!=0) { 
-	    DEBUG("Not expecting this to be a non-empty bar...\n");
-	  }
-	  if (!(bar & 0x0)) { 
-	    uint8_t mem_bar_type = (bar & 0x6) >> 1;
-	    if (mem_bar_type != 0) { 
-	      ERROR("Cannot handle memory bar type 0x%x\n", mem_bar_type);
-	      return -1;
-	    }
+
+	  if (!(bar & 0x1)) { 
+	    mem_bar_type = (bar & 0x6) >> 1;
 	  }
 
 	  // determine size
@@ -114,22 +479,28 @@ int virtio_pci_init(struct naut_info * naut)
 	  // now we have to put back the original bar
 	  pci_cfg_writel(bus->num,pdev->num,0,0x10 + i*4, bar);
 
-	  if (!size) { 
-	    // non-existent bar, skip to next one
+	  if (mem_bar_type == 2) { 
+	    // 64 bit bar, the next one is its upper half
+	    DEBUG("Skipping 64 bit memory bar %d\n",i);
+	    i++;
 	    continue;
 	  }
 
-	  if (size>0 && i>=2) { 
-	    ERROR("unexpected virtio pci bar with size>0!\n");
-	    return -1;
+	  if (!size || !bar) { 
+	    // non-existent bar, skip to next one
+	    continue;
 	  }
-	  
+
 	  if (bar & 0x1) { 
-	    vdev->ioport_start = bar & 0xffffffc0;
-	    vdev->ioport_end = vdev->ioport_start + size;
+	    if (!vdev->ioport_start) { 
+	      vdev->ioport_start = bar & 0xfffffffc;
+	      vdev->ioport_end = vdev->ioport_start + size;
+	    }
 	  } else {
-	    vdev->mem_start = bar & 0xfffffff0;
-	    vdev->mem_end = vdev->mem_start + size;
+	    if (!vdev->mem_start) { 
+	      vdev->mem_start = bar & 0xfffffff0;
+	      vdev->mem_end = vdev->mem_start + size;
+	    }
 	  }
 
 	}
@@ -143,13 +514,34 @@ int virtio_pci_init(struct naut_info * naut)
 	     vdev->mem_start, vdev->mem_end);
 	     
 
-	list_add(&dev_list, &vdev->virtio_node);
+	list_add(&vdev->virtio_node, &dev_list);
       }
       
     }
   }
-      
 
+  // now bring up drivers for the devices we know
+  list_for_each_entry(vdev, &dev_list, virtio_node) { 
+    switch (vdev->type) { 
+#ifdef NAUT_CONFIG_VIRTIO_BLK
+    case VIRTIO_PCI_BLOCK:
+      if (virtio_blk_init(vdev)) { 
+	ERROR("Failed to initialize block device\n");
+      }
+      break;
+#endif
+#ifdef NAUT_CONFIG_VIRTIO_NET
+    case VIRTIO_PCI_NET:
+      if (virtio_net_init(vdev)) { 
+	ERROR("Failed to initialize network device\n");
+      }
+      break;
+#endif
+    default:
+      DEBUG("No driver for device of type %d\n", vdev->type);
+      break;
+    }
+  }
   
   return 0;
 }
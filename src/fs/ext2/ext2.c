@@ -26,6 +26,7 @@
 #include <nautilus/nautilus.h>
 #include <nautilus/dev.h>
 #include <nautilus/blkdev.h>
+#include <nautilus/blkcache.h>
 #include <nautilus/fs.h>
 
 #include <fs/ext2/ext2.h>
@@ -52,9 +53,27 @@ struct ext2_state {
     struct nk_block_dev_characteristics chars; 
     struct nk_block_dev *dev;
     struct nk_fs        *fs;
+    struct nk_bcache    *cache;
     struct ext2_super_block super;
+    // bumped whenever any file's block mapping changes
+    uint64_t             map_gen;
 };
 
+/*
+  What the fs layer holds for an open file.  Sequential access walks
+  through one leaf (lowest level) indirect block at a time, so we keep
+  a copy of the last one, which is good until any mapping changes.
+*/
+struct ext2_file {
+    uint32_t  inode_num;
+    uint32_t  leaf_start;   // first logical block the leaf maps, 0 if none
+    uint64_t  map_gen;
+    uint32_t *leaf;
+};
+
+// largest physically contiguous run moved with one request
+#define MAX_RUN_BLOCKS 256
+
 #include "ext2_access.c"
 
 static size_t get_file_size(struct ext2_state *fs, struct ext2_inode *inode) 
@@ -73,6 +92,36 @@ static void set_file_size(struct ext2_state *fs, struct ext2_inode *inode, size_
 }
 
 
+static struct ext2_file *file_alloc(struct ext2_state *fs, uint32_t inode_num)
+{
+    struct ext2_file *f = malloc(sizeof(*f));
+
+    if (!f) { 
+	ERROR("Cannot allocate open file\n");
+	return 0;
+    }
+
+    memset(f,0,sizeof(*f));
+
+    f->inode_num = inode_num;
+    f->leaf = malloc(get_block_size(fs));
+
+    if (!f->leaf) { 
+	ERROR("Cannot allocate open file mapping cache\n");
+	free(f);
+	return 0;
+    }
+
+    return f;
+}
+
+static void file_free(struct ext2_file *f)
+{
+    free(f->leaf);
+    free(f);
+}
+
+
 static void * ext2_open(void *state, char *path) 
 {
     struct ext2_state *fs = (struct ext2_state *)state;
@@ -81,18 +130,32 @@ static void * ext2_open(void *state, char *path)
 
     DEBUG("open of %s returned inode number %u\n",path,inode_num);
 
+    if (!inode_num) { 
+	return 0;
+    }
+
     // ideally FS would track this here so that we can handle multiple
     // opens, locking, etc correctly, but that's outside of scope for now
 
-    return (void*)(uint64_t)inode_num;
+    return file_alloc(fs,inode_num);
 }
 
 
+static int ext2_sync(void *state)
+{
+    struct ext2_state *fs = (struct ext2_state *)state;
+
+    return nk_bcache_flush(fs->cache);
+}
+
 static void ext2_close(void *state, void *file) 
 {
     struct ext2_state *fs = (struct ext2_state *)state;
+    struct ext2_file *f = (struct ext2_file *)file;
+
+    DEBUG("closing inode %u\n",f->inode_num);
 
-    DEBUG("closing inode %u\n",(uint32_t)(uint64_t)file);
+    file_free(f);
 
     // ideally FS would track this here so that we can handle multiple
     // opens, locking, etc correctly, but that's outside of scope for now
@@ -124,6 +187,11 @@ static int map_logical_to_physical_get_put(struct ext2_state *fs, uint32_t inode
     uint8_t   buf[block_size];
     uint32_t  *ptrs = (uint32_t*)buf;
     uint8_t   temp[block_size];
+
+    if (put) { 
+	// open files' cached leaves may now be stale
+	fs->map_gen++;
+    }
 	
     if (!their_inode) { 
 	if (read_inode(fs,inode_num,&our_inode)) {
@@ -375,11 +443,93 @@ static int map_logical_to_physical_get_put(struct ext2_state *fs, uint32_t inode
     map_logical_to_physical_get_put(fs,inode_num,inode,logical_block,&physical_block,1)
 
 
+/*
+ * Find the leaf indirect block that maps logical block, which must
+ * be past the direct blocks.  Returns the leaf's block number, or 0
+ * if the mapping does not exist.
+ */
+static uint32_t find_leaf(struct ext2_state *fs, struct ext2_inode *inode, uint32_t logical_block)
+{
+    uint64_t ptrs_per_block = get_block_size(fs)/4;
+    uint64_t left = logical_block - NUM_DIRECT_DATA_BLOCKS;
+    uint64_t span;
+    uint32_t next;
+    int levels;
+    struct nk_bcache_buf *b;
+
+    if (left < ptrs_per_block) { 
+	return inode->i_block[NUM_DIRECT_DATA_BLOCKS];
+    }
+
+    left -= ptrs_per_block;
+
+    if (left < ptrs_per_block*ptrs_per_block) { 
+	next = inode->i_block[NUM_DIRECT_DATA_BLOCKS+1];
+	span = ptrs_per_block;
+	levels = 1;
+    } else {
+	left -= ptrs_per_block*ptrs_per_block;
+	if (left >= ptrs_per_block*ptrs_per_block*ptrs_per_block) { 
+	    return 0;
+	}
+	next = inode->i_block[NUM_DIRECT_DATA_BLOCKS+2];
+	span = ptrs_per_block*ptrs_per_block;
+	levels = 2;
+    }
+
+    while (levels--) { 
+	if (!next || !(b = nk_bcache_get(fs->cache,next))) { 
+	    return 0;
+	}
+	next = ((uint32_t *)b->data)[left/span];
+	nk_bcache_put(fs->cache,b,0);
+	left %= span;
+	span /= ptrs_per_block;
+    }
+
+    return next;
+}
+
+// map_logical_to_physical_get() through the open file's cached leaf
+static int map_cached(struct ext2_state *fs, struct ext2_file *f, struct ext2_inode *inode,
+		      uint32_t logical_block, uint32_t *physical_block)
+{
+    uint64_t ptrs_per_block = get_block_size(fs)/4;
+    uint32_t leaf_start, leaf;
+
+    if (logical_block < NUM_DIRECT_DATA_BLOCKS) { 
+	*physical_block = inode->i_block[logical_block];
+	return 0;
+    }
+
+    // leaves are aligned on ptrs_per_block past the direct blocks
+    leaf_start = logical_block - (logical_block - NUM_DIRECT_DATA_BLOCKS) % ptrs_per_block;
+
+    if (f->leaf_start != leaf_start || f->map_gen != fs->map_gen) { 
+	f->leaf_start = 0;
+	if (!(leaf = find_leaf(fs,inode,logical_block))) { 
+	    ERROR("required indirect block for logical block %u does not exist\n",logical_block);
+	    return -1;
+	}
+	if (read_block(fs,leaf,f->leaf)) { 
+	    ERROR("Cannot read indirect block %u\n",leaf);
+	    return -1;
+	}
+	f->leaf_start = leaf_start;
+	f->map_gen = fs->map_gen;
+    }
+
+    *physical_block = f->leaf[logical_block - leaf_start];
+
+    return 0;
+}
+
+
 static int ext2_truncate(void *state, void *file, off_t len)
 { 
     struct ext2_state *fs = (struct ext2_state *)state;
     uint64_t block_size = get_block_size(fs);
-    uint32_t inode_num = (uint32_t)(uint64_t)file;
+    uint32_t inode_num = ((struct ext2_file *)file)->inode_num;
     uint32_t phys;
 
     struct ext2_inode inode;   
@@ -412,6 +562,7 @@ static int ext2_truncate(void *state, void *file, off_t len)
 		return -1;
 	    }
 	}
+	fs->map_gen++;
     } else if (new_file_size_blocks > file_size_blocks) {
 	// grow
 	uint64_t block;
@@ -454,7 +605,8 @@ static ssize_t ext2_read_write(void *state, void *file, void *srcdest, off_t off
 {
     struct ext2_state *fs = (struct ext2_state *)state;
     uint64_t block_size = get_block_size(fs);
-    uint32_t inode_num = (uint32_t)(uint64_t)file;
+    struct ext2_file *f = (struct ext2_file *)file;
+    uint32_t inode_num = f->inode_num;
     struct ext2_inode inode;   
     size_t file_size_bytes, file_size_blocks;
 
@@ -502,99 +654,75 @@ static ssize_t ext2_read_write(void *state, void *file, void *srcdest, off_t off
     }
 
     DEBUG("Updated request: %sing inode %u %lu bytes at offset %lu\n",rw[write], inode_num, num_bytes, offset);
-    
-    uint64_t offset_into_first_block = offset % block_size;
-    uint64_t bytes_from_first_block = MIN(num_bytes,block_size - offset_into_first_block);
-    uint64_t bytes_from_middle_blocks = block_size*FLOOR_DIV((num_bytes - bytes_from_first_block),block_size);
-    uint64_t bytes_from_last_block = num_bytes-bytes_from_first_block-bytes_from_middle_blocks;
-    uint64_t have_first_block = bytes_from_first_block!=0;
-    uint64_t num_middle_blocks = bytes_from_middle_blocks/block_size;
-    uint64_t have_last_block = bytes_from_last_block!=0;
-    uint64_t num_blocks = have_first_block + num_middle_blocks + have_last_block;
-
-    uint64_t logical_block_start = FLOOR_DIV(offset,block_size);
-	
-    uint8_t buf[block_size];
-    uint32_t cur_logical_block;
-    uint32_t cur_physical_block;
-
-    DEBUG("logical blocks [%lu,%lu), first_offset=%lu first=%lu middle=%lu, last=%lu\n",
-	  logical_block_start, logical_block_start+num_blocks,
-	  offset_into_first_block, bytes_from_last_block);
 
+    /*
+      Partial blocks at either end go through a bounce buffer.  Whole
+      blocks move directly between the caller's buffer and the cache,
+      which hands long runs straight to the device, so we gather them
+      into runs that are physically contiguous.
+    */
+    uint8_t buf[block_size];
+    uint32_t cur_logical_block = FLOOR_DIV(offset,block_size);
+    uint32_t cur_physical_block, next_physical_block;
+    uint64_t off, len, run;
     uint64_t bytes=0;
 
-    for (cur_logical_block = logical_block_start;
-	 cur_logical_block < logical_block_start + num_blocks;
-	 cur_logical_block++) {
-	
-	if (map_logical_to_physical_get(fs,inode_num,&inode,cur_logical_block,&cur_physical_block)) { 
+    while (bytes < num_bytes) {
+
+	if (map_cached(fs,f,&inode,cur_logical_block,&cur_physical_block)) { 
 	    ERROR("Unable to map logical block %lu\n", cur_logical_block);
 	    return -1;
 	}
-	
+
 	DEBUG("mapped logical block %lu to physical block %lu\n", cur_logical_block, cur_physical_block);
-	
-	if (have_first_block && cur_logical_block==logical_block_start) {
-	    // first block (partial)
-	    if (read_block(fs,cur_physical_block,buf)) {
-		ERROR("Failed to read first partial physical block %lu\n",cur_physical_block);
-		return -1;
-	    } 
-	    if (!write) { 
-		// read - copy-out
-		memcpy(srcdest+bytes,buf+offset_into_first_block,bytes_from_first_block);
-	    } else {
-		// write - copy-in and flush
-		memcpy(buf+offset_into_first_block,srcdest+bytes,bytes_from_first_block);
-		if (write_block(fs,cur_physical_block,buf)) { 
-		    ERROR("Failed to write first partial physical block %lu\n",cur_physical_block);
-		    return -1;
-		}
-	    }
-	    bytes += bytes_from_first_block;
-	    continue;
-	}
 
-	if (have_last_block && cur_logical_block==(logical_block_start+num_blocks-1)) {
-	    // last block (partial)
+	off = bytes ? 0 : offset % block_size;
+	len = MIN(block_size - off, num_bytes - bytes);
+
+	if (len < block_size) {
+	    // partial block
 	    if (read_block(fs,cur_physical_block,buf)) {
-		ERROR("Failed to read last partial physical block %lu\n",cur_physical_block);
+		ERROR("Failed to read partial physical block %lu\n",cur_physical_block);
 		return -1;
 	    } 
 	    if (!write) { 
 		// read - copy-out
-		memcpy(srcdest+bytes,buf,bytes_from_last_block);
+		memcpy(srcdest+bytes,buf+off,len);
 	    } else {
 		// write - copy-in and flush
-		memcpy(buf,srcdest+bytes,bytes_from_last_block);
+		memcpy(buf+off,srcdest+bytes,len);
 		if (write_block(fs,cur_physical_block,buf)) { 
-		    ERROR("Failed to write first partial physical block %lu\n",cur_physical_block);
+		    ERROR("Failed to write partial physical block %lu\n",cur_physical_block);
 		    return -1;
 		}
 	    }
-	    bytes += bytes_from_last_block;
+	    bytes += len;
+	    cur_logical_block++;
 	    continue;
 	}
-	
-	// common case - r/w complete blocks
-	if (!write) {
-	    if (read_block(fs,cur_physical_block,srcdest+bytes)) { 
-		ERROR("Failed to read middle block %lu\n",cur_physical_block);
+
+	// common case - r/w complete blocks, as many as are contiguous
+	for (run=1; 
+	     run < MAX_RUN_BLOCKS && bytes + (run+1)*block_size <= num_bytes;
+	     run++) { 
+	    if (map_cached(fs,f,&inode,cur_logical_block+run,&next_physical_block)) { 
+		ERROR("Unable to map logical block %lu\n", cur_logical_block+run);
 		return -1;
-	    } else {
-		bytes += block_size;
-		continue;
 	    }
-	} else {
-	    if (write_block(fs,cur_physical_block,srcdest+bytes)) { 
-		ERROR("Failed to write middle block %lu\n",cur_physical_block);
-		return -1;
-	    } else {
-		bytes += block_size;
-		continue;
+	    if (next_physical_block != cur_physical_block+run) { 
+		break;
 	    }
 	}
+
+	DEBUG("%s run of %lu blocks at physical block %lu\n", rw[write], run, cur_physical_block);
+
+	if ((write ? nk_bcache_write : nk_bcache_read)(fs->cache,cur_physical_block,run,srcdest+bytes)) { 
+	    ERROR("Failed to %s %lu blocks at %lu\n",rw[write],run,cur_physical_block);
+	    return -1;
+	}
+
+	bytes += run*block_size;
+	cur_logical_block += run;
     }
 
     if (bytes != num_bytes) { 
@@ -1087,6 +1215,7 @@ static void *ext2_create(void *state, char *path, int dir)
     for (int i=strlen(dirname); i>=0; i--) {
 	if (dirname[i]=='/') {
 	    dirname[i] = 0;
+	    break;
 	}
     }
 
@@ -1134,7 +1263,7 @@ static void *ext2_create(void *state, char *path, int dir)
     
     free_split_path(parts,num_parts);
 
-    return (void*)(uint64_t)inode_num;
+    return file_alloc(fs,inode_num);
 
 }
 
@@ -1150,6 +1279,7 @@ static int ext2_create_dir(void *state, char *path)
     if (!f) { 
 	return -1;
     } else {
+	file_free(f);
 	return 0;
     }
 }
@@ -1204,6 +1334,7 @@ int ext2_remove(void *state, char *path)
     for (int i=strlen(dirname); i>=0; i--) {
 	if (dirname[i]=='/') {
 	    dirname[i] = 0;
+	    break;
 	}
     }
 
@@ -1227,8 +1358,10 @@ int ext2_remove(void *state, char *path)
 	return -1;
     }
 
-    // truncate file
-    if (ext2_truncate(fs, (void*)(uint64_t)inum, 0)) {
+    // truncate file, which needs no more of an open file than this
+    struct ext2_file tf = { .inode_num = inum };
+
+    if (ext2_truncate(fs, &tf, 0)) {
 	ERROR("Failed to truncate file during removal\n");
 	return -1;
     }
@@ -1241,10 +1374,8 @@ int ext2_remove(void *state, char *path)
     return 0;
 }
 
-static int ext2_stat(void *state, void *file, struct nk_fs_stat *st)
+static int stat_inode(struct ext2_state *fs, uint32_t inum, struct nk_fs_stat *st)
 {
-    struct ext2_state *fs = (struct ext2_state *)state;
-    uint32_t inum = (uint32_t)(uint64_t)file;
     struct ext2_inode inode;
 
     if (read_inode(fs,inum,&inode)) { 
@@ -1257,6 +1388,11 @@ static int ext2_stat(void *state, void *file, struct nk_fs_stat *st)
     return 0;
 }
 
+static int ext2_stat(void *state, void *file, struct nk_fs_stat *st)
+{
+    return stat_inode((struct ext2_state *)state,((struct ext2_file *)file)->inode_num,st);
+}
+
 static int ext2_stat_path(void *state, char *path, struct nk_fs_stat *st)
 {
     struct ext2_state *fs = (struct ext2_state *)state;
@@ -1267,7 +1403,53 @@ static int ext2_stat_path(void *state, char *path, struct nk_fs_stat *st)
 	return -1;
     }
 
-    return ext2_stat(state,(void*)(uint64_t)inum,st);
+    return stat_inode(fs,inum,st);
+}
+
+static int ext2_root(void *state, uint64_t *ino)
+{
+    *ino = EXT2_ROOT_INO;
+    return 0;
+}
+
+static int ext2_lookup(void *state, uint64_t dir, char *name, uint64_t *ino)
+{
+    struct ext2_state *fs = (struct ext2_state *)state;
+    struct ext2_inode inode;
+    uint32_t inum;
+
+    if (strlen(name) >= EXT2_NAME_LEN) {
+	return 1;
+    }
+
+    if (read_inode(fs,dir,&inode)) {
+	ERROR("Failed to read inode during lookup\n");
+	return -1;
+    }
+
+    if (!inode_has_mode(&inode, EXT2_S_IFDIR)) {
+	return 1;
+    }
+
+    inum = get_inode_num_from_dir(fs, dir, &inode, name);
+
+    if (!inum) {
+	return 1;
+    }
+
+    *ino = inum;
+
+    return 0;
+}
+
+static int ext2_stat_ino(void *state, uint64_t ino, struct nk_fs_stat *st)
+{
+    return stat_inode((struct ext2_state *)state,ino,st);
+}
+
+static void *ext2_open_ino(void *state, uint64_t ino)
+{
+    return file_alloc((struct ext2_state *)state,ino);
 }
 
 
@@ -1281,8 +1463,13 @@ static struct nk_fs_int ext2_inter = {
     .stat = ext2_stat,
     .trunc_file = ext2_truncate,
     .close_file = ext2_close,
+    .sync = ext2_sync,
     .read_file = ext2_read,
     .write_file = ext2_write,
+    .root = ext2_root,
+    .lookup = ext2_lookup,
+    .stat_ino = ext2_stat_ino,
+    .open_ino = ext2_open_ino,
 };
 
 
@@ -1321,11 +1508,20 @@ int nk_fs_ext2_attach(char *devname, char *fsname, int readonly)
 	free(s);
 	return -1;
     }
+
+    s->cache = nk_bcache_create(fsname, dev, get_block_size(s), 0, NK_BCACHE_DEFAULT_FLAGS);
+
+    if (!s->cache) { 
+	ERROR("Cannot create block cache for fs %s\n", fsname);
+	free(s);
+	return -1;
+    }
     
     s->fs = nk_fs_register(fsname, flags, &ext2_inter, s);
 
     if (!s->fs) { 
 	ERROR("Unable to register filesystem %s\n", fsname);
+	nk_bcache_destroy(s->cache);
 	free(s);
 	return -1;
     }
@@ -1338,10 +1534,19 @@ int nk_fs_ext2_attach(char *devname, char *fsname, int readonly)
 int nk_fs_ext2_detach(char *fsname)
 {
     struct nk_fs *fs = nk_fs_find(fsname);
+    struct ext2_state *s;
+
     if (!fs) { 
 	return -1;
     } else {
-	return nk_fs_unregister(fs);
+	s = (struct ext2_state *)fs->state;
+	if (nk_fs_unregister(fs)) { 
+	    return -1;
+	}
+	// writes back anything still dirty
+	nk_bcache_destroy(s->cache);
+	free(s);
+	return 0;
     }
 }
 
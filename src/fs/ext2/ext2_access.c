@@ -45,6 +45,15 @@
 static char *rw[2] = { "read", "write" };
 
 
+static uint32_t get_block_size(struct ext2_state *fs) 
+{
+    uint32_t shift;
+
+    //s_log_block_size tells how much to shift 1K by to determine block size
+    shift = fs->super.s_log_block_size;
+    return (1024 << shift);
+}
+
 static int read_write_superblock(struct ext2_state *fs, int write)
 {
     write &= 0x1;
@@ -75,9 +84,18 @@ static int read_write_superblock(struct ext2_state *fs, int write)
 	  rw[write], SUPERBLOCK_OFFSET, SUPERBLOCK_SIZE, fs->fs->name, fs->chars.block_size, dev_offset, dev_num);
 
     if (write) { 
-	rc = nk_block_dev_write(fs->dev,dev_offset,dev_num,&fs->super,NK_DEV_REQ_BLOCKING,0,0); 
+	// through the cache, as the superblock shares a cached block
+	uint32_t block_size = get_block_size(fs);
+	struct nk_bcache_buf *b = nk_bcache_get(fs->cache,FLOOR_DIV(SUPERBLOCK_OFFSET,block_size));
+	if (b) { 
+	    memcpy(b->data+SUPERBLOCK_OFFSET%block_size,&fs->super,SUPERBLOCK_SIZE);
+	    rc = nk_bcache_put(fs->cache,b,1);
+	} else {
+	    rc = -1;
+	}
 	// TODO: write shadow copies
     } else {
+	// only done at attach, before the cache exists
 	rc = nk_block_dev_read(fs->dev,dev_offset,dev_num,&fs->super,NK_DEV_REQ_BLOCKING,0,0);
     }
     
@@ -94,31 +112,19 @@ static int read_write_superblock(struct ext2_state *fs, int write)
 
 
 
-static uint32_t get_block_size(struct ext2_state *fs) 
-{
-    uint32_t shift;
-
-    //s_log_block_size tells how much to shift 1K by to determine block size
-    shift = fs->super.s_log_block_size;
-    return (1024 << shift);
-}
-
 static int read_write_block(struct ext2_state * fs, uint32_t block_num, void *srcdest, int write) 
 {
-    uint32_t block_size = get_block_size(fs);
-    uint64_t dev_offset = FLOOR_DIV(block_num*block_size,fs->chars.block_size);
-    uint64_t dev_num    = FLOOR_DIV(block_size,fs->chars.block_size);
     int rc;
 
     write &= 0x1;
 
-    DEBUG("%sing block %u on fs %s / dev %s, bs=%u, dev_off=%lu, dev_num=%lu\n",
-	  rw[write], block_num, fs->fs->name, fs->dev->dev.name, block_size, dev_offset, dev_num);
+    DEBUG("%sing block %u on fs %s / dev %s\n",
+	  rw[write], block_num, fs->fs->name, fs->dev->dev.name);
 
     if (write) { 
-	rc = nk_block_dev_write(fs->dev,dev_offset,dev_num,srcdest,NK_DEV_REQ_BLOCKING,0,0); 
+	rc = nk_bcache_write(fs->cache,block_num,1,srcdest);
     } else {
-	rc = nk_block_dev_read(fs->dev,dev_offset,dev_num,srcdest,NK_DEV_REQ_BLOCKING,0,0);
+	rc = nk_bcache_read(fs->cache,block_num,1,srcdest);
     }
     
     if (rc) { 
@@ -161,17 +167,20 @@ static int read_write_block_group(struct ext2_state* fs, uint32_t block_group_nu
     DEBUG("%sing block group descriptor %u (block_num=%u) on fs %s\n",
 	  rw[write], block_group_num, block_num, fs->fs->name);
     
-    uint8_t buf[block_size];
-    struct ext2_group_desc *d = (struct ext2_group_desc *)buf;
+    // the descriptor is updated in place in the cached block
+    struct nk_bcache_buf *b = nk_bcache_get(fs->cache,block_num);
+    struct ext2_group_desc *d;
 
-    if (read_block(fs,block_num,buf)) { 
+    if (!b) { 
 	ERROR("Cannot read block group\n");
 	return -1;
     } 
 
+    d = (struct ext2_group_desc *)b->data;
+
     if (write) { 
 	d[offset] = *srcdest;
-	if (write_block(fs,block_num,buf)) { 
+	if (nk_bcache_put(fs->cache,b,1)) { 
 	    ERROR("Cannot write block group\n");
 	    return -1;
 	} else {
@@ -180,7 +189,7 @@ static int read_write_block_group(struct ext2_state* fs, uint32_t block_group_nu
 	// TODO: update shadow copies
     } else {
 	*srcdest = d[offset];
-	return 0;
+	return nk_bcache_put(fs->cache,b,0);
     }
 }
 
@@ -194,8 +203,8 @@ static int read_write_inode(struct ext2_state *fs, uint32_t inode_num, struct ex
     uint64_t inode_offset;
     uint32_t block_size = get_block_size(fs);
     uint64_t inodes_per_block = FLOOR_DIV(block_size,sizeof(struct ext2_inode));
-    uint8_t buf[block_size];
-    struct ext2_inode* inode_table = (struct ext2_inode *)buf;
+    struct nk_bcache_buf *b;
+    struct ext2_inode* inode_table;
 
     write &= 0x1;
 
@@ -215,14 +224,16 @@ static int read_write_inode(struct ext2_state *fs, uint32_t inode_num, struct ex
 	  rw[write], inode_num, inode_block, inode_offset, sizeof(struct ext2_inode), fs->fs->name);
 
     //gets pointer to block where inodes are located 
-    if (read_block(fs,inode_block,buf)) { 
+    if (!(b = nk_bcache_get(fs->cache,inode_block))) { 
 	ERROR("Cannot read inode block\n");
 	return -1;
     }
 
+    inode_table = (struct ext2_inode *)b->data;
+
     if (write) { 
 	inode_table[inode_offset] = *srcdest;
-	if (write_block(fs,inode_block,buf)) { 
+	if (nk_bcache_put(fs->cache,b,1)) { 
 	    ERROR("Cannot write inode block\n");
 	    return -1;
 	} else {
@@ -230,7 +241,7 @@ static int read_write_inode(struct ext2_state *fs, uint32_t inode_num, struct ex
 	}
     } else {
 	*srcdest = inode_table[inode_offset];
-	return 0;
+	return nk_bcache_put(fs->cache,b,0);
     }
 }
 
@@ -451,7 +462,8 @@ static int alloc_free_inode(struct ext2_state *fs, uint32_t *num, int free)
     free &= 0x1;
 
     if (free) { 
-	bg_start = bg_end = (*num-1)/inodes_per_group(&fs->super);
+	bg_start = (*num-1)/inodes_per_group(&fs->super);
+	bg_end = bg_start+1;
     } else {
 	bg_start = 0;
 	bg_end = num_block_groups(&fs->super);
@@ -524,7 +536,8 @@ static int alloc_free_block(struct ext2_state *fs, uint32_t *num, int free)
     free &= 0x1;
 
     if (free) { 
-	bg_start = bg_end = *num/blocks_per_group(&fs->super);
+	bg_start = *num/blocks_per_group(&fs->super);
+	bg_end = bg_start+1;
     } else {
 	bg_start = 0;
 	bg_end = num_block_groups(&fs->super);
@@ -27,6 +27,7 @@
 #include <nautilus/nautilus.h>
 #include <nautilus/dev.h>
 #include <nautilus/blkdev.h>
+#include <nautilus/blkcache.h>
 #include <nautilus/fs.h>
 
 #include <fs/fat32/fat32.h>
@@ -37,6 +38,130 @@
 
 static int fat32_exists(void *state, char *path);
 
+// An open file.  The directory entry is located once, at open time,
+// and is then addressed directly.  The cursor is the extent of the
+// cluster chain we last touched: file clusters [run_index,
+// run_index+run_len) are the physically contiguous clusters starting
+// at run_cluster.  Sequential I/O thus costs one FAT lookup per
+// extent, and an extent moves with a single request.
+struct fat32_file {
+    uint32_t dir_cluster_num;   // cluster holding our directory entry
+    uint32_t dir_num;           // index of the entry within it
+    uint32_t first_cluster;
+    uint32_t run_index;
+    uint32_t run_cluster;       // 0 if there is no cursor
+    uint32_t run_len;
+    uint64_t chain_gen;         // fs->chain_gen when the cursor was set
+};
+
+// longest extent we cache, and so move with one request, in sectors
+#define MAX_RUN_SECTORS 2048
+
+static struct fat32_file *file_alloc(uint32_t dir_cluster_num, uint32_t dir_num, uint32_t first_cluster)
+{
+    struct fat32_file *f = malloc(sizeof(*f));
+
+    if (!f) {
+	ERROR("Cannot allocate open file\n");
+	return 0;
+    }
+
+    memset(f,0,sizeof(*f));
+
+    f->dir_cluster_num = dir_cluster_num;
+    f->dir_num = dir_num;
+    f->first_cluster = first_cluster;
+
+    return f;
+}
+
+// read or write back the directory entry at index dir_num of a cluster
+static int entry_rw(struct fat32_state *fs, uint32_t dir_cluster_num, uint32_t dir_num, dir_entry *ent, int write)
+{
+    uint32_t per_sector = FLOOR_DIV(fs->bootrecord.sector_size, sizeof(dir_entry));
+    uint32_t sector = get_sector_num(dir_cluster_num, fs) + dir_num / per_sector;
+    dir_entry ents[per_sector];
+
+    if (nk_bcache_read(fs->cache, sector, 1, ents)) {
+	ERROR("Failed to read directory block\n");
+	return -1;
+    }
+
+    if (!write) {
+	*ent = ents[dir_num % per_sector];
+	return 0;
+    }
+
+    ents[dir_num % per_sector] = *ent;
+
+    if (nk_bcache_write(fs->cache, sector, 1, ents)) {
+	ERROR("Failed to write directory block\n");
+	return -1;
+    }
+
+    return 0;
+}
+
+static inline int file_entry(struct fat32_state *fs, struct fat32_file *f, dir_entry *ent, int write)
+{
+    return entry_rw(fs, f->dir_cluster_num, f->dir_num, ent, write);
+}
+
+static int cluster_valid(struct fat32_state *fs, uint32_t cluster)
+{
+    return cluster >= fs->bootrecord.rootdir_cluster &&
+	cluster <= fs->table_chars.data_end - fs->table_chars.data_start;
+}
+
+// point the cursor at the extent that starts with file cluster index
+static void run_fill(struct fat32_state *fs, struct fat32_file *f, uint32_t index, uint32_t cluster)
+{
+    uint32_t *fat = fs->table_chars.FAT32_begin;
+    uint32_t max = MAX_RUN_SECTORS / fs->bootrecord.cluster_size;
+    uint32_t len = 1;
+
+    while (len < max && fat[cluster+len-1] == cluster+len) {
+	len++;
+    }
+
+    f->run_index = index;
+    f->run_cluster = cluster;
+    f->run_len = len;
+    f->chain_gen = fs->chain_gen;
+}
+
+// find the cluster holding file cluster index, moving the cursor there
+// returns 1 if the chain ends first, leaving the cursor on its last extent
+static int file_seek(struct fat32_state *fs, struct fat32_file *f, uint32_t index, uint32_t *cluster)
+{
+    uint32_t *fat = fs->table_chars.FAT32_begin;
+    uint32_t next;
+
+    if (!f->run_cluster || f->chain_gen != fs->chain_gen || index < f->run_index) {
+	if (!cluster_valid(fs, f->first_cluster)) {
+	    ERROR("Bogus first cluster value (%x)\n", f->first_cluster);
+	    return -1;
+	}
+	run_fill(fs, f, 0, f->first_cluster);
+    }
+
+    while (index >= f->run_index + f->run_len) {
+	next = fat[f->run_cluster + f->run_len - 1];
+	if (next >= EOC_MIN && next <= EOC_MAX) {
+	    return 1;
+	}
+	if (!cluster_valid(fs, next)) {
+	    ERROR("Bogus next cluster value (%x)\n", next);
+	    return -1;
+	}
+	run_fill(fs, f, f->run_index + f->run_len, next);
+    }
+
+    *cluster = f->run_cluster + (index - f->run_index);
+
+    return 0;
+}
+
 static ssize_t fat32_read_write(void *state, void *file, void *srcdest, off_t offset, size_t num_bytes, int write)
 {
     char *rw[2] = {"read","write"};
@@ -48,30 +173,15 @@ static ssize_t fat32_read_write(void *state, void *file, void *srcdest, off_t of
     write &= 0x1;
 
     struct fat32_state *fs = (struct fat32_state *) state;
-
-    uint32_t dir_cluster_num;
+    struct fat32_file *f = (struct fat32_file *) file;
     dir_entry dir_ent;
 
-    DEBUG("%s from fs %s file %s offset %lu %lu bytes\n",rw[write], fs->fs->name, (char*) file, offset, num_bytes);
-    
-    int dir_num = path_lookup(fs, (char*) file, &dir_cluster_num, &dir_ent, 0);
-    if (dir_num == -1) {
-	DEBUG("Directory entry does not exist\n");
+    DEBUG("%s from fs %s file at cluster %u offset %lu %lu bytes\n",rw[write], fs->fs->name, f->first_cluster, offset, num_bytes);
+
+    if (file_entry(fs, f, &dir_ent, 0)) {
 	return -1;
     }
 
-/*
-    dir_entry full_dirs[FLOOR_DIV(fs->bootrecord.sector_size, sizeof(dir_entry))];
-    nk_block_dev_read(fs->dev, get_sector_num(dir_cluster_num, fs), 1, full_dirs, NK_DEV_REQ_BLOCKING);
-    DEBUG("dir_num is %d\n", dir_num);
-    dir_entry *dir = &(full_dirs[dir_num]);
-    */
-/*
-    if (!dir) { // if dir doesn't exist
-        return -1;
-    }*/
-
-
     off_t file_size = (off_t)dir_ent.size;
 
     DEBUG("offset = %lu file_size = %u\n", offset, file_size);
@@ -86,176 +196,98 @@ static ssize_t fat32_read_write(void *state, void *file, void *srcdest, off_t of
         return 0; 
     }
 
-    off_t remainder;
     if (write && dir_ent.attri.each_att.readonly) {
 	DEBUG("Attempt to write read-only file\n");
 	return -1;
     }  
 
-    remainder = offset;
-
-    //off_t remainder = offset;
     uint32_t cluster_size = get_cluster_size(fs); // in bytes
-    uint32_t cluster_num = DECODE_CLUSTER(dir_ent.high_cluster, dir_ent.low_cluster);  //first cluster number of the file
-    DEBUG("CLUSTER NUM is %u\n", cluster_num);
-    uint32_t cluster_min = fs->bootrecord.rootdir_cluster; // min valid cluster number
-    uint32_t cluster_max = fs->table_chars.data_end - fs->table_chars.data_start; // max valid cluster number
+    uint32_t sectors_per_cluster = fs->bootrecord.cluster_size;
+    size_t to_do = write ? num_bytes : MIN(num_bytes, file_size - offset);
+    size_t done = 0;
+    uint32_t cluster;
+    int rc;
 
-    // scan the FAT chain until we find the relevant cluster
-    while (remainder > cluster_size) {
-        uint32_t next = fs->table_chars.FAT32_begin[cluster_num];
-        //check if next is valid
-        if ( next >= EOC_MIN && next <= EOC_MAX ) {
-	    DEBUG("Bogus next cluster value (%x)\n",next);
-            return -1;
-        }
-        if ( next < cluster_min || next > cluster_max ) {
-	    DEBUG("Bogus next cluster value (%x)\n",next);
-            return -1;
-        }
-        cluster_num = next; 
-        remainder -= cluster_size;
+    if (write && to_do) {
+	// make sure the chain covers the whole write before we start
+	uint32_t last = (offset + to_do - 1) / cluster_size;
+	rc = file_seek(fs, f, last, &cluster);
+	if (rc < 0) {
+	    return -1;
+	}
+	if (rc > 0) {
+	    uint32_t tail = f->run_index + f->run_len - 1;
+	    DEBUG("extending chain by %u clusters\n", last - tail);
+	    if (grow_shrink_chain(fs, f->run_cluster + f->run_len - 1, last - tail) == -1) {
+		ERROR("Cannot allocate blocks\n");
+		return -1;
+	    }
+	}
     }
-    
-    DEBUG("remainder = %d\n", remainder);
 
     char buf[cluster_size];
-    if (write) { // write
-        //suppose we have the file
-        int rc;
-        long src_off = 0;
-        if (offset + num_bytes < file_size ) {  //don't need to allocate new block 
-            //update file content
-            do {
-                if (nk_block_dev_read(fs->dev, get_sector_num(cluster_num, fs), fs->bootrecord.cluster_size, buf, NK_DEV_REQ_BLOCKING,0,0)) {
-                    ERROR("Failed to read block.\n");
-		    // should really unwind here
-		    return -1;
-                }
-                memcpy(buf+remainder, srcdest + src_off, MIN(cluster_size - remainder, num_bytes-src_off));
-                DEBUG("Num Bytes to be written: %d\n", MIN(cluster_size - remainder, num_bytes-src_off));
-                if (nk_block_dev_write(fs->dev, get_sector_num(cluster_num, fs), fs->bootrecord.cluster_size, buf, NK_DEV_REQ_BLOCKING,0,0)) {
-                    ERROR("Failed to write block.\n");
-		    // should really unwind here
-		    return -1;
-                }
-                src_off += MIN(cluster_size - remainder, num_bytes-src_off); 
-                remainder = 0; //?
-                uint32_t next = fs->table_chars.FAT32_begin[cluster_num];
-                //if( next >= EOC_MIN && next <= EOC_MAX ) break;
-                //if( next < cluster_min || next > cluster_max ) break;
-                cluster_num = next;
-            } while(src_off < num_bytes);
-        } else {
-	    //need to allocate block
-            //1. fill up current block
-            uint32_t next = cluster_num;
-            while( ! (next >= EOC_MIN && next <= EOC_MAX) ) {
-                cluster_num = next;
-                if (nk_block_dev_read(fs->dev, get_sector_num(cluster_num, fs), fs->bootrecord.cluster_size, buf, NK_DEV_REQ_BLOCKING,0,0)) {
-                    ERROR("Failed to read on block.\n");
-		    // should really unwind here
-		    return -1;
-                }
-                memcpy(buf+remainder, srcdest + src_off, MIN(cluster_size - remainder, num_bytes-src_off));
-                DEBUG("Num Bytes to be written: %d\n", MIN(cluster_size - remainder, num_bytes-src_off));
-                if (nk_block_dev_write(fs->dev, get_sector_num(cluster_num, fs), fs->bootrecord.cluster_size, buf, NK_DEV_REQ_BLOCKING,0,0)) {
-                    ERROR("Failed to write on block.\n");
-		    // should really unwind here
-		    return -1;
-                }
-                src_off += MIN(cluster_size - remainder, num_bytes-src_off); 
-                remainder = 0;
-                next = fs->table_chars.FAT32_begin[cluster_num];
-                if (next < cluster_min || ( next > cluster_max && next < EOC_MIN ) ) {
-		    ERROR("No block available\n");
-		    // should really unwind here
-		    return -1;
-                }
-            }
-            //2. if it still has sth to write, allocate new block
-            uint32_t num_allocate = CEIL_DIV(num_bytes - src_off, cluster_size);
-            DEBUG("num_allocate is %u\n", num_allocate);
-            if (num_allocate > 0){
-                if (grow_shrink_chain(fs, cluster_num, num_allocate) == -1 ) {
-		    ERROR("Cannot allocate blocks\n");
-		    // unwind... 
-                    return -1;
-                }
-                cluster_num = fs->table_chars.FAT32_begin[cluster_num];
-                DEBUG("cluster number after allocation is %u\n", cluster_num);
-                do {
-                    memset(buf, '\0', cluster_size);
-                    memcpy(buf, srcdest + src_off, MIN(cluster_size, num_bytes-src_off));
-                    DEBUG("Num Bytes to be written: %d\n", MIN(cluster_size, num_bytes-src_off));
-                    if (nk_block_dev_write(fs->dev, get_sector_num(cluster_num, fs), fs->bootrecord.cluster_size, buf, NK_DEV_REQ_BLOCKING,0,0)) {
-                        //TODO: RESTORE THE FILE
-                        ERROR("Failed to write block.\n");
-			// unwind... 
-			return -1;
-                    }
-                    src_off += MIN(cluster_size, num_bytes-src_off); 
-                    cluster_num = fs->table_chars.FAT32_begin[cluster_num];
-                } while (num_bytes > src_off);
-            }
-
-            //Update directory entry
-            dir_entry dir_buf[fs->bootrecord.directory_entry_num];
-            if (nk_block_dev_read(fs->dev, get_sector_num(dir_cluster_num, fs), fs->bootrecord.cluster_size, dir_buf, NK_DEV_REQ_BLOCKING,0,0)) {
-                ERROR("Failed to read block.\n");
-		// unwind... 
-		return -1;
-            }
 
-            uint32_t new_file_size = offset + num_bytes; 
-            dir_buf[dir_num].size = new_file_size; 
+    while (done < to_do) {
+	off_t pos = offset + done;
+	uint32_t index = pos / cluster_size;
+	uint32_t within = pos % cluster_size;
 
-            if (nk_block_dev_write(fs->dev, get_sector_num(dir_cluster_num, fs), fs->bootrecord.cluster_size, dir_buf, NK_DEV_REQ_BLOCKING,0,0)) {
-                ERROR("Failed to write block.\n");
-		// unwind... 
-		return -1;
-            }
-        }
-        return src_off;
-    } else { // read
-        long to_be_read = MIN(num_bytes, file_size - offset);
-        DEBUG("to_be_read = %d\n", to_be_read);
-        long dest_off = 0;
-        
-        do {
-            if (nk_block_dev_read(fs->dev, get_sector_num(cluster_num, fs), fs->bootrecord.cluster_size, buf, NK_DEV_REQ_BLOCKING,0,0)) {
+	if (file_seek(fs, f, index, &cluster)) {
+	    ERROR("Cluster chain is shorter than the file\n");
+	    return -1;
+	}
+
+	if (within || to_do - done < cluster_size) {
+	    // partial cluster, through the bounce buffer
+	    size_t n = MIN(cluster_size - within, to_do - done);
+
+	    if (write && (off_t)index * cluster_size >= file_size) {
+		// never held data, so there is nothing to preserve
+		memset(buf, 0, cluster_size);
+	    } else if (nk_bcache_read(fs->cache, get_sector_num(cluster, fs), sectors_per_cluster, buf)) {
 		ERROR("Failed to read block\n");
 		return -1;
 	    }
 
-            if (remainder > 0) {
-                memcpy(srcdest + dest_off, (char *)buf + remainder, MIN(cluster_size - remainder, to_be_read));
-                to_be_read = to_be_read - cluster_size + remainder;
-                
-                dest_off += MIN(cluster_size - remainder, to_be_read);
-                DEBUG("dest_off is %ld\n", dest_off);
-                remainder = 0;
-            } else {
-                memcpy(srcdest + dest_off, buf, MIN(to_be_read, cluster_size));
-                DEBUG("read buf is %s\n", buf);
-                dest_off += MIN(to_be_read, cluster_size);
-                DEBUG("dest_off is %ld\n", dest_off);
-                to_be_read -= cluster_size;
-            }
-            //update cluster number
-            uint32_t next = fs->table_chars.FAT32_begin[cluster_num];
+	    if (write) {
+		memcpy(buf + within, srcdest + done, n);
+		if (nk_bcache_write(fs->cache, get_sector_num(cluster, fs), sectors_per_cluster, buf)) {
+		    ERROR("Failed to write block\n");
+		    return -1;
+		}
+	    } else {
+		memcpy(srcdest + done, buf + within, n);
+	    }
+
+	    done += n;
+	} else {
+	    // whole clusters move directly to or from the caller's
+	    // buffer, as many per request as are contiguous on disk
+	    uint32_t count = MIN(f->run_len - (index - f->run_index), (to_do - done) / cluster_size);
 
-            if( next >= EOC_MIN && next <= EOC_MAX ) {
-		break; // end of file
+	    if (write) {
+		rc = nk_bcache_write(fs->cache, get_sector_num(cluster, fs), count * sectors_per_cluster, srcdest + done);
+	    } else {
+		rc = nk_bcache_read(fs->cache, get_sector_num(cluster, fs), count * sectors_per_cluster, srcdest + done);
+	    }
+
+	    if (rc) {
+		ERROR("Failed to %s %u clusters\n", rw[write], count);
+		return -1;
 	    }
-           // if( next < cluster_min || next > cluster_max ) break;
-            cluster_num = next;
 
-        } while (to_be_read > 0);
+	    done += (size_t)count * cluster_size;
+	}
+    }
 
-        return MIN(num_bytes, file_size - offset);
+    if (write && offset + num_bytes > file_size) {
+	dir_ent.size = offset + num_bytes;
+	if (file_entry(fs, f, &dir_ent, 1)) {
+	    return -1;
+	}
     }
 
+    return done;
 }
 
 static ssize_t fat32_read(void *state, void *file, void *srcdest, off_t offset, size_t num_bytes)
@@ -329,7 +361,7 @@ static void *fat32_create(void *state, char *path, int isdir)
 	    free_split_path(parts,num_parts);
             return NULL;
         }
-        if (nk_block_dev_read(fs->dev, get_sector_num(dir_cluster_num, fs), 1, full_dirs, NK_DEV_REQ_BLOCKING,0,0)) { 
+        if (nk_bcache_read(fs->cache, get_sector_num(dir_cluster_num, fs), 1, full_dirs)) { 
 	    ERROR("block read failed\n");
 	    free_split_path(parts,num_parts);
 	    return NULL;
@@ -348,7 +380,7 @@ static void *fat32_create(void *state, char *path, int isdir)
 
     dir_entry full_dirs2[num_dir_entry_per_file]; // last cluster of c
     DEBUG("end of dir_cluster_num (c) is %d\n", cluster_num);
-    if (nk_block_dev_read(fs->dev, get_sector_num(cluster_num, fs), 1, full_dirs2, NK_DEV_REQ_BLOCKING,0,0)) {
+    if (nk_bcache_read(fs->cache, get_sector_num(cluster_num, fs), 1, full_dirs2)) {
 	ERROR("block read failed\n");
 	free_split_path(parts,num_parts);
 	return NULL;
@@ -367,7 +399,7 @@ static void *fat32_create(void *state, char *path, int isdir)
         }
         cluster_num = fat[cluster_num]; // advance to the allocated cluster
         i = 0; // start of cluster
-        if (nk_block_dev_read(fs->dev, get_sector_num(cluster_num, fs), 1, full_dirs2, NK_DEV_REQ_BLOCKING,0,0)) { // read the new cluster of c
+        if (nk_bcache_read(fs->cache, get_sector_num(cluster_num, fs), 1, full_dirs2)) { // read the new cluster of c
 	    ERROR("Failed to read block\n");
 	    free_split_path(parts,num_parts);
             return NULL;
@@ -406,23 +438,23 @@ static void *fat32_create(void *state, char *path, int isdir)
     int rc;
     if (path_without_name[0] != 0) { // make sure path not like "/name"
         dir_ent.size += sizeof(dir_entry); // increment size of c in (dir entry of c in b)
-        if (nk_block_dev_write(fs->dev, get_sector_num(dir_cluster_num, fs), fs->bootrecord.cluster_size, full_dirs, NK_DEV_REQ_BLOCKING,0,0)) {
+        if (nk_bcache_write(fs->cache, get_sector_num(dir_cluster_num, fs), fs->bootrecord.cluster_size, full_dirs)) {
             ERROR("Failed to write block for full_dirs.\n");
 	    free_split_path(parts,num_parts);
 	    return NULL;
         }
     }
     
-    if (nk_block_dev_write(fs->dev, get_sector_num(cluster_num, fs), fs->bootrecord.cluster_size, full_dirs2, NK_DEV_REQ_BLOCKING,0,0)) {
+    if (nk_bcache_write(fs->cache, get_sector_num(cluster_num, fs), fs->bootrecord.cluster_size, full_dirs2)) {
         ERROR("Failed to write on block for full_dirs2.\n");
 	free_split_path(parts,num_parts);
 	return NULL;
     }
 
     free_split_path(parts,num_parts);
-    //return ptr to the dir_entry of the newly created file
-    // huh?
-    return (void*) (1);
+
+    // the new entry is the first sector's worth of cluster_num
+    return file_alloc(cluster_num, i, new_file_cluster_num);
 }
 
 static void *fat32_create_file(void *state, char *path)
@@ -437,6 +469,7 @@ static int fat32_create_dir(void *state, char *path)
     if (!f) {
         return -1;
     } else {
+        free(f);
         return 0;
     }
 }
@@ -479,6 +512,8 @@ int fat32_remove(void *state, char *path)
     } while (! (cluster_num >= EOC_MIN && cluster_num <= EOC_MAX) );
 
     fs->table_chars.FAT32_begin[cluster_num] = FREE_CLUSTER; 
+    fs->chain_gen++;
+
     if (nk_block_dev_write(fs->dev, fs->bootrecord.reservedblock_size, fat_size, fat, NK_DEV_REQ_BLOCKING,0,0)) {
 	ERROR("Failed to write block\n");
 	return -1;
@@ -491,13 +526,13 @@ int fat32_remove(void *state, char *path)
 
     //remove the directory entry
     dir_entry full_dirs[FLOOR_DIV(fs->bootrecord.sector_size, sizeof(dir_entry))];
-    if (nk_block_dev_read(fs->dev, get_sector_num(dir_cluster_num, fs), 1, full_dirs, NK_DEV_REQ_BLOCKING,0,0)) { 
+    if (nk_bcache_read(fs->cache, get_sector_num(dir_cluster_num, fs), 1, full_dirs)) { 
 	ERROR("Failed to read block\n");
 	return -1;
     }
     DEBUG("dir_num is %d\n", dir_num);
     memset(full_dirs + dir_num, 0, sizeof(dir_entry));
-    if (nk_block_dev_write(fs->dev, get_sector_num(dir_cluster_num, fs), 1, full_dirs, NK_DEV_REQ_BLOCKING,0,0)) {
+    if (nk_bcache_write(fs->cache, get_sector_num(dir_cluster_num, fs), 1, full_dirs)) {
 	ERROR("Failed to write block\n");
 	return -1;
     }
@@ -517,44 +552,47 @@ static void * fat32_open(void *state, char *path)
 	DEBUG("Failed to look up path\n");
 	return NULL;
     }
-    /*
-    dir_entry full_dirs[FLOOR_DIV(fs->bootrecord.sector_size, sizeof(dir_entry))];
-    nk_block_dev_read(fs->dev, get_sector_num(dir_cluster_num, fs), 1, full_dirs, NK_DEV_REQ_BLOCKING);
-    dir_entry *dir = &full_dirs[dir_num];
-    */
-    //uint32_t cluster_num = DECODE_CLUSTER(dir_ent.high_cluster, dir_ent.low_cluster);
-    //DEBUG("open of %s returned cluster number %u\n", path, cluster_num);
 
-    return (void*)path;
+    uint32_t cluster_num = DECODE_CLUSTER(dir_ent.high_cluster, dir_ent.low_cluster);
+    DEBUG("open of %s found entry %d in cluster %u, first cluster %u\n", path, dir_num, dir_cluster_num, cluster_num);
+
+    return file_alloc(dir_cluster_num, dir_num, cluster_num);
 }
 
 static int fat32_stat(void *state, void *file, struct nk_fs_stat *st)
 {
-    return fat32_stat_path(state, file, st);
+    struct fat32_state *fs = (struct fat32_state *)state;
+    dir_entry dir_ent;
+
+    if (file_entry(fs, (struct fat32_file *)file, &dir_ent, 0)) {
+	return -1;
+    }
+
+    st->st_size = dir_ent.size;
+
+    return 0;
 }
 
 static int fat32_truncate(void *state, void *file, off_t len)
 {
     struct fat32_state *fs = (struct fat32_state *)state;
-    uint32_t dir_cluster_num;
+    struct fat32_file *f = (struct fat32_file *)file;
     dir_entry dir_ent;
 
-    DEBUG("truncate file %s on fs %s to length %lu\n", (char*)file, fs->fs->name, len);
-
-    int dir_num = path_lookup(fs, (char*) file, &dir_cluster_num, &dir_ent, 0);
+    DEBUG("truncate file at cluster %u on fs %s to length %lu\n", f->first_cluster, fs->fs->name, len);
 
-    if (dir_num == -1) {
-	DEBUG("Failed to look up path\n");
+    if (file_entry(fs, f, &dir_ent, 0)) {
 	return -1;
     }
 
     uint32_t cluster_size = get_cluster_size(fs);
     off_t file_size = (off_t)dir_ent.size;
-    size_t file_size_clusters = CEIL_DIV(file_size,(off_t)cluster_size);
+    // a file always holds at least its first cluster
+    size_t file_size_clusters = MAX(CEIL_DIV(file_size,(off_t)cluster_size),1);
     off_t new_file_size = len; 
-    size_t new_file_size_clusters = CEIL_DIV(new_file_size,(off_t)cluster_size);
+    size_t new_file_size_clusters = MAX(CEIL_DIV(new_file_size,(off_t)cluster_size),1);
     long size_clusters_diff = new_file_size_clusters-file_size_clusters; 
-    uint32_t cluster_num = DECODE_CLUSTER(dir_ent.high_cluster, dir_ent.low_cluster);
+    uint32_t cluster_num = f->first_cluster;
     uint32_t cluster_min = fs->bootrecord.rootdir_cluster; // min valid cluster number
     uint32_t cluster_max = fs->table_chars.data_end - fs->table_chars.data_start; // max valid cluster number
 
@@ -570,14 +608,15 @@ static int fat32_truncate(void *state, void *file, off_t len)
             cluster_num = next;
             size -= cluster_size;
         }
+        // clear the tail of the new last cluster
         char file_content[cluster_size];
-        if (nk_block_dev_read(fs->dev, get_sector_num(cluster_num, fs), 1, file_content, NK_DEV_REQ_BLOCKING,0,0)) {
+        if (nk_bcache_read(fs->cache, get_sector_num(cluster_num, fs), fs->bootrecord.cluster_size, file_content)) {
 	    ERROR("Failed to read block\n");
 	    return -1;
 	}
 
-        memset(file_content + size - 1, '\0', cluster_size - size + 1);
-        if (nk_block_dev_write(fs->dev, get_sector_num(cluster_num, fs), 1, file_content, NK_DEV_REQ_BLOCKING,0,0)) { 
+        memset(file_content + size, '\0', cluster_size - size);
+        if (nk_bcache_write(fs->cache, get_sector_num(cluster_num, fs), fs->bootrecord.cluster_size, file_content)) { 
 	    ERROR("Failed to write block\n");
 	    return -1;
 	}
@@ -616,36 +655,148 @@ static int fat32_truncate(void *state, void *file, off_t len)
 	return -1;
     }
     //set new file size and write directory entry back 
-    dir_entry full_dirs[FLOOR_DIV(fs->bootrecord.sector_size, sizeof(dir_entry))];
+    dir_ent.size = (uint32_t) new_file_size; 
+
+    return file_entry(fs, f, &dir_ent, 1);
+}
+
+static int fat32_sync(void *state)
+{
+    struct fat32_state *fs = (struct fat32_state *)state;
+
+    return nk_bcache_flush(fs->cache);
+}
+
+static void fat32_close(void *state, void *file)
+{
+    struct fat32_state *fs = (struct fat32_state *)state;
+    struct fat32_file *f = (struct fat32_file *)file;
     
-    if (nk_block_dev_read(fs->dev, get_sector_num(dir_cluster_num, fs), 1, full_dirs, NK_DEV_REQ_BLOCKING,0,0)) { 
-	ERROR("FAiled to read block\n");
-	return -1;
+    DEBUG("Close file at cluster %u on fs %s\n",f->first_cluster,fs->fs->name);
+
+    free(f);
+}
+// An ino is the location of a directory entry, which stays put
+// until the file is removed.  The root directory has no entry.
+#define FAT32_ROOT_INO           1
+#define INO_ENCODE(cluster,num)  (((uint64_t)(cluster) << 32) | (num))
+#define INO_CLUSTER(ino)         ((uint32_t)((ino) >> 32))
+#define INO_NUM(ino)             ((uint32_t)(ino))
+
+static int fat32_root(void *state, uint64_t *ino)
+{
+    *ino = FAT32_ROOT_INO;
+    return 0;
+}
+
+// One component of what path_lookup() does: a directory matches by
+// name prefix, anything else by its 8.3 name.  Like path_lookup(),
+// only the first sector of each directory cluster is searched.
+static int fat32_lookup(void *state, uint64_t dir, char *name, uint64_t *ino)
+{
+    struct fat32_state *fs = (struct fat32_state *)state;
+    uint32_t per_sector = FLOOR_DIV(fs->bootrecord.sector_size, sizeof(dir_entry));
+    dir_entry ents[per_sector];
+    dir_entry dir_ent;
+    uint32_t cluster_num;
+    int len = strlen(name);
+    char upper[len+1];
+    char *dot;
+    char file_name[8];
+    char file_ext[3];
+    int name_size, ext_size;
+
+    // nothing longer can be an 8.3 name
+    dot = strchr(name, '.');
+    if ((dot ? dot - name : len) > 8 || (dot && strlen(dot+1) > 3)) {
+	return 1;
     }
-    full_dirs[dir_num].size = (uint32_t) new_file_size; 
 
-    if (nk_block_dev_write(fs->dev, get_sector_num(dir_cluster_num, fs), 1, full_dirs, NK_DEV_REQ_BLOCKING,0,0)) { 
-	ERROR("Failed to write block\n");
+    strcpy(upper, name);
+    toUpperCase(upper);
+    filename_parser(upper, file_name, file_ext, &name_size, &ext_size);
+
+    if (dir == FAT32_ROOT_INO) {
+	cluster_num = fs->bootrecord.rootdir_cluster;
+    } else {
+	if (entry_rw(fs, INO_CLUSTER(dir), INO_NUM(dir), &dir_ent, 0)) {
+	    return -1;
+	}
+	if (!dir_ent.attri.each_att.dir) {
+	    return 1;
+	}
+	cluster_num = DECODE_CLUSTER(dir_ent.high_cluster, dir_ent.low_cluster);
+    }
+
+    while (!(cluster_num >= EOC_MIN && cluster_num <= EOC_MAX)) {
+	if (!cluster_valid(fs, cluster_num)) {
+	    ERROR("Directory chain has invalid entry (%x)\n", cluster_num);
+	    return -1;
+	}
+
+	if (nk_bcache_read(fs->cache, get_sector_num(cluster_num, fs), 1, ents)) {
+	    ERROR("Failed to read block\n");
+	    return -1;
+	}
+
+	for (uint32_t i = 0; i < per_sector; i++) {
+	    dir_entry *d = &ents[i];
+
+	    if (d->name[0] == 0 || (uint8_t)d->name[0] == 0xe5) {
+		continue; // unused or deleted
+	    }
+
+	    if ((d->attri.each_att.dir && !strncmp(d->name, upper, len)) ||
+		(!strncmp(d->name, file_name, name_size) &&
+		 (!ext_size || !strncmp(d->ext, file_ext, ext_size)))) {
+		*ino = INO_ENCODE(cluster_num, i);
+		return 0;
+	    }
+	}
+
+	cluster_num = fs->table_chars.FAT32_begin[cluster_num];
+    }
+
+    return 1;
+}
+
+static int fat32_stat_ino(void *state, uint64_t ino, struct nk_fs_stat *st)
+{
+    struct fat32_state *fs = (struct fat32_state *)state;
+    dir_entry dir_ent;
+
+    if (ino == FAT32_ROOT_INO) {
+	st->st_size = 0;
+	return 0;
+    }
+
+    if (entry_rw(fs, INO_CLUSTER(ino), INO_NUM(ino), &dir_ent, 0)) {
 	return -1;
     }
 
+    st->st_size = dir_ent.size;
+
     return 0;
 }
 
-static void fat32_close(void *state, void *file)
+static void *fat32_open_ino(void *state, uint64_t ino)
 {
-    dir_entry dir_ent;
     struct fat32_state *fs = (struct fat32_state *)state;
-    
-    DEBUG("Close %s on fs %s\n",(char*)file,fs->fs->name);
+    dir_entry dir_ent;
 
-    if (path_lookup(fs, file, NULL, &dir_ent, 0) == -1 ) {
-        ERROR("cannot find the file to be closed");
-    } else   {
-        DEBUG("closed file %s\n", file);
+    if (ino == FAT32_ROOT_INO) {
+	DEBUG("Cannot open the root directory\n");
+	return NULL;
+    }
+
+    if (entry_rw(fs, INO_CLUSTER(ino), INO_NUM(ino), &dir_ent, 0)) {
+	return NULL;
     }
+
+    return file_alloc(INO_CLUSTER(ino), INO_NUM(ino), DECODE_CLUSTER(dir_ent.high_cluster, dir_ent.low_cluster));
 }
 
+
 static struct nk_fs_int fat32_inter = {
     .stat_path = fat32_stat_path,
     .create_file = fat32_create_file,
@@ -656,26 +807,39 @@ static struct nk_fs_int fat32_inter = {
     .stat = fat32_stat,
     .trunc_file = fat32_truncate,
     .close_file = fat32_close,
+    .sync = fat32_sync,
     .read_file = fat32_read,
     .write_file = fat32_write,
+    .root = fat32_root,
+    .lookup = fat32_lookup,
+    .stat_ino = fat32_stat_ino,
+    .open_ino = fat32_open_ino,
 };
 
 static void fat32_demo(struct fat32_state *s)
 {
     char src[600];
+    void *f;
 
     // create a new dir and a new file under it
     fat32_create_dir(s, "/live");
-    fat32_create_file(s, "/live/foo.txt");
+    f = fat32_create_file(s, "/live/foo.txt");
 
     // write into file just created
-    fat32_write(s, "/live/foo.txt", "Hello world!\n", 0, 13);
+    if (f) {
+	fat32_write(s, f, "Hello world!\n", 0, 13);
+	fat32_close(s, f);
+    }
     for(int i = 0; i < 600; i++) { 
 	src[i] = 'o'; 
     }
     src[598] = '!';
     src[599] = '\n';
-    fat32_write(s, "/bar.txt", src, 2, 600);
+    f = fat32_open(s, "/bar.txt");
+    if (f) {
+	fat32_write(s, f, src, 2, 600);
+	fat32_close(s, f);
+    }
 
     // truncate and remove
     // fat32_truncate(s, "/bar.txt", 3);
@@ -723,6 +887,17 @@ int nk_fs_fat32_attach(char *devname, char *fsname, int readonly)
         free(s);
         return -1;
     }
+
+    // the FAT lives in memory and is written directly, so only
+    // directories and file data go through the cache
+    s->cache = nk_bcache_create(fsname, dev, s->chars.block_size, 0, NK_BCACHE_DEFAULT_FLAGS);
+
+    if (!s->cache) {
+        ERROR("Cannot create block cache for fs %s\n", fsname);
+        free(s->table_chars.FAT32_begin);
+        free(s);
+        return -1;
+    }
     
     //DEBUG("System ID \"%s\"\n", s->bootrecord.system_id);
     DEBUG("Media byte %x\n", s->bootrecord.media_type);
@@ -743,6 +918,8 @@ int nk_fs_fat32_attach(char *devname, char *fsname, int readonly)
 
     if (!s->fs) { 
 	ERROR("Unable to register filesystem %s\n", fsname);
+	nk_bcache_destroy(s->cache);
+	free(s->table_chars.FAT32_begin);
 	free(s);
 	return -1;
     }
@@ -757,9 +934,19 @@ int nk_fs_fat32_attach(char *devname, char *fsname, int readonly)
 int nk_fs_fat32_detach(char *fsname)
 {
     struct nk_fs *fs = nk_fs_find(fsname);
+    struct fat32_state *s;
+
     if (!fs) {
         return -1;
     } else {
-        return nk_fs_unregister(fs);
+        s = (struct fat32_state *)fs->state;
+        if (nk_fs_unregister(fs)) {
+            return -1;
+        }
+        // writes back anything still dirty
+        nk_bcache_destroy(s->cache);
+        free(s->table_chars.FAT32_begin);
+        free(s);
+        return 0;
     }
 }
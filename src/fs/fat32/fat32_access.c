@@ -231,7 +231,7 @@ static void filename_parser(char* path, char* name, char* ext, int* name_s, int*
 static void debug_print_file(struct fat32_state* state, uint32_t cluster_num, uint32_t size)
 {
     char file[512];
-    if (nk_block_dev_read(state->dev, get_sector_num(cluster_num, state), 1, file, NK_DEV_REQ_BLOCKING,0,0)) {
+    if (nk_bcache_read(state->cache, get_sector_num(cluster_num, state), 1, file)) {
 	ERROR("Failed to read block\n");
 	return;
     }
@@ -288,7 +288,7 @@ static int path_lookup( struct fat32_state* state, char* path, uint32_t* dir_clu
 	DEBUG("dir_len is %d\n", dir_len);
 	DEBUG("dir_name is %s\n", dir_name);
 	while(! (*dir_cluster_num >= EOC_MIN && *dir_cluster_num <= EOC_MAX) ){
-	    if (nk_block_dev_read(state->dev, dir_sector, clu_per_sec, dir_data, NK_DEV_REQ_BLOCKING,0,0)) { 
+	    if (nk_bcache_read(state->cache, dir_sector, clu_per_sec, dir_data)) { 
 		ERROR("Failed to read block\n");
 		free_split_path(parts, num_parts);
 		return -1;
@@ -349,7 +349,7 @@ static int path_lookup( struct fat32_state* state, char* path, uint32_t* dir_clu
     
     DEBUG("read file name is %s, ext is %s, ext_size is %d\n", file_name, file_ext, ext_size);
     while(! (*dir_cluster_num >= EOC_MIN && *dir_cluster_num <= EOC_MAX) ){
-	if (nk_block_dev_read(state->dev, dir_sector, clu_per_sec, dir_data, NK_DEV_REQ_BLOCKING,0,0) ) {
+	if (nk_bcache_read(state->cache, dir_sector, clu_per_sec, dir_data) ) {
 	    ERROR("Failed to read block\n");
 	    free_split_path(parts, num_parts);
 	    return -1;
@@ -463,6 +463,7 @@ static int grow_shrink_chain(struct fat32_state* state, uint32_t cluster_entry,
             cluster_entry = next; 
         }
         fat[cluster_entry_cpy] = EOC_MIN;
+        state->chain_gen++;
     
     }
 
@@ -46,6 +46,8 @@ struct fat32_state {
     struct nk_block_dev_characteristics chars; 
     struct nk_block_dev *dev;
     struct nk_fs        *fs;
+    struct nk_bcache    *cache;
+    uint64_t            chain_gen;   // bumped whenever clusters are freed
     struct fat32_bootrecord bootrecord;
     struct fat32_char	table_chars;
 };
@@ -0,0 +1,396 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/thread.h>
+#include <nautilus/smp.h>
+#include <nautilus/tsc.h>
+#include <nautilus/vc.h>
+#include <nautilus/bench.h>
+#include <dev/serial.h>
+
+#define INFO(fmt, args...)  INFO_PRINT("bench: " fmt, ##args)
+#define ERROR(fmt, args...) ERROR_PRINT("bench: " fmt, ##args)
+
+#define DEFAULT_ITERS    1000
+#define DEFAULT_WARMUP   100
+#define OVERHEAD_SAMPLES 1000
+
+// laid out back to back by the linker scripts
+extern const struct nk_bench __start__nk_benchmarks[];
+extern const struct nk_bench __stop__nk_benchmarks[];
+
+#define for_each_bench(b) \
+    for (b = __start__nk_benchmarks; b < __stop__nk_benchmarks; b++)
+
+// one benchmark on one CPU
+struct bench_run {
+    const struct nk_bench *bench;
+    int       cpu;
+    uint64_t  iters;
+    uint64_t  warmup;
+    uint64_t *samples;   // at least OVERHEAD_SAMPLES long
+    uint64_t  overhead;
+    int       rc;
+};
+
+
+static void
+sift_down (uint64_t *a, uint64_t i, uint64_t n)
+{
+    uint64_t c, t;
+
+    while ((c = 2*i + 1) < n) {
+        if (c + 1 < n && a[c + 1] > a[c]) {
+            c++;
+        }
+        if (a[i] >= a[c]) {
+            return;
+        }
+        t = a[i]; a[i] = a[c]; a[c] = t;
+        i = c;
+    }
+}
+
+static void
+sort_samples (uint64_t *a, uint64_t n)
+{
+    uint64_t i, t;
+
+    for (i = n / 2; i > 0; i--) {
+        sift_down(a, i - 1, n);
+    }
+    for (i = n; i > 1; i--) {
+        t = a[0]; a[0] = a[i - 1]; a[i - 1] = t;
+        sift_down(a, 0, i - 1);
+    }
+}
+
+// the p per-mille sample of a sorted array
+static inline uint64_t
+sample_at (uint64_t *a, uint64_t n, uint64_t p)
+{
+    uint64_t i = (n * p + 999) / 1000;
+
+    return a[i ? i - 1 : 0];
+}
+
+
+// median cost of reading the TSC twice in a row, on this CPU
+static uint64_t
+measure_overhead (uint64_t *scratch)
+{
+    uint64_t i, start;
+
+    for (i = 0; i < OVERHEAD_SAMPLES; i++) {
+        start = rdtsc();
+        scratch[i] = rdtsc() - start;
+    }
+
+    sort_samples(scratch, OVERHEAD_SAMPLES);
+
+    return scratch[OVERHEAD_SAMPLES / 2];
+}
+
+
+static inline uint64_t
+run_once (const struct nk_bench *b, struct nk_bench_ctx *ctx)
+{
+    uint64_t start, end;
+
+    if (b->timed_body) {
+        return b->timed_body(ctx);
+    }
+
+    start = rdtsc();
+    b->body(ctx);
+    end = rdtsc() - start;
+
+    return end > ctx->tsc_overhead ? end - ctx->tsc_overhead : 0;
+}
+
+
+static void
+bench_thread (void *in, void **out)
+{
+    struct bench_run *r = (struct bench_run *)in;
+    const struct nk_bench *b = r->bench;
+    struct nk_bench_ctx ctx;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.bench = b;
+    ctx.cpu = my_cpu_id();
+    ctx.tsc_overhead = r->overhead = measure_overhead(r->samples);
+
+    if (b->setup && b->setup(&ctx)) {
+        ERROR("Setup of %s failed on cpu %d\n", b->name, ctx.cpu);
+        r->rc = -1;
+        return;
+    }
+
+    ctx.warmup = 1;
+    for (ctx.iter = 0; ctx.iter < r->warmup; ctx.iter++) {
+        run_once(b, &ctx);
+    }
+
+    ctx.warmup = 0;
+    for (ctx.iter = 0; ctx.iter < r->iters; ctx.iter++) {
+        r->samples[ctx.iter] = run_once(b, &ctx);
+    }
+
+    if (b->teardown) {
+        b->teardown(&ctx);
+    }
+
+    r->rc = 0;
+}
+
+
+static void
+report_header (enum nk_bench_format format)
+{
+    switch (format) {
+    case NK_BENCH_TEXT:
+        nk_vc_printf("%-20s %4s %8s %10s %10s %10s %10s %10s  (cycles, tsc overhead)\n",
+                     "benchmark", "cpu", "iters", "min", "median", "p99", "max", "mean");
+        break;
+    case NK_BENCH_CSV:
+        serial_write("nkbench,name,cpu,iters,warmup,tsc_overhead,min,median,p99,max,mean,unit,tsc_hz\n");
+        break;
+    case NK_BENCH_JSON:
+        break;
+    }
+}
+
+// r->samples are sorted
+static void
+report (struct bench_run *r, enum nk_bench_format format)
+{
+    uint64_t *s = r->samples, n = r->iters, i, sum = 0;
+    char buf[256];
+
+    for (i = 0; i < n; i++) {
+        sum += s[i];
+    }
+
+    switch (format) {
+    case NK_BENCH_TEXT:
+        nk_vc_printf("%-20s %4d %8lu %10lu %10lu %10lu %10lu %10lu  (%lu)\n",
+                     r->bench->name, r->cpu, n, s[0], sample_at(s, n, 500),
+                     sample_at(s, n, 990), s[n - 1], sum / n, r->overhead);
+        return;
+    case NK_BENCH_CSV:
+        snprintf(buf, sizeof(buf), "nkbench,%s,%d,%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu,cycles,%lu\n",
+                 r->bench->name, r->cpu, n, r->warmup, r->overhead, s[0],
+                 sample_at(s, n, 500), sample_at(s, n, 990), s[n - 1], sum / n,
+                 nk_tsc_info.hz);
+        break;
+    case NK_BENCH_JSON:
+        snprintf(buf, sizeof(buf),
+                 "{\"nkbench\":\"%s\",\"cpu\":%d,\"iters\":%lu,\"warmup\":%lu,"
+                 "\"tsc_overhead\":%lu,\"min\":%lu,\"median\":%lu,\"p99\":%lu,"
+                 "\"max\":%lu,\"mean\":%lu,\"unit\":\"cycles\",\"tsc_hz\":%lu}\n",
+                 r->bench->name, r->cpu, n, r->warmup, r->overhead, s[0],
+                 sample_at(s, n, 500), sample_at(s, n, 990), s[n - 1], sum / n,
+                 nk_tsc_info.hz);
+        break;
+    }
+
+    serial_write(buf);
+}
+
+
+static int
+run_one (const struct nk_bench *b, struct nk_bench_config *cfg)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    struct bench_run r;
+    nk_thread_id_t tid;
+    int cpu, any = 0, rc = 0;
+
+    memset(&r, 0, sizeof(r));
+    r.bench  = b;
+    r.iters  = cfg->iters ? cfg->iters : b->iters ? b->iters : DEFAULT_ITERS;
+    r.warmup = cfg->warmup != -1ULL ? cfg->warmup : b->warmup ? b->warmup : DEFAULT_WARMUP;
+
+    r.samples = malloc((r.iters > OVERHEAD_SAMPLES ? r.iters : OVERHEAD_SAMPLES) * sizeof(uint64_t));
+    if (!r.samples) {
+        ERROR("Cannot allocate %lu samples for %s\n", r.iters, b->name);
+        return -1;
+    }
+
+    // one CPU at a time, so that they do not disturb each other
+    for (cpu = 0; cpu < sys->num_cpus; cpu++) {
+        if (!(cfg->cpus[cpu / 64] & (1UL << (cpu % 64)))) {
+            continue;
+        }
+        any = 1;
+        r.cpu = cpu;
+        r.rc = -1;
+        if (nk_thread_start(bench_thread, &r, 0, 0, TSTACK_DEFAULT, &tid, cpu)) {
+            ERROR("Cannot start benchmark thread on cpu %d\n", cpu);
+            rc = -1;
+            continue;
+        }
+        nk_join(tid, 0);
+        if (r.rc) {
+            rc = -1;
+            continue;
+        }
+        sort_samples(r.samples, r.iters);
+        report(&r, cfg->format);
+    }
+
+    if (!any) {
+        ERROR("No CPUs selected\n");
+        rc = -1;
+    }
+
+    free(r.samples);
+
+    return rc;
+}
+
+
+void
+nk_bench_config_init (struct nk_bench_config *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->warmup = -1ULL;
+    cfg->format = NK_BENCH_TEXT;
+}
+
+
+int
+nk_bench_parse_cpus (struct nk_bench_config *cfg, char *list)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    char *p = list;
+    long lo, hi, i;
+
+    memset(cfg->cpus, 0, sizeof(cfg->cpus));
+
+    if (!strcmp(list, "all")) {
+        for (i = 0; i < sys->num_cpus; i++) {
+            cfg->cpus[i / 64] |= 1UL << (i % 64);
+        }
+        return 0;
+    }
+
+    while (*p) {
+        lo = hi = strtol(p, &p, 10);
+        if (*p == '-') {
+            hi = strtol(p + 1, &p, 10);
+        }
+        if (*p == ',') {
+            p++;
+        } else if (*p) {
+            return -1;
+        }
+        if (lo < 0 || hi < lo || hi >= sys->num_cpus) {
+            return -1;
+        }
+        for (i = lo; i <= hi; i++) {
+            cfg->cpus[i / 64] |= 1UL << (i % 64);
+        }
+    }
+
+    return 0;
+}
+
+
+const struct nk_bench *
+nk_bench_find (char *name)
+{
+    const struct nk_bench *b;
+
+    for_each_bench(b) {
+        if (!strcmp(b->name, name)) {
+            return b;
+        }
+    }
+
+    return 0;
+}
+
+
+void
+nk_bench_map (void (*f)(const struct nk_bench *b, void *state), void *state)
+{
+    const struct nk_bench *b;
+
+    for_each_bench(b) {
+        f(b, state);
+    }
+}
+
+
+void
+nk_bench_list (void)
+{
+    const struct nk_bench *b;
+
+    for_each_bench(b) {
+        nk_vc_printf("%-20s %8lu iters %6lu warmup  %s\n", b->name,
+                     b->iters ? b->iters : DEFAULT_ITERS,
+                     b->warmup ? b->warmup : DEFAULT_WARMUP,
+                     b->desc ? b->desc : "");
+    }
+}
+
+
+int
+nk_bench_run (char *name, struct nk_bench_config *cfg)
+{
+    const struct nk_bench *b;
+    int i, empty = 1, rc = 0;
+
+    for (i = 0; i < sizeof(cfg->cpus) / sizeof(cfg->cpus[0]); i++) {
+        empty &= !cfg->cpus[i];
+    }
+    if (empty) {
+        i = my_cpu_id();
+        cfg->cpus[i / 64] |= 1UL << (i % 64);
+    }
+
+    if (strcmp(name, "all") && !nk_bench_find(name)) {
+        ERROR("No benchmark named %s\n", name);
+        return -1;
+    }
+
+    report_header(cfg->format);
+
+    for_each_bench(b) {
+        if (!strcmp(name, "all") || !strcmp(name, b->name)) {
+            if (!b->body == !b->timed_body) {
+                ERROR("%s needs exactly one body, skipping\n", b->name);
+                rc = -1;
+                continue;
+            }
+            rc |= run_one(b, cfg);
+        }
+    }
+
+    if (cfg->format != NK_BENCH_TEXT) {
+        serial_flush();
+        nk_vc_printf("Results written to serial\n");
+    }
+
+    return rc;
+}
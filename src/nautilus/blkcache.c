@@ -0,0 +1,621 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/blkcache.h>
+
+#ifndef NAUT_CONFIG_DEBUG_FILESYSTEM
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif
+
+#define INFO(fmt, args...)  INFO_PRINT("bcache: " fmt, ##args)
+#define ERROR(fmt, args...) ERROR_PRINT("bcache: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("bcache: " fmt, ##args)
+
+#ifndef NAUT_CONFIG_BLOCK_CACHE_KB
+#define NAUT_CONFIG_BLOCK_CACHE_KB 4096
+#endif
+
+#define MIN_BUFS 16
+
+// largest run of dirty blocks written with one request
+#define FLUSH_RUN 64
+
+// a run of misses longer than max_bufs/STREAM_FRAC is streaming
+// data that would only push out the working set, so it is not kept
+#define STREAM_FRAC 8
+
+static nk_mutex_t       cache_list_lock;
+static struct list_head cache_list = LIST_HEAD_INIT(cache_list);
+
+
+static inline struct list_head *
+bucket (struct nk_bcache * c, uint64_t blocknum)
+{
+    return &c->hash[(blocknum * 0x9e3779b97f4a7c15ULL) >> (64 - c->hash_bits)];
+}
+
+
+static struct nk_bcache_buf *
+lookup (struct nk_bcache * c, uint64_t blocknum)
+{
+    struct list_head * h = bucket(c, blocknum);
+    struct nk_bcache_buf * b;
+
+    list_for_each_entry(b, h, hash_node) {
+        if (b->blocknum == blocknum) {
+            return b;
+        }
+    }
+
+    return 0;
+}
+
+
+static inline void
+touch (struct nk_bcache * c, struct nk_bcache_buf * b)
+{
+    list_move(&b->lru_node, &c->lru);
+}
+
+
+static int
+dev_io (struct nk_bcache * c, uint64_t blocknum, uint64_t count, void * buf, int write)
+{
+    int rc;
+
+    if (write) {
+        rc = nk_block_dev_write(c->dev, blocknum * c->dev_per_block, count * c->dev_per_block,
+                                buf, NK_DEV_REQ_BLOCKING, 0, 0);
+        c->stats.dev_writes++;
+    } else {
+        rc = nk_block_dev_read(c->dev, blocknum * c->dev_per_block, count * c->dev_per_block,
+                               buf, NK_DEV_REQ_BLOCKING, 0, 0);
+        __sync_fetch_and_add(&c->stats.dev_reads, 1);  // may be unlocked
+    }
+
+    if (rc) {
+        ERROR("%s: failed to %s %lu blocks at %lu\n", c->name,
+              write ? "write" : "read", count, blocknum);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static inline void
+mark_dirty (struct nk_bcache * c, struct nk_bcache_buf * b)
+{
+    if (!(b->flags & NK_BCACHE_BUF_DIRTY)) {
+        b->flags |= NK_BCACHE_BUF_DIRTY;
+        c->num_dirty++;
+    }
+}
+
+
+static inline void
+mark_clean (struct nk_bcache * c, struct nk_bcache_buf * b)
+{
+    if (b->flags & NK_BCACHE_BUF_DIRTY) {
+        b->flags &= ~NK_BCACHE_BUF_DIRTY;
+        c->num_dirty--;
+        c->stats.writebacks++;
+    }
+}
+
+
+/*
+ * Find a buffer to hold a new block, with the cache locked.
+ * The buffer is returned unhashed and off the LRU list.  The
+ * least recently used unreferenced buffer is reclaimed once we
+ * are at our budget, but if every buffer is referenced, we go
+ * over budget rather than fail.
+ */
+static struct nk_bcache_buf *
+buf_alloc (struct nk_bcache * c)
+{
+    struct nk_bcache_buf * b;
+
+    if (c->num_bufs >= c->max_bufs) {
+        list_for_each_entry_reverse(b, &c->lru, lru_node) {
+            if (b->refcount) {
+                continue;
+            }
+            if ((b->flags & NK_BCACHE_BUF_DIRTY)) {
+                if (dev_io(c, b->blocknum, 1, b->data, 1)) {
+                    continue;
+                }
+                mark_clean(c, b);
+            }
+            if (b->flags & NK_BCACHE_BUF_VALID) {
+                list_del(&b->hash_node);
+                c->stats.evictions++;
+            }
+            b->flags = 0;
+            list_del(&b->lru_node);
+            return b;
+        }
+        DEBUG("%s: all %lu buffers referenced, growing\n", c->name, c->num_bufs);
+    }
+
+    b = malloc(sizeof(*b));
+    if (!b) {
+        ERROR("%s: cannot allocate buffer\n", c->name);
+        return 0;
+    }
+
+    memset(b, 0, sizeof(*b));
+
+    b->data = malloc(c->block_size);
+    if (!b->data) {
+        ERROR("%s: cannot allocate buffer data\n", c->name);
+        free(b);
+        return 0;
+    }
+
+    c->num_bufs++;
+
+    return b;
+}
+
+
+// a buffer we could not fill goes where it will be reused first
+static inline void
+buf_discard (struct nk_bcache * c, struct nk_bcache_buf * b)
+{
+    b->flags = 0;
+    list_add_tail(&b->lru_node, &c->lru);
+}
+
+
+static inline void
+buf_insert (struct nk_bcache * c, struct nk_bcache_buf * b, uint64_t blocknum)
+{
+    b->blocknum = blocknum;
+    b->flags = NK_BCACHE_BUF_VALID;
+    list_add(&b->hash_node, bucket(c, blocknum));
+    list_add(&b->lru_node, &c->lru);
+}
+
+
+// shell sort by block number, the list is rarely more than a few thousand
+static void
+sort_bufs (struct nk_bcache_buf ** a, uint64_t n)
+{
+    struct nk_bcache_buf * t;
+    uint64_t gap, i, j;
+
+    for (gap = n / 2; gap > 0; gap /= 2) {
+        for (i = gap; i < n; i++) {
+            t = a[i];
+            for (j = i; j >= gap && a[j-gap]->blocknum > t->blocknum; j -= gap) {
+                a[j] = a[j-gap];
+            }
+            a[j] = t;
+        }
+    }
+}
+
+
+static int
+flush_locked (struct nk_bcache * c)
+{
+    struct nk_bcache_buf ** dirty;
+    struct nk_bcache_buf * b;
+    uint8_t * bounce;
+    uint64_t n = 0, i, j, k;
+    int rc = 0;
+
+    if (!c->num_dirty) {
+        return 0;
+    }
+
+    dirty = malloc(sizeof(*dirty) * c->num_dirty);
+    bounce = malloc((uint64_t)c->block_size * FLUSH_RUN);
+
+    if (!dirty) {
+        ERROR("%s: cannot allocate flush list\n", c->name);
+        free(bounce);
+        return -1;
+    }
+
+    list_for_each_entry(b, &c->lru, lru_node) {
+        if (b->flags & NK_BCACHE_BUF_DIRTY) {
+            dirty[n++] = b;
+        }
+    }
+
+    sort_bufs(dirty, n);
+
+    for (i = 0; i < n; i = j) {
+        // extend the run while blocks are adjacent
+        for (j = i + 1; bounce && j < n && j - i < FLUSH_RUN &&
+                 dirty[j]->blocknum == dirty[j-1]->blocknum + 1; j++) {
+        }
+
+        if (j - i == 1) {
+            if (dev_io(c, dirty[i]->blocknum, 1, dirty[i]->data, 1)) {
+                rc = -1;
+                continue;
+            }
+        } else {
+            for (k = i; k < j; k++) {
+                memcpy(bounce + (k - i) * c->block_size, dirty[k]->data, c->block_size);
+            }
+            if (dev_io(c, dirty[i]->blocknum, j - i, bounce, 1)) {
+                rc = -1;
+                continue;
+            }
+        }
+
+        for (k = i; k < j; k++) {
+            mark_clean(c, dirty[k]);
+        }
+    }
+
+    DEBUG("%s: flushed %lu blocks\n", c->name, n);
+
+    free(bounce);
+    free(dirty);
+
+    return rc;
+}
+
+
+struct nk_bcache *
+nk_bcache_create (char * name, struct nk_block_dev * dev, uint32_t block_size,
+                  uint64_t size, uint64_t flags)
+{
+    struct nk_block_dev_characteristics chars;
+    struct nk_bcache * c;
+    uint64_t i, nbuckets;
+
+    if (nk_block_dev_get_characteristics(dev, &chars)) {
+        ERROR("Cannot get characteristics of %s\n", dev->dev.name);
+        return 0;
+    }
+
+    if (!block_size || block_size % chars.block_size) {
+        ERROR("Cache block size %u is not a multiple of %s's block size %lu\n",
+              block_size, dev->dev.name, chars.block_size);
+        return 0;
+    }
+
+    c = malloc(sizeof(*c));
+    if (!c) {
+        ERROR("Cannot allocate cache\n");
+        return 0;
+    }
+
+    memset(c, 0, sizeof(*c));
+
+    strncpy(c->name, name, sizeof(c->name) - 1);
+    c->dev = dev;
+    c->flags = flags;
+    c->block_size = block_size;
+    c->dev_per_block = block_size / chars.block_size;
+
+    if (!size) {
+        size = NAUT_CONFIG_BLOCK_CACHE_KB * 1024ULL;
+    }
+    c->max_bufs = size / block_size;
+    if (c->max_bufs < MIN_BUFS) {
+        c->max_bufs = MIN_BUFS;
+    }
+
+    // about two buffers per bucket when full
+    for (c->hash_bits = 4; (1ULL << c->hash_bits) < c->max_bufs / 2; c->hash_bits++) {
+    }
+    nbuckets = 1ULL << c->hash_bits;
+
+    c->hash = malloc(sizeof(struct list_head) * nbuckets);
+    if (!c->hash) {
+        ERROR("Cannot allocate hash table\n");
+        free(c);
+        return 0;
+    }
+
+    for (i = 0; i < nbuckets; i++) {
+        INIT_LIST_HEAD(&c->hash[i]);
+    }
+
+    INIT_LIST_HEAD(&c->lru);
+    nk_mutex_init(&c->lock);
+
+    nk_mutex_lock(&cache_list_lock);
+    list_add_tail(&c->cache_node, &cache_list);
+    nk_mutex_unlock(&cache_list_lock);
+
+    INFO("%s: %lu x %u byte buffers on %s, %s\n", c->name, c->max_bufs, block_size,
+         dev->dev.name, flags & NK_BCACHE_WRITE_THROUGH ? "write-through" : "write-back");
+
+    return c;
+}
+
+
+int
+nk_bcache_destroy (struct nk_bcache * c)
+{
+    struct nk_bcache_buf * b, * n;
+    int rc;
+
+    nk_mutex_lock(&cache_list_lock);
+    list_del(&c->cache_node);
+    nk_mutex_unlock(&cache_list_lock);
+
+    nk_mutex_lock(&c->lock);
+
+    rc = flush_locked(c);
+
+    list_for_each_entry_safe(b, n, &c->lru, lru_node) {
+        if (b->refcount) {
+            ERROR("%s: destroying referenced block %lu\n", c->name, b->blocknum);
+        }
+        list_del(&b->lru_node);
+        free(b->data);
+        free(b);
+    }
+
+    nk_mutex_unlock(&c->lock);
+
+    free(c->hash);
+    free(c);
+
+    return rc;
+}
+
+
+struct nk_bcache_buf *
+nk_bcache_get (struct nk_bcache * c, uint64_t blocknum)
+{
+    struct nk_bcache_buf * b;
+
+    nk_mutex_lock(&c->lock);
+
+    b = lookup(c, blocknum);
+
+    if (b) {
+        c->stats.hits++;
+        touch(c, b);
+    } else {
+        c->stats.misses++;
+        b = buf_alloc(c);
+        if (!b) {
+            nk_mutex_unlock(&c->lock);
+            return 0;
+        }
+        if (dev_io(c, blocknum, 1, b->data, 0)) {
+            buf_discard(c, b);
+            nk_mutex_unlock(&c->lock);
+            return 0;
+        }
+        buf_insert(c, b, blocknum);
+    }
+
+    b->refcount++;
+
+    nk_mutex_unlock(&c->lock);
+
+    return b;
+}
+
+
+int
+nk_bcache_put (struct nk_bcache * c, struct nk_bcache_buf * b, int dirty)
+{
+    int rc = 0;
+
+    nk_mutex_lock(&c->lock);
+
+    if (dirty) {
+        if (c->flags & NK_BCACHE_WRITE_THROUGH) {
+            rc = dev_io(c, b->blocknum, 1, b->data, 1);
+        } else {
+            mark_dirty(c, b);
+        }
+    }
+
+    ASSERT(b->refcount);
+    b->refcount--;
+
+    if (c->num_dirty > c->max_bufs / 2) {
+        rc |= flush_locked(c);
+    }
+
+    nk_mutex_unlock(&c->lock);
+
+    return rc;
+}
+
+
+int
+nk_bcache_read (struct nk_bcache * c, uint64_t blocknum, uint64_t count, void * dest)
+{
+    struct nk_bcache_buf * b;
+    uint8_t * d = (uint8_t *)dest;
+    uint64_t i, j, n;
+    uint64_t wgen;
+    int rc;
+
+    nk_mutex_lock(&c->lock);
+
+    for (i = 0; i < count; i += n) {
+        b = lookup(c, blocknum + i);
+        if (b) {
+            memcpy(d + i * c->block_size, b->data, c->block_size);
+            touch(c, b);
+            c->stats.hits++;
+            n = 1;
+            continue;
+        }
+
+        // read a run of misses straight into the caller's buffer,
+        // without the lock, so that other readers can proceed
+        for (n = 1; i + n < count && !lookup(c, blocknum + i + n); n++) {
+        }
+
+        c->stats.misses += n;
+        wgen = c->wgen;
+
+        nk_mutex_unlock(&c->lock);
+        rc = dev_io(c, blocknum + i, n, d + i * c->block_size, 0);
+        nk_mutex_lock(&c->lock);
+
+        // nothing from a failed read is cached
+        if (rc) {
+            nk_mutex_unlock(&c->lock);
+            return -1;
+        }
+
+        // a write while we were reading may have beaten our data to
+        // the device, in which case what we have may be stale
+        if (n > c->max_bufs / STREAM_FRAC || c->wgen != wgen) {
+            continue;
+        }
+
+        for (j = 0; j < n; j++) {
+            if (lookup(c, blocknum + i + j)) {
+                // someone else brought it in meanwhile
+                continue;
+            }
+            if (!(b = buf_alloc(c))) {
+                break;
+            }
+            memcpy(b->data, d + (i + j) * c->block_size, c->block_size);
+            buf_insert(c, b, blocknum + i + j);
+        }
+    }
+
+    nk_mutex_unlock(&c->lock);
+
+    return 0;
+}
+
+
+int
+nk_bcache_write (struct nk_bcache * c, uint64_t blocknum, uint64_t count, void * src)
+{
+    struct nk_bcache_buf * b;
+    uint8_t * s = (uint8_t *)src;
+    int wt = c->flags & NK_BCACHE_WRITE_THROUGH;
+    uint64_t i;
+    int rc = 0;
+
+    nk_mutex_lock(&c->lock);
+
+    c->wgen++;
+
+    if (!wt && count > c->max_bufs / STREAM_FRAC) {
+        // streaming, so like a long read miss, it goes around the cache,
+        // after which any copies we have match the device
+        rc = dev_io(c, blocknum, count, src, 1);
+        for (i = 0; !rc && i < count; i++) {
+            if ((b = lookup(c, blocknum + i))) {
+                memcpy(b->data, s + i * c->block_size, c->block_size);
+                if (b->flags & NK_BCACHE_BUF_DIRTY) {
+                    b->flags &= ~NK_BCACHE_BUF_DIRTY;
+                    c->num_dirty--;
+                }
+            }
+        }
+        nk_mutex_unlock(&c->lock);
+        return rc;
+    }
+
+    for (i = 0; i < count; i++) {
+        b = lookup(c, blocknum + i);
+        if (b) {
+            touch(c, b);
+        } else if ((b = buf_alloc(c))) {
+            // the whole block is overwritten, so there is nothing to read
+            buf_insert(c, b, blocknum + i);
+        } else if (wt) {
+            // the device write below is all that matters
+            continue;
+        } else {
+            nk_mutex_unlock(&c->lock);
+            return -1;
+        }
+        memcpy(b->data, s + i * c->block_size, c->block_size);
+        if (!wt) {
+            mark_dirty(c, b);
+        }
+    }
+
+    if (wt) {
+        rc = dev_io(c, blocknum, count, src, 1);
+    } else if (c->num_dirty > c->max_bufs / 2) {
+        rc = flush_locked(c);
+    }
+
+    nk_mutex_unlock(&c->lock);
+
+    return rc;
+}
+
+
+int
+nk_bcache_flush (struct nk_bcache * c)
+{
+    int rc;
+
+    nk_mutex_lock(&c->lock);
+    rc = flush_locked(c);
+    nk_mutex_unlock(&c->lock);
+
+    return rc;
+}
+
+
+int
+nk_bcache_flush_all (void)
+{
+    struct nk_bcache * c;
+    int rc = 0;
+
+    nk_mutex_lock(&cache_list_lock);
+    list_for_each_entry(c, &cache_list, cache_node) {
+        rc |= nk_bcache_flush(c);
+    }
+    nk_mutex_unlock(&cache_list_lock);
+
+    return rc;
+}
+
+
+void
+nk_bcache_dump (void)
+{
+    struct nk_bcache * c;
+    uint64_t lookups;
+
+    nk_mutex_lock(&cache_list_lock);
+    list_for_each_entry(c, &cache_list, cache_node) {
+        lookups = c->stats.hits + c->stats.misses;
+        nk_vc_printf("%s: dev %s, %u byte blocks, %lu/%lu buffers, %lu dirty, %s\n",
+                     c->name, c->dev->dev.name, c->block_size, c->num_bufs, c->max_bufs,
+                     c->num_dirty, c->flags & NK_BCACHE_WRITE_THROUGH ? "write-through" : "write-back");
+        nk_vc_printf("  hits=%lu misses=%lu (%lu%% hit) evictions=%lu writebacks=%lu dev_reads=%lu dev_writes=%lu\n",
+                     c->stats.hits, c->stats.misses, lookups ? c->stats.hits * 100 / lookups : 0,
+                     c->stats.evictions, c->stats.writebacks, c->stats.dev_reads, c->stats.dev_writes);
+    }
+    nk_mutex_unlock(&cache_list_lock);
+}
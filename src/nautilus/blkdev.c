@@ -90,9 +90,23 @@ int nk_block_dev_get_characteristics(struct nk_block_dev *dev, struct nk_block_d
     return di->get_characteristics(d->state,c);
 }
 
-void generic_callback(void *context)
+struct generic_completion {
+    volatile int done;
+    int          status;
+};
+
+void generic_callback(void *context, int status)
 {
-    *(volatile uint64_t *)context = 1;
+    struct generic_completion *c = (struct generic_completion *)context;
+
+    c->status = status;
+    __sync_synchronize();
+    c->done = 1;
+}
+
+static int generic_check(void *context)
+{
+    return ((struct generic_completion *)context)->done;
 }
 
 
@@ -101,7 +115,7 @@ int nk_block_dev_read(struct nk_block_dev *dev,
 		      uint64_t count, 
 		      void *dest, 
 		      nk_dev_request_type_t type,
-		      void (*callback)(void *state),
+		      void (*callback)(void *state, int status),
 		      void *state)
 {
     struct nk_dev *d = (struct nk_dev *)(&(dev->dev));
@@ -122,7 +136,7 @@ int nk_block_dev_read(struct nk_block_dev *dev,
 	    DEBUG("readblocks is not possible\n");
 	    return -1;
 	} else {
-	    volatile uint64_t completion = 0;
+	    struct generic_completion completion = { 0, 0 };
 	    
 	    if (type==NK_DEV_REQ_NONBLOCKING) {
 		if (di->read_blocks(d->state,blocknum,count,dest,0,0)) {
@@ -138,8 +152,12 @@ int nk_block_dev_read(struct nk_block_dev *dev,
 		    return -1;
 		} else {
 		    DEBUG("readblocks started, waiting for completion\n");
-		    while (!completion) { 
-			nk_dev_wait((struct nk_dev *)d);
+		    while (!completion.done) { 
+			nk_dev_wait_cond((struct nk_dev *)d, generic_check, (void*)&completion);
+		    }
+		    if (completion.status) {
+			ERROR("readblocks failed\n");
+			return -1;
 		    }
 		    return 0;
 		}
@@ -158,7 +176,7 @@ int nk_block_dev_write(struct nk_block_dev *dev,
 		       uint64_t count, 
 		       void     *src,  
 		       nk_dev_request_type_t type,
-		       void (*callback)(void *state),
+		       void (*callback)(void *state, int status),
 		       void *state)
 {
     struct nk_dev *d = (struct nk_dev *)(&(dev->dev));
@@ -179,7 +197,7 @@ int nk_block_dev_write(struct nk_block_dev *dev,
 	    DEBUG("writeblocks is not possible\n");
 	    return -1;
 	} else {
-	    volatile uint64_t completion = 0;
+	    struct generic_completion completion = { 0, 0 };
 	    
 	    if (type==NK_DEV_REQ_NONBLOCKING) {
 		if (di->write_blocks(d->state,blocknum,count,src,0,0)) {
@@ -195,8 +213,12 @@ int nk_block_dev_write(struct nk_block_dev *dev,
 		    return -1;
 		} else {
 		    DEBUG("writeblocks started, waiting for completion\n");
-		    while (!completion) { 
-			nk_dev_wait((struct nk_dev *)d);
+		    while (!completion.done) { 
+			nk_dev_wait_cond((struct nk_dev *)d, generic_check, (void*)&completion);
+		    }
+		    if (completion.status) {
+			ERROR("writeblocks failed\n");
+			return -1;
 		    }
 		    return 0;
 		}
@@ -0,0 +1,307 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/brlock.h>
+#include <nautilus/thread.h>
+#include <nautilus/scheduler.h>
+#include <nautilus/numa.h>
+#include <nautilus/irq.h>
+#include <nautilus/errno.h>
+#include <nautilus/mm.h>
+#include <nautilus/tsc.h>
+
+#ifndef NAUT_CONFIG_DEBUG_SYNCH
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif
+
+#define INFO(fmt, args...)  INFO_PRINT("brlock: " fmt, ##args)
+#define ERROR(fmt, args...) ERROR_PRINT("brlock: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("brlock: " fmt, ##args)
+
+// how long a blocking writer spins on draining readers before it
+// starts yielding the CPU to them
+#define WRITER_SPIN_NS 20000ULL
+
+extern void nk_yield(void);
+extern void nk_simple_timing_loop(uint64_t iter_count);
+
+
+int
+nk_brlock_init (nk_brlock_t * l, int flags)
+{
+    int n;
+
+    memset(l, 0, sizeof(*l));
+
+    n = (flags & NK_BRLOCK_PER_NODE) ? nk_get_num_domains() : nk_get_num_cpus();
+    if (n < 1) {
+        n = 1;
+    }
+
+    // over-allocate so the counters can be cache-line aligned
+    l->readers_mem = malloc((n + 1) * sizeof(struct nk_brlock_reader));
+    if (!l->readers_mem) {
+        ERROR("Failed to allocate %d reader counters\n", n);
+        return -ENOMEM;
+    }
+
+    l->readers = (struct nk_brlock_reader *)
+        (((addr_t)l->readers_mem + sizeof(struct nk_brlock_reader) - 1) &
+         ~(addr_t)(sizeof(struct nk_brlock_reader) - 1));
+
+    memset(l->readers, 0, n * sizeof(struct nk_brlock_reader));
+
+    l->nslots = n;
+    l->flags = flags;
+
+    nk_ticket_lock_init(&l->wticket);
+    nk_mutex_init(&l->wmutex);
+    INIT_LIST_HEAD(&l->waitq.queue);
+    spinlock_init(&l->waitq.lock);
+
+    DEBUG("brlock init (%p) with %d %s counters%s\n", l, n,
+          (flags & NK_BRLOCK_PER_NODE) ? "domain" : "cpu",
+          (flags & NK_BRLOCK_BLOCKING) ? ", blocking" : "");
+
+    return 0;
+}
+
+
+int
+nk_brlock_deinit (nk_brlock_t * l)
+{
+    if (l->writer) {
+        ERROR("Destroying write-held brlock %p\n", l);
+        return -EINVAL;
+    }
+    free(l->readers_mem);
+    memset(l, 0, sizeof(*l));
+    return 0;
+}
+
+
+static inline struct nk_brlock_reader *
+my_slot (nk_brlock_t * l)
+{
+    unsigned i;
+
+    if (l->flags & NK_BRLOCK_PER_NODE) {
+        i = nk_my_numa_node();
+    } else {
+        i = my_cpu_id();
+    }
+
+    return &l->readers[i % l->nslots];
+}
+
+
+// sum of all reader counters, only zero when there are no readers
+static inline sint64_t
+reader_count (nk_brlock_t * l)
+{
+    sint64_t sum = 0;
+    int i;
+
+    for (i = 0; i < l->nslots; i++) {
+        sum += l->readers[i].count;
+    }
+
+    return sum;
+}
+
+
+static int
+writer_gone (void * state)
+{
+    return !((nk_brlock_t *)state)->writer;
+}
+
+
+void
+nk_brlock_rd_lock (nk_brlock_t * l)
+{
+    struct nk_brlock_reader * r;
+    uint8_t flags;
+
+    NK_PROFILE_ENTRY();
+
+    while (1) {
+        // the increment and the back-off must hit the same counter,
+        // so we cannot migrate between them
+        flags = irq_disable_save();
+        r = my_slot(l);
+        // full barrier: our increment is visible before we look for a writer
+        __sync_fetch_and_add(&r->count, 1);
+        if (likely(!l->writer)) {
+            irq_enable_restore(flags);
+            break;
+        }
+        // writer preference - get out of its way
+        __sync_fetch_and_sub(&r->count, 1);
+        irq_enable_restore(flags);
+
+        if (l->flags & NK_BRLOCK_BLOCKING) {
+            nk_thread_queue_sleep_extended(&l->waitq, writer_gone, l);
+        } else {
+            while (l->writer) {
+                asm volatile ("pause");
+            }
+        }
+    }
+
+    NK_PROFILE_EXIT();
+}
+
+
+void
+nk_brlock_rd_unlock (nk_brlock_t * l)
+{
+    uint8_t flags;
+
+    NK_PROFILE_ENTRY();
+
+    flags = irq_disable_save();
+    __sync_fetch_and_sub(&my_slot(l)->count, 1);
+    irq_enable_restore(flags);
+
+    NK_PROFILE_EXIT();
+}
+
+
+void
+nk_brlock_wr_lock (nk_brlock_t * l)
+{
+    uint64_t limit = 0;
+
+    NK_PROFILE_ENTRY();
+
+    if (l->flags & NK_BRLOCK_BLOCKING) {
+        nk_mutex_lock(&l->wmutex);
+        limit = rdtsc() + nk_tsc_ns_to_cycles(WRITER_SPIN_NS);
+    } else {
+        nk_ticket_lock(&l->wticket);
+    }
+
+    // full barrier: new readers see us before we look at the counters
+    __sync_lock_test_and_set(&l->writer, 1);
+
+    // only readers already inside can hold us up, so this is bounded
+    // by the longest read-side critical section in progress
+    while (reader_count(l)) {
+        if (limit && rdtsc() > limit) {
+            nk_yield();
+        } else {
+            asm volatile ("pause");
+        }
+    }
+
+    NK_PROFILE_EXIT();
+}
+
+
+void
+nk_brlock_wr_unlock (nk_brlock_t * l)
+{
+    NK_PROFILE_ENTRY();
+
+    __sync_lock_release(&l->writer);
+
+    if (l->flags & NK_BRLOCK_BLOCKING) {
+        nk_thread_queue_wake_all(&l->waitq);
+        nk_mutex_unlock(&l->wmutex);
+    } else {
+        nk_ticket_unlock(&l->wticket);
+    }
+
+    NK_PROFILE_EXIT();
+}
+
+
+/*
+ * Readers and writers on every CPU; writers keep two values equal
+ * and readers check that they never observe them torn.
+ */
+#define TEST_ITERS 10000
+
+static struct {
+    nk_brlock_t       lock;
+    volatile uint64_t a;
+    volatile uint64_t b;
+    volatile uint64_t errors;
+} test;
+
+static void
+test_func (void * in, void ** out)
+{
+    int writer = (int)(uint64_t)in;
+    uint64_t a, b;
+    int i;
+
+    for (i = 0; i < TEST_ITERS; i++) {
+        if (writer && !(i % 16)) {
+            nk_brlock_wr_lock(&test.lock);
+            test.a++;
+            nk_simple_timing_loop(10);
+            test.b++;
+            nk_brlock_wr_unlock(&test.lock);
+        } else {
+            nk_brlock_rd_lock(&test.lock);
+            a = test.a;
+            nk_simple_timing_loop(10);
+            b = test.b;
+            nk_brlock_rd_unlock(&test.lock);
+            if (a != b) {
+                __sync_fetch_and_add(&test.errors, 1);
+            }
+        }
+    }
+}
+
+
+void
+nk_brlock_test (void)
+{
+    int ncpus = nk_get_num_cpus();
+    nk_thread_id_t t[ncpus];
+    int flags, i;
+
+    for (flags = 0; flags <= (NK_BRLOCK_PER_NODE | NK_BRLOCK_BLOCKING); flags++) {
+        if (nk_brlock_init(&test.lock, flags)) {
+            return;
+        }
+
+        test.a = test.b = test.errors = 0;
+
+        for (i = 0; i < ncpus; i++) {
+            nk_thread_start(test_func, (void*)(uint64_t)(i & 1), NULL, 0, TSTACK_DEFAULT, &t[i], i);
+        }
+
+        for (i = 0; i < ncpus; i++) {
+            nk_join(t[i], NULL);
+        }
+
+        nk_vc_printf("brlock test (flags=%x): %lu writes, %lu errors - %s\n",
+                     flags, test.a, test.errors,
+                     (test.errors || test.a != test.b) ? "FAILED" : "passed");
+
+        nk_brlock_deinit(&test.lock);
+    }
+}
@@ -144,14 +144,18 @@ uint64_t nk_char_dev_write(struct nk_char_dev *dev,
     switch (type) {
     case NK_DEV_REQ_BLOCKING:
     case NK_DEV_REQ_NONBLOCKING:
-	if (!di->write) { 
+	if (!di->write && !di->write_buf) { 
 	    DEBUG("write not possible\n");
 	    return -1;
 	} else {
 	    uint64_t num=0;
 	    int err;
 	    while (num<count) {
-		err = di->write(d->state,src);
+		if (di->write_buf) {
+		    err = di->write_buf(d->state,src,count-num);
+		} else {
+		    err = di->write(d->state,src);
+		}
 		if (err < 0) { 
 		    return -1;
 		} else if (err==0) { 
@@ -161,8 +165,8 @@ uint64_t nk_char_dev_write(struct nk_char_dev *dev,
 			nk_dev_wait((struct nk_dev *)dev);
 		    }
 		} else {
-		    num++;
-		    src++;
+		    num+=err;
+		    src+=err;
 		}
 	    }
 	    return num;
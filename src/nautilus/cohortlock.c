@@ -0,0 +1,233 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/cohortlock.h>
+#include <nautilus/numa.h>
+
+#ifndef NAUT_CONFIG_DEBUG_SYNCH
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif
+
+#define ERROR(fmt, args...) ERROR_PRINT("cohortlock: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("cohortlock: " fmt, ##args)
+
+// queue nodes per CPU - one for each lock a CPU's threads can be
+// acquiring or holding at once (nesting, interrupts, preempted holders)
+#define QNODES_PER_CPU 8
+
+#define QNODE_WAIT   0
+#define QNODE_LOCAL  1   // lock passed within the cohort, global lock inherited
+#define QNODE_GLOBAL 2   // head of the local queue, must take the global lock
+
+static struct qnode_pool {
+    volatile uint64_t      busy;
+    struct nk_cohort_qnode node[QNODES_PER_CPU];
+} __align(64) pools[NAUT_CONFIG_MAX_CPUS];
+
+
+// null if every node is in use, which can happen when threads
+// preempted while holding or waiting on cohort locks pile up on one
+// CPU.  Waiting for one of them to run again could wait forever if
+// interrupts are off, so the caller goes without a node instead.
+static struct nk_cohort_qnode *
+qnode_alloc (void)
+{
+    uint32_t cpu = my_cpu_id();
+    struct qnode_pool * p = &pools[cpu];
+    uint64_t bit;
+    int i;
+
+    for (i = 0; i < QNODES_PER_CPU; i++) {
+        bit = 1ULL << i;
+        if (!(p->busy & bit) && !(__sync_fetch_and_or(&p->busy, bit) & bit)) {
+            p->node[i].cpu = cpu;
+            p->node[i].slot = i;
+            return &p->node[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+static inline void
+qnode_free (struct nk_cohort_qnode * n)
+{
+    // may run on a CPU other than the node's if the holder migrated
+    __sync_fetch_and_and(&pools[n->cpu].busy, ~(1ULL << n->slot));
+}
+
+
+static inline unsigned
+my_domain (void)
+{
+    struct numa_domain * d = per_cpu_get(domain);
+
+    return d ? d->id % NK_COHORT_DOMAINS : 0;
+}
+
+
+static inline void
+global_lock (nk_cohort_lock_t * l)
+{
+    while (__sync_lock_test_and_set(&l->global, 1)) {
+        PAUSE_WHILE(l->global);
+    }
+}
+
+
+void
+nk_cohort_lock_init (nk_cohort_lock_t * l)
+{
+    memset((void*)l, 0, sizeof(*l));
+}
+
+
+void
+nk_cohort_lock_deinit (nk_cohort_lock_t * l)
+{
+    if (l->global) {
+        ERROR("Destroying held cohort lock %p\n", l);
+    }
+    memset((void*)l, 0, sizeof(*l));
+}
+
+
+void
+nk_cohort_lock (nk_cohort_lock_t * l)
+{
+    struct nk_cohort_qnode * me = qnode_alloc();
+    struct nk_cohort_qnode * pred;
+
+    NK_PROFILE_ENTRY();
+
+    if (!me) {
+        // no node, so skip the local queues and contend for the
+        // global lock directly, as the head of a queue does
+        global_lock(l);
+        l->owner = NULL;
+        NK_PROFILE_EXIT();
+        return;
+    }
+
+    me->next = NULL;
+    me->status = QNODE_WAIT;
+    me->domain = my_domain();
+
+    pred = __sync_lock_test_and_set(&l->tail[me->domain], me);
+
+    if (pred) {
+        pred->next = me;
+        PAUSE_WHILE(me->status == QNODE_WAIT);
+        if (me->status == QNODE_LOCAL) {
+            l->owner = me;
+            NK_PROFILE_EXIT();
+            return;
+        }
+    }
+
+    // head of our cohort
+    global_lock(l);
+    l->batch = 0;
+    l->owner = me;
+
+    NK_PROFILE_EXIT();
+}
+
+
+int
+nk_cohort_trylock (nk_cohort_lock_t * l)
+{
+    struct nk_cohort_qnode * me;
+
+    if (l->global || __sync_lock_test_and_set(&l->global, 1)) {
+        return -1;
+    }
+
+    me = qnode_alloc();
+    if (!me) {
+        // without a node we cannot check for a local heir
+        __sync_lock_release(&l->global);
+        return -1;
+    }
+
+    me->next = NULL;
+    me->status = QNODE_GLOBAL;
+    me->domain = my_domain();
+
+    // the global lock is ours, but a local waiter could be about to
+    // inherit it from the previous holder - back off if so
+    if (!__sync_bool_compare_and_swap(&l->tail[me->domain], NULL, me)) {
+        qnode_free(me);
+        __sync_lock_release(&l->global);
+        return -1;
+    }
+
+    l->batch = 0;
+    l->owner = me;
+
+    return 0;
+}
+
+
+void
+nk_cohort_unlock (nk_cohort_lock_t * l)
+{
+    struct nk_cohort_qnode * me = l->owner;
+    struct nk_cohort_qnode * next;
+
+    NK_PROFILE_ENTRY();
+
+    if (!me) {
+        // taken without a node, so there is no one to hand off to
+        __sync_lock_release(&l->global);
+        NK_PROFILE_EXIT();
+        return;
+    }
+
+    next = me->next;
+
+    if (!next) {
+        if (__sync_bool_compare_and_swap(&l->tail[me->domain], me, NULL)) {
+            // nobody waiting locally
+            __sync_lock_release(&l->global);
+            qnode_free(me);
+            NK_PROFILE_EXIT();
+            return;
+        }
+        // a local waiter is between the swap and linking in
+        PAUSE_WHILE(!(next = me->next));
+    }
+
+    if (l->batch < NK_COHORT_BATCH) {
+        l->batch++;
+        asm volatile ("" ::: "memory");
+        next->status = QNODE_LOCAL;
+    } else {
+        // give other domains a turn
+        __sync_lock_release(&l->global);
+        next->status = QNODE_GLOBAL;
+    }
+
+    qnode_free(me);
+
+    NK_PROFILE_EXIT();
+}
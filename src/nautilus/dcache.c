@@ -0,0 +1,443 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/fs.h>
+#include <nautilus/dcache.h>
+
+#ifndef NAUT_CONFIG_DEBUG_FILESYSTEM
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif
+
+#define INFO(fmt, args...)  INFO_PRINT("dcache: " fmt, ##args)
+#define ERROR(fmt, args...) ERROR_PRINT("dcache: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("dcache: " fmt, ##args)
+
+#ifndef NAUT_CONFIG_FS_DCACHE_ENTRIES
+#define NAUT_CONFIG_FS_DCACHE_ENTRIES 1024
+#endif
+
+#define MIN_ENTRIES 16
+
+// names and attributes share the table and the LRU list
+#define DC_NAME 0   // key is the directory's ino, value is an ino, 0 if absent
+#define DC_ATTR 1   // key is the ino itself, value is its stat
+
+struct dc_entry {
+    uint32_t          kind;
+    uint32_t          hash;
+    uint64_t          key;
+    union {
+        uint64_t          ino;
+        struct nk_fs_stat st;
+    };
+    struct list_head  hash_node;
+    struct list_head  lru_node;
+    char              name[NK_DCACHE_NAME_LEN];
+};
+
+
+static uint32_t
+hash (uint32_t kind, uint64_t key, char * name)
+{
+    uint64_t h = 0xcbf29ce484222325ULL ^ kind;
+
+    while (*name) {
+        h = (h ^ (uint8_t)*name++) * 0x100000001b3ULL;
+    }
+
+    h ^= key * 0x9e3779b97f4a7c15ULL;
+
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+
+static inline struct list_head *
+bucket (struct nk_fs_dcache * c, uint32_t h)
+{
+    return &c->hash[(h * 0x9e3779b9U) >> (32 - c->hash_bits)];
+}
+
+
+static struct dc_entry *
+lookup (struct nk_fs_dcache * c, uint32_t kind, uint64_t key, char * name, uint32_t h)
+{
+    struct dc_entry * e;
+
+    list_for_each_entry(e, bucket(c, h), hash_node) {
+        if (e->hash == h && e->kind == kind && e->key == key && !strcmp(e->name, name)) {
+            return e;
+        }
+    }
+
+    return 0;
+}
+
+
+static inline void
+drop (struct nk_fs_dcache * c, struct dc_entry * e)
+{
+    list_del(&e->hash_node);
+    list_del(&e->lru_node);
+    c->num_entries--;
+    free(e);
+}
+
+
+// with the cache locked, returns a hashed entry the caller fills in
+static struct dc_entry *
+insert (struct nk_fs_dcache * c, uint32_t kind, uint64_t key, char * name, uint32_t h)
+{
+    struct dc_entry * e;
+
+    if (c->num_entries >= c->max_entries) {
+        // recycle the least recently used
+        e = list_entry(c->lru.prev, struct dc_entry, lru_node);
+        list_del(&e->hash_node);
+        list_del(&e->lru_node);
+        c->stats.evictions++;
+    } else {
+        e = malloc(sizeof(*e));
+        if (!e) {
+            return 0;
+        }
+        c->num_entries++;
+    }
+
+    memset(e, 0, sizeof(*e));
+
+    e->kind = kind;
+    e->hash = h;
+    e->key = key;
+    strcpy(e->name, name);
+
+    list_add(&e->hash_node, bucket(c, h));
+    list_add(&e->lru_node, &c->lru);
+
+    return e;
+}
+
+
+struct nk_fs_dcache *
+nk_fs_dcache_create (struct nk_fs * fs, uint64_t max_entries)
+{
+    struct nk_fs_dcache * c;
+    uint64_t i;
+
+    if (!max_entries) {
+        max_entries = NAUT_CONFIG_FS_DCACHE_ENTRIES;
+    }
+
+    if (max_entries < MIN_ENTRIES) {
+        max_entries = MIN_ENTRIES;
+    }
+
+    c = malloc(sizeof(*c));
+
+    if (!c) {
+        ERROR("Cannot allocate cache for %s\n", fs->name);
+        return 0;
+    }
+
+    memset(c, 0, sizeof(*c));
+
+    c->fs = fs;
+    c->max_entries = max_entries;
+
+    if (fs->interface->root(fs->state, &c->root)) {
+        ERROR("Cannot find root of %s\n", fs->name);
+        free(c);
+        return 0;
+    }
+
+    // about two entries per bucket when full
+    for (c->hash_bits = 4; (1ULL << c->hash_bits) < max_entries / 2; c->hash_bits++) {}
+
+    c->hash = malloc(sizeof(struct list_head) << c->hash_bits);
+
+    if (!c->hash) {
+        ERROR("Cannot allocate hash table for %s\n", fs->name);
+        free(c);
+        return 0;
+    }
+
+    for (i = 0; i < (1ULL << c->hash_bits); i++) {
+        INIT_LIST_HEAD(&c->hash[i]);
+    }
+
+    INIT_LIST_HEAD(&c->lru);
+    nk_mutex_init(&c->lock);
+
+    DEBUG("created cache for %s with %lu entries and %lu buckets\n",
+          fs->name, c->max_entries, 1ULL << c->hash_bits);
+
+    return c;
+}
+
+
+void
+nk_fs_dcache_destroy (struct nk_fs_dcache * c)
+{
+    nk_fs_dcache_purge(c);
+    nk_mutex_deinit(&c->lock);
+    free(c->hash);
+    free(c);
+}
+
+
+// one component, through the cache
+static int
+resolve_one (struct nk_fs_dcache * c, uint64_t dir, char * name, uint64_t * ino)
+{
+    struct nk_fs_int * fi = c->fs->interface;
+    int cacheable = strlen(name) < NK_DCACHE_NAME_LEN;
+    uint32_t h = 0;
+    struct dc_entry * e;
+    uint64_t gen = 0;
+    int rc;
+
+    if (cacheable) {
+        h = hash(DC_NAME, dir, name);
+
+        nk_mutex_lock(&c->lock);
+
+        e = lookup(c, DC_NAME, dir, name, h);
+
+        if (e) {
+            list_move(&e->lru_node, &c->lru);
+            *ino = e->ino;
+            if (e->ino) {
+                c->stats.hits++;
+            } else {
+                c->stats.neg_hits++;
+            }
+            nk_mutex_unlock(&c->lock);
+            return *ino ? 0 : 1;
+        }
+
+        c->stats.misses++;
+        gen = c->gen;
+
+        nk_mutex_unlock(&c->lock);
+    }
+
+    rc = fi->lookup(c->fs->state, dir, name, ino);
+
+    if (rc < 0) {
+        ERROR("Lookup of %s in %lx on %s failed\n", name, dir, c->fs->name);
+        return -1;
+    }
+
+    if (cacheable) {
+        nk_mutex_lock(&c->lock);
+        if (c->gen == gen && !lookup(c, DC_NAME, dir, name, h)) {
+            e = insert(c, DC_NAME, dir, name, h);
+            if (e) {
+                e->ino = rc ? 0 : *ino;
+            }
+        }
+        nk_mutex_unlock(&c->lock);
+    }
+
+    return rc;
+}
+
+
+int
+nk_fs_dcache_resolve (struct nk_fs_dcache * c, char * path, uint64_t * ino)
+{
+    char name[strlen(path) + 1];
+    uint64_t cur = c->root;
+    char * p = path;
+    int len;
+    int rc;
+
+    while (1) {
+        while (*p == '/') {
+            p++;
+        }
+
+        if (!*p) {
+            break;
+        }
+
+        for (len = 0; p[len] && p[len] != '/'; len++) {}
+
+        memcpy(name, p, len);
+        name[len] = 0;
+        p += len;
+
+        rc = resolve_one(c, cur, name, &cur);
+
+        if (rc) {
+            DEBUG("%s does not resolve at %s (rc=%d)\n", path, name, rc);
+            return rc;
+        }
+    }
+
+    DEBUG("%s resolves to %lx\n", path, cur);
+
+    *ino = cur;
+
+    return 0;
+}
+
+
+int
+nk_fs_dcache_stat (struct nk_fs_dcache * c, uint64_t ino, struct nk_fs_stat * st)
+{
+    struct nk_fs_int * fi = c->fs->interface;
+    uint32_t h = hash(DC_ATTR, ino, "");
+    struct dc_entry * e;
+    uint64_t gen;
+
+    nk_mutex_lock(&c->lock);
+
+    e = lookup(c, DC_ATTR, ino, "", h);
+
+    if (e) {
+        list_move(&e->lru_node, &c->lru);
+        *st = e->st;
+        c->stats.attr_hits++;
+        nk_mutex_unlock(&c->lock);
+        return 0;
+    }
+
+    c->stats.attr_misses++;
+    gen = c->gen;
+
+    nk_mutex_unlock(&c->lock);
+
+    if (fi->stat_ino(c->fs->state, ino, st)) {
+        return -1;
+    }
+
+    nk_mutex_lock(&c->lock);
+    if (c->gen == gen && !lookup(c, DC_ATTR, ino, "", h)) {
+        e = insert(c, DC_ATTR, ino, "", h);
+        if (e) {
+            e->st = *st;
+        }
+    }
+    nk_mutex_unlock(&c->lock);
+
+    return 0;
+}
+
+
+/*
+ * A new name appears in the parent directory, so its negative
+ * entries are now suspect.  All of them, not just the one for the
+ * exact name, since a filesystem may match names loosely (FAT
+ * ignores case, for example).
+ */
+void
+nk_fs_dcache_created (struct nk_fs_dcache * c, char * path)
+{
+    char parent[strlen(path) + 1];
+    struct dc_entry * e;
+    struct dc_entry * n;
+    uint64_t dir;
+    int all;
+    int i;
+
+    strcpy(parent, path);
+
+    for (i = strlen(parent) - 1; i >= 0 && parent[i] == '/'; i--) {
+        parent[i] = 0;
+    }
+    for (; i >= 0 && parent[i] != '/'; i--) {
+        parent[i] = 0;
+    }
+
+    // if we can't tell the parent, every negative entry goes
+    all = nk_fs_dcache_resolve(c, parent, &dir) != 0;
+
+    nk_mutex_lock(&c->lock);
+
+    list_for_each_entry_safe(e, n, &c->lru, lru_node) {
+        if (e->kind == DC_NAME && !e->ino && (all || e->key == dir)) {
+            drop(c, e);
+        }
+    }
+
+    c->gen++;
+    c->stats.invalidations++;
+
+    nk_mutex_unlock(&c->lock);
+
+    DEBUG("created %s\n", path);
+}
+
+
+void
+nk_fs_dcache_changed (struct nk_fs_dcache * c, uint64_t ino)
+{
+    uint32_t h = hash(DC_ATTR, ino, "");
+    struct dc_entry * e;
+
+    nk_mutex_lock(&c->lock);
+
+    e = lookup(c, DC_ATTR, ino, "", h);
+
+    if (e) {
+        drop(c, e);
+    }
+
+    c->gen++;
+    c->stats.invalidations++;
+
+    nk_mutex_unlock(&c->lock);
+}
+
+
+/*
+ * Removal frees the ino for reuse by the filesystem, so anything
+ * naming it, or naming something below it, would become a lie.
+ * Removes are rare enough that starting over is the simple answer.
+ */
+void
+nk_fs_dcache_purge (struct nk_fs_dcache * c)
+{
+    struct dc_entry * e;
+    struct dc_entry * n;
+
+    nk_mutex_lock(&c->lock);
+
+    list_for_each_entry_safe(e, n, &c->lru, lru_node) {
+        drop(c, e);
+    }
+
+    c->gen++;
+    c->stats.invalidations++;
+
+    nk_mutex_unlock(&c->lock);
+}
+
+
+void
+nk_fs_dcache_dump (struct nk_fs_dcache * c)
+{
+    // racy, but only counters
+    nk_vc_printf("  dcache: %lu/%lu entries, %lu hits, %lu negative hits, %lu misses\n",
+                 c->num_entries, c->max_entries, c->stats.hits, c->stats.neg_hits, c->stats.misses);
+    nk_vc_printf("          %lu attr hits, %lu attr misses, %lu invalidations, %lu evictions\n",
+                 c->stats.attr_hits, c->stats.attr_misses, c->stats.invalidations, c->stats.evictions);
+}
@@ -144,6 +144,17 @@ void nk_dev_wait(struct nk_dev *d)
     }
 }
 
+void nk_dev_wait_cond(struct nk_dev *d, int (*cond_check)(void *state), void *state)
+{
+    if (get_cpu()->interrupt_nesting_level) { 
+	return;
+    } else {
+	// the check is made atomically with queueing, so
+	// a signal that arrives in between is not lost
+	nk_thread_queue_sleep_extended(d->waiting_threads, cond_check, state);
+    }
+}
+
 void nk_dev_signal(struct nk_dev *d)
 {
     nk_thread_queue_wake_all(d->waiting_threads);
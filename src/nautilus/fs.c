@@ -26,6 +26,10 @@
 
 #include <nautilus/nautilus.h>
 #include <nautilus/fs.h>
+#include <nautilus/thread.h>
+#include <nautilus/atomic.h>
+#include <nautilus/dcache.h>
+#include <nautilus/fs_stream.h>
 #include <nautilus/testfs.h>
 
 #define INFO(fmt, args...)  INFO_PRINT("fs: " fmt, ##args)
@@ -37,47 +41,73 @@
 #define DEBUG(fmt, args...)
 #endif
 
-#define STATE_LOCK_CONF uint8_t _state_lock_flags
-#define STATE_LOCK() _state_lock_flags = spin_lock_irq_save(&state_lock)
-#define STATE_UNLOCK() spin_unlock_irq_restore(&state_lock, _state_lock_flags);
+// The filesystem list is changed and walked under the state lock, so
+// an unregistered filesystem can be freed once it is off the list.
+// The backends do no locking of their own, so anything that reaches
+// one holds its filesystem's lock, shared for lookups, stats and
+// reads, and exclusive for anything that changes the filesystem.
+// The filesystem lock is taken after the lock of an open file, and
+// is never taken recursively.  None of these locks disable interrupts,
+// as none of this is done in interrupt context.
+#define STATE_LOCK() spin_lock(&state_lock)
+#define STATE_UNLOCK() spin_unlock(&state_lock)
 
-#define FILE_LOCK_CONF uint8_t _file_lock_flags
-#define FILE_LOCK(fd) _file_lock_flags = spin_lock_irq_save(&fd->lock)
-#define FILE_UNLOCK(fd) spin_unlock_irq_restore(&fd->lock, _file_lock_flags);
+#define FS_RLOCK(fs) nk_brlock_rd_lock(&(fs)->lock)
+#define FS_RUNLOCK(fs) nk_brlock_rd_unlock(&(fs)->lock)
+#define FS_WLOCK(fs) nk_brlock_wr_lock(&(fs)->lock)
+#define FS_WUNLOCK(fs) nk_brlock_wr_unlock(&(fs)->lock)
 
+#define FILE_LOCK(fd) nk_mutex_lock(&(fd)->lock)
+#define FILE_UNLOCK(fd) nk_mutex_unlock(&(fd)->lock)
+
+// taken before the file lock
+#define POS_LOCK(fd) nk_mutex_lock(&(fd)->pos_lock)
+#define POS_UNLOCK(fd) nk_mutex_unlock(&(fd)->pos_lock)
+
+#define TABLE_LOCK(t) nk_mutex_lock(&(t)->lock)
+#define TABLE_UNLOCK(t) nk_mutex_unlock(&(t)->lock)
+
+#define FD_TABLE_INIT_SIZE 16
 
 
 //typedef enum {EXT2}      nk_fs_type_t;
 //typedef enum {BLOCK,NET} nk_fs_media_t;
 
 struct nk_fs_open_file_state {
-    spinlock_t lock;
+    nk_mutex_t lock;
+    nk_mutex_t pos_lock;  // held across stream I/O, which takes lock
+
+    struct nk_fs_fd_table *table;   // installed here
+    int                    fileno;  // at this index
+    int                    refcount;  // the table's, plus nk_fs_fd_get()s
 
-    struct list_head file_node;
-    
     struct nk_fs  *fs;
     void          *file;
-    
+    uint64_t       ino;   // for the dcache, 0 if unknown
+
+    struct nk_fs_stream *stream;  // readahead and write-behind, if any
+
     size_t   position;
     int      flags;
 };
 
+struct nk_fs_fd_table {
+    nk_mutex_t        lock;
+    struct list_head  table_node;  // on the list of all tables
+
+    int               size;    // slots allocated
+    int               count;   // slots in use
+    int               hint;    // no slot below this is free
+    nk_fs_fd_t       *slots;
+};
+
 
 static spinlock_t state_lock;
 static struct list_head fs_list;
-static struct list_head open_files;
 
-static void map_over_open_files(void (*callback)(nk_fs_fd_t)) 
-{
-    struct list_head *cur;
-    struct list_head *temp;
-    nk_fs_fd_t fd;
-    
-    list_for_each_safe(cur, temp, &open_files) {
-	fd = list_entry(cur,struct nk_fs_open_file_state, file_node);
-	callback(fd);
-    }
-}
+static nk_mutex_t tables_lock;
+static struct list_head fd_tables;
+static struct nk_fs_fd_table default_table;
 
 
 //TODO: deal with hard links
@@ -88,8 +118,21 @@ static ssize_t __seek(nk_fs_fd_t fd, size_t offset, int whence);
 
 static int path_stat(struct nk_fs *fs, char *path, struct nk_fs_stat *st) 
 {
+    uint64_t ino;
+    int rc;
+
+    if (fs && fs->dcache) {
+	FS_RLOCK(fs);
+	rc = nk_fs_dcache_resolve(fs->dcache, path, &ino) ? -1 : nk_fs_dcache_stat(fs->dcache, ino, st);
+	FS_RUNLOCK(fs);
+	return rc;
+    }
+
     if (fs && fs->interface && fs->interface->stat_path) {
-	return fs->interface->stat_path(fs->state, path, st);
+	FS_RLOCK(fs);
+	rc = fs->interface->stat_path(fs->state, path, st);
+	FS_RUNLOCK(fs);
+	return rc;
     } else {
 	return -1;
     }
@@ -98,16 +141,30 @@ static int path_stat(struct nk_fs *fs, char *path, struct nk_fs_stat *st)
 
 static int file_stat(struct nk_fs *fs, void *file, struct nk_fs_stat *st) 
 {
+    int rc;
+
     if (fs && fs->interface && fs->interface->stat) {
-	return fs->interface->stat(fs->state, file, st);
+	FS_RLOCK(fs);
+	rc = fs->interface->stat(fs->state, file, st);
+	FS_RUNLOCK(fs);
+	return rc;
     } else {
 	return -1;
     }
 }
 
-
-static void * file_open(struct nk_fs *fs, char *path, int access) 
+// called with the fs lock held, shared or exclusive
+static void * file_open(struct nk_fs *fs, char *path, int access, uint64_t *ino) 
 {
+    *ino = 0;
+
+    if (fs && fs->dcache) {
+	if (nk_fs_dcache_resolve(fs->dcache, path, ino)) {
+	    return 0;
+	}
+	return fs->interface->open_ino(fs->state, *ino);
+    }
+
     if (fs && fs->interface && fs->interface->open_file) {
 	return fs->interface->open_file(fs->state, path);
     } else {
@@ -116,6 +173,7 @@ static void * file_open(struct nk_fs *fs, char *path, int access)
 }
 
 
+// called with the fs lock held exclusive
 static void *file_create(struct nk_fs *fs, char* path) 
 {
     if (fs && fs->interface && fs->interface->create_file) {
@@ -125,6 +183,15 @@ static void *file_create(struct nk_fs *fs, char* path)
     }
 }
 
+// the file's attributes have changed, called without the file lock
+static inline void file_changed(nk_fs_fd_t fd)
+{
+    if (fd->fs->dcache && fd->ino) {
+	nk_fs_dcache_changed(fd->fs->dcache, fd->ino);
+    }
+}
+
+// called with the fs lock held exclusive
 static int file_trunc(nk_fs_fd_t fd, off_t len)
 {
     if (fd && fd->fs && fd->fs->interface && fd->fs->interface->trunc_file) {
@@ -134,38 +201,56 @@ static int file_trunc(nk_fs_fd_t fd, off_t len)
     }
 }
 
-static inline ssize_t file_read(nk_fs_fd_t fd, char *buf, size_t num_bytes) 
+// called with the file lock held
+static inline ssize_t file_read(nk_fs_fd_t fd, char *buf, size_t num_bytes, off_t offset) 
 {
+    ssize_t n;
+
     if (!FS_FD_ERR(fd) && fd->fs && fd->fs->interface 
 	&& fd->fs->interface->read_file) {
-	return fd->fs->interface->read_file(fd->fs->state, 
-					    fd->file, 
-					    buf, 
-					    fd->position,
-					    num_bytes);
+	FS_RLOCK(fd->fs);
+	n = fd->fs->interface->read_file(fd->fs->state, 
+					 fd->file, 
+					 buf, 
+					 offset,
+					 num_bytes);
+	FS_RUNLOCK(fd->fs);
+	return n;
     } else {
 	return -1;
     }
 }
 
-static inline ssize_t file_write(nk_fs_fd_t fd, char *buf, size_t num_bytes) 
+// called with the file lock held
+static inline ssize_t file_write(nk_fs_fd_t fd, char *buf, size_t num_bytes, off_t offset) 
 {
+    ssize_t n;
+
     if (!FS_FD_ERR(fd) && fd->fs && fd->fs->interface 
 	&& fd->fs->interface->write_file) {
-	return fd->fs->interface->write_file(fd->fs->state, 
-					     fd->file, 
-					     buf, 
-					     fd->position,
-					     num_bytes);
+	FS_WLOCK(fd->fs);
+	n = fd->fs->interface->write_file(fd->fs->state,
+					  fd->file,
+					  buf,
+					  offset,
+					  num_bytes);
+	FS_WUNLOCK(fd->fs);
+	return n;
     } else {
 	return -1;
     }
 }
 
-
+// called with the fs lock held, shared or exclusive
 static int exists(struct nk_fs *fs, char *path) 
 {
+    uint64_t ino;
+
     //    DEBUG("Exists (%s, %s)\n",fs->name,path);
+    if (fs && fs->dcache) {
+	return nk_fs_dcache_resolve(fs->dcache, path, &ino) == 0;
+    }
+
     if (fs && fs->interface && fs->interface->exists) { 
 	return fs->interface->exists(fs->state, path);
     } else {
@@ -175,28 +260,226 @@ static int exists(struct nk_fs *fs, char *path)
 
 static int remove(struct nk_fs *fs, char* path) 
 {
+    int rc;
+
     if (fs && fs->interface && fs->interface->remove) { 
-	return fs->interface->remove(fs->state, path);
+	FS_WLOCK(fs);
+	rc = fs->interface->remove(fs->state, path);
+	if (fs->dcache) {
+	    nk_fs_dcache_purge(fs->dcache);
+	}
+	FS_WUNLOCK(fs);
+	return rc;
     } else {
 	return -1;
     }
 }
 
+
+static inline struct nk_fs_fd_table *cur_table(void)
+{
+    struct nk_thread *t = get_cur_thread();
+
+    return t && t->fd_table ? t->fd_table : &default_table;
+}
+
+// take the lowest free slot, growing the table if there is none
+static int table_install(struct nk_fs_fd_table *t, nk_fs_fd_t fd)
+{
+    nk_fs_fd_t *slots;
+    int i, size;
+
+    TABLE_LOCK(t);
+
+    for (i=t->hint; i<t->size && t->slots[i]; i++) {}
+
+    if (i==t->size) {
+	size = t->size ? 2*t->size : FD_TABLE_INIT_SIZE;
+	slots = malloc(size*sizeof(nk_fs_fd_t));
+	if (!slots) {
+	    TABLE_UNLOCK(t);
+	    ERROR("Cannot grow file descriptor table to %d entries\n", size);
+	    return -1;
+	}
+	memset(slots,0,size*sizeof(nk_fs_fd_t));
+	if (t->slots) {
+	    memcpy(slots,t->slots,t->size*sizeof(nk_fs_fd_t));
+	    free(t->slots);
+	}
+	t->slots = slots;
+	t->size = size;
+    }
+
+    t->slots[i] = fd;
+    t->count++;
+    t->hint = i+1;
+
+    fd->table = t;
+    fd->fileno = i;
+
+    TABLE_UNLOCK(t);
+
+    return 0;
+}
+
+// the last reference is gone
+static int fd_release(nk_fs_fd_t fd)
+{
+    int rc = 0;
+
+    if (fd->stream) {
+	rc = nk_fs_stream_destroy(fd->stream, fd);
+    }
+
+    // the filesystem may keep per-open-file state
+    if (fd->file && fd->fs->interface->close_file) {
+	fd->fs->interface->close_file(fd->fs->state,fd->file);
+    }
+
+    free(fd);
+
+    return rc;
+}
+
+int nk_fs_fileno(nk_fs_fd_t fd)
+{
+    return FS_FD_ERR(fd) ? -1 : fd->fileno;
+}
+
+nk_fs_fd_t nk_fs_fd_get(int fileno)
+{
+    struct nk_fs_fd_table *t = cur_table();
+    nk_fs_fd_t fd = FS_BAD_FD;
+
+    TABLE_LOCK(t);
+    if (fileno>=0 && fileno<t->size && t->slots[fileno]) {
+	fd = t->slots[fileno];
+	atomic_inc(fd->refcount);
+    }
+    TABLE_UNLOCK(t);
+
+    return fd;
+}
+
+int nk_fs_fd_put(nk_fs_fd_t fd)
+{
+    if (atomic_dec_val(fd->refcount)==0) {
+	return fd_release(fd);
+    }
+    return 0;
+}
+
+struct nk_fs_fd_table *nk_fs_fd_table_create(void)
+{
+    struct nk_fs_fd_table *t = malloc(sizeof(*t));
+
+    if (!t) {
+	ERROR("Cannot allocate file descriptor table\n");
+	return 0;
+    }
+
+    memset(t,0,sizeof(*t));
+
+    nk_mutex_lock(&tables_lock);
+    list_add(&t->table_node,&fd_tables);
+    nk_mutex_unlock(&tables_lock);
+
+    DEBUG("Created file descriptor table %p\n", t);
+
+    return t;
+}
+
+static int table_close_all(struct nk_fs_fd_table *t)
+{
+    nk_fs_fd_t fd;
+    int i, rc = 0;
+
+    while (1) {
+	fd = 0;
+	TABLE_LOCK(t);
+	for (i=0;i<t->size && !fd;i++) {
+	    fd = t->slots[i];
+	}
+	TABLE_UNLOCK(t);
+	if (!fd) {
+	    return rc;
+	}
+	if (nk_fs_close(fd)) {
+	    rc = -1;
+	}
+    }
+}
+
+int nk_fs_fd_table_destroy(struct nk_fs_fd_table *t)
+{
+    struct nk_thread *me = get_cur_thread();
+    int rc;
+
+    if (!t || t==&default_table) {
+	ERROR("Cannot destroy the default file descriptor table\n");
+	return -1;
+    }
+
+    nk_mutex_lock(&tables_lock);
+    list_del(&t->table_node);
+    nk_mutex_unlock(&tables_lock);
+
+    if (t->count) {
+	DEBUG("Closing %d files left in table %p\n", t->count, t);
+    }
+
+    rc = table_close_all(t);
+
+    if (me && me->fd_table==t) {
+	me->fd_table = 0;
+    }
+
+    free(t->slots);
+    free(t);
+
+    return rc;
+}
+
+struct nk_fs_fd_table *nk_fs_fd_table_bind(struct nk_fs_fd_table *t)
+{
+    struct nk_thread *me = get_cur_thread();
+    struct nk_fs_fd_table *old = me->fd_table;
+
+    me->fd_table = t==&default_table ? 0 : t;
+
+    return old;
+}
+
+
 int nk_fs_init(void) 
 {
     INIT_LIST_HEAD(&fs_list);
-    INIT_LIST_HEAD(&open_files);
     spinlock_init(&state_lock);
+    INIT_LIST_HEAD(&fd_tables);
+    nk_mutex_init(&tables_lock);
+    memset(&default_table,0,sizeof(default_table));
+    list_add(&default_table.table_node,&fd_tables);
+#ifdef NAUT_CONFIG_FS_STREAM
+    nk_fs_stream_init();
+#endif
     INFO("inited\n");
     return 0;
 }
 
 int nk_deinit_fs(void) 
 {
-    if (!list_empty(&open_files)) {
-	ERROR("Open files remain.. closing them\n");
-	map_over_open_files((void (*)(nk_fs_fd_t))nk_fs_close);
+    struct list_head *cur;
+
+    nk_mutex_lock(&tables_lock);
+    list_for_each(cur,&fd_tables) {
+	struct nk_fs_fd_table *t = list_entry(cur,struct nk_fs_fd_table,table_node);
+	if (t->count) {
+	    ERROR("Open files remain in table %p.. closing them\n", t);
+	    table_close_all(t);
+	}
     }
+    nk_mutex_unlock(&tables_lock);
+
     if (!list_empty(&fs_list)) {
 	ERROR("registered filesystems remain\n");
     }
@@ -207,7 +490,6 @@ int nk_deinit_fs(void)
 
 struct nk_fs *nk_fs_register(char *name, uint64_t flags, struct nk_fs_int *inter, void *state)
 {
-    STATE_LOCK_CONF;
     struct nk_fs *f = malloc(sizeof(*f));
 
     DEBUG("register fs with name %s, flags 0x%lx, interface %p, and state %p\n", name, flags, inter, state);
@@ -216,7 +498,7 @@ struct nk_fs *nk_fs_register(char *name, uint64_t flags, struct nk_fs_int *inter
 	ERROR("Failed to allocate filesystem\n");
 	return 0;
     }
-    
+
     memset(f,0,sizeof(*f));
 
     strncpy(f->name,name,FS_NAME_LEN); f->name[FS_NAME_LEN-1]=0;
@@ -225,22 +507,42 @@ struct nk_fs *nk_fs_register(char *name, uint64_t flags, struct nk_fs_int *inter
     f->interface = inter;
     f->state = state;
 
+    // backend I/O may sleep, so waiters on the lock should too
+    if (nk_brlock_init(&f->lock, NK_BRLOCK_BLOCKING)) {
+	ERROR("Failed to allocate lock for filesystem\n");
+	free(f);
+	return 0;
+    }
+
+#ifdef NAUT_CONFIG_FS_DCACHE
+    if (inter->root && inter->lookup && inter->stat_ino && inter->open_ino) {
+	f->dcache = nk_fs_dcache_create(f, 0);
+	if (!f->dcache) {
+	    ERROR("Cannot create dcache for %s, continuing without\n", f->name);
+	}
+    }
+#endif
+
     STATE_LOCK();
-    list_add(&f->fs_list_node,&fs_list);
+    list_add(&f->fs_list_node, &fs_list);
     STATE_UNLOCK();
-    
+
     INFO("Added filesystem with name %s and flags 0x%lx\n", f->name,f->flags);
-    
+
     return f;
 }
 
+// nothing may be open on the filesystem, or about to be
 int            nk_fs_unregister(struct nk_fs *f)
 {
-    STATE_LOCK_CONF;
     STATE_LOCK();
     list_del(&f->fs_list_node);
     STATE_UNLOCK();
     INFO("Unregistered filesystem %s\n",f->name);
+    if (f->dcache) {
+	nk_fs_dcache_destroy(f->dcache);
+    }
+    nk_brlock_deinit(&f->lock);
     free(f);
     return 0;
 }
@@ -249,23 +551,20 @@ static struct nk_fs *__fs_find(char *name)
 {
     struct list_head *cur;
     struct nk_fs *target=0;
+    STATE_LOCK();
     list_for_each(cur,&fs_list) {
 	if (!strncasecmp(list_entry(cur,struct nk_fs,fs_list_node)->name,name,FS_NAME_LEN)) { 
 	    target = list_entry(cur,struct nk_fs, fs_list_node);
 	    break;
 	}
     }
+    STATE_UNLOCK();
     return target;
 }
 
 struct nk_fs *nk_fs_find(char *name)
 {
-    STATE_LOCK_CONF;
-    struct nk_fs *fs=0;
-    STATE_LOCK();
-    fs = __fs_find(name);
-    STATE_UNLOCK();
-    return fs;
+    return __fs_find(name);
 }
 
 static char *decode_path(char *path, char *fs_name)
@@ -292,7 +591,6 @@ static char *decode_path(char *path, char *fs_name)
 
 int nk_fs_stat(char *path, struct nk_fs_stat *st)
 {
-    STATE_LOCK_CONF;
     struct nk_fs *fs;
     char fs_name[strlen(path)+1];
 
@@ -300,9 +598,7 @@ int nk_fs_stat(char *path, struct nk_fs_stat *st)
 
     DEBUG("decode has fs_name %s path %s\n", fs_name,path);
 
-    STATE_LOCK();
     fs = __fs_find(fs_name);
-    STATE_UNLOCK();
 
     if (!fs) { 
 	ERROR("Cannot find filesystem named %s\n",fs_name);
@@ -315,7 +611,7 @@ int nk_fs_stat(char *path, struct nk_fs_stat *st)
 int nk_fs_truncate(char *path, off_t len)
 {
     nk_fs_fd_t fd = nk_fs_open(path,O_RDWR,0);
-    
+
     if (FS_FD_ERR(fd)) { 
 	return -1;
     } else{
@@ -325,7 +621,7 @@ int nk_fs_truncate(char *path, off_t len)
 	    return nk_fs_close(fd);
 	}
     }
-}	
+}
 
 nk_fs_fd_t nk_fs_creat(char *path, int mode) 
 {
@@ -334,17 +630,16 @@ nk_fs_fd_t nk_fs_creat(char *path, int mode)
 
 nk_fs_fd_t nk_fs_open(char *path, int flags, int mode) 
 {
-    STATE_LOCK_CONF;
     struct nk_fs *fs;
     char fs_name[strlen(path)+1];
+    // creation or truncation changes the filesystem
+    int changes = flags & (O_CREAT | O_TRUNC);
 
     DEBUG("open path %s, flags=%d, mode=%d\n",path,flags,mode);
 
     path=decode_path(path,fs_name);
 
-    STATE_LOCK();
     fs = __fs_find(fs_name);
-    STATE_UNLOCK();
 
     if (!fs) { 
 	ERROR("Cannot find filesystem named %s\n",fs_name);
@@ -358,67 +653,156 @@ nk_fs_fd_t nk_fs_open(char *path, int flags, int mode)
     }
 
     memset(fd,0,sizeof(*fd));
-    spinlock_init(&fd->lock);
+    nk_mutex_init(&fd->lock);
+    nk_mutex_init(&fd->pos_lock);
+    fd->refcount = 1;
     fd->fs = fs;
     fd->flags = flags;
 
+    if (changes) {
+	FS_WLOCK(fs);
+    } else {
+	FS_RLOCK(fs);
+    }
+
     if (exists(fs,path)) {
 	DEBUG("path %s exists\n", path);
-	fd->file = file_open(fs, path, flags);
+	fd->file = file_open(fs, path, flags, &fd->ino);
+	if (!fd->file) {
+	    ERROR("Cannot open file %s\n", path);
+	    goto fail;
+	}
     } else if (flags & O_CREAT) {
 	DEBUG("path %s does not exist, but creating file\n",path);
 	if ((fs->flags & NK_FS_READONLY)) { 
 	    ERROR("Filesystem is not writeable so cannot create file\n");
-	    return FS_BAD_FD;
+	    goto fail;
 	}
 	fd->file = file_create(fs, path);
 	if (!fd->file) {
 	    ERROR("Cannot create file %s\n", path);
-	    free(fd);
-	    return FS_BAD_FD;
+	    goto fail;
 	} else {
 	    DEBUG("Created file %s on fs %s file=%p ", path, fs_name, fd);
-	} 
+	}
+	if (fs->dcache) {
+	    nk_fs_dcache_created(fs->dcache, path);
+	    if (nk_fs_dcache_resolve(fs->dcache, path, &fd->ino)) {
+		fd->ino = 0;
+	    }
+	}
     } else {
 	DEBUG("path %s does not exist, and no creation requested\n",path);
-	free(fd);
-	return FS_BAD_FD;
+	goto fail;
     }
-    
-    STATE_LOCK();
-    list_add(&fd->file_node, &open_files);
-    STATE_UNLOCK();
 
     if (flags & O_TRUNC) { 
 	file_trunc(fd,0);
     }
 
+    if (changes) {
+	FS_WUNLOCK(fs);
+    } else {
+	FS_RUNLOCK(fs);
+    }
+
+    if (flags & O_TRUNC) { 
+	file_changed(fd);
+    }
+
+    if (table_install(cur_table(), fd)) {
+	fd_release(fd);
+	return FS_BAD_FD;
+    }
+
     if (flags & O_APPEND) {
 	__seek(fd, 0, 2);
     }
 
-    DEBUG("Opened file %s on fs %s file=%p ", path, fs_name, fd);
+#ifdef NAUT_CONFIG_FS_STREAM
+    fd->stream = nk_fs_stream_create((fs->flags & NK_FS_READONLY) ? flags & ~O_WRONLY : flags);
+#endif
+
+    DEBUG("Opened file %s on fs %s file=%p fileno %d\n", path, fs_name, fd, fd->fileno);
 
     return fd;
+
+ fail:
+    if (changes) {
+	FS_WUNLOCK(fs);
+    } else {
+	FS_RUNLOCK(fs);
+    }
+    fd_release(fd);
+    return FS_BAD_FD;
 }
 
 int nk_fs_close(nk_fs_fd_t fd) 
 {
-    STATE_LOCK_CONF;
+    struct nk_fs_fd_table *t = fd->table;
+    int rc = 0;
 
-    STATE_LOCK();
-    list_del(&fd->file_node);
-    STATE_UNLOCK();
+    // write out anything buffered now, so an error can be reported
+    if (fd->stream && nk_fs_stream_flush(fd->stream, fd)) {
+	rc = -1;
+    }
 
-    free(fd);
-    
-    return 0;
+    TABLE_LOCK(t);
+    if (t->slots[fd->fileno]!=fd) {
+	TABLE_UNLOCK(t);
+	ERROR("Closing file that is not open\n");
+	return -1;
+    }
+    t->slots[fd->fileno] = 0;
+    t->count--;
+    if (fd->fileno < t->hint) {
+	t->hint = fd->fileno;
+    }
+    TABLE_UNLOCK(t);
+
+    // drop the table's reference
+    if (nk_fs_fd_put(fd)) {
+	rc = -1;
+    }
+
+    return rc;
 }
 
-ssize_t nk_fs_read(nk_fs_fd_t fd, void *buf, size_t num_bytes) 
+// the stream's background I/O takes the file lock, so the position
+// lock is what keeps concurrent users of the descriptor from doing
+// I/O at the same position
+static ssize_t stream_rw(nk_fs_fd_t fd, void *buf, size_t num_bytes, int write)
 {
-    FILE_LOCK_CONF;
+    size_t pos;
+    ssize_t n;
+
+    POS_LOCK(fd);
 
+    FILE_LOCK(fd);
+    pos = fd->position;
+    FILE_UNLOCK(fd);
+
+    if (write) {
+	n = nk_fs_stream_write(fd->stream, fd, buf, num_bytes, pos);
+    } else {
+	n = nk_fs_stream_read(fd->stream, fd, buf, num_bytes, pos);
+    }
+
+    if (n>=0) {
+	FILE_LOCK(fd);
+	fd->position = pos + n;
+	FILE_UNLOCK(fd);
+    }
+
+    POS_UNLOCK(fd);
+
+    DEBUG("%s %ld bytes ending at position %lu\n", write ? "wrote" : "read", n, pos + (n>0 ? n : 0));
+
+    return n;
+}
+
+ssize_t nk_fs_read(nk_fs_fd_t fd, void *buf, size_t num_bytes) 
+{
     DEBUG("attempt read of %ld bytes starting at position %lu\n", num_bytes, fd->position);
 
     if (FS_FD_ERR(fd) || !(fd->flags & O_RDONLY)) { // includes RDWR
@@ -426,8 +810,12 @@ ssize_t nk_fs_read(nk_fs_fd_t fd, void *buf, size_t num_bytes)
 	return -1;
     }
 
+    if (fd->stream) {
+	return stream_rw(fd, buf, num_bytes, 0);
+    }
+
     FILE_LOCK(fd);
-    ssize_t n = file_read(fd, buf, num_bytes);
+    ssize_t n = file_read(fd, buf, num_bytes, fd->position);
     if (n>=0) {fd->position += n; }
     FILE_UNLOCK(fd);
 
@@ -438,8 +826,6 @@ ssize_t nk_fs_read(nk_fs_fd_t fd, void *buf, size_t num_bytes)
 
 ssize_t nk_fs_write(nk_fs_fd_t fd, void *buf, size_t num_bytes) 
 {
-    FILE_LOCK_CONF;
-
     DEBUG("attempt write of %ld bytes starting at position %lu\n", num_bytes, fd->position);
 
     if (FS_FD_ERR(fd) || !(fd->flags & O_WRONLY)) { // includes RDWR
@@ -452,19 +838,83 @@ ssize_t nk_fs_write(nk_fs_fd_t fd, void *buf, size_t num_bytes)
 	return -1;
     }
 
+    if (fd->stream) {
+	return stream_rw(fd, buf, num_bytes, 1);
+    }
+
     FILE_LOCK(fd);
-    ssize_t n = file_read(fd, buf, num_bytes);
+    ssize_t n = file_write(fd, buf, num_bytes, fd->position);
     if (n>=0) {fd->position += n; }
     FILE_UNLOCK(fd);
 
+    file_changed(fd);
+
     DEBUG("wrote %ld bytes ending at position %lu\n", n, fd->position);
 
     return n;
 }
 
+// positional variants leave the file position alone
+ssize_t _nk_fs_pread(nk_fs_fd_t fd, void *buf, size_t num_bytes, off_t offset)
+{
+    DEBUG("attempt pread of %ld bytes at %lu\n", num_bytes, offset);
+
+    if (FS_FD_ERR(fd) || !(fd->flags & O_RDONLY)) { // includes RDWR
+	ERROR("Cannot read file not opened for reading\n");
+	return -1;
+    }
+
+    // the lock still protects the filesystem's per-open-file state
+    FILE_LOCK(fd);
+    ssize_t n = file_read(fd, buf, num_bytes, offset);
+    FILE_UNLOCK(fd);
+
+    return n;
+}
+
+ssize_t _nk_fs_pwrite(nk_fs_fd_t fd, void *buf, size_t num_bytes, off_t offset)
+{
+    DEBUG("attempt pwrite of %ld bytes at %lu\n", num_bytes, offset);
+
+    if (FS_FD_ERR(fd) || !(fd->flags & O_WRONLY)) { // includes RDWR
+	ERROR("Cannot write file not opened for writing\n");
+	return -1;
+    }
+
+    if (fd->fs->flags & NK_FS_READONLY) { 
+	ERROR("Not a writeable filesystem\n");
+	return -1;
+    }
+
+    FILE_LOCK(fd);
+    ssize_t n = file_write(fd, buf, num_bytes, offset);
+    FILE_UNLOCK(fd);
+
+    file_changed(fd);
+
+    return n;
+}
+
+// the stream may hold data newer than the file's, or data that
+// a write would make stale, so it is written out and dropped first
+ssize_t nk_fs_pread(nk_fs_fd_t fd, void *buf, size_t num_bytes, off_t offset)
+{
+    if (!FS_FD_ERR(fd) && fd->stream && nk_fs_stream_flush(fd->stream, fd)) {
+	return -1;
+    }
+    return _nk_fs_pread(fd, buf, num_bytes, offset);
+}
+
+ssize_t nk_fs_pwrite(nk_fs_fd_t fd, void *buf, size_t num_bytes, off_t offset)
+{
+    if (!FS_FD_ERR(fd) && fd->stream && nk_fs_stream_flush(fd->stream, fd)) {
+	return -1;
+    }
+    return _nk_fs_pwrite(fd, buf, num_bytes, offset);
+}
+
 int nk_fs_ftruncate(nk_fs_fd_t fd, off_t len)
 {
-    FILE_LOCK_CONF;
     int rc;
 
     if (fd->fs->flags & NK_FS_READONLY) { 
@@ -472,17 +922,42 @@ int nk_fs_ftruncate(nk_fs_fd_t fd, off_t len)
 	return -1;
     }
 
+    if (fd->stream && nk_fs_stream_flush(fd->stream, fd)) {
+	return -1;
+    }
+
     FILE_LOCK(fd);
+    FS_WLOCK(fd->fs);
     rc = file_trunc(fd,len);
+    FS_WUNLOCK(fd->fs);
     FILE_UNLOCK(fd);
+
+    file_changed(fd);
+
     return rc;
 }
 
 int nk_fs_fstat(nk_fs_fd_t fd, struct nk_fs_stat *st)
 {
+    if (fd->stream && nk_fs_stream_flush(fd->stream, fd)) {
+	return -1;
+    }
     return file_stat(fd->fs,fd->file,st);
 }
 
+int nk_fs_fsync(nk_fs_fd_t fd)
+{
+    int rc = 0;
+
+    if (fd->stream && nk_fs_stream_flush(fd->stream, fd)) {
+	rc = -1;
+    }
+    if (fd->fs->interface->sync && fd->fs->interface->sync(fd->fs->state)) {
+	rc = -1;
+    }
+    return rc;
+}
+
 static ssize_t __seek(nk_fs_fd_t fd, size_t offset, int whence) 
 {
     if (whence == 0) {
@@ -506,12 +981,21 @@ static ssize_t __seek(nk_fs_fd_t fd, size_t offset, int whence)
  
 off_t nk_fs_seek(nk_fs_fd_t fd, off_t offset, int whence) 
 {
-    FILE_LOCK_CONF;
     ssize_t s;
 
+    // not in the middle of a stream read or write
+    POS_LOCK(fd);
+
+    // the size must include anything still buffered
+    if (whence == 2 && fd->stream && nk_fs_stream_flush(fd->stream, fd)) {
+	POS_UNLOCK(fd);
+	return -1;
+    }
+
     FILE_LOCK(fd);
     s = __seek(fd, offset, whence);
     FILE_UNLOCK(fd);
+    POS_UNLOCK(fd);
     return s;
 }
 
@@ -525,31 +1009,46 @@ ssize_t nk_fs_tell(nk_fs_fd_t fd)
 
 void nk_fs_dump_filesystems()
 {
-    STATE_LOCK_CONF;
     struct list_head *cur;
 
-    STATE_LOCK();
-
     list_for_each(cur,&fs_list) {
 	struct nk_fs *fs = list_entry(cur,struct nk_fs,fs_list_node);
 	nk_vc_printf("%s:\n", fs->name);
+	if (fs->dcache) {
+	    nk_fs_dcache_dump(fs->dcache);
+	}
     }
-    STATE_UNLOCK();
 }
 
 
 void nk_fs_dump_files()
 {
-    STATE_LOCK_CONF;
     struct list_head *cur;
+    int i;
 
-    STATE_LOCK();
+    nk_mutex_lock(&tables_lock);
 
-    list_for_each(cur,&open_files) {
-	struct nk_fs_open_file_state *f = list_entry(cur,struct nk_fs_open_file_state,file_node);
-	nk_vc_printf("%s:%p at %lu flags %x\n", f->fs->name,f->file,f->position,f->flags);
+    list_for_each(cur,&fd_tables) {
+	struct nk_fs_fd_table *t = list_entry(cur,struct nk_fs_fd_table,table_node);
+	TABLE_LOCK(t);
+	if (t!=&default_table) {
+	    nk_vc_printf("table %p (%d open, %d slots):\n", t, t->count, t->size);
+	}
+	for (i=0;i<t->size;i++) {
+	    struct nk_fs_open_file_state *f = t->slots[i];
+	    if (!f) {
+		continue;
+	    }
+	    nk_vc_printf("%d: %s:%p at %lu flags %x refs %d", i, f->fs->name,f->file,f->position,f->flags,f->refcount);
+	    if (f->stream) {
+		nk_vc_printf(" readahead window %lu", f->stream->window);
+	    }
+	    nk_vc_printf("\n");
+	}
+	TABLE_UNLOCK(t);
     }
-    STATE_UNLOCK();
+
+    nk_mutex_unlock(&tables_lock);
 }
 
 
@@ -0,0 +1,416 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/thread.h>
+#include <nautilus/fs.h>
+#include <nautilus/fs_aio.h>
+
+#ifndef NAUT_CONFIG_DEBUG_FILESYSTEM
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif
+
+#define INFO(fmt, args...)  INFO_PRINT("aio: " fmt, ##args)
+#define ERROR(fmt, args...) ERROR_PRINT("aio: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("aio: " fmt, ##args)
+
+#define MAX_WORKERS 64
+
+#define LOCK_CONF uint8_t _lock_flags
+#define LOCK(ctx) _lock_flags = spin_lock_irq_save(&(ctx)->lock)
+#define UNLOCK(ctx) spin_unlock_irq_restore(&(ctx)->lock, _lock_flags)
+
+#define MASK(ctx) ((ctx)->entries - 1)
+
+
+static int
+work_ready (void * state)
+{
+    struct nk_fs_aio_ctx * ctx = (struct nk_fs_aio_ctx *)state;
+
+    return ctx->sq_head != ctx->sq_tail || ctx->stopping;
+}
+
+
+static int
+cq_ready (void * state)
+{
+    struct nk_fs_aio_ctx * ctx = (struct nk_fs_aio_ctx *)state;
+
+    return ctx->cq_head != ctx->cq_tail || !ctx->cq_owed;
+}
+
+
+static int
+cbq_ready (void * state)
+{
+    struct nk_fs_aio_ctx * ctx = (struct nk_fs_aio_ctx *)state;
+
+    return ctx->cbq_head != ctx->cbq_tail || ctx->stopping;
+}
+
+
+static int
+all_done (void * state)
+{
+    struct nk_fs_aio_ctx * ctx = (struct nk_fs_aio_ctx *)state;
+
+    return !ctx->threads;
+}
+
+
+static int
+idle (void * state)
+{
+    struct nk_fs_aio_ctx * ctx = (struct nk_fs_aio_ctx *)state;
+
+    return !ctx->outstanding;
+}
+
+
+static void
+complete (struct nk_fs_aio_ctx * ctx, struct nk_fs_aio_op * op, ssize_t result)
+{
+    LOCK_CONF;
+    struct nk_fs_aio_cqe cqe = { .priv = op->priv, .result = result };
+
+    if (op->callback && !(ctx->flags & NK_FS_AIO_COMPLETION_THREAD)) {
+        op->callback(&cqe);
+    }
+
+    LOCK(ctx);
+
+    ctx->inflight--;
+    ctx->stats.completed++;
+    if (result < 0) {
+        ctx->stats.errors++;
+    } else {
+        ctx->stats.bytes += result;
+    }
+
+    if (!op->callback) {
+        ctx->cq[ctx->cq_tail++ & MASK(ctx)] = cqe;
+    } else if (ctx->flags & NK_FS_AIO_COMPLETION_THREAD) {
+        op->len = result;   // the completion thread's copy carries the result
+        ctx->cbq[ctx->cbq_tail++ & MASK(ctx)] = *op;
+    } else {
+        ctx->outstanding--;
+    }
+
+    UNLOCK(ctx);
+
+    nk_thread_queue_wake_all(ctx->done_wq);
+}
+
+
+static void
+worker (void * in, void ** out)
+{
+    LOCK_CONF;
+    struct nk_fs_aio_ctx * ctx = (struct nk_fs_aio_ctx *)in;
+    struct nk_fs_aio_op op;
+    ssize_t rc;
+
+    nk_thread_name(get_cur_thread(), "fs-aio");
+
+    while (1) {
+        LOCK(ctx);
+
+        if (ctx->sq_head == ctx->sq_tail) {
+            if (ctx->stopping) {
+                UNLOCK(ctx);
+                break;
+            }
+            UNLOCK(ctx);
+            nk_thread_queue_sleep_extended(ctx->work_wq, work_ready, ctx);
+            continue;
+        }
+
+        op = ctx->sq[ctx->sq_head++ & MASK(ctx)];
+
+        if (++ctx->inflight > ctx->stats.max_inflight) {
+            ctx->stats.max_inflight = ctx->inflight;
+        }
+
+        UNLOCK(ctx);
+
+        if (op.opcode == NK_FS_AIO_READ) {
+            rc = (op.flags & NK_FS_AIO_NO_STREAM) ?
+                _nk_fs_pread(op.fd, op.buf, op.len, op.offset) :
+                nk_fs_pread(op.fd, op.buf, op.len, op.offset);
+        } else if (op.opcode == NK_FS_AIO_WRITE) {
+            rc = (op.flags & NK_FS_AIO_NO_STREAM) ?
+                _nk_fs_pwrite(op.fd, op.buf, op.len, op.offset) :
+                nk_fs_pwrite(op.fd, op.buf, op.len, op.offset);
+        } else {
+            ERROR("Unknown opcode %d\n", op.opcode);
+            rc = -1;
+        }
+
+        complete(ctx, &op, rc);
+    }
+
+    LOCK(ctx);
+    ctx->threads--;
+    UNLOCK(ctx);
+
+    nk_thread_queue_wake_all(ctx->done_wq);
+}
+
+
+// runs callbacks for a context with NK_FS_AIO_COMPLETION_THREAD
+static void
+completer (void * in, void ** out)
+{
+    LOCK_CONF;
+    struct nk_fs_aio_ctx * ctx = (struct nk_fs_aio_ctx *)in;
+    struct nk_fs_aio_op op;
+    struct nk_fs_aio_cqe cqe;
+
+    nk_thread_name(get_cur_thread(), "fs-aio-completion");
+
+    while (1) {
+        LOCK(ctx);
+
+        if (ctx->cbq_head == ctx->cbq_tail) {
+            if (ctx->stopping) {
+                UNLOCK(ctx);
+                break;
+            }
+            UNLOCK(ctx);
+            nk_thread_queue_sleep_extended(ctx->done_wq, cbq_ready, ctx);
+            continue;
+        }
+
+        op = ctx->cbq[ctx->cbq_head++ & MASK(ctx)];
+
+        UNLOCK(ctx);
+
+        cqe.priv = op.priv;
+        cqe.result = (ssize_t)op.len;
+
+        op.callback(&cqe);
+
+        LOCK(ctx);
+        ctx->outstanding--;
+        UNLOCK(ctx);
+
+        nk_thread_queue_wake_all(ctx->done_wq);
+    }
+
+    LOCK(ctx);
+    ctx->threads--;
+    UNLOCK(ctx);
+
+    nk_thread_queue_wake_all(ctx->done_wq);
+}
+
+
+static void
+ctx_free (struct nk_fs_aio_ctx * ctx)
+{
+    if (ctx->work_wq) {
+        nk_thread_queue_destroy(ctx->work_wq);
+    }
+    if (ctx->done_wq) {
+        nk_thread_queue_destroy(ctx->done_wq);
+    }
+    free(ctx->sq);
+    free(ctx->cq);
+    free(ctx->cbq);
+    free(ctx);
+}
+
+
+struct nk_fs_aio_ctx *
+nk_fs_aio_create (uint32_t entries, uint32_t workers, uint64_t flags)
+{
+    LOCK_CONF;
+    struct nk_fs_aio_ctx * ctx;
+    uint32_t i;
+
+    if (!entries || !workers || workers > MAX_WORKERS) {
+        ERROR("Bad context geometry (%u entries, %u workers)\n", entries, workers);
+        return 0;
+    }
+
+    ctx = malloc(sizeof(*ctx));
+
+    if (!ctx) {
+        ERROR("Cannot allocate context\n");
+        return 0;
+    }
+
+    memset(ctx, 0, sizeof(*ctx));
+
+    for (ctx->entries = 1; ctx->entries < entries; ctx->entries <<= 1) {}
+
+    ctx->flags = flags;
+
+    spinlock_init(&ctx->lock);
+
+    ctx->sq = malloc(sizeof(struct nk_fs_aio_op) * ctx->entries);
+    ctx->cq = malloc(sizeof(struct nk_fs_aio_cqe) * ctx->entries);
+    ctx->cbq = malloc(sizeof(struct nk_fs_aio_op) * ctx->entries);
+    ctx->work_wq = nk_thread_queue_create();
+    ctx->done_wq = nk_thread_queue_create();
+
+    if (!ctx->sq || !ctx->cq || !ctx->cbq || !ctx->work_wq || !ctx->done_wq) {
+        ERROR("Cannot allocate rings\n");
+        ctx_free(ctx);
+        return 0;
+    }
+
+    for (i = 0; i < workers + !!(flags & NK_FS_AIO_COMPLETION_THREAD); i++) {
+        LOCK(ctx);
+        ctx->threads++;
+        UNLOCK(ctx);
+        if (nk_thread_start(i < workers ? worker : completer, ctx, 0, 1, TSTACK_DEFAULT, 0, CPU_ANY)) {
+            ERROR("Cannot start thread\n");
+            LOCK(ctx);
+            ctx->threads--;
+            UNLOCK(ctx);
+            nk_fs_aio_destroy(ctx);
+            return 0;
+        }
+    }
+
+    DEBUG("created context with %u entries and %u workers\n", ctx->entries, workers);
+
+    return ctx;
+}
+
+
+int
+nk_fs_aio_destroy (struct nk_fs_aio_ctx * ctx)
+{
+    LOCK_CONF;
+    // unreaped completions are simply dropped
+    LOCK(ctx);
+    ctx->outstanding -= ctx->cq_tail - ctx->cq_head;
+    ctx->cq_owed -= ctx->cq_tail - ctx->cq_head;
+    ctx->cq_head = ctx->cq_tail;
+    UNLOCK(ctx);
+
+    while (ctx->outstanding) {
+        nk_thread_queue_sleep_extended(ctx->done_wq, idle, ctx);
+        LOCK(ctx);
+        ctx->outstanding -= ctx->cq_tail - ctx->cq_head;
+        ctx->cq_owed -= ctx->cq_tail - ctx->cq_head;
+        ctx->cq_head = ctx->cq_tail;
+        UNLOCK(ctx);
+    }
+
+    LOCK(ctx);
+    ctx->stopping = 1;
+    UNLOCK(ctx);
+
+    nk_thread_queue_wake_all(ctx->work_wq);
+    nk_thread_queue_wake_all(ctx->done_wq);
+
+    nk_thread_queue_sleep_extended(ctx->done_wq, all_done, ctx);
+
+    DEBUG("destroyed context after %lu operations\n", ctx->stats.completed);
+
+    ctx_free(ctx);
+
+    return 0;
+}
+
+
+int
+nk_fs_aio_submit (struct nk_fs_aio_ctx * ctx, struct nk_fs_aio_op * ops, int n)
+{
+    LOCK_CONF;
+    int i;
+
+    if (n < 0) {
+        return -1;
+    }
+
+    LOCK(ctx);
+
+    if (ctx->stopping) {
+        UNLOCK(ctx);
+        return -1;
+    }
+
+    for (i = 0; i < n && ctx->outstanding < ctx->entries; i++) {
+        ctx->sq[ctx->sq_tail++ & MASK(ctx)] = ops[i];
+        ctx->outstanding++;
+        if (!ops[i].callback) {
+            ctx->cq_owed++;
+        }
+    }
+
+    ctx->stats.submitted += i;
+
+    UNLOCK(ctx);
+
+    if (i) {
+        nk_thread_queue_wake_all(ctx->work_wq);
+    }
+
+    DEBUG("queued %d of %d operations\n", i, n);
+
+    return i;
+}
+
+
+int
+nk_fs_aio_reap (struct nk_fs_aio_ctx * ctx, struct nk_fs_aio_cqe * cqes, int max, int min)
+{
+    LOCK_CONF;
+    int n = 0;
+
+    while (1) {
+        LOCK(ctx);
+
+        while (n < max && ctx->cq_head != ctx->cq_tail) {
+            cqes[n++] = ctx->cq[ctx->cq_head++ & MASK(ctx)];
+            ctx->outstanding--;
+            ctx->cq_owed--;
+        }
+
+        // don't wait for what can never arrive
+        if (n + ctx->cq_owed < min) {
+            min = n + ctx->cq_owed;
+        }
+
+        UNLOCK(ctx);
+
+        if (n >= min || n == max) {
+            return n;
+        }
+
+        nk_thread_queue_sleep_extended(ctx->done_wq, cq_ready, ctx);
+    }
+}
+
+
+void
+nk_fs_aio_dump (struct nk_fs_aio_ctx * ctx)
+{
+    nk_vc_printf("aio %p: %u entries, %u outstanding, %u in progress\n",
+                 ctx, ctx->entries, ctx->outstanding, ctx->inflight);
+    nk_vc_printf("  %lu submitted, %lu completed, %lu errors, %lu bytes, %lu max in progress\n",
+                 ctx->stats.submitted, ctx->stats.completed, ctx->stats.errors,
+                 ctx->stats.bytes, ctx->stats.max_inflight);
+}
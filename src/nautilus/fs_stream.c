@@ -0,0 +1,588 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/thread.h>
+#include <nautilus/mutex.h>
+#include <nautilus/fs.h>
+#include <nautilus/fs_aio.h>
+#include <nautilus/fs_stream.h>
+
+#ifndef NAUT_CONFIG_DEBUG_FILESYSTEM
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif
+
+#define INFO(fmt, args...)  INFO_PRINT("fs_stream: " fmt, ##args)
+#define ERROR(fmt, args...) ERROR_PRINT("fs_stream: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("fs_stream: " fmt, ##args)
+
+#ifndef NAUT_CONFIG_FS_READAHEAD_MIN_KB
+#define NAUT_CONFIG_FS_READAHEAD_MIN_KB 16
+#endif
+#ifndef NAUT_CONFIG_FS_READAHEAD_MAX_KB
+#define NAUT_CONFIG_FS_READAHEAD_MAX_KB 256
+#endif
+#ifndef NAUT_CONFIG_FS_WRITE_BEHIND_KB
+#define NAUT_CONFIG_FS_WRITE_BEHIND_KB 128
+#endif
+#ifndef NAUT_CONFIG_FS_STREAM_WORKERS
+#define NAUT_CONFIG_FS_STREAM_WORKERS 2
+#endif
+
+// each stream has at most three operations outstanding
+#define AIO_ENTRIES 256
+
+#define STAT_ADD(f, n) __sync_fetch_and_add(&stats.f, (n))
+
+static struct nk_fs_stream_tuning tuning = {
+    .ra_min  = NAUT_CONFIG_FS_READAHEAD_MIN_KB * 1024,
+    .ra_max  = NAUT_CONFIG_FS_READAHEAD_MAX_KB * 1024,
+    .wb      = NAUT_CONFIG_FS_WRITE_BEHIND_KB * 1024,
+    .workers = NAUT_CONFIG_FS_STREAM_WORKERS,
+};
+
+static struct nk_fs_stream_stats stats;
+
+static nk_thread_queue_t    *wq;        // waiters for any buffer
+static struct nk_fs_aio_ctx *aio;
+static int                   aio_failed;
+static nk_mutex_t            aio_lock;
+
+
+int
+nk_fs_stream_init (void)
+{
+    wq = nk_thread_queue_create();
+
+    if (!wq) {
+        ERROR("Cannot create wait queue\n");
+        return -1;
+    }
+
+    INFO("readahead %lu-%lu bytes, write-behind %lu bytes\n",
+         tuning.ra_min, tuning.ra_max, tuning.wb);
+
+    return 0;
+}
+
+
+// the shared context is created on first use, and if that fails,
+// the background I/O is done synchronously instead
+static struct nk_fs_aio_ctx *
+get_aio (void)
+{
+    if (aio || aio_failed) {
+        return aio;
+    }
+
+    nk_mutex_lock(&aio_lock);
+    if (!aio && !aio_failed) {
+        aio = nk_fs_aio_create(AIO_ENTRIES, tuning.workers, 0);
+        if (!aio) {
+            ERROR("Cannot create aio context, doing background I/O synchronously\n");
+            aio_failed = 1;
+        }
+    }
+    nk_mutex_unlock(&aio_lock);
+
+    return aio;
+}
+
+
+static int
+buf_idle (void * state)
+{
+    return !((struct nk_fs_stream_buf *)state)->busy;
+}
+
+
+static void
+buf_wait (struct nk_fs_stream_buf * b)
+{
+    if (b->busy) {
+        nk_thread_queue_sleep_extended(wq, buf_idle, b);
+    }
+}
+
+
+// runs on an aio worker, and the buffer's stream may be gone
+// as soon as busy is clear
+static void
+io_done (struct nk_fs_aio_cqe * cqe)
+{
+    struct nk_fs_stream_buf * b = (struct nk_fs_stream_buf *)cqe->priv;
+
+    b->result = cqe->result;
+    __sync_synchronize();
+    b->busy = 0;
+    nk_thread_queue_wake_all(wq);
+}
+
+
+// transfer the buffer's first len bytes at b->start
+static void
+buf_start (nk_fs_fd_t fd, struct nk_fs_stream_buf * b, int opcode, uint64_t len)
+{
+    struct nk_fs_aio_ctx * ctx = get_aio();
+    struct nk_fs_aio_op op = {
+        .opcode   = opcode,
+        .fd       = fd,
+        .buf      = b->data,
+        .len      = len,
+        .offset   = b->start,
+        .callback = io_done,
+        .priv     = b,
+        .flags    = NK_FS_AIO_NO_STREAM,
+    };
+
+    b->busy = 1;
+
+    if (ctx && nk_fs_aio_submit(ctx, &op, 1) == 1) {
+        return;
+    }
+
+    // no context, or it is full
+    if (opcode == NK_FS_AIO_READ) {
+        b->result = _nk_fs_pread(fd, b->data, len, b->start);
+    } else {
+        b->result = _nk_fs_pwrite(fd, b->data, len, b->start);
+    }
+    b->busy = 0;
+}
+
+
+static int
+bufs_alloc (struct nk_fs_stream_buf * b, uint64_t size)
+{
+    b[0].data = malloc(size);
+    b[1].data = malloc(size);
+
+    if (!b[0].data || !b[1].data) {
+        free(b[0].data);
+        free(b[1].data);
+        b[0].data = b[1].data = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+struct nk_fs_stream *
+nk_fs_stream_create (int flags)
+{
+    struct nk_fs_stream * s;
+    int ra = (flags & O_RDONLY) && tuning.ra_max;
+    int wb = (flags & O_WRONLY) && tuning.wb;
+
+    if (!ra && !wb) {
+        return 0;
+    }
+
+    s = malloc(sizeof(*s));
+
+    if (!s) {
+        ERROR("Cannot allocate stream\n");
+        return 0;
+    }
+
+    memset(s, 0, sizeof(*s));
+
+    // buffers are allocated when first needed
+    s->ra_size = ra ? tuning.ra_max : 0;
+    s->wb_size = wb ? tuning.wb : 0;
+    s->window = tuning.ra_min < s->ra_size ? tuning.ra_min : s->ra_size;
+
+    return s;
+}
+
+
+/*
+ * Readahead
+ *
+ * A buffer covers [start, start+len) once it has been issued, and
+ * holds result bytes of it once it is no longer busy.  len of zero
+ * means it is unused.
+ */
+
+static struct nk_fs_stream_buf *
+ra_find (struct nk_fs_stream * s, uint64_t off)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        struct nk_fs_stream_buf * b = &s->ra[i];
+        if (b->len && off >= b->start && off < b->start + b->len) {
+            return b;
+        }
+    }
+
+    return 0;
+}
+
+
+static void
+ra_drop (struct nk_fs_stream * s)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        buf_wait(&s->ra[i]);
+        s->ra[i].len = 0;
+    }
+}
+
+
+// read the next window at off into a buffer other than keep
+static struct nk_fs_stream_buf *
+ra_fill (struct nk_fs_stream * s, nk_fs_fd_t fd, uint64_t off, struct nk_fs_stream_buf * keep)
+{
+    struct nk_fs_stream_buf * b = &s->ra[0];
+
+    if (b == keep || (b->busy && !s->ra[1].busy && &s->ra[1] != keep)) {
+        b = &s->ra[1];
+    }
+
+    buf_wait(b);
+
+    b->start = off;
+    b->len = s->window;
+
+    DEBUG("readahead %lu bytes at %lu\n", b->len, b->start);
+
+    STAT_ADD(ra_fills, 1);
+    STAT_ADD(ra_bytes, b->len);
+
+    buf_start(fd, b, NK_FS_AIO_READ, b->len);
+
+    s->window = s->window * 2 < s->ra_size ? s->window * 2 : s->ra_size;
+
+    return b;
+}
+
+
+static ssize_t
+ra_copy (struct nk_fs_stream * s, nk_fs_fd_t fd, uint8_t * buf, size_t len, uint64_t pos, int fill, int * hit)
+{
+    struct nk_fs_stream_buf * b = 0;
+    uint64_t done = 0, off, avail, c;
+
+    while (done < len) {
+        off = pos + done;
+        b = ra_find(s, off);
+        if (!b) {
+            if (!fill) {
+                break;
+            }
+            b = ra_fill(s, fd, off, 0);
+        }
+        if (b->busy) {
+            *hit = 0;
+            buf_wait(b);
+        }
+        if (b->result < 0) {
+            // let the caller's direct read report it
+            b->len = 0;
+            break;
+        }
+        if (off >= b->start + b->result) {
+            break;   // end of file
+        }
+        avail = b->start + b->result - off;
+        c = len - done < avail ? len - done : avail;
+        memcpy(buf + done, b->data + (off - b->start), c);
+        done += c;
+    }
+
+    // stay one window ahead of the reader
+    if (fill && b && b->len && b->result == b->len &&
+        !ra_find(s, b->start + b->len)) {
+        ra_fill(s, fd, b->start + b->len, b);
+    }
+
+    return done;
+}
+
+
+/*
+ * Write-behind
+ *
+ * wb[cur_wb] is being filled, and the other one is either unused
+ * (len of zero) or has been issued and not yet looked at.
+ */
+
+static void
+wb_reap (struct nk_fs_stream * s, struct nk_fs_stream_buf * b)
+{
+    buf_wait(b);
+
+    if (b->len && b->result != (ssize_t)b->len) {
+        ERROR("Write of %lu bytes at %lu failed\n", b->len, b->start);
+        STAT_ADD(wb_errors, 1);
+        s->error = 1;
+    }
+
+    b->len = 0;
+}
+
+
+static void
+wb_push (struct nk_fs_stream * s, nk_fs_fd_t fd)
+{
+    struct nk_fs_stream_buf * cur = &s->wb[s->cur_wb];
+    struct nk_fs_stream_buf * other = &s->wb[!s->cur_wb];
+
+    // one write at a time, so that they extend the file in order
+    if (other->busy) {
+        STAT_ADD(wb_waits, 1);
+    }
+    wb_reap(s, other);
+
+    DEBUG("write-behind %lu bytes at %lu\n", cur->len, cur->start);
+
+    STAT_ADD(wb_writes, 1);
+    STAT_ADD(wb_bytes, cur->len);
+
+    buf_start(fd, cur, NK_FS_AIO_WRITE, cur->len);
+
+    s->cur_wb = !s->cur_wb;
+}
+
+
+static int
+wb_flush (struct nk_fs_stream * s, nk_fs_fd_t fd)
+{
+    int err;
+
+    if (s->wb[s->cur_wb].len) {
+        wb_push(s, fd);
+    }
+
+    wb_reap(s, &s->wb[0]);
+    wb_reap(s, &s->wb[1]);
+
+    err = s->error;
+    s->error = 0;
+
+    return err ? -1 : 0;
+}
+
+
+ssize_t
+nk_fs_stream_read (struct nk_fs_stream * s, nk_fs_fd_t fd, void * buf, size_t len, off_t pos)
+{
+    ssize_t n;
+    int hit = 1;
+
+    nk_mutex_lock(&s->lock);
+
+    if (s->wb_size && wb_flush(s, fd)) {
+        nk_mutex_unlock(&s->lock);
+        return -1;
+    }
+
+    if (len >= s->ra_size) {
+        // buffering would only add a copy
+        n = _nk_fs_pread(fd, buf, len, pos);
+        goto out;
+    }
+
+    if (!s->ra[0].data && bufs_alloc(s->ra, s->ra_size)) {
+        ERROR("Cannot allocate readahead buffers, continuing without\n");
+        s->ra_size = 0;
+        n = _nk_fs_pread(fd, buf, len, pos);
+        goto out;
+    }
+
+    if ((uint64_t)pos != s->next) {
+        // random access, readahead would be wasted
+        STAT_ADD(ra_resets, 1);
+        s->window = tuning.ra_min < s->ra_size ? tuning.ra_min : s->ra_size;
+        n = ra_copy(s, fd, buf, len, pos, 0, &hit);
+    } else {
+        n = ra_copy(s, fd, buf, len, pos, 1, &hit);
+    }
+
+    if (n < (ssize_t)len && !ra_find(s, pos + n)) {
+        // anything we could not get from readahead, usually just
+        // the end of the file
+        ssize_t rest = _nk_fs_pread(fd, (uint8_t *)buf + n, len - n, pos + n);
+        if (rest < 0 && !n) {
+            n = -1;
+        } else if (rest > 0) {
+            n += rest;
+        }
+        hit = 0;
+    }
+
+    if (hit) {
+        STAT_ADD(ra_hits, 1);
+    } else {
+        STAT_ADD(ra_misses, 1);
+    }
+
+ out:
+    if (n > 0) {
+        s->next = pos + n;
+    }
+
+    nk_mutex_unlock(&s->lock);
+
+    return n;
+}
+
+
+ssize_t
+nk_fs_stream_write (struct nk_fs_stream * s, nk_fs_fd_t fd, void * buf, size_t len, off_t pos)
+{
+    struct nk_fs_stream_buf * cur;
+    uint64_t done = 0, c;
+    ssize_t n;
+
+    nk_mutex_lock(&s->lock);
+
+    if (s->ra_size) {
+        ra_drop(s);
+    }
+
+    if (len >= s->wb_size) {
+        n = wb_flush(s, fd) ? -1 : _nk_fs_pwrite(fd, buf, len, pos);
+        goto out;
+    }
+
+    if (!s->wb[0].data && bufs_alloc(s->wb, s->wb_size)) {
+        ERROR("Cannot allocate write-behind buffers, continuing without\n");
+        s->wb_size = 0;
+        n = _nk_fs_pwrite(fd, buf, len, pos);
+        goto out;
+    }
+
+    cur = &s->wb[s->cur_wb];
+
+    // not sequential, write out what we have first
+    if (cur->len && (uint64_t)pos != cur->start + cur->len && wb_flush(s, fd)) {
+        n = -1;
+        goto out;
+    }
+
+    // report a failed background write
+    if (s->error) {
+        s->error = 0;
+        n = -1;
+        goto out;
+    }
+
+    while (done < len) {
+        cur = &s->wb[s->cur_wb];
+        if (!cur->len) {
+            cur->start = pos + done;
+        }
+        c = len - done < s->wb_size - cur->len ? len - done : s->wb_size - cur->len;
+        memcpy(cur->data + cur->len, (uint8_t *)buf + done, c);
+        cur->len += c;
+        done += c;
+        if (cur->len == s->wb_size) {
+            wb_push(s, fd);
+        }
+    }
+
+    n = len;
+
+ out:
+    nk_mutex_unlock(&s->lock);
+
+    return n;
+}
+
+
+int
+nk_fs_stream_flush (struct nk_fs_stream * s, nk_fs_fd_t fd)
+{
+    int rc = 0;
+
+    nk_mutex_lock(&s->lock);
+    if (s->wb_size) {
+        rc = wb_flush(s, fd);
+    }
+    if (s->ra_size) {
+        ra_drop(s);
+    }
+    nk_mutex_unlock(&s->lock);
+
+    return rc;
+}
+
+
+int
+nk_fs_stream_destroy (struct nk_fs_stream * s, nk_fs_fd_t fd)
+{
+    int rc = nk_fs_stream_flush(s, fd);
+
+    free(s->ra[0].data);
+    free(s->ra[1].data);
+    free(s->wb[0].data);
+    free(s->wb[1].data);
+    free(s);
+
+    return rc;
+}
+
+
+void
+nk_fs_stream_get_tuning (struct nk_fs_stream_tuning * t)
+{
+    *t = tuning;
+}
+
+
+int
+nk_fs_stream_set_tuning (struct nk_fs_stream_tuning * t)
+{
+    if (t->ra_max && (!t->ra_min || t->ra_min > t->ra_max)) {
+        ERROR("Readahead minimum must be nonzero and at most the maximum\n");
+        return -1;
+    }
+
+    tuning.ra_min = t->ra_min;
+    tuning.ra_max = t->ra_max;
+    tuning.wb = t->wb;
+
+    if (!aio && t->workers) {
+        tuning.workers = t->workers;
+    }
+
+    return 0;
+}
+
+
+void
+nk_fs_stream_dump (void)
+{
+    nk_vc_printf("readahead %lu-%lu bytes, write-behind %lu bytes, %u workers\n",
+                 tuning.ra_min, tuning.ra_max, tuning.wb, tuning.workers);
+    nk_vc_printf("readahead: %lu hits %lu misses %lu resets %lu fills %lu bytes\n",
+                 stats.ra_hits, stats.ra_misses, stats.ra_resets,
+                 stats.ra_fills, stats.ra_bytes);
+    nk_vc_printf("write-behind: %lu writes %lu bytes %lu waits %lu errors\n",
+                 stats.wb_writes, stats.wb_bytes, stats.wb_waits, stats.wb_errors);
+    if (aio) {
+        nk_fs_aio_dump(aio);
+    }
+}
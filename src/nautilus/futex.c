@@ -0,0 +1,274 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/futex.h>
+#include <nautilus/thread.h>
+#include <nautilus/scheduler.h>
+#include <nautilus/timer.h>
+#include <nautilus/irq.h>
+#include <nautilus/errno.h>
+#include <nautilus/list.h>
+
+#ifndef NAUT_CONFIG_DEBUG_SYNCH
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif
+
+#define ERROR(fmt, args...) ERROR_PRINT("futex: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("futex: " fmt, ##args)
+
+#define FUTEX_HASH_BITS 8
+#define FUTEX_BUCKETS   (1 << FUTEX_HASH_BITS)
+
+static struct futex_bucket {
+    spinlock_t       lock;
+    struct list_head waiters;
+} __align(64) buckets[FUTEX_BUCKETS];
+
+// lives on the waiting thread's stack
+struct futex_waiter {
+    struct list_head      node;
+    volatile uint32_t *   addr;
+    struct nk_thread *    thread;
+    struct futex_bucket * bucket;
+    volatile int          woken;
+    volatile int          expired;
+};
+
+
+static inline struct futex_bucket *
+hash_bucket (volatile uint32_t * addr)
+{
+    uint64_t a = (uint64_t)addr >> 2;
+
+    // Fibonacci hashing
+    a *= 0x9e3779b97f4a7c15ULL;
+
+    return &buckets[a >> (64 - FUTEX_HASH_BITS)];
+}
+
+
+// buckets start out zeroed, fix the list head on first use
+static inline void
+bucket_lazy_init (struct futex_bucket * b)
+{
+    if (!b->waiters.next) {
+        INIT_LIST_HEAD(&b->waiters);
+    }
+}
+
+
+static inline void
+wake_waiter (struct futex_waiter * w)
+{
+    struct nk_thread * t = w->thread;
+
+    list_del_init(&w->node);
+
+    ASSERT(t->status == NK_THR_WAITING);
+
+    if (nk_sched_awaken(t, t->current_cpu)) {
+        ERROR("Failed to awaken thread %lu (%s)\n", t->tid, t->name);
+        return;
+    }
+
+    nk_sched_kick_cpu(t->current_cpu);
+}
+
+
+/*
+ * Timer callback.  Timer callbacks for CPU 0 run synchronously
+ * within the timer handler, under the timer state lock, so once
+ * nk_cancel_timer() returns in the waiter this can no longer be
+ * running and the waiter record is safe to discard.
+ */
+static void
+futex_timeout (void * state)
+{
+    struct futex_waiter * w = (struct futex_waiter *)state;
+    struct futex_bucket * b = w->bucket;
+    uint8_t flags;
+
+    flags = spin_lock_irq_save(&b->lock);
+
+    // an nk_futex_wake() that got here first wins
+    if (!w->woken) {
+        w->expired = 1;
+        if (!list_empty(&w->node)) {
+            DEBUG("Timeout for thread %lu on %p\n", w->thread->tid, w->addr);
+            wake_waiter(w);
+        }
+    }
+
+    spin_unlock_irq_restore(&b->lock, flags);
+}
+
+
+int
+nk_futex_wait (volatile uint32_t * addr, uint32_t expected, uint64_t timeout_ns)
+{
+    struct futex_bucket * b = hash_bucket(addr);
+    struct nk_timer * timer = NULL;
+    struct futex_waiter w;
+    uint8_t flags;
+
+    ASSERT(!in_interrupt_context());
+
+    INIT_LIST_HEAD(&w.node);
+    w.addr = addr;
+    w.thread = get_cur_thread();
+    w.bucket = b;
+    w.woken = 0;
+    w.expired = 0;
+
+    // arming the timer takes the timer lock, which the callback
+    // holds while taking the bucket lock, so this must come first
+    if (timeout_ns != NK_FUTEX_NO_TIMEOUT) {
+        timer = nk_alloc_timer();
+        if (!timer) {
+            ERROR("Cannot allocate timer\n");
+            return -ENOMEM;
+        }
+        nk_set_timer(timer, timeout_ns, TIMER_CALLBACK, futex_timeout, &w, 0);
+    }
+
+    flags = spin_lock_irq_save(&b->lock);
+
+    bucket_lazy_init(b);
+
+    if (*addr != expected || w.expired) {
+        spin_unlock_irq_restore(&b->lock, flags);
+        if (timer) {
+            nk_cancel_timer(timer);
+            nk_free_timer(timer);
+        }
+        return w.expired ? -ETIMEDOUT : -EAGAIN;
+    }
+
+    DEBUG("Thread %lu (%s) waiting on %p (%u)\n", w.thread->tid, w.thread->name, addr, expected);
+
+    list_add_tail(&w.node, &b->waiters);
+    w.thread->status = NK_THR_WAITING;
+
+    __asm__ __volatile__ ("mfence" : : : "memory");
+
+    // same protocol as nk_thread_queue_sleep_extended():  the
+    // scheduler releases the bucket lock once we are off the CPU
+    preempt_disable();
+    irq_enable_restore(flags);
+    nk_sched_sleep(&b->lock);
+
+    if (timer) {
+        nk_cancel_timer(timer);
+        nk_free_timer(timer);
+    }
+
+    DEBUG("Thread %lu (%s) resumes from %p%s\n", w.thread->tid, w.thread->name, addr,
+          w.expired ? " (timeout)" : "");
+
+    return w.expired ? -ETIMEDOUT : 0;
+}
+
+
+int
+nk_futex_wake (volatile uint32_t * addr, int n)
+{
+    struct futex_bucket * b = hash_bucket(addr);
+    struct futex_waiter * w, * tmp;
+    uint8_t flags;
+    int woken = 0;
+
+    flags = spin_lock_irq_save(&b->lock);
+
+    bucket_lazy_init(b);
+
+    list_for_each_entry_safe(w, tmp, &b->waiters, node) {
+        if (woken >= n) {
+            break;
+        }
+        if (w->addr == addr) {
+            w->woken = 1;
+            wake_waiter(w);
+            woken++;
+        }
+    }
+
+    spin_unlock_irq_restore(&b->lock, flags);
+
+    DEBUG("Woke %d waiters on %p\n", woken, addr);
+
+    return woken;
+}
+
+
+/*
+ * A latch built directly on a futex word, and a timed wait that
+ * nobody wakes.
+ */
+#define TEST_WAITERS 4
+
+static volatile uint32_t test_latch;
+static volatile uint32_t test_passed;
+
+static void
+test_waiter (void * in, void ** out)
+{
+    while (!test_latch) {
+        nk_futex_wait(&test_latch, 0, NK_FUTEX_NO_TIMEOUT);
+    }
+    __sync_fetch_and_add(&test_passed, 1);
+}
+
+
+void
+nk_futex_test (void)
+{
+    nk_thread_id_t t[TEST_WAITERS];
+    volatile uint32_t word = 0;
+    int i, rc;
+
+    test_latch = 0;
+    test_passed = 0;
+
+    for (i = 0; i < TEST_WAITERS; i++) {
+        nk_thread_start(test_waiter, NULL, NULL, 0, TSTACK_DEFAULT, &t[i], i % nk_get_num_cpus());
+    }
+
+    // let the waiters block, though the latch works either way
+    for (i = 0; i < 1000; i++) {
+        nk_yield();
+    }
+
+    test_latch = 1;
+    rc = nk_futex_wake_all(&test_latch);
+
+    for (i = 0; i < TEST_WAITERS; i++) {
+        nk_join(t[i], NULL);
+    }
+
+    nk_vc_printf("futex test: latch released %u of %d waiters (%d woken by wake)\n",
+                 test_passed, TEST_WAITERS, rc);
+
+    rc = nk_futex_wait(&word, 1, NK_FUTEX_NO_TIMEOUT);
+    nk_vc_printf("futex test: mismatched wait returns %d (expect %d)\n", rc, -EAGAIN);
+
+    rc = nk_futex_wait(&word, 0, 1000000);
+    nk_vc_printf("futex test: timed wait returns %d (expect %d)\n", rc, -ETIMEDOUT);
+}
@@ -27,6 +27,9 @@
 #include <nautilus/thread.h>
 #include <nautilus/atomic.h>
 #include <nautilus/list.h>
+#include <nautilus/tsc.h>
+#include <nautilus/vc.h>
+#include <nautilus/trace.h>
 
 #include <nautilus/group.h>
 #include <nautilus/group_sched.h>
@@ -62,6 +65,8 @@
 typedef struct group_member {
   nk_thread_t *thread;
   struct list_head group_member_node;
+  // written only by the member itself, or by the scheduler on its behalf
+  struct nk_thread_group_member_stats stats;
 } group_member_t;
 
 typedef struct nk_thread_group {
@@ -84,6 +89,17 @@ typedef struct nk_thread_group {
 
   void *state;
 
+  // gang tracking, updated by the schedulers of all members
+  spinlock_t stats_lock;
+  uint64_t gang_period;     // the period being tracked
+  uint64_t gang_seen;       // members that have started in it so far
+  uint64_t gang_first;
+  uint64_t gang_last;
+  struct nk_hist gang_skew;
+  uint64_t gang_partial;
+  // stats of members that have left
+  struct nk_thread_group_member_stats departed;
+
   struct list_head thread_group_node;
 } nk_thread_group_t;
 
@@ -151,7 +167,7 @@ thread_group_member_create(void) {
     return NULL;
   }
 
-  if (memset(group_member, 0, sizeof(group_member)) == NULL) {
+  if (memset(group_member, 0, sizeof(group_member_t)) == NULL) {
     FREE(group_member);
     ERROR("Fail to clear memory for group member!\n");
     return NULL;
@@ -183,6 +199,27 @@ thread_group_get_next_group_id(void) {
   }
 }
 
+static void
+member_stats_merge(struct nk_thread_group_member_stats *dst, struct nk_thread_group_member_stats *src) {
+  nk_hist_merge(&dst->barrier_wait, &src->barrier_wait);
+  nk_hist_merge(&dst->change, &src->change);
+  nk_hist_merge(&dst->slice_util, &src->slice_util);
+  dst->change_fails += src->change_fails;
+  dst->change_defaults += src->change_defaults;
+}
+
+// the current thread's stats, if it is a member of group
+static inline struct nk_thread_group_member_stats *
+cur_member_stats(nk_thread_group_t *group) {
+  nk_thread_t *c = get_cur_thread();
+
+  if (c->group != group || !c->group_member) {
+    return NULL;
+  }
+
+  return &c->group_member->stats;
+}
+
 static void
 thread_group_barrier_init (nk_barrier_t *barrier) {
   DEBUG_BARRIER("Initializing group barrier, group barrier at %p, count=%u\n", (void*)barrier, 0);
@@ -315,6 +352,7 @@ nk_thread_group_create(char *name) {
   list_add(&(new_group->thread_group_node), &(parallel_thread_group_list.group_list_node));
 
   spinlock_init(&new_group->group_lock);
+  spinlock_init(&new_group->stats_lock);
 
   new_group->group_id = thread_group_get_next_group_id();
 
@@ -397,13 +435,16 @@ nk_thread_group_join(nk_thread_group_t *group) {
   list_add(&group_member->group_member_node, &group->group_member_array[my_cpu_id()]);
   spin_unlock(&group->group_lock);
 
+  get_cur_thread()->group = group;
+  get_cur_thread()->group_member = group_member;
+
   return id;
 }
 
 // current thread leaves a group
 int
 nk_thread_group_leave(nk_thread_group_t *group) {
-  group_member_t *leaving_member;
+  group_member_t *leaving_member = NULL;
   struct nk_thread *cur_thread = get_cur_thread();
   struct list_head *cur;
 
@@ -426,9 +467,16 @@ nk_thread_group_leave(nk_thread_group_t *group) {
 
   list_del(&leaving_member->group_member_node);
 
+  if (cur_thread->group == group) {
+    cur_thread->group = NULL;
+    cur_thread->group_member = NULL;
+  }
+
+  member_stats_merge(&group->departed, &leaving_member->stats);
+
   spin_unlock(&group->group_lock);
 
-  FREE(&leaving_member);
+  FREE(leaving_member);
 
   thread_group_barrier_leave(&group->group_barrier);
 
@@ -455,7 +503,20 @@ nk_thread_group_delete(nk_thread_group_t *group) {
 // all threads in the group call to synchronize
 int
 nk_thread_group_barrier(nk_thread_group_t *group) {
-  return thread_group_barrier_wait(&group->group_barrier);
+  struct nk_thread_group_member_stats *stats = cur_member_stats(group);
+  uint64_t start = nk_tsc_get_ns();
+
+  NK_TRACE(NK_TRACE_BARRIER_ENTER, 0, group->group_id, get_cur_thread()->tid);
+
+  int res = thread_group_barrier_wait(&group->group_barrier);
+
+  NK_TRACE(NK_TRACE_BARRIER_EXIT, res == NK_BARRIER_LAST, group->group_id, get_cur_thread()->tid);
+
+  if (stats) {
+    nk_hist_add(&stats->barrier_wait, nk_tsc_get_ns() - start);
+  }
+
+  return res;
 }
 
 // all threads in the group call to select one thread as leader
@@ -549,3 +610,206 @@ uint64_t
 nk_thread_group_get_size(nk_thread_group_t *group) {
   return group->group_size;
 }
+
+// return the id of a group
+uint64_t
+nk_thread_group_get_id(nk_thread_group_t *group) {
+  return group->group_id;
+}
+
+// return the name of a group
+char *
+nk_thread_group_get_name(nk_thread_group_t *group) {
+  return group->group_name;
+}
+
+// apply f to every group
+void
+nk_thread_group_map(void (*f)(nk_thread_group_t *group, void *state), void *state) {
+  struct list_head *cur = NULL;
+  parallel_thread_group_list_t * l = &parallel_thread_group_list;
+
+  spin_lock(&l->group_list_lock);
+
+  list_for_each(cur, &l->group_list_node) {
+    f(list_entry(cur, nk_thread_group_t, thread_group_node), state);
+  }
+
+  spin_unlock(&l->group_list_lock);
+}
+
+/*****************************************************/
+/*********************Telemetry***********************/
+/*****************************************************/
+
+// Gang skew is keyed on the period number (the scheduler's arrival
+// count), which lines up across members since they are admitted
+// together by nk_group_sched_change_constraints.   A period is closed
+// once group_size members have started in it, or counted as partial
+// when some member moves on to a later period first.
+void
+nk_thread_group_note_start(struct nk_thread *t, uint64_t period, uint64_t now) {
+  nk_thread_group_t *group = t->group;
+
+  uint8_t flags = spin_lock_irq_save(&group->stats_lock);
+
+  if (period > group->gang_period || !group->gang_seen) {
+    if (group->gang_seen) {
+      group->gang_partial++;
+    }
+    group->gang_period = period;
+    group->gang_seen = 1;
+    group->gang_first = now;
+    group->gang_last = now;
+  } else if (period == group->gang_period) {
+    group->gang_seen++;
+    if (now < group->gang_first) {
+      group->gang_first = now;
+    }
+    if (now > group->gang_last) {
+      group->gang_last = now;
+    }
+  } else {
+    // a straggler from a period that has already been given up on
+    goto out;
+  }
+
+  if (group->gang_seen >= group->group_size) {
+    nk_hist_add(&group->gang_skew, group->gang_last - group->gang_first);
+    group->gang_seen = 0;
+    group->gang_period = period + 1;
+  }
+
+ out:
+  spin_unlock_irq_restore(&group->stats_lock, flags);
+}
+
+void
+nk_thread_group_note_period(struct nk_thread *t, uint64_t run, uint64_t slice) {
+  if (t->group_member && slice) {
+    nk_hist_add(&t->group_member->stats.slice_util, run * 1000 / slice);
+  }
+}
+
+void
+nk_thread_group_note_change(nk_thread_group_t *group, uint64_t ns, int failed, int defaulted) {
+  struct nk_thread_group_member_stats *stats = cur_member_stats(group);
+
+  if (stats) {
+    nk_hist_add(&stats->change, ns);
+    stats->change_fails += failed;
+    stats->change_defaults += defaulted;
+  }
+}
+
+int
+nk_thread_group_get_stats(nk_thread_group_t *group, struct nk_thread_group_stats *stats) {
+  struct list_head *cur;
+  int i;
+
+  memset(stats, 0, sizeof(*stats));
+
+  uint8_t flags = spin_lock_irq_save(&group->stats_lock);
+  stats->gang_skew = group->gang_skew;
+  stats->gang_partial = group->gang_partial;
+  spin_unlock_irq_restore(&group->stats_lock, flags);
+
+  spin_lock(&group->group_lock);
+
+  member_stats_merge(&stats->members, &group->departed);
+
+  for (i = 0; i < MAX_CPU_NUM; i++) {
+    list_for_each(cur, &group->group_member_array[i]) {
+      member_stats_merge(&stats->members, &list_entry(cur, group_member_t, group_member_node)->stats);
+    }
+  }
+
+  spin_unlock(&group->group_lock);
+
+  return 0;
+}
+
+void
+nk_thread_group_map_member_stats(nk_thread_group_t *group,
+                                 void (*f)(uint64_t tid, struct nk_thread_group_member_stats *stats, void *state),
+                                 void *state) {
+  struct list_head *cur;
+  group_member_t *m;
+  int i;
+
+  spin_lock(&group->group_lock);
+
+  for (i = 0; i < MAX_CPU_NUM; i++) {
+    list_for_each(cur, &group->group_member_array[i]) {
+      m = list_entry(cur, group_member_t, group_member_node);
+      f(m->thread->tid, &m->stats, state);
+    }
+  }
+
+  spin_unlock(&group->group_lock);
+}
+
+// members may be updating their own stats as we clear them, which at
+// worst leaves a stray sample behind
+void
+nk_thread_group_reset_stats(nk_thread_group_t *group) {
+  struct list_head *cur;
+  int i;
+
+  uint8_t flags = spin_lock_irq_save(&group->stats_lock);
+  group->gang_seen = 0;
+  group->gang_partial = 0;
+  nk_hist_reset(&group->gang_skew);
+  spin_unlock_irq_restore(&group->stats_lock, flags);
+
+  spin_lock(&group->group_lock);
+
+  memset(&group->departed, 0, sizeof(group->departed));
+
+  for (i = 0; i < MAX_CPU_NUM; i++) {
+    list_for_each(cur, &group->group_member_array[i]) {
+      memset(&list_entry(cur, group_member_t, group_member_node)->stats, 0,
+             sizeof(struct nk_thread_group_member_stats));
+    }
+  }
+
+  spin_unlock(&group->group_lock);
+}
+
+static void
+member_stats_print(struct nk_thread_group_member_stats *s) {
+  nk_hist_print_summary(&s->barrier_wait, "barrier-wait");
+  nk_hist_print_summary(&s->change, "change");
+  nk_hist_print_summary(&s->slice_util, "slice-util/1000");
+  nk_vc_printf("change failures %lu (%lu to defaults)\n", s->change_fails, s->change_defaults);
+}
+
+static void
+member_stats_dump(uint64_t tid, struct nk_thread_group_member_stats *stats, void *state) {
+  nk_vc_printf("member %lu:\n", tid);
+  member_stats_print(stats);
+}
+
+void
+nk_thread_group_dump_stats(nk_thread_group_t *group, int members) {
+  struct nk_thread_group_stats *stats = (struct nk_thread_group_stats *)MALLOC(sizeof(*stats));
+
+  if (!stats) {
+    ERROR("Fail to allocate stats!\n");
+    return;
+  }
+
+  nk_thread_group_get_stats(group, stats);
+
+  nk_vc_printf("group %lu \"%s\" (%lu members), times in ns\n",
+               group->group_id, group->group_name, group->group_size);
+  nk_hist_print_summary(&stats->gang_skew, "gang-skew");
+  nk_vc_printf("partial periods %lu\n", stats->gang_partial);
+  member_stats_print(&stats->members);
+
+  FREE(stats);
+
+  if (members) {
+    nk_thread_group_map_member_stats(group, member_stats_dump, 0);
+  }
+}
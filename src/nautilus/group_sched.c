@@ -25,6 +25,7 @@
 
 #include <nautilus/nautilus.h>
 #include <nautilus/scheduler.h>
+#include <nautilus/tsc.h>
 
 #include <nautilus/group.h>
 #include <nautilus/group_sched.h>
@@ -138,6 +139,8 @@ nk_group_sched_change_constraints(nk_thread_group_t *group, struct nk_sched_cons
   //get old constraints
   struct nk_thread *t = get_cur_thread();
   struct nk_sched_constraints old;
+  uint64_t start = nk_tsc_get_ns();
+  int defaulted = 0;
   nk_sched_thread_get_constraints(t, &old);
 
   if (nk_thread_group_check_leader(group) == 1) {
@@ -172,6 +175,7 @@ nk_group_sched_change_constraints(nk_thread_group_t *group, struct nk_sched_cons
     //if there is any failure, roll back to default constraints
     if (group_state.roll_back_to_old_fail) {
       DEBUG("Fail to roll back to old constraints, roll back to default constraints!\n");
+      defaulted = 1;
       if(group_sched_roll_back_constraint() != 0) {
         panic("Roll back to default constraints should not fail!\n");
         return -1;
@@ -188,5 +192,7 @@ nk_group_sched_change_constraints(nk_thread_group_t *group, struct nk_sched_cons
     spin_unlock(&group_change_constraint_lock);
   }
 
+  nk_thread_group_note_change(group, nk_tsc_get_ns() - start, res != 0, defaulted);
+
   return res;
 }
@@ -0,0 +1,136 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/vc.h>
+#include <nautilus/histogram.h>
+
+
+void
+nk_hist_reset (struct nk_hist *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+
+void
+nk_hist_merge (struct nk_hist *dst, struct nk_hist *src)
+{
+    int i;
+
+    if (!src->count) {
+        return;
+    }
+
+    if (!dst->count || src->min < dst->min) {
+        dst->min = src->min;
+    }
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+
+    dst->count += src->count;
+    dst->sum   += src->sum;
+
+    for (i = 0; i < NK_HIST_BUCKETS; i++) {
+        dst->bucket[i] += src->bucket[i];
+    }
+}
+
+
+uint64_t
+nk_hist_percentile (struct nk_hist *h, uint32_t permille)
+{
+    uint64_t rank, seen = 0, lo, hi, v;
+    int i;
+
+    if (!h->count) {
+        return 0;
+    }
+
+    // the rank'th smallest sample, 1-based
+    rank = (h->count * permille + 999) / 1000;
+    if (!rank) {
+        rank = 1;
+    }
+
+    for (i = 0; i < NK_HIST_BUCKETS; i++) {
+        if (seen + h->bucket[i] >= rank) {
+            break;
+        }
+        seen += h->bucket[i];
+    }
+
+    if (i == NK_HIST_BUCKETS) {
+        return h->max;
+    }
+
+    lo = nk_hist_bucket_low(i);
+    hi = i + 1 < NK_HIST_BUCKETS ? nk_hist_bucket_low(i + 1) : h->max + 1;
+    v  = lo + (hi - lo) * (rank - seen - 1) / h->bucket[i];
+
+    // the extremes are known exactly
+    if (v < h->min) {
+        v = h->min;
+    }
+    if (v > h->max) {
+        v = h->max;
+    }
+
+    return v;
+}
+
+
+void
+nk_hist_print_summary (struct nk_hist *h, char *name)
+{
+    nk_vc_printf("%-14s n=%lu avg=%lu min=%lu p50=%lu p90=%lu p99=%lu p99.9=%lu max=%lu\n",
+                 name,
+                 h->count,
+                 h->count ? h->sum / h->count : 0,
+                 h->min,
+                 nk_hist_percentile(h, 500),
+                 nk_hist_percentile(h, 900),
+                 nk_hist_percentile(h, 990),
+                 nk_hist_percentile(h, 999),
+                 h->max);
+}
+
+
+void
+nk_hist_print_buckets (struct nk_hist *h)
+{
+    uint64_t seen = 0;
+    int i;
+
+    for (i = 0; i < NK_HIST_BUCKETS; i++) {
+        if (!h->bucket[i]) {
+            continue;
+        }
+        seen += h->bucket[i];
+        if (i + 1 < NK_HIST_BUCKETS) {
+            nk_vc_printf("  [%lu, %lu) %u (%lu%% cumulative)\n",
+                         nk_hist_bucket_low(i), nk_hist_bucket_low(i + 1),
+                         h->bucket[i], seen * 100 / h->count);
+        } else {
+            nk_vc_printf("  [%lu, ...) %u (%lu%% cumulative)\n",
+                         nk_hist_bucket_low(i), h->bucket[i], seen * 100 / h->count);
+        }
+    }
+}
@@ -197,6 +197,42 @@ idt_get_entry (ulong_t entry, ulong_t *handler_addr, ulong_t *state_addr)
 }
 
 
+/*
+ * Find an unused vector for a dynamically configured interrupt
+ * source (e.g., MSI-X) and install the handler on it.  We search
+ * upwards from the middle of the range because vectors near the
+ * top are handed out to IOAPIC IRQs in decreasing order.
+ */
+int
+idt_find_and_reserve (ulong_t handler_addr, ulong_t state_addr, ulong_t *vec)
+{
+    static spinlock_t reserve_lock;
+    uint8_t flags;
+    ulong_t i;
+
+    flags = spin_lock_irq_save(&reserve_lock);
+
+    for (i = IDT_DYN_VEC_START; i <= IDT_DYN_VEC_END; i++) {
+        // does an IOAPIC IRQ own it?
+        if (nk_irq_is_assigned(0xef - i)) {
+            continue;
+        }
+        if (idt_handler_table[i] == (ulong_t)null_irq_handler) {
+            idt_assign_entry(i, handler_addr, state_addr);
+            spin_unlock_irq_restore(&reserve_lock, flags);
+            *vec = i;
+            return 0;
+        }
+    }
+
+    spin_unlock_irq_restore(&reserve_lock, flags);
+
+    ERROR_PRINT("No free interrupt vectors\n");
+
+    return -1;
+}
+
+
 extern void early_irq_handlers(void);
 extern void early_excp_handlers(void);
 
@@ -22,125 +22,244 @@
  */
 #include <nautilus/nautilus.h>
 #include <nautilus/printk.h>
-#include <nautilus/hashtable.h>
 #include <nautilus/naut_string.h>
 #include <nautilus/percpu.h>
 #include <nautilus/atomic.h>
 #include <nautilus/mm.h>
-#include <nautilus/libccompat.h>
+#include <nautilus/cpu.h>
+#include <nautilus/thread.h>
 #include <nautilus/irq.h>
 
 #include <nautilus/instrument.h>
+#include <nautilus/ksyms.h>
+
+/*
+  Function profiling is keyed on an address: the function itself
+  when called from -finstrument-functions hooks, or the function's
+  __func__ string when called from the NK_PROFILE_* macros.   Each
+  CPU has an open-addressed table of them, allocated at init, so
+  entry and exit neither allocate nor lock.  Slots are claimed
+  with a CAS, which only has to order against interrupts on the
+  same CPU since a CPU only updates its own table.   Times are in
+  cycles and converted using the CPU's frequency when reported.
+
+  Addresses are turned into names only at report time.
+*/
+
+#define FUNC_TABLE_SIZE   (1UL << NAUT_CONFIG_PROFILE_FUNC_TABLE_ORDER)
+#define FUNC_TABLE_PROBES 32
+
+#define NO_INSTR __attribute__((no_instrument_function))
 
 static uint8_t instr_active = 0;
+static uint64_t instr_epoch = 0;
 static uint64_t instr_start_count = 0;
 static uint64_t instr_end_count = 0;
 
-struct func_data {
+struct nk_instr_func {
+    const void * key;
+    const char * name;
     uint64_t call_count;
-    uint64_t avg_nsec;
-    uint64_t max_nsec;
-    uint64_t min_nsec;
-    uint64_t start_count;
-    uint64_t total_count;
+    uint64_t incl_cycles;
+    uint64_t excl_cycles;
+    uint64_t max_cycles;
+    uint64_t min_cycles;   // 0 => no complete call yet
 };
 
 
-static unsigned
-instr_hash_fn(addr_t key) {
-    char * name = (char *)key;
-    return nk_hash_buffer((uint8_t *)name, strlen(name));
+static void
+instr_calibrate (void)
+{
+    NK_PROFILE_ENTRY();
+
+    NK_PROFILE_EXIT();
 }
 
 
-static int
-instr_eq_fn (addr_t key1, addr_t key2) {
-    char * name1 = (char *)key1;
-    char * name2 = (char *)key2;
+static inline NO_INSTR struct nk_instr_func *
+instr_lookup (struct nk_instr_data * id, const void * key, const char * name)
+{
+    uint64_t h = ((uint64_t)key * 0x9e3779b97f4a7c15UL) >> (64 - NAUT_CONFIG_PROFILE_FUNC_TABLE_ORDER);
+    int i;
+
+    for (i = 0; i < FUNC_TABLE_PROBES; i++) {
+        struct nk_instr_func * f = &id->funcs[(h + i) & (FUNC_TABLE_SIZE - 1)];
 
-    return (strcmp(name1, name2) == 0);
+        if (f->key == key) {
+            return f;
+        }
+        if (!f->key) {
+            if (__sync_bool_compare_and_swap(&f->key, 0, key)) {
+                f->name = name;
+                return f;
+            }
+            // an interrupt claimed it first
+            if (f->key == key) {
+                return f;
+            }
+        }
+    }
+
+    id->funcs_dropped++;
+    return NULL;
 }
 
 
-static void
-instr_calibrate (void)
+static NO_INSTR void
+instr_enter (const void * key, const char * name)
 {
-    NK_PROFILE_ENTRY();
+    struct nk_thread * t;
+    struct nk_instr_shadow * s;
+    struct nk_instr_frame * f;
+    uint32_t d;
 
-    NK_PROFILE_EXIT();
+    if (!instr_active || !(t = get_cur_thread())) {
+        return;
+    }
+
+    s = &t->instr_shadow;
+
+    if (s->epoch != instr_epoch) {
+        // left over from an earlier run
+        s->depth = 0;
+        s->off_cpu = 0;
+        s->switched_out = 0;
+        s->epoch = instr_epoch;
+    }
+
+    // claim the frame before filling it so an interrupt
+    // arriving in between nests above it
+    d = s->depth++;
+
+    if (d < NK_INSTR_SHADOW_DEPTH) {
+        f = &s->frames[d];
+        f->key = key;
+        f->name = name;
+        f->child = 0;
+        f->off_cpu = s->off_cpu;
+        f->start = rdtsc();
+    }
 }
 
 
-void
-nk_profile_func_enter (const char  *func)
+static NO_INSTR void
+instr_exit (const void * key, const char * name)
 {
-    struct func_data * new = NULL;
-    struct timespec ts;
+    struct nk_thread * t;
+    struct nk_instr_shadow * s;
+    struct nk_instr_frame * f;
+    struct nk_instr_data * id;
+    struct nk_instr_func * fd;
+    uint64_t end = rdtsc();
+    uint64_t incl, excl;
+    uint32_t d;
+
+    // frames are popped even when inactive so a stack is
+    // never left holding stale entries
+    if (!instr_epoch || !(t = get_cur_thread())) {
+        return;
+    }
 
-    if (!instr_active) {
+    s = &t->instr_shadow;
+
+    if (s->epoch != instr_epoch || !s->depth) {
+        // entered before this run began
         return;
     }
 
-    if (!(per_cpu_get(instr_data)->func_htable)) {
+    d = --s->depth;
+
+    if (d >= NK_INSTR_SHADOW_DEPTH) {
         return;
     }
 
-    new = (struct func_data*)nk_htable_search(per_cpu_get(instr_data)->func_htable, (addr_t)(func));
+    f = &s->frames[d];
 
-    if (!new) {
+    if (f->key != key && !(f->name && name && !strcmp(f->name, name))) {
+        // unmatched exit, e.g. for a function that was entered
+        // before instrumentation began; leave the frame alone
+        s->depth++;
+        return;
+    }
+
+    incl = end - f->start - (s->off_cpu - f->off_cpu);
+    excl = incl > f->child ? incl - f->child : 0;
 
-        new = malloc(sizeof(struct func_data));
-        memset(new, 0, sizeof(struct func_data));
+    if (d > 0) {
+        s->frames[d-1].child += incl;
+    }
 
-        new->call_count  = 1;
-        new->min_nsec = ULONG_MAX;
+    if (!instr_active || !(id = per_cpu_get(instr_data)) || !id->funcs) {
+        return;
+    }
+
+    if (!(fd = instr_lookup(id, f->key, f->name))) {
+        return;
+    }
 
-        nk_htable_insert(per_cpu_get(instr_data)->func_htable, (addr_t)func, (addr_t)new);
-    } else {
-        new->call_count++;
+    fd->call_count++;
+    fd->incl_cycles += incl;
+    fd->excl_cycles += excl;
+    if (!fd->min_cycles || incl < fd->min_cycles) {
+        fd->min_cycles = incl;
+    }
+    if (incl > fd->max_cycles) {
+        fd->max_cycles = incl;
     }
+}
+
 
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    new->start_count = ts.tv_sec * 1000000000 + ts.tv_nsec;
+void NO_INSTR
+nk_profile_func_enter (const char  *func)
+{
+    instr_enter(func, func);
 }
 
 
-void
+void NO_INSTR
 nk_profile_func_exit (const char *func)
 {
-    struct timespec te;
-    struct func_data * data = NULL;
-    uint64_t end;
-    uint64_t time;
+    instr_exit(func, func);
+}
 
-    if (!instr_active) {
-        return;
-    }
 
-    if (!(per_cpu_get(instr_data)->func_htable)) {
+#ifdef NAUT_CONFIG_PROFILE_INSTRUMENT_FUNCTIONS
+void NO_INSTR
+__cyg_profile_func_enter (void * fn, void * call_site)
+{
+    instr_enter(fn, NULL);
+}
+
+
+void NO_INSTR
+__cyg_profile_func_exit (void * fn, void * call_site)
+{
+    instr_exit(fn, NULL);
+}
+#endif
+
+
+/*
+  Time a thread spends switched out is excluded from the frames
+  on its shadow stack.  Called by the scheduler with interrupts
+  off just before the switch.
+*/
+void NO_INSTR
+nk_instr_thread_switch (struct nk_thread * prev, struct nk_thread * next)
+{
+    uint64_t now;
+
+    if (!instr_active) {
         return;
     }
 
-    clock_gettime(CLOCK_MONOTONIC, &te);
+    now = rdtsc();
 
-    data = (struct func_data*)nk_htable_search(per_cpu_get(instr_data)->func_htable, (addr_t)func);
+    prev->instr_shadow.switched_out = now;
 
-    if (!data) {
-        return;
-    } else {
-        end = 1000000000 * te.tv_sec + te.tv_nsec;
-        if (end < data->start_count) {
-            return;
-        }
-        time = end - data->start_count;
-        data->total_count += time;
-        if (time < data->min_nsec) {
-            data->min_nsec = time;
-        }
-        if (time > data->max_nsec) {
-            data->max_nsec = time;
-        }
-        data->avg_nsec = (((data->avg_nsec * (data->call_count - 1)) + time )/ data->call_count);
+    if (next->instr_shadow.switched_out) {
+        next->instr_shadow.off_cpu += now - next->instr_shadow.switched_out;
+        next->instr_shadow.switched_out = 0;
     }
 }
 
@@ -150,56 +269,57 @@ void
 nk_instrument_init (void)
 {
     int i;
-    uint8_t flags = irq_disable_save();
 
     for (i = 0; i < nk_get_nautilus_info()->sys.num_cpus; i++) {
-        printk("init instrumentation for cpu %u\n", i);
-
         struct cpu * this_cpu = nk_get_nautilus_info()->sys.cpus[i];
-        int flags2 = spin_lock_irq_save(&this_cpu->lock);
+
         if (!this_cpu) {
             ERROR_PRINT("Could not get CPU\n");
-            spin_unlock_irq_restore(&this_cpu->lock, flags2);
             return;
         }
 
-        this_cpu->instr_data = malloc(sizeof(struct nk_instr_data));
-        memset(this_cpu->instr_data, 0, sizeof(struct nk_instr_data));
-        this_cpu->instr_data->mallocstat.min_latency = ULONG_MAX;
-        this_cpu->instr_data->irqstat.min_latency    = ULONG_MAX;
-        this_cpu->instr_data->thr_switch.min_latency = ULONG_MAX;
+        printk("init instrumentation for cpu %u\n", i);
 
-        this_cpu->instr_data->func_htable = nk_create_htable(0, instr_hash_fn, instr_eq_fn);
-        if (!this_cpu->instr_data->func_htable) {
-            ERROR_PRINT("Could not create instrumentation hash table for core %u\n",
+        struct nk_instr_data * id = malloc(sizeof(struct nk_instr_data));
+        if (!id) {
+            ERROR_PRINT("Could not allocate instrumentation data for core %u\n", i);
+            return;
+        }
+        memset(id, 0, sizeof(struct nk_instr_data));
+        id->mallocstat.min_latency = ULONG_MAX;
+        id->irqstat.min_latency    = ULONG_MAX;
+        id->thr_switch.min_latency = ULONG_MAX;
+
+        id->funcs = malloc(sizeof(struct nk_instr_func) * FUNC_TABLE_SIZE);
+        if (!id->funcs) {
+            ERROR_PRINT("Could not create instrumentation function table for core %u\n",
                     i);
-            spin_unlock_irq_restore(&this_cpu->lock, flags2);
+            free(id);
             return;
         }
+        memset(id->funcs, 0, sizeof(struct nk_instr_func) * FUNC_TABLE_SIZE);
 
-        spin_unlock_irq_restore(&this_cpu->lock, flags2);
+        // publish only once complete
+        __sync_synchronize();
+        this_cpu->instr_data = id;
     }
-
-    irq_enable_restore(flags);
 }
 
 
 void
 nk_instrument_start (void)
 {
-    struct timespec ts;
     printk("Beginning Instrumentation\n");
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    instr_start_count = 1000000000 * ts.tv_sec + ts.tv_nsec;
+    instr_start_count = rdtsc();
+    // stale shadow stack frames are dropped lazily
+    __sync_fetch_and_add(&instr_epoch, 1);
     atomic_cmpswap(instr_active, 0, 1);
 }
 
 void
 nk_instrument_end (void)
 {
-    struct timespec te;
-    clock_gettime(CLOCK_MONOTONIC, &te);
-    instr_end_count = 1000000000 * te.tv_sec + te.tv_nsec;
+    instr_end_count = rdtsc();
     printk("Deactivating instrumentation\n");
     atomic_cmpswap(instr_active, 1, 0);
 }
@@ -208,7 +328,6 @@ void
 nk_malloc_enter (void)
 {
     struct malloc_data * md = NULL;
-    struct timespec ts;
 
     if (!instr_active) {
         return;
@@ -217,16 +336,13 @@ nk_malloc_enter (void)
     md = &(per_cpu_get(instr_data)->mallocstat);
     md->count++;
 
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-
-    md->start_count = 1000000000 * ts.tv_sec + ts.tv_nsec;
+    md->start_count = rdtsc();
 }
 
 void
 nk_malloc_exit (void)
 {
     struct malloc_data * md = NULL;
-    struct timespec te;
     uint64_t end;
     uint64_t time;
 
@@ -236,9 +352,8 @@ nk_malloc_exit (void)
 
     md = &(per_cpu_get(instr_data)->mallocstat);
 
-    clock_gettime(CLOCK_MONOTONIC, &te);
+    end = rdtsc();
 
-    end = 1000000000 * te.tv_sec + te.tv_nsec;
     if (end < md->start_count) {
         return;
     }
@@ -257,7 +372,6 @@ void
 nk_irq_prof_enter (void)
 {
     struct irq_data * irq = NULL;
-    struct timespec ts;
 
     if (!instr_active) {
         return;
@@ -266,9 +380,7 @@ nk_irq_prof_enter (void)
     irq = &(per_cpu_get(instr_data)->irqstat);
     irq->count++;
 
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-
-    irq->start_count = 1000000000 * ts.tv_sec + ts.tv_nsec;
+    irq->start_count = rdtsc();
 }
 
 
@@ -276,7 +388,6 @@ void
 nk_irq_prof_exit (void)
 {
     struct irq_data * irq = NULL;
-    struct timespec te;
     uint64_t end;
     uint64_t time;
 
@@ -286,11 +397,10 @@ nk_irq_prof_exit (void)
 
     irq = &(per_cpu_get(instr_data)->irqstat);
 
-    clock_gettime(CLOCK_MONOTONIC, &te);
+    end = rdtsc();
 
-    end = 1000000000 * te.tv_sec + te.tv_nsec;
     if (end < irq->start_count) {
-        return;{}
+        return;
     }
     time = end - irq->start_count;
     if (time < irq->min_latency) {
@@ -307,7 +417,6 @@ void
 nk_thr_switch_prof_enter (void)
 {
     struct thread_switch_data * thr = NULL;
-    struct timespec ts;
 
     if (!instr_active) {
         return;
@@ -316,9 +425,7 @@ nk_thr_switch_prof_enter (void)
     thr = &(per_cpu_get(instr_data)->thr_switch);
     thr->count++;
 
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-
-    thr->start_count = 1000000000 * ts.tv_sec + ts.tv_nsec;
+    thr->start_count = rdtsc();
 }
 
 
@@ -326,7 +433,6 @@ void
 nk_thr_switch_prof_exit (void)
 {
     struct thread_switch_data * thr = NULL;
-    struct timespec te;
     uint64_t end;
     uint64_t time;
 
@@ -340,9 +446,8 @@ nk_thr_switch_prof_exit (void)
         return;
     }
 
-    clock_gettime(CLOCK_MONOTONIC, &te);
+    end = rdtsc();
 
-    end = 1000000000 * te.tv_sec + te.tv_nsec;
     if (end < thr->start_count) {
         return;
     }
@@ -357,65 +462,117 @@ nk_thr_switch_prof_exit (void)
 }
 
 
-void
-nk_instrument_query (void)
+static uint64_t
+cycles_to_ns (uint64_t cycles, ulong_t khz)
 {
-    int i;
+    if (!khz) {
+        return cycles;
+    }
+    return (cycles / khz) * 1000000UL + ((cycles % khz) * 1000000UL) / khz;
+}
 
-    printk("Dumping instrumentation data...\n");
-    for (i = 0; i < nk_get_nautilus_info()->sys.num_cpus; i++) {
-        struct cpu * this_cpu = nk_get_nautilus_info()->sys.cpus[i];
 
+static void
+dump_funcs (struct cpu * this_cpu, int i)
+{
+    struct nk_instr_data * id = this_cpu->instr_data;
+    ulong_t khz = this_cpu->cpu_khz;
+    uint64_t total = instr_end_count - instr_start_count;
+    uint64_t j;
 
-        printk("Function Table Stats for Core %u:\n", i);
-        struct nk_hashtable_iter * iter = nk_create_htable_iter(this_cpu->instr_data->func_htable);
-        if (!iter) {
-            ERROR_PRINT("Could not iterate over function htable on core %u\n", i);
+    printk("Function Table Stats for Core %u (times in nsec, %% of run inclusive):\n", i);
+
+    if (!total) {
+        total = 1;
+    }
+
+    for (j = 0; j < FUNC_TABLE_SIZE; j++) {
+        struct nk_instr_func * f = &id->funcs[j];
+
+        if (!f->key || !f->call_count) {
             continue;
         }
 
-        do {
-            char * func = (void*)nk_htable_get_iter_key(iter);
-            struct func_data * data = (struct func_data*)nk_htable_get_iter_value(iter);
-
-            uint64_t total_nsec = (instr_end_count - instr_start_count);
-
-            if (data->call_count > 0) {
-                printk("\t%lu.%lu\% Func: %s\n\tCount: %16u Lat - Avg: %16llunsec Max: %16llunsec Min: %16llunsec\n",
-                        data->total_count / total_nsec,
-                        data->total_count % total_nsec,
-                        func,
-                        data->call_count,
-                        data->avg_nsec,
-                        data->max_nsec,
-                        data->min_nsec);
+        // symbolized here, not when recorded
+        if (f->name) {
+            printk("\t%3lu.%02lu%% Func: %s\n",
+                   f->incl_cycles * 100 / total,
+                   (f->incl_cycles * 10000 / total) % 100,
+                   f->name);
+        } else {
+            addr_t start;
+            const char * sym = nk_ksym_lookup((addr_t)f->key, &start);
+            if (sym) {
+                printk("\t%3lu.%02lu%% Func: %s+0x%lx\n",
+                       f->incl_cycles * 100 / total,
+                       (f->incl_cycles * 10000 / total) % 100,
+                       sym, (addr_t)f->key - start);
+            } else {
+                printk("\t%3lu.%02lu%% Func: %p\n",
+                       f->incl_cycles * 100 / total,
+                       (f->incl_cycles * 10000 / total) % 100,
+                       f->key);
             }
+        }
+        printk("\tCount: %16lu Incl: %16lu Excl: %16lu Lat - Avg: %16lu Max: %16lu Min: %16lu\n",
+               f->call_count,
+               cycles_to_ns(f->incl_cycles, khz),
+               cycles_to_ns(f->excl_cycles, khz),
+               cycles_to_ns(f->incl_cycles / f->call_count, khz),
+               cycles_to_ns(f->max_cycles, khz),
+               cycles_to_ns(f->min_cycles, khz));
+    }
+
+    if (id->funcs_dropped) {
+        printk("\t%lu calls not recorded due to a full table\n", id->funcs_dropped);
+    }
+}
 
 
-        } while (nk_htable_iter_advance(iter) != 0);
+static void
+dump_latencies (struct cpu * this_cpu, int i)
+{
+    struct nk_instr_data * id = this_cpu->instr_data;
+    ulong_t khz = this_cpu->cpu_khz;
+
+    printk("Malloc Stats for Core %u:\n", i);
+    printk("\tCount: %16lu | Lat - Avg: %16lunsec | Max: %16lunsec | Min: %16lunsec\n",
+            id->mallocstat.count,
+            cycles_to_ns(id->mallocstat.avg_latency, khz),
+            cycles_to_ns(id->mallocstat.max_latency, khz),
+            id->mallocstat.count ? cycles_to_ns(id->mallocstat.min_latency, khz) : 0);
+
+    printk("IRQ Stats for Core %u:\n", i);
+    printk("\tCount: %16lu | Lat - Avg: %16lunsec | Max: %16lunsec | Min: %16lunsec\n",
+            id->irqstat.count,
+            cycles_to_ns(id->irqstat.avg_latency, khz),
+            cycles_to_ns(id->irqstat.max_latency, khz),
+            id->irqstat.count ? cycles_to_ns(id->irqstat.min_latency, khz) : 0);
+
+    printk("Thread Switch Stats for Core %u:\n", i);
+    printk("\tCount: %16lu | Lat - Avg: %16lunsec | Max: %16lunsec | Min: %16lunsec\n",
+            id->thr_switch.count,
+            cycles_to_ns(id->thr_switch.avg_latency, khz),
+            cycles_to_ns(id->thr_switch.max_latency, khz),
+            id->thr_switch.count ? cycles_to_ns(id->thr_switch.min_latency, khz) : 0);
+}
 
-        printk("Malloc Stats for Core %u:\n", i);
 
-        /* print malloc data */
-        printk("\tCount: %16u Lat - Avg: %16llunsec, Max: %16llunsec Min: %16llunsec\n",
-                this_cpu->instr_data->mallocstat.count,
-                this_cpu->instr_data->mallocstat.avg_latency,
-                this_cpu->instr_data->mallocstat.max_latency,
-                this_cpu->instr_data->mallocstat.min_latency);
-        printk("IRQ Stats for Core %u:\n", i);
-        printk("\tCount: %16u Lat - Avg: %16llunsec Max: %16llunsec Min: %16llunsec\n",
-                this_cpu->instr_data->irqstat.count,
-                this_cpu->instr_data->irqstat.avg_latency,
-                this_cpu->instr_data->irqstat.max_latency,
-                this_cpu->instr_data->irqstat.min_latency);
-        printk("Thread Switch Stats for Core %u:\n", i);
-        printk("\tCount: %16u Lat - Avg: %16llunsec Max: %16llunsec Min: %16llunsec\n",
+void
+nk_instrument_query (void)
+{
+    int i;
 
-                this_cpu->instr_data->thr_switch.count,
-                this_cpu->instr_data->thr_switch.avg_latency,
-                this_cpu->instr_data->thr_switch.max_latency,
-                this_cpu->instr_data->thr_switch.min_latency);
+    printk("Dumping instrumentation data...\n");
+    for (i = 0; i < nk_get_nautilus_info()->sys.num_cpus; i++) {
+        struct cpu * this_cpu = nk_get_nautilus_info()->sys.cpus[i];
 
+        if (!this_cpu->instr_data) {
+            continue;
+        }
+
+        dump_funcs(this_cpu, i);
+        dump_latencies(this_cpu, i);
     }
 }
 
@@ -428,27 +585,11 @@ nk_profile_dump(void)
     for (i = 0; i < nk_get_nautilus_info()->sys.num_cpus; i++) {
         struct cpu * this_cpu = nk_get_nautilus_info()->sys.cpus[i];
 
-        printk("Malloc Stats for Core %u:\n", i);
-        printk("\tCount: %16u | Lat - Avg: %16llunsec | Max: %16llunsec | Min: %16llunsec\n",
-                this_cpu->instr_data->mallocstat.count,
-                this_cpu->instr_data->mallocstat.avg_latency,
-                this_cpu->instr_data->mallocstat.max_latency,
-                this_cpu->instr_data->mallocstat.min_latency);
-
-        printk("IRQ Stats for Core %u:\n", i);
-        printk("\tCount: %16u | Lat - Avg: %16llunsec | Max: %16llunsec | Min: %16llunsec\n",
-                this_cpu->instr_data->irqstat.count,
-                this_cpu->instr_data->irqstat.avg_latency,
-                this_cpu->instr_data->irqstat.max_latency,
-                this_cpu->instr_data->irqstat.min_latency);
-
-        printk("Thread Switch Stats for Core %u:\n", i);
-        printk("\tCount: %16u | Lat - Avg: %16llunsec | Max: %16llunsec | Min: %16llunsec\n",
-                this_cpu->instr_data->thr_switch.count,
-                this_cpu->instr_data->thr_switch.avg_latency,
-                this_cpu->instr_data->thr_switch.max_latency,
-                this_cpu->instr_data->thr_switch.min_latency);
+        if (!this_cpu->instr_data) {
+            continue;
+        }
 
+        dump_latencies(this_cpu, i);
     }
 }
 
@@ -0,0 +1,403 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/klog.h>
+#include <nautilus/mutex.h>
+#include <nautilus/timer.h>
+#include <nautilus/scheduler.h>
+
+// nothing here may print through the rings while they are being
+// written or drained, so there is only INFO, used at init
+#define INFO(fmt, args...)  INFO_PRINT("klog: " fmt, ##args)
+#define ERROR(fmt, args...) ERROR_PRINT("klog: " fmt, ##args)
+
+#ifndef NAUT_CONFIG_KLOG_RING_KB
+#define NAUT_CONFIG_KLOG_RING_KB 64
+#endif
+
+#ifndef NAUT_CONFIG_KLOG_DRAIN_MS
+#define NAUT_CONFIG_KLOG_DRAIN_MS 10
+#endif
+
+// well below the default aperiodic priority (higher is lower)
+#define DRAIN_PRIORITY (10ULL*1000000000ULL/NAUT_CONFIG_HZ)
+
+/*
+ * A ring holds records back to back.  A record that would not fit
+ * before the end of the ring is preceded by a pad record that fills
+ * the rest, so that every message is contiguous and NUL-terminated
+ * in place.  Writers reserve space by advancing head with a
+ * compare-and-swap, which also makes writers that interrupt other
+ * writers on the same CPU safe, fill in the record, and set ready
+ * last.  The drainer consumes ready records from tail, zeroes them
+ * so that ready is clear when the space is reused, and then
+ * advances tail.
+ */
+#define REC_ALIGN 16
+
+#define REC_PAD   3
+
+struct klog_rec {
+    uint64_t         tsc;
+    uint32_t         len;     // of the whole record, header included
+    uint8_t          kind;    // NK_KLOG_*, or REC_PAD
+    volatile uint8_t ready;
+    uint16_t         pad;
+    char             text[];
+};
+
+struct klog_ring {
+    char              *buf;
+    uint64_t           size;   // a power of two
+    volatile uint64_t  head;   // next byte to reserve
+    volatile uint64_t  tail;   // next byte to drain
+
+    // written only on this ring's CPU
+    uint64_t           records;
+    uint64_t           bytes;
+    uint64_t           dropped;
+} __attribute__((aligned(64)));
+
+static struct klog_ring *rings;
+static int               num_rings;
+
+static volatile int up;
+static volatile int emergency;
+static volatile int held;
+
+static nk_mutex_t   drain_lock;
+static nk_thread_id_t drain_tid;
+
+
+static inline struct klog_rec *
+rec_at (struct klog_ring * r, uint64_t pos)
+{
+    return (struct klog_rec *)(r->buf + (pos & (r->size - 1)));
+}
+
+
+int
+nk_klog_vwrite (int kind, const char * fmt, va_list args)
+{
+    struct klog_ring * r;
+    struct klog_rec * rec;
+    uint64_t head, off, pad, need;
+    va_list count;
+    int n;
+
+    if (!up || emergency || !__cpu_state_get_cpu()) {
+        return -1;
+    }
+
+    va_copy(count, args);
+    n = vsnprintf(0, 0, fmt, count);
+    va_end(count);
+
+    preempt_disable();
+
+    r = &rings[my_cpu_id()];
+
+    // a very long message is cut down to something the ring can hold
+    if (n > r->size / 4) {
+        n = r->size / 4;
+    }
+
+    need = (sizeof(struct klog_rec) + n + 1 + REC_ALIGN - 1) & ~(uint64_t)(REC_ALIGN - 1);
+
+    do {
+        head = r->head;
+        off = head & (r->size - 1);
+        pad = off + need > r->size ? r->size - off : 0;
+        if (head + pad + need - r->tail > r->size) {
+            r->dropped++;
+            preempt_enable();
+            return 0;
+        }
+    } while (!__sync_bool_compare_and_swap(&r->head, head, head + pad + need));
+
+    if (pad) {
+        rec = rec_at(r, head);
+        rec->len = pad;
+        rec->kind = REC_PAD;
+        __asm__ __volatile__ ("" : : : "memory");
+        rec->ready = 1;
+    }
+
+    rec = rec_at(r, head + pad);
+    rec->tsc = rdtsc();
+    rec->len = need;
+    rec->kind = kind;
+    vsnprintf(rec->text, n + 1, fmt, args);
+    __asm__ __volatile__ ("" : : : "memory");
+    rec->ready = 1;
+
+    r->records++;
+    r->bytes += n;
+
+    preempt_enable();
+
+    return n;
+}
+
+
+static void
+ring_consume (struct klog_ring * r, struct klog_rec * rec)
+{
+    uint32_t len = rec->len;
+
+    memset(rec, 0, len);
+    __sync_synchronize();
+    r->tail += len;
+}
+
+
+// the oldest complete record on the ring, if any, skipping padding
+static struct klog_rec *
+ring_peek (struct klog_ring * r)
+{
+    struct klog_rec * rec;
+
+    while (r->tail != r->head) {
+        rec = rec_at(r, r->tail);
+        if (!rec->ready) {
+            // still being written
+            return 0;
+        }
+        __asm__ __volatile__ ("" : : : "memory");
+        if (rec->kind != REC_PAD) {
+            return rec;
+        }
+        ring_consume(r, rec);
+    }
+
+    return 0;
+}
+
+
+/*
+ * Move records to sink, oldest first across all the rings.  Called
+ * with the drain lock held, except in a panic.  Records are handed
+ * to the sink in place.
+ */
+static int
+drain (void (*sink)(int cpu, struct klog_rec * rec))
+{
+    struct klog_rec * rec, * best;
+    int i, cpu, count = 0;
+
+    while (1) {
+        best = 0;
+        cpu = -1;
+        for (i = 0; i < num_rings; i++) {
+            rec = ring_peek(&rings[i]);
+            if (rec && (!best || rec->tsc < best->tsc)) {
+                best = rec;
+                cpu = i;
+            }
+        }
+        if (!best) {
+            return count;
+        }
+        sink(cpu, best);
+        ring_consume(&rings[cpu], best);
+        count++;
+    }
+}
+
+
+static void
+console_sink (int cpu, struct klog_rec * rec)
+{
+    if (rec->kind == NK_KLOG_LOG) {
+        nk_vc_log_print(rec->text);
+    } else {
+        nk_vc_print(rec->text);
+    }
+}
+
+
+static void
+dump_sink (int cpu, struct klog_rec * rec)
+{
+    nk_vc_printf("[%3d %16lu] %s%s", cpu, rec->tsc,
+                 rec->kind == NK_KLOG_LOG ? "" : "printk: ", rec->text);
+}
+
+
+int
+nk_klog_flush (void)
+{
+    int n;
+
+    if (!up) {
+        return 0;
+    }
+
+    nk_mutex_lock(&drain_lock);
+    n = drain(console_sink);
+    nk_mutex_unlock(&drain_lock);
+
+    return n;
+}
+
+
+int
+nk_klog_dump (void)
+{
+    int n;
+
+    if (!up) {
+        return 0;
+    }
+
+    nk_mutex_lock(&drain_lock);
+    n = drain(dump_sink);
+    nk_mutex_unlock(&drain_lock);
+
+    return n;
+}
+
+
+void
+nk_klog_hold (int hold)
+{
+    held = hold;
+}
+
+
+void
+nk_klog_stats (void)
+{
+    struct klog_ring * r;
+    int i;
+
+    if (!up) {
+        nk_vc_printf("klog is not active\n");
+        return;
+    }
+
+    nk_vc_printf("%d rings of %lu bytes%s%s\n", num_rings, rings[0].size,
+                 held ? ", held" : "", emergency ? ", after panic" : "");
+
+    for (i = 0; i < num_rings; i++) {
+        r = &rings[i];
+        nk_vc_printf("cpu %3d: %lu records %lu bytes %lu dropped %lu pending\n",
+                     i, r->records, r->bytes, r->dropped, r->head - r->tail);
+    }
+}
+
+
+void
+nk_klog_panic (void)
+{
+    if (!up || emergency) {
+        return;
+    }
+
+    emergency = 1;
+
+    // the drainer may be stuck, or be us, so take the lock only
+    // if it is free, and drain regardless
+    if (!in_interrupt_context() && !nk_mutex_trylock(&drain_lock)) {
+        drain(console_sink);
+        nk_mutex_unlock(&drain_lock);
+    } else {
+        drain(console_sink);
+    }
+}
+
+
+static void
+drain_thread (void * in, void ** out)
+{
+    struct nk_sched_constraints c = { .type = APERIODIC,
+                                      .aperiodic.priority = DRAIN_PRIORITY };
+
+    nk_thread_name(get_cur_thread(), "klog-drain");
+
+    if (nk_sched_thread_change_constraints(&c)) {
+        ERROR("Cannot lower drain thread priority, continuing\n");
+    }
+
+    while (1) {
+        if (!held) {
+            nk_klog_flush();
+        }
+        nk_sleep(NAUT_CONFIG_KLOG_DRAIN_MS * 1000000ULL);
+    }
+}
+
+
+int
+nk_klog_init (void)
+{
+    struct sys_info * sys = per_cpu_get(system);
+    uint64_t size = 1;
+    int i;
+
+    // round down to a power of two
+    while (size * 2 <= NAUT_CONFIG_KLOG_RING_KB * 1024ULL) {
+        size *= 2;
+    }
+
+    num_rings = sys->num_cpus;
+
+    rings = malloc(num_rings * sizeof(struct klog_ring));
+    if (!rings) {
+        ERROR("Cannot allocate rings\n");
+        return -1;
+    }
+    memset(rings, 0, num_rings * sizeof(struct klog_ring));
+
+    for (i = 0; i < num_rings; i++) {
+        rings[i].size = size;
+        rings[i].buf = malloc(size);
+        if (!rings[i].buf) {
+            ERROR("Cannot allocate ring for cpu %d\n", i);
+            goto fail;
+        }
+        memset(rings[i].buf, 0, size);
+    }
+
+    nk_mutex_init(&drain_lock);
+
+    if (nk_thread_start(drain_thread, 0, 0, 1, TSTACK_DEFAULT, &drain_tid, -1)) {
+        ERROR("Cannot start drain thread\n");
+        goto fail;
+    }
+
+    INFO("%d rings of %lu bytes, drained every %d ms\n",
+         num_rings, size, NAUT_CONFIG_KLOG_DRAIN_MS);
+
+    __sync_synchronize();
+    up = 1;
+
+    return 0;
+
+ fail:
+    for (i = 0; i < num_rings; i++) {
+        if (rings[i].buf) {
+            free(rings[i].buf);
+        }
+    }
+    free(rings);
+    rings = 0;
+    return -1;
+}
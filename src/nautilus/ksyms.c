@@ -0,0 +1,224 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/multiboot2.h>
+#include <nautilus/mm.h>
+#include <nautilus/ksyms.h>
+
+#define INFO(fmt, args...)  INFO_PRINT("ksyms: " fmt, ##args)
+#define ERROR(fmt, args...) ERROR_PRINT("ksyms: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("ksyms: " fmt, ##args)
+
+// just enough of ELF64 to walk the symbol table
+struct elf64_shdr {
+    uint32_t sh_name;
+    uint32_t sh_type;
+    uint64_t sh_flags;
+    uint64_t sh_addr;
+    uint64_t sh_offset;
+    uint64_t sh_size;
+    uint32_t sh_link;
+    uint32_t sh_info;
+    uint64_t sh_addralign;
+    uint64_t sh_entsize;
+} __packed;
+
+struct elf64_sym {
+    uint32_t st_name;
+    uint8_t  st_info;
+    uint8_t  st_other;
+    uint16_t st_shndx;
+    uint64_t st_value;
+    uint64_t st_size;
+} __packed;
+
+#define SHT_SYMTAB 2
+#define STT_FUNC   2
+#define ELF64_ST_TYPE(i) ((i) & 0xf)
+
+struct ksym {
+    addr_t      addr;
+    uint64_t    size;
+    const char *name;
+};
+
+// sorted by address
+static struct ksym *ksyms;
+static uint64_t     nksyms;
+
+
+static inline int
+is_func (struct elf64_sym *s)
+{
+    return ELF64_ST_TYPE(s->st_info) == STT_FUNC && s->st_value && s->st_shndx;
+}
+
+
+static void
+sift_down (struct ksym *a, uint64_t i, uint64_t n)
+{
+    struct ksym t;
+    uint64_t c;
+
+    while ((c = 2*i + 1) < n) {
+        if (c + 1 < n && a[c+1].addr > a[c].addr) {
+            c++;
+        }
+        if (a[i].addr >= a[c].addr) {
+            return;
+        }
+        t = a[i]; a[i] = a[c]; a[c] = t;
+        i = c;
+    }
+}
+
+
+// heapsort, as there is nothing to lean on this early
+static void
+sort_ksyms (struct ksym *a, uint64_t n)
+{
+    struct ksym t;
+    uint64_t i;
+
+    for (i = n/2; i > 0; i--) {
+        sift_down(a, i-1, n);
+    }
+    for (i = n; i > 1; i--) {
+        t = a[0]; a[0] = a[i-1]; a[i-1] = t;
+        sift_down(a, 0, i-1);
+    }
+}
+
+
+int
+nk_ksyms_boot_init (struct multiboot_tag_elf_sections *elf)
+{
+    struct elf64_shdr *sh = NULL, *strsh;
+    struct elf64_sym *syms;
+    const char *strs;
+    char *names;
+    uint64_t n, i, j, len;
+
+    for (i = 0; i < elf->num; i++) {
+        struct elf64_shdr *s = (struct elf64_shdr *)(elf->sections + i*elf->entsize);
+        if (s->sh_type == SHT_SYMTAB) {
+            sh = s;
+            break;
+        }
+    }
+
+    if (!sh || sh->sh_link >= elf->num) {
+        DEBUG("No symbol table passed by the boot loader\n");
+        return -1;
+    }
+
+    strsh = (struct elf64_shdr *)(elf->sections + sh->sh_link*elf->entsize);
+
+    if (!sh->sh_addr || !strsh->sh_addr || sh->sh_entsize != sizeof(struct elf64_sym)) {
+        DEBUG("Symbol table was not loaded\n");
+        return -1;
+    }
+
+    syms = (struct elf64_sym *)sh->sh_addr;
+    strs = (const char *)strsh->sh_addr;
+    n    = sh->sh_size / sh->sh_entsize;
+
+    // the loader's copy is in memory we do not own, so keep
+    // only the function names, packed
+    for (i = 0, nksyms = 0, len = 0; i < n; i++) {
+        if (is_func(&syms[i]) && syms[i].st_name < strsh->sh_size) {
+            nksyms++;
+            len += strlen(strs + syms[i].st_name) + 1;
+        }
+    }
+
+    if (!nksyms) {
+        return -1;
+    }
+
+    ksyms = mm_boot_alloc(nksyms * sizeof(struct ksym));
+    names = mm_boot_alloc(len);
+
+    if (!ksyms || !names) {
+        ERROR("Could not allocate space for %lu symbols\n", nksyms);
+        ksyms  = NULL;
+        nksyms = 0;
+        return -1;
+    }
+
+    for (i = 0, j = 0; i < n; i++) {
+        if (is_func(&syms[i]) && syms[i].st_name < strsh->sh_size) {
+            ksyms[j].addr = syms[i].st_value;
+            ksyms[j].size = syms[i].st_size;
+            ksyms[j].name = names;
+            strcpy(names, strs + syms[i].st_name);
+            names += strlen(names) + 1;
+            j++;
+        }
+    }
+
+    sort_ksyms(ksyms, nksyms);
+
+    INFO("%lu function symbols\n", nksyms);
+
+    return 0;
+}
+
+
+const char *
+nk_ksym_lookup (addr_t addr, addr_t *start)
+{
+    uint64_t lo = 0, hi = nksyms, mid;
+    struct ksym *k;
+
+    // last symbol at or below addr
+    while (lo < hi) {
+        mid = lo + (hi - lo)/2;
+        if (ksyms[mid].addr <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (!lo) {
+        return NULL;
+    }
+
+    k = &ksyms[lo-1];
+
+    // assembly entry points often have no size
+    if (k->size && addr >= k->addr + k->size) {
+        return NULL;
+    }
+
+    if (start) {
+        *start = k->addr;
+    }
+
+    return k->name;
+}
+
+
+uint64_t
+nk_ksyms_count (void)
+{
+    return nksyms;
+}
@@ -32,6 +32,8 @@
 #include <nautilus/thread.h>
 #include <nautilus/errno.h>
 #include <nautilus/random.h>
+#include <nautilus/tsc.h>
+#include <nautilus/mutex.h>
 #include <dev/hpet.h>
 
 
@@ -94,8 +96,9 @@ exit(int status)
 int 
 clock_gettime (clockid_t clk_id, struct timespec * tp)
 {
+    uint64_t nsec;
 
-    if (clk_id != CLOCK_MONOTONIC) {
+    if (clk_id != CLOCK_MONOTONIC && clk_id != CLOCK_MONOTONIC_RAW) {
         printk("NAUTILUS WARNING: using invalid clock type\n");
         return -EINVAL;
     }
@@ -105,19 +108,26 @@ clock_gettime (clockid_t clk_id, struct timespec * tp)
         return -EINVAL;
     }
 
+    // the TSC is never slewed, so both clocks are the same here
+    if (nk_tsc_reliable()) {
+        nsec = nk_tsc_get_ns();
 #ifdef NAUT_CONFIG_HPET
-    //uint64_t freq = nk_hpet_get_freq();
-    uint64_t cnt  = nk_hpet_get_cntr();
-    //uint64_t nsec = (1000000000/freq) * cnt;
-    uint64_t nsec = cnt * nk_hpet_nanos_per_tick();
-    tp->tv_sec    = nsec / 1000000000;
-    tp->tv_nsec   = nsec % 1000000000;
-#else
-    /* runs at "10kHz" */
-    tp->tv_nsec = dummy_mono_clock*100000;
-    tp->tv_sec  = dummy_mono_clock/10000;
-    ++dummy_mono_clock;
+    } else if (nk_get_nautilus_info()->sys.hpet) {
+        uint64_t freq = nk_hpet_get_freq();
+        uint64_t cnt  = nk_hpet_get_cntr();
+        nsec = (cnt / freq) * 1000000000ULL + ((cnt % freq) * 1000000000ULL) / freq;
 #endif
+    } else if (nk_tsc_info.calibrated) {
+        // no better choice, even if it's not invariant
+        nsec = nk_tsc_get_ns();
+    } else {
+        /* runs at "10kHz" */
+        nsec = dummy_mono_clock * 100000;
+        ++dummy_mono_clock;
+    }
+
+    tp->tv_sec  = nsec / 1000000000ULL;
+    tp->tv_nsec = nsec % 1000000000ULL;
 
     return 0;
 }
@@ -451,6 +461,45 @@ gettext (const char * msgid)
 }
 
 
+/* glibc's x86_64 pthread_mutex_t is 40 bytes */
+#define PTHREAD_MUTEX_SIZE 40
+
+typedef char pthread_mutex_fits_nk_mutex[sizeof(nk_mutex_t) <= PTHREAD_MUTEX_SIZE ? 1 : -1];
+
+int
+pthread_mutex_init (void * mutex, const void * attr)
+{
+    // attributes (recursive, error checking, ...) are not supported
+    return nk_mutex_init((nk_mutex_t*)mutex) ? EINVAL : 0;
+}
+
+int
+pthread_mutex_destroy (void * mutex)
+{
+    return nk_mutex_deinit((nk_mutex_t*)mutex) ? EBUSY : 0;
+}
+
+int
+pthread_mutex_lock (void * mutex)
+{
+    nk_mutex_lock((nk_mutex_t*)mutex);
+    return 0;
+}
+
+int
+pthread_mutex_trylock (void * mutex)
+{
+    return nk_mutex_trylock((nk_mutex_t*)mutex) ? EBUSY : 0;
+}
+
+int
+pthread_mutex_unlock (void * mutex)
+{
+    nk_mutex_unlock((nk_mutex_t*)mutex);
+    return 0;
+}
+
+
 /* became lazy... */
 GEN_DEF(writev)
 GEN_DEF(ungetwc)
@@ -497,9 +546,6 @@ GEN_DEF(__towupper_l)
 GEN_DEF(__uselocale)
 GEN_DEF(__strftime_l)
 GEN_DEF(mbsnrtowcs)
-GEN_DEF(pthread_mutex_init)
-GEN_DEF(pthread_mutex_lock)
-GEN_DEF(pthread_mutex_unlock)
 GEN_DEF(wcscoll)
 GEN_DEF(strcoll)
 GEN_DEF(towupper)
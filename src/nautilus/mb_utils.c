@@ -26,6 +26,9 @@
 #include <nautilus/naut_types.h>
 #include <nautilus/paging.h>
 #include <nautilus/mm.h>
+#ifdef NAUT_CONFIG_KSYMS
+#include <nautilus/ksyms.h>
+#endif
 
 
 uint_t 
@@ -202,7 +205,12 @@ multiboot_parse (ulong_t mbd, ulong_t magic)
                         elf->size,
                         elf->num,
                         elf->entsize,
-                        elf->shndx);
+                        elf->shndx,
+                        elf->sections);
+                mb_info->sec_hdr_start = elf->sections;
+#ifdef NAUT_CONFIG_KSYMS
+                nk_ksyms_boot_init(elf);
+#endif
                 break;
                                                   }
             case MULTIBOOT_TAG_TYPE_MMAP: {
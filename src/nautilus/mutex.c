@@ -0,0 +1,198 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/mutex.h>
+#include <nautilus/thread.h>
+#include <nautilus/scheduler.h>
+#include <nautilus/irq.h>
+#include <nautilus/errno.h>
+#include <nautilus/tsc.h>
+
+#ifndef NAUT_CONFIG_DEBUG_SYNCH
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif
+
+#define ERROR(fmt, args...) ERROR_PRINT("mutex: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("mutex: " fmt, ##args)
+
+// how long an acquirer will spin on a running owner before blocking
+// this is on the order of a couple of context switches
+#define MUTEX_SPIN_NS 20000ULL
+
+
+int
+nk_mutex_init (nk_mutex_t * m)
+{
+    memset(m, 0, sizeof(*m));
+    INIT_LIST_HEAD(&m->waitq.queue);
+    spinlock_init(&m->waitq.lock);
+    return 0;
+}
+
+
+int
+nk_mutex_deinit (nk_mutex_t * m)
+{
+    if (m->state != NK_MUTEX_UNLOCKED) {
+        ERROR("Destroying held mutex %p (owner %p)\n", m, m->owner);
+        return -EINVAL;
+    }
+    memset(m, 0, sizeof(*m));
+    return 0;
+}
+
+
+/*
+ * Is the owner currently executing on some other CPU?
+ * The owner may release the mutex and even exit while we look,
+ * but thread structures are only reclaimed by reaping, and we only
+ * read them, so the worst outcome is a wrong guess.
+ */
+static inline int
+owner_running (struct nk_thread * owner)
+{
+    struct sys_info * sys = per_cpu_get(system);
+    int cpu = owner->current_cpu;
+
+    return cpu != my_cpu_id() && sys->cpus[cpu]->cur_thread == owner;
+}
+
+
+// a zeroed mutex has a zeroed list head, fix it on first contention
+static inline void
+waitq_lazy_init (nk_mutex_t * m)
+{
+    if (!m->waitq.queue.next) {
+        INIT_LIST_HEAD(&m->waitq.queue);
+    }
+}
+
+
+/*
+ * Invoked by the thread queue with the wait queue locked, just
+ * before we would enqueue ourselves.   Either grab the mutex if it
+ * was released in the meantime, or mark it contended so that the
+ * releaser knows to hand it off to us.
+ */
+static int
+mutex_try_block (void * state)
+{
+    nk_mutex_t * m = (nk_mutex_t *)state;
+    uint32_t s;
+
+    waitq_lazy_init(m);
+
+    while (1) {
+        s = m->state;
+        if (s == NK_MUTEX_UNLOCKED) {
+            // nobody can be queued on a free mutex
+            if (__sync_bool_compare_and_swap(&m->state, NK_MUTEX_UNLOCKED, NK_MUTEX_LOCKED)) {
+                m->owner = get_cur_thread();
+                return 1;
+            }
+        } else if (s == NK_MUTEX_LOCKED) {
+            if (__sync_bool_compare_and_swap(&m->state, NK_MUTEX_LOCKED, NK_MUTEX_CONTENDED)) {
+                return 0;
+            }
+        } else {
+            return 0;
+        }
+    }
+}
+
+
+void
+nk_mutex_lock_slow (nk_mutex_t * m)
+{
+    struct nk_thread * me = get_cur_thread();
+    struct nk_thread * owner;
+    uint64_t limit;
+
+    ASSERT(!in_interrupt_context());
+
+    limit = rdtsc() + nk_tsc_ns_to_cycles(MUTEX_SPIN_NS);
+
+    // adaptive phase - spin only while it could pay off
+    while (rdtsc() < limit) {
+        if (m->state == NK_MUTEX_UNLOCKED &&
+            __sync_bool_compare_and_swap(&m->state, NK_MUTEX_UNLOCKED, NK_MUTEX_LOCKED)) {
+            m->owner = me;
+            return;
+        }
+        if (m->state == NK_MUTEX_CONTENDED) {
+            // others are already queued, don't jump ahead of them
+            break;
+        }
+        owner = m->owner;
+        // a null owner is a release or acquire in progress
+        if (owner && !owner_running(owner)) {
+            break;
+        }
+        asm volatile ("pause");
+    }
+
+    DEBUG("Thread %lu (%s) blocking on mutex %p\n", me->tid, me->name, m);
+
+    // blocking phase - we hold the mutex when this returns,
+    // either from mutex_try_block() or by hand-off
+    nk_thread_queue_sleep_extended(&m->waitq, mutex_try_block, m);
+
+    ASSERT(m->owner == me);
+}
+
+
+void
+nk_mutex_unlock_slow (nk_mutex_t * m)
+{
+    nk_queue_entry_t * elm = NULL;
+    struct nk_thread * t;
+    uint8_t flags;
+
+    flags = spin_lock_irq_save(&m->waitq.lock);
+
+    waitq_lazy_init(m);
+
+    elm = nk_dequeue_first(&m->waitq);
+
+    if (!elm) {
+        m->state = NK_MUTEX_UNLOCKED;
+        spin_unlock_irq_restore(&m->waitq.lock, flags);
+        return;
+    }
+
+    t = container_of(elm, struct nk_thread, wait_node);
+
+    ASSERT(t->status == NK_THR_WAITING);
+
+    // direct hand-off, the mutex is never free
+    m->owner = t;
+    m->state = nk_queue_empty(&m->waitq) ? NK_MUTEX_LOCKED : NK_MUTEX_CONTENDED;
+
+    DEBUG("Handing off mutex %p to thread %lu (%s)\n", m, t->tid, t->name);
+
+    if (nk_sched_awaken(t, t->current_cpu)) {
+        ERROR("Failed to awaken thread %lu (%s)\n", t->tid, t->name);
+    } else {
+        nk_sched_kick_cpu(t->current_cpu);
+    }
+
+    spin_unlock_irq_restore(&m->waitq.lock, flags);
+}
@@ -72,7 +72,7 @@ struct nk_net_dev * nk_net_dev_find(char *name)
 {
     DEBUG("find %s\n",name);
     struct nk_dev *d = nk_dev_find(name);
-    if (d->type!=NK_DEV_NET) {
+    if (!d || d->type!=NK_DEV_NET) {
 	DEBUG("%s not found\n",name);
 	return 0;
     } else {
@@ -96,6 +96,11 @@ static void generic_send_callback(void *context)
     *(uint64_t *)context = 1;
 }
 
+static int generic_check(void *context)
+{
+    return *(volatile uint64_t *)context;
+}
+
 static void generic_receive_callback(void *context)
 {
     DEBUG("generic receive callback for %p\n",context);
@@ -145,7 +150,7 @@ int nk_net_dev_send_packet(struct nk_net_dev *dev,
 		} else {
 		    DEBUG("Packet launch started, waiting for completion\n");
 		    while (!completion) {
-			nk_dev_wait((struct nk_dev *)dev);
+			nk_dev_wait_cond((struct nk_dev *)dev, generic_check, (void*)&completion);
 		    }
 		    return 0;
 		}
@@ -201,7 +206,7 @@ int nk_net_dev_receive_packet(struct nk_net_dev *dev,
 		} else {
 		    DEBUG("Packet receive posted, waiting for completion\n");
 		    while (!completion) {
-			nk_dev_wait((struct nk_dev *)d);
+			nk_dev_wait_cond((struct nk_dev *)d, generic_check, (void*)&completion);
 		    }
 		    return 0;
 		}
@@ -23,8 +23,14 @@
 #include <nautilus/msr.h>
 #include <nautilus/nautilus.h>
 #include <nautilus/cpu.h>
+#include <nautilus/cpuid.h>
+#include <nautilus/smp.h>
+#include <nautilus/irq.h>
+#include <nautilus/thread.h>
+#include <nautilus/scheduler.h>
 #include <nautilus/pmc.h>
 #include <nautilus/mm.h>
+#include <dev/apic.h>
 
 
 #define PMC_DEBUG(fmt, args...) DEBUG_PRINT("PMC: " fmt, ##args)
@@ -32,6 +38,19 @@
 #define PMC_ERR(fmt, args...)   ERROR_PRINT("PMC: " fmt, ##args)
 #define PMC_WARN(fmt, args...)  WARN_PRINT("PMC: " fmt, ##args)
 
+// slot used by per-thread counting
+#define PMC_SLOT_THREAD 2
+// slot used for sampling
+#define PMC_SLOT_SAMPLE 3
+
+// AMD without the extended core counters
+#define AMD_LEGACY_SLOTS    4
+#define AMD_LEGACY_CTL0_MSR 0xc0010000
+#define AMD_LEGACY_CTR0_MSR 0xc0010004
+
+static struct nk_pmc_info pmc_info;
+static uint8_t amd_legacy;
+
 static perf_slot_t  pmc_slots[NUM_PERF_SLOTS];
 
 static event_prop_t event_props[256] = 
@@ -46,40 +65,69 @@ static event_prop_t event_props[256] =
     [AMD_PMC_ICACHE_INV]   = {"Instr. Cache Lines Invalidated", 0x07},
 };
 
+// architectural events may go in any slot
+static event_prop_t intel_event_prop = {"Architectural Event", 0xff};
+
+
+static inline uint32_t
+pmc_ctl_msr (uint8_t idx)
+{
+    if (pmc_info.vendor == NK_PMC_INTEL) {
+        return INTEL_PERFEVTSEL0_MSR + idx;
+    }
+    return amd_legacy ? AMD_LEGACY_CTL0_MSR + idx : PERF_CTL_MSR_N(idx);
+}
+
+static inline uint32_t
+pmc_ctr_msr (uint8_t idx)
+{
+    if (pmc_info.vendor == NK_PMC_INTEL) {
+        return INTEL_PMC0_MSR + idx;
+    }
+    return amd_legacy ? AMD_LEGACY_CTR0_MSR + idx : PERF_CTR_MSR_N(idx);
+}
+
+static inline uint64_t
+rdpmc (uint32_t idx)
+{
+    uint32_t lo, hi;
+    asm volatile ("rdpmc" : "=a"(lo), "=d"(hi) : "c"(idx));
+    return lo | ((uint64_t)hi << 32);
+}
 
 
 static inline uint64_t
 read_pmc_ctl (uint8_t idx)
 {
-    if (idx >= NUM_PERF_SLOTS) {
+    if (idx >= pmc_info.num_gp) {
         WARN_PRINT("Attempt to access invalid PMC CTL slot (%u)\n", idx);
         return 0;
     }
 
-    return msr_read(PERF_CTL_MSR_N(idx));
+    return msr_read(pmc_ctl_msr(idx));
 }
 
 static inline void
 write_pmc_ctl (uint8_t idx, uint64_t val)
 {
-    if (idx >= NUM_PERF_SLOTS) {
+    if (idx >= pmc_info.num_gp) {
         WARN_PRINT("Attempt to access invalid PMC CTL slot (%u)\n", idx);
         return;
     }
 
-    msr_write(PERF_CTL_MSR_N(idx), val);
+    msr_write(pmc_ctl_msr(idx), val);
 }
 
 
 static inline uint64_t
 read_pmc_ctr (uint8_t idx)
 { 
-    if (idx >= NUM_PERF_SLOTS) {
+    if (idx >= pmc_info.num_gp) {
         PMC_WARN("Attempt to access invalid PMC CTR slot (%u)\n", idx);
         return 0;
     }
 
-    return msr_read(PERF_CTR_MSR_N(idx));
+    return msr_read(pmc_ctr_msr(idx));
 
 }
 
@@ -87,12 +135,35 @@ read_pmc_ctr (uint8_t idx)
 static inline void
 write_pmc_ctr (uint8_t idx, uint64_t val)
 { 
-    if (idx >= NUM_PERF_SLOTS) {
+    if (idx >= pmc_info.num_gp) {
         PMC_WARN("Attempt to access invalid PMC CTR slot (%u)\n", idx);
         return;
     }
 
-    msr_write(PERF_CTR_MSR_N(idx), val);
+    msr_write(pmc_ctr_msr(idx), val);
+}
+
+
+// on Intel, a counter also has to be enabled globally
+static inline void
+intel_global_ctrl (uint64_t bits, int on)
+{
+    uint64_t val;
+
+    if (pmc_info.vendor != NK_PMC_INTEL) {
+        return;
+    }
+
+    val = msr_read(INTEL_PERF_GLOBAL_CTRL_MSR);
+    val = on ? (val | bits) : (val & ~bits);
+    msr_write(INTEL_PERF_GLOBAL_CTRL_MSR, val);
+}
+
+
+static inline event_prop_t *
+pmc_event_prop (uint8_t event_id)
+{
+    return pmc_info.vendor == NK_PMC_INTEL ? &intel_event_prop : &event_props[event_id];
 }
 
 
@@ -102,20 +173,21 @@ assign_perf_event (uint8_t event_id, uint8_t unit_mask)
     uint8_t i;
     perf_event_t * event = NULL;
     perf_slot_t * slot = NULL;
+    event_prop_t * prop = pmc_event_prop(event_id);
 
-    for (i = 0; i < NUM_PERF_SLOTS; i++) {
+    for (i = 0; i < pmc_info.num_gp; i++) {
 
         slot = &pmc_slots[i];
 
         if (slot->status == PMC_SLOT_FREE && 
-            event_props[event_id].slot_mask & (1<<i)) {
+            prop->slot_mask & (1<<i)) {
 
             pmc_ctl_t ctl;
 
             PMC_INFO("Assigning PMC slot %u to performance event %x (%s) with unit mask 0x%x\n", 
                     i, 
                     event_id,
-                    event_props[event_id].name,
+                    prop->name,
                     unit_mask);
 
             ctl.val           = 0;
@@ -134,8 +206,8 @@ assign_perf_event (uint8_t event_id, uint8_t unit_mask)
         }
     }
 
-    if (i == NUM_PERF_SLOTS) {
-        PMC_ERR("Could not assign event 0x%x, no empty slots\n", event);
+    if (i == pmc_info.num_gp) {
+        PMC_ERR("Could not assign event 0x%x, no empty slots\n", event_id);
         return NULL;
     }
 
@@ -148,7 +220,7 @@ assign_perf_event (uint8_t event_id, uint8_t unit_mask)
     event->id           = event_id;
     event->assigned_idx = i;
     event->enabled      = 0;
-    event->prop         = &event_props[event_id];
+    event->prop         = prop;
 
     slot->event = event;
 
@@ -175,6 +247,7 @@ enable_perf_event (perf_event_t * event)
     ctl.en = 1;
 
     write_pmc_ctl(idx, ctl.val);
+    intel_global_ctrl(1UL << idx, 1);
 }
 
 
@@ -197,6 +270,7 @@ disable_perf_event (perf_event_t * event)
     ctl.en = 0;
 
     write_pmc_ctl(idx, ctl.val);
+    intel_global_ctrl(1UL << idx, 0);
 }
 
 
@@ -204,7 +278,7 @@ void
 enable_all_events (void)
 {
     unsigned i;
-    for (i = 0; i < NUM_PERF_SLOTS; i++) {
+    for (i = 0; i < pmc_info.num_gp; i++) {
         perf_slot_t * slot = &pmc_slots[i];
         if (slot->status == PMC_SLOT_USED) {
             enable_perf_event(slot->event);
@@ -217,7 +291,7 @@ void
 disable_all_events (void)
 {
     unsigned i;
-    for (i = 0; i < NUM_PERF_SLOTS; i++) {
+    for (i = 0; i < pmc_info.num_gp; i++) {
         perf_slot_t * slot = &pmc_slots[i];
         if (slot->status == PMC_SLOT_USED) {
             disable_perf_event(slot->event);
@@ -230,8 +304,10 @@ void
 reset_all_counters (void)
 {
     unsigned i;
-    for (i = 0; i < NUM_PERF_SLOTS; i++) {
-        write_pmc_ctr(i, 0);
+    for (i = 0; i < pmc_info.num_gp; i++) {
+        if (pmc_slots[i].status == PMC_SLOT_USED) {
+            write_pmc_ctr(i, 0);
+        }
     }
 }
 
@@ -244,7 +320,7 @@ release_perf_event (perf_event_t * event)
     perf_slot_t * slot = NULL;
     uint8_t idx = event->assigned_idx;
 
-    if (idx >= NUM_PERF_SLOTS) {
+    if (idx >= pmc_info.num_gp) {
         PMC_ERR("Cannot release PMC slot for invalid index %u\n", idx);
         return;
     }
@@ -256,6 +332,7 @@ release_perf_event (perf_event_t * event)
         slot->event  = NULL;
         write_pmc_ctl(idx, 0);
         write_pmc_ctr(idx, 0);
+        intel_global_ctrl(1UL << idx, 0);
     }
 
     free(event);
@@ -281,11 +358,11 @@ perf_report (void)
 
     PMC_INFO("++++++++ Perf Monitor Event Report ++++++++\n");
 
-    for (i = 0; i < NUM_PERF_SLOTS; i++) {
+    for (i = 0; i < pmc_info.num_gp; i++) {
 
         perf_slot_t * slot = &pmc_slots[i];
 
-        if (slot->status == PMC_SLOT_FREE) {
+        if (slot->status != PMC_SLOT_USED) {
             continue;
         }
 
@@ -304,13 +381,610 @@ perf_report (void)
 
 }
 
+
+/*
+  Per-thread counting.   Each event is either on an Intel fixed
+  counter or on a general-purpose slot taken from the top.  Every
+  CPU counts all the time; at a context switch the difference 
+  from the CPU's last reading goes to the outgoing thread, which 
+  is cheaper than saving and zeroing the counters, and gives the
+  same counts.   The counters are read with rdpmc.
+*/
+
+int nk_pmc_thread_active = 0;
+
+struct thread_ctr {
+    int      valid;
+    int      slot;     // general-purpose slot, or -1 for fixed
+    uint32_t rdpmc;    // rdpmc index
+    uint16_t event;    // select | unit mask<<8, for a slot
+    uint64_t mask;     // of the counter width
+};
+
+static struct thread_ctr thread_ctrs[NK_PMC_NUM_THREAD_EVENTS];
+
+static struct pmc_cpu_state {
+    uint64_t last[NK_PMC_NUM_THREAD_EVENTS];
+} __attribute__((aligned(64))) pmc_cpu[NAUT_CONFIG_MAX_CPUS];
+
+static const char *thread_event_names[NK_PMC_NUM_THREAD_EVENTS] = {
+    [NK_PMC_INSTRUCTIONS]  = "instructions",
+    [NK_PMC_CYCLES]        = "cycles",
+    [NK_PMC_CACHE_MISSES]  = "cache-misses",
+    [NK_PMC_BRANCH_MISSES] = "branch-misses",
+};
+
+
+const char *
+nk_pmc_thread_event_name (enum nk_pmc_thread_event e)
+{
+    return e < NK_PMC_NUM_THREAD_EVENTS ? thread_event_names[e] : "unknown";
+}
+
+
+static inline uint64_t
+width_mask (uint8_t width)
+{
+    return width >= 64 ? -1UL : (1UL << width) - 1;
+}
+
+
+static int
+thread_ctr_fixed (enum nk_pmc_thread_event e, uint8_t fixed)
+{
+    if (fixed >= pmc_info.num_fixed) {
+        return -1;
+    }
+    thread_ctrs[e].valid = 1;
+    thread_ctrs[e].slot  = -1;
+    thread_ctrs[e].rdpmc = RDPMC_FIXED | fixed;
+    thread_ctrs[e].mask  = width_mask(pmc_info.fixed_width);
+    return 0;
+}
+
+
+// Intel CPUID.0xa:EBX bit, or -1 for no check
+static int
+thread_ctr_slot (enum nk_pmc_thread_event e, uint16_t event, int unavail_bit)
+{
+    int i;
+
+    if (unavail_bit >= 0 && (pmc_info.unavail & (1U << unavail_bit))) {
+        return -1;
+    }
+
+    for (i = pmc_info.num_gp - 1; i >= 0; i--) {
+        if (pmc_slots[i].status == PMC_SLOT_FREE) {
+            pmc_slots[i].status = PMC_SLOT_THREAD;
+            thread_ctrs[e].valid = 1;
+            thread_ctrs[e].slot  = i;
+            thread_ctrs[e].rdpmc = i;
+            thread_ctrs[e].event = event;
+            thread_ctrs[e].mask  = width_mask(pmc_info.gp_width);
+            return 0;
+        }
+    }
+
+    PMC_WARN("No free slot to count %s per thread\n", thread_event_names[e]);
+    return -1;
+}
+
+
+static void
+thread_ctrs_choose (void)
+{
+    memset(thread_ctrs, 0, sizeof(thread_ctrs));
+
+    if (pmc_info.vendor == NK_PMC_INTEL) {
+        if (thread_ctr_fixed(NK_PMC_INSTRUCTIONS, INTEL_FIXED_INSTR_RETIRED)) {
+            thread_ctr_slot(NK_PMC_INSTRUCTIONS, INTEL_PMC_INSTR_RETIRED, 1);
+        }
+        if (thread_ctr_fixed(NK_PMC_CYCLES, INTEL_FIXED_CORE_CYCLES)) {
+            thread_ctr_slot(NK_PMC_CYCLES, INTEL_PMC_CORE_CYCLES, 0);
+        }
+        thread_ctr_slot(NK_PMC_CACHE_MISSES, INTEL_PMC_LLC_MISS, 4);
+        thread_ctr_slot(NK_PMC_BRANCH_MISSES, INTEL_PMC_BRANCH_MISS, 6);
+    } else {
+        thread_ctr_slot(NK_PMC_INSTRUCTIONS, AMD_PMC_INSTR_RETIRED, -1);
+        thread_ctr_slot(NK_PMC_CYCLES, AMD_PMC_CORE_CYCLES, -1);
+        thread_ctr_slot(NK_PMC_CACHE_MISSES, AMD_PMC_DCACHE_MISS | (0x1 << 8), -1);
+        thread_ctr_slot(NK_PMC_BRANCH_MISSES, AMD_PMC_BRANCH_MISS, -1);
+    }
+}
+
+
+static void
+thread_ctrs_release (void)
+{
+    int i;
+
+    for (i = 0; i < NK_PMC_NUM_THREAD_EVENTS; i++) {
+        if (thread_ctrs[i].valid && thread_ctrs[i].slot >= 0) {
+            pmc_slots[thread_ctrs[i].slot].status = PMC_SLOT_FREE;
+        }
+        thread_ctrs[i].valid = 0;
+    }
+}
+
+
+// xcall, on each CPU with interrupts off
+static void
+thread_ctrs_program (void * arg)
+{
+    struct pmc_cpu_state * pc = &pmc_cpu[my_cpu_id()];
+    int on = (int)(long)arg;
+    uint64_t fixed_ctrl = 0, fixed_bits = 0, global = 0;
+    pmc_ctl_t ctl;
+    int i;
+
+    if (pmc_info.vendor == NK_PMC_INTEL && pmc_info.num_fixed) {
+        fixed_ctrl = msr_read(INTEL_FIXED_CTR_CTRL_MSR);
+    }
+
+    for (i = 0; i < NK_PMC_NUM_THREAD_EVENTS; i++) {
+        struct thread_ctr * c = &thread_ctrs[i];
+
+        if (!c->valid) {
+            continue;
+        }
+
+        if (c->slot < 0) {
+            uint32_t f = c->rdpmc & ~RDPMC_FIXED;
+            fixed_bits |= 0xfUL << (4*f);
+            if (on) {
+                fixed_ctrl |= (INTEL_FIXED_CTRL_OS | INTEL_FIXED_CTRL_USR) << (4*f);
+            }
+            global |= 1UL << (32 + f);
+        } else {
+            ctl.val = 0;
+            if (on) {
+                ctl.event_select0 = c->event & 0xff;
+                ctl.unit_mask     = c->event >> 8;
+                ctl.usr           = 1;
+                ctl.os            = 1;
+                ctl.en            = 1;
+            }
+            write_pmc_ctl(c->slot, ctl.val);
+            global |= 1UL << c->slot;
+        }
+    }
+
+    if (pmc_info.vendor == NK_PMC_INTEL) {
+        if (pmc_info.num_fixed) {
+            if (!on) {
+                fixed_ctrl &= ~fixed_bits;
+            }
+            msr_write(INTEL_FIXED_CTR_CTRL_MSR, fixed_ctrl);
+        }
+        intel_global_ctrl(global, on);
+    }
+
+    for (i = 0; i < NK_PMC_NUM_THREAD_EVENTS; i++) {
+        if (thread_ctrs[i].valid) {
+            pc->last[i] = rdpmc(thread_ctrs[i].rdpmc);
+        }
+    }
+}
+
+
+static void
+thread_ctrs_all_cpus (int on)
+{
+    struct sys_info * sys = per_cpu_get(system);
+    int i;
+
+    for (i = 0; i < sys->num_cpus; i++) {
+        if (smp_xcall(i, thread_ctrs_program, (void*)(long)on, 1)) {
+            PMC_ERR("Could not program counters on cpu %d\n", i);
+        }
+    }
+}
+
+
+int
+nk_pmc_thread_enable (void)
+{
+    if (pmc_info.vendor == NK_PMC_NONE) {
+        PMC_ERR("No supported performance counters\n");
+        return -1;
+    }
+
+    if (nk_pmc_thread_active) {
+        return 0;
+    }
+
+    thread_ctrs_choose();
+    thread_ctrs_all_cpus(1);
+
+    __sync_synchronize();
+    nk_pmc_thread_active = 1;
+
+    PMC_INFO("Per-thread counting enabled\n");
+    return 0;
+}
+
+
+int
+nk_pmc_thread_disable (void)
+{
+    if (!nk_pmc_thread_active) {
+        return 0;
+    }
+
+    nk_pmc_thread_active = 0;
+    __sync_synchronize();
+
+    thread_ctrs_all_cpus(0);
+    thread_ctrs_release();
+
+    PMC_INFO("Per-thread counting disabled\n");
+    return 0;
+}
+
+
+// charge what this CPU counted since its last reading to t
+static inline void
+thread_accumulate (struct nk_thread * t)
+{
+    struct pmc_cpu_state * pc = &pmc_cpu[my_cpu_id()];
+    uint64_t cur;
+    int i;
+
+    for (i = 0; i < NK_PMC_NUM_THREAD_EVENTS; i++) {
+        struct thread_ctr * c = &thread_ctrs[i];
+        if (c->valid) {
+            cur = rdpmc(c->rdpmc);
+            t->pmc.count[i] += (cur - pc->last[i]) & c->mask;
+            pc->last[i] = cur;
+        }
+    }
+}
+
+
+void
+_nk_pmc_thread_switch (struct nk_thread * prev)
+{
+    thread_accumulate(prev);
+}
+
+
+void
+nk_pmc_thread_read (struct nk_thread * t, struct nk_pmc_counts * counts)
+{
+    uint8_t flags = irq_disable_save();
+
+    if (nk_pmc_thread_active && t == get_cur_thread()) {
+        thread_accumulate(t);
+    }
+
+    *counts = t->pmc;
+
+    irq_enable_restore(flags);
+}
+
+
+struct group_sum {
+    struct nk_thread_group * group;
+    struct nk_pmc_counts   * counts;
+    int                      members;
+};
+
+static void
+group_add (struct nk_thread * t, void * state)
+{
+    struct group_sum * g = (struct group_sum *)state;
+    struct nk_pmc_counts c;
+    int i;
+
+    // the group is only compared, so it may have gone away
+    if (t->group != g->group) {
+        return;
+    }
+
+    nk_pmc_thread_read(t, &c);
+
+    for (i = 0; i < NK_PMC_NUM_THREAD_EVENTS; i++) {
+        g->counts->count[i] += c.count[i];
+    }
+
+    g->members++;
+}
+
+
+int
+nk_pmc_group_read (struct nk_thread_group * group, struct nk_pmc_counts * counts)
+{
+    struct group_sum g = { .group = group, .counts = counts, .members = 0 };
+
+    memset(counts, 0, sizeof(*counts));
+
+    nk_sched_map_threads(-1, group_add, &g);
+
+    return g.members;
+}
+
+
+/*
+  Sampling.   One general-purpose counter per CPU is loaded with
+  -period and interrupts on APIC_PC_INT_VEC when it wraps.  This is
+  a fixed vector rather than an NMI, so the handler may touch
+  anything an interrupt handler may, but a sample that comes due
+  with interrupts off is taken when they are turned back on.
+*/
+
+static struct {
+    volatile int on;
+    int          slot;
+    uint16_t     event;    // select | unit mask<<8
+    uint64_t     reload;   // -period, to the counter width
+    void       (*handler)(excp_entry_t * excp);
+} pmc_sample = { .slot = -1 };
+
+
+static int
+pmc_sample_irq (excp_entry_t * excp, excp_vec_t vec, void * state)
+{
+    int slot = pmc_sample.slot;
+    int ours;
+
+    if (pmc_sample.on && slot >= 0) {
+        if (pmc_info.vendor == NK_PMC_INTEL) {
+            ours = !!(msr_read(INTEL_PERF_GLOBAL_STATUS_MSR) & (1UL << slot));
+            if (ours) {
+                msr_write(INTEL_PERF_GLOBAL_OVF_CTRL_MSR, 1UL << slot);
+            }
+        } else {
+            // the reload value has the top bit set until it wraps
+            ours = !(read_pmc_ctr(slot) & (1UL << (pmc_info.gp_width - 1)));
+        }
+
+        if (ours) {
+            write_pmc_ctr(slot, pmc_sample.reload);
+            pmc_sample.handler(excp);
+        }
+
+        // delivery masks the entry
+        apic_write(per_cpu_get(apic), APIC_REG_LVTPC, APIC_DEL_MODE_FIXED | APIC_PC_INT_VEC);
+    }
+
+    IRQ_HANDLER_END();
+
+    return 0;
+}
+
+
+// xcall, on each CPU with interrupts off
+static void
+pmc_sample_program (void * arg)
+{
+    struct apic_dev * apic = per_cpu_get(apic);
+    int slot = pmc_sample.slot;
+    int on = (int)(long)arg;
+    pmc_ctl_t ctl;
+
+    write_pmc_ctl(slot, 0);
+
+    if (on) {
+        write_pmc_ctr(slot, pmc_sample.reload);
+        apic_write(apic, APIC_REG_LVTPC, APIC_DEL_MODE_FIXED | APIC_PC_INT_VEC);
+        ctl.val           = 0;
+        ctl.event_select0 = pmc_sample.event & 0xff;
+        ctl.unit_mask     = pmc_sample.event >> 8;
+        ctl.usr           = 1;
+        ctl.os            = 1;
+        ctl.int_enable    = 1;
+        ctl.en            = 1;
+        write_pmc_ctl(slot, ctl.val);
+    } else {
+        apic_write(apic, APIC_REG_LVTPC, APIC_DEL_MODE_FIXED | APIC_LVT_DISABLED | APIC_PC_INT_VEC);
+        write_pmc_ctr(slot, 0);
+    }
+
+    intel_global_ctrl(1UL << slot, on);
+}
+
+
+static void
+pmc_sample_all_cpus (int on)
+{
+    struct sys_info * sys = per_cpu_get(system);
+    int i;
+
+    for (i = 0; i < sys->num_cpus; i++) {
+        if (smp_xcall(i, pmc_sample_program, (void*)(long)on, 1)) {
+            PMC_ERR("Could not program sampling on cpu %d\n", i);
+        }
+    }
+}
+
+
+// event code for a general-purpose counter, or -1 if the CPU lacks it
+static int
+pmc_event_code (enum nk_pmc_thread_event e)
+{
+    static const uint16_t intel[NK_PMC_NUM_THREAD_EVENTS] = {
+        [NK_PMC_INSTRUCTIONS]  = INTEL_PMC_INSTR_RETIRED,
+        [NK_PMC_CYCLES]        = INTEL_PMC_CORE_CYCLES,
+        [NK_PMC_CACHE_MISSES]  = INTEL_PMC_LLC_MISS,
+        [NK_PMC_BRANCH_MISSES] = INTEL_PMC_BRANCH_MISS,
+    };
+    // CPUID.0xa:EBX bit for each
+    static const uint8_t intel_bit[NK_PMC_NUM_THREAD_EVENTS] = { 1, 0, 4, 6 };
+    static const uint16_t amd[NK_PMC_NUM_THREAD_EVENTS] = {
+        [NK_PMC_INSTRUCTIONS]  = AMD_PMC_INSTR_RETIRED,
+        [NK_PMC_CYCLES]        = AMD_PMC_CORE_CYCLES,
+        [NK_PMC_CACHE_MISSES]  = AMD_PMC_DCACHE_MISS | (0x1 << 8),
+        [NK_PMC_BRANCH_MISSES] = AMD_PMC_BRANCH_MISS,
+    };
+
+    if (e >= NK_PMC_NUM_THREAD_EVENTS) {
+        return -1;
+    }
+
+    if (pmc_info.vendor == NK_PMC_INTEL) {
+        return pmc_info.unavail & (1U << intel_bit[e]) ? -1 : intel[e];
+    }
+
+    return amd[e];
+}
+
+
+int
+nk_pmc_sample_start (enum nk_pmc_thread_event e, 
+                     uint64_t period, 
+                     void (*handler)(excp_entry_t * excp))
+{
+    int code, i;
+
+    if (pmc_info.vendor == NK_PMC_NONE) {
+        PMC_ERR("No supported performance counters\n");
+        return -1;
+    }
+
+    if (pmc_sample.on) {
+        PMC_ERR("Sampling is already on\n");
+        return -1;
+    }
+
+    // Intel sign-extends writes to the counters from bit 31
+    if (!period || period >= (1UL << 31) || !handler) {
+        PMC_ERR("Invalid sampling period %lu\n", period);
+        return -1;
+    }
+
+    code = pmc_event_code(e);
+
+    if (code < 0) {
+        PMC_ERR("This CPU cannot count %s\n", nk_pmc_thread_event_name(e));
+        return -1;
+    }
+
+    for (i = pmc_info.num_gp - 1; i >= 0; i--) {
+        if (pmc_slots[i].status == PMC_SLOT_FREE) {
+            break;
+        }
+    }
+
+    if (i < 0) {
+        PMC_ERR("No free counter for sampling\n");
+        return -1;
+    }
+
+    pmc_slots[i].status = PMC_SLOT_SAMPLE;
+
+    pmc_sample.slot    = i;
+    pmc_sample.event   = code;
+    pmc_sample.reload  = -period & width_mask(pmc_info.gp_width);
+    pmc_sample.handler = handler;
+
+    if (register_int_handler(APIC_PC_INT_VEC, pmc_sample_irq, NULL)) {
+        PMC_ERR("Could not register performance counter interrupt handler\n");
+        pmc_slots[i].status = PMC_SLOT_FREE;
+        pmc_sample.slot = -1;
+        return -1;
+    }
+
+    __sync_synchronize();
+    pmc_sample.on = 1;
+
+    pmc_sample_all_cpus(1);
+
+    PMC_INFO("Sampling every %lu %s on slot %d\n", period, nk_pmc_thread_event_name(e), i);
+
+    return 0;
+}
+
+
+int
+nk_pmc_sample_stop (void)
+{
+    if (!pmc_sample.on) {
+        return 0;
+    }
+
+    pmc_sample.on = 0;
+    __sync_synchronize();
+
+    pmc_sample_all_cpus(0);
+
+    pmc_slots[pmc_sample.slot].status = PMC_SLOT_FREE;
+    pmc_sample.slot = -1;
+
+    PMC_INFO("Sampling stopped\n");
+
+    return 0;
+}
+
+
+struct nk_pmc_info *
+nk_pmc_get_info (void)
+{
+    return &pmc_info;
+}
+
+
+static void
+pmc_detect (void)
+{
+    cpuid_ret_t r;
+    uint8_t len;
+
+    memset(&pmc_info, 0, sizeof(pmc_info));
+
+    if (nk_is_intel()) {
+        cpuid(0, &r);
+        if (r.a < 0xa) {
+            return;
+        }
+        cpuid(0xa, &r);
+        if ((r.a & 0xff) < 2) {
+            // v1 lacks the fixed counters and global control
+            PMC_INFO("Intel architectural perfmon version %u not supported\n", r.a & 0xff);
+            return;
+        }
+        pmc_info.vendor      = NK_PMC_INTEL;
+        pmc_info.version     = r.a & 0xff;
+        pmc_info.num_gp      = (r.a >> 8) & 0xff;
+        pmc_info.gp_width    = (r.a >> 16) & 0xff;
+        // events beyond the enumerated EBX length are not available
+        len = (r.a >> 24) & 0xff;
+        pmc_info.unavail     = len >= 32 ? r.b : r.b | ~((1U << len) - 1);
+        pmc_info.num_fixed   = r.d & 0x1f;
+        pmc_info.fixed_width = (r.d >> 5) & 0xff;
+        if (pmc_info.num_fixed > INTEL_MAX_FIXED) {
+            pmc_info.num_fixed = INTEL_MAX_FIXED;
+        }
+    } else if (nk_is_amd()) {
+        cpuid(0x80000001, &r);
+        amd_legacy = !(r.c & (1U << 23)); // PerfCtrExtCore
+        pmc_info.vendor   = NK_PMC_AMD;
+        pmc_info.num_gp   = amd_legacy ? AMD_LEGACY_SLOTS : AMD_PERF_SLOTS;
+        pmc_info.gp_width = 48;
+    }
+
+    if (pmc_info.num_gp > NUM_PERF_SLOTS) {
+        pmc_info.num_gp = NUM_PERF_SLOTS;
+    }
+}
+
+
 int 
 pmc_init (void)
 {
+    memset(pmc_slots, 0, sizeof(pmc_slots));
 
-    /* TODO: make sure we actually have these counters, get the number of them from the index */
+    pmc_detect();
 
-    memset(pmc_slots, 0, sizeof(pmc_slots));
+    if (pmc_info.vendor == NK_PMC_NONE) {
+        PMC_INFO("No supported performance counters\n");
+        return 0;
+    }
+
+    PMC_INFO("%s, version %u, %u general-purpose counters of %u bits, %u fixed of %u bits\n",
+             pmc_info.vendor == NK_PMC_INTEL ? "Intel" : "AMD",
+             pmc_info.version,
+             pmc_info.num_gp, pmc_info.gp_width,
+             pmc_info.num_fixed, pmc_info.fixed_width);
 
 #if 0
     assign_perf_event(AMD_PMC_TLB_MISS, 0x77);
@@ -322,5 +996,3 @@ pmc_init (void)
 
     return 0;
 }
-
-
@@ -43,6 +43,7 @@
 #include <nautilus/errno.h>
 #include <nautilus/math.h>
 #include <nautilus/vc.h>
+#include <nautilus/klog.h>
 
 // All output is handled via the virtual console
 #define do_putchar(x) do { nk_vc_putchar(x);} while (0)
@@ -52,6 +53,7 @@ spinlock_t printk_lock;
 
 extern void serial_putchar(uchar_t c);
 extern void serial_putln(const char * ln);
+extern void serial_flush(void);
 
 struct printk_state {
 	char buf[PRINTK_BUFMAX];
@@ -101,6 +103,13 @@ vprintk (const char * fmt, va_list args)
 {
 	struct printk_state state;
 
+#ifdef NAUT_CONFIG_KLOG
+	// goes to a ring, and reaches the console later
+	if (nk_klog_vwrite(NK_KLOG_CONSOLE, fmt, args) >= 0) {
+	    return 0;
+	}
+#endif
+
     //uint8_t flags = spin_lock_irq_save(&printk_lock);
 
 	state.index = 0;
@@ -121,10 +130,20 @@ panic (const char * fmt, ...)
 {
     va_list arg;
 
+#ifdef NAUT_CONFIG_KLOG
+    // get out whatever is buffered, after which output is direct
+    nk_klog_panic();
+#endif
+
     va_start(arg, fmt);
     vprintk(fmt, arg);
     va_end(arg);
 
+#ifdef NAUT_CONFIG_SERIAL_REDIRECT
+    // serial output is interrupt-driven, and interrupts are going away
+    serial_flush();
+#endif
+
    __asm__ __volatile__ ("cli");
    while(1);
 }
@@ -0,0 +1,414 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/thread.h>
+#include <nautilus/group.h>
+#include <nautilus/irq.h>
+#include <nautilus/pmc.h>
+#include <nautilus/ksyms.h>
+#include <nautilus/vc.h>
+#include <nautilus/sampler.h>
+
+#define INFO(fmt, args...)  INFO_PRINT("sampler: " fmt, ##args)
+#define ERROR(fmt, args...) ERROR_PRINT("sampler: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("sampler: " fmt, ##args)
+
+#define RING_ENTRIES (1UL << NAUT_CONFIG_SAMPLER_RING_ORDER)
+
+// about 3 kHz at 3 GHz
+#define DEFAULT_CYCLES_PERIOD 1000000
+#define DEFAULT_MISSES_PERIOD 10000
+#define DEFAULT_TIMER_PERIOD  1
+
+// most distinct keys aggregated in a dump
+#define MAX_AGG_ORDER 17
+
+int nk_sampler_timer_active = 0;
+
+static struct sampler_cpu {
+    struct nk_sample *ring;
+    uint64_t          count;   // samples taken, the ring holds the last of them
+    uint64_t          ticks;   // timer source
+    uint64_t          cycles;  // spent taking samples
+} __attribute__((aligned(64))) sampler_cpu[NAUT_CONFIG_MAX_CPUS];
+
+static struct {
+    int                    active;
+    enum nk_sampler_source source;
+    uint64_t               period;
+    uint64_t               start;
+    uint64_t               stop;
+} sampler;
+
+static const char *source_names[] = {
+    [NK_SAMPLER_CYCLES]       = "cycles",
+    [NK_SAMPLER_CACHE_MISSES] = "cache-misses",
+    [NK_SAMPLER_TIMER]        = "timer ticks",
+};
+
+
+// interrupt context
+void
+_nk_sampler_record (excp_entry_t * excp)
+{
+    uint64_t start = rdtsc();
+    struct sampler_cpu *sc = &sampler_cpu[my_cpu_id()];
+    struct nk_thread *t = get_cur_thread();
+    struct nk_sample *s;
+
+    if (sampler.source == NK_SAMPLER_TIMER && ++sc->ticks % sampler.period) {
+        return;
+    }
+
+    s = &sc->ring[sc->count & (RING_ENTRIES - 1)];
+
+    s->rip   = excp->rip;
+    s->tid   = t ? t->tid : 0;
+    s->group = t && t->group ? nk_thread_group_get_id(t->group) : NK_SAMPLE_NO_GROUP;
+    s->cpu   = my_cpu_id();
+
+    sc->count++;
+    sc->cycles += rdtsc() - start;
+}
+
+
+int
+nk_sampler_start (enum nk_sampler_source source, uint64_t period)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    enum nk_pmc_thread_event e;
+    int i;
+
+    if (sampler.active) {
+        ERROR("Already sampling\n");
+        return -1;
+    }
+
+    for (i = 0; i < sys->num_cpus; i++) {
+        if (!sampler_cpu[i].ring) {
+            sampler_cpu[i].ring = malloc(RING_ENTRIES * sizeof(struct nk_sample));
+            if (!sampler_cpu[i].ring) {
+                ERROR("Could not allocate sample ring for cpu %d\n", i);
+                return -1;
+            }
+        }
+        sampler_cpu[i].count  = 0;
+        sampler_cpu[i].ticks  = 0;
+        sampler_cpu[i].cycles = 0;
+    }
+
+    if (!period) {
+        period = source == NK_SAMPLER_CYCLES ? DEFAULT_CYCLES_PERIOD :
+                 source == NK_SAMPLER_CACHE_MISSES ? DEFAULT_MISSES_PERIOD :
+                 DEFAULT_TIMER_PERIOD;
+    }
+
+    sampler.source = source;
+    sampler.period = period;
+    sampler.start  = rdtsc();
+    sampler.stop   = 0;
+
+    __sync_synchronize();
+
+    if (source == NK_SAMPLER_TIMER) {
+        nk_sampler_timer_active = 1;
+    } else {
+        e = source == NK_SAMPLER_CYCLES ? NK_PMC_CYCLES : NK_PMC_CACHE_MISSES;
+        if (nk_pmc_sample_start(e, period, _nk_sampler_record)) {
+            ERROR("Could not start sampling on %s, try the timer\n", source_names[source]);
+            return -1;
+        }
+    }
+
+    sampler.active = 1;
+
+    INFO("Sampling every %lu %s\n", period, source_names[source]);
+
+    return 0;
+}
+
+
+int
+nk_sampler_stop (void)
+{
+    if (!sampler.active) {
+        return 0;
+    }
+
+    if (sampler.source == NK_SAMPLER_TIMER) {
+        nk_sampler_timer_active = 0;
+    } else {
+        nk_pmc_sample_stop();
+    }
+
+    sampler.stop   = rdtsc();
+    sampler.active = 0;
+
+    INFO("Sampling stopped\n");
+
+    return 0;
+}
+
+
+/*
+  Aggregation, at dump time only.   Keys are hashed into a table 
+  big enough for every sample; anything beyond MAX_AGG_ORDER 
+  distinct keys is lumped together.
+*/
+
+struct agg {
+    uint64_t key;     // 0 is empty
+    uint64_t aux;
+    uint64_t count;
+};
+
+struct agg_table {
+    struct agg *e;
+    uint64_t    size;
+    uint64_t    other;
+};
+
+
+static int
+agg_init (struct agg_table *t, uint64_t n)
+{
+    uint64_t size = 1;
+
+    while (size < 2*n && size < (1UL << MAX_AGG_ORDER)) {
+        size <<= 1;
+    }
+
+    t->e = malloc(size * sizeof(struct agg));
+    if (!t->e) {
+        ERROR("Could not allocate %lu aggregation entries\n", size);
+        return -1;
+    }
+    memset(t->e, 0, size * sizeof(struct agg));
+    t->size  = size;
+    t->other = 0;
+
+    return 0;
+}
+
+
+static void
+agg_add (struct agg_table *t, uint64_t key, uint64_t aux)
+{
+    uint64_t i, h = (key * 0x9e3779b97f4a7c15UL) >> 32;
+
+    for (i = 0; i < t->size; i++) {
+        struct agg *a = &t->e[(h + i) & (t->size - 1)];
+        if (a->key == key) {
+            a->count++;
+            return;
+        }
+        if (!a->key) {
+            a->key   = key;
+            a->aux   = aux;
+            a->count = 1;
+            return;
+        }
+    }
+
+    t->other++;
+}
+
+
+// removes the entry with the most samples
+static int
+agg_take_max (struct agg_table *t, struct agg *out)
+{
+    struct agg *best = NULL;
+    uint64_t i;
+
+    for (i = 0; i < t->size; i++) {
+        if (t->e[i].count && (!best || t->e[i].count > best->count)) {
+            best = &t->e[i];
+        }
+    }
+
+    if (!best) {
+        return -1;
+    }
+
+    *out = *best;
+    best->count = 0;
+
+    return 0;
+}
+
+
+static inline uint64_t
+ring_held (struct sampler_cpu *sc)
+{
+    return sc->count < RING_ENTRIES ? sc->count : RING_ENTRIES;
+}
+
+
+// calls f on every sample still in the rings, returning how many
+static uint64_t
+for_each_sample (void (*f)(struct nk_sample *s, void *state), void *state)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    uint64_t i, n, total = 0;
+    int c;
+
+    for (c = 0; c < sys->num_cpus; c++) {
+        struct sampler_cpu *sc = &sampler_cpu[c];
+        if (!sc->ring) {
+            continue;
+        }
+        n = ring_held(sc);
+        if (f) {
+            for (i = 0; i < n; i++) {
+                f(&sc->ring[i], state);
+            }
+        }
+        total += n;
+    }
+
+    return total;
+}
+
+
+static void
+add_func (struct nk_sample *s, void *state)
+{
+    addr_t start;
+
+    // unknown addresses stand for themselves
+    if (!nk_ksym_lookup(s->rip, &start)) {
+        start = s->rip;
+    }
+
+    agg_add((struct agg_table *)state, start, 0);
+}
+
+
+static void
+add_thread (struct nk_sample *s, void *state)
+{
+    agg_add((struct agg_table *)state, s->tid + 1, s->group);
+}
+
+
+static void
+dump_header (uint64_t held)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    uint64_t taken = 0, cycles = 0, elapsed, khz, pct;
+    int c;
+
+    for (c = 0; c < sys->num_cpus; c++) {
+        taken  += sampler_cpu[c].count;
+        cycles += sampler_cpu[c].cycles;
+    }
+
+    elapsed = (sampler.active ? rdtsc() : sampler.stop) - sampler.start;
+    khz     = sys->cpus[my_cpu_id()]->cpu_khz;
+    // hundredths of a percent of all CPUs' time
+    pct     = elapsed ? cycles * 10000 / (elapsed * sys->num_cpus) : 0;
+
+    nk_vc_printf("%s every %lu %s: %lu samples (%lu kept) over %lu ms on %d cpus, overhead %lu.%02lu%%\n",
+                 sampler.active ? "Sampling" : "Sampled",
+                 sampler.period, source_names[sampler.source],
+                 taken, held,
+                 khz ? elapsed / khz : 0,
+                 sys->num_cpus,
+                 pct / 100, pct % 100);
+}
+
+
+void
+nk_sampler_dump (int n)
+{
+    struct agg_table t;
+    struct agg a;
+    uint64_t held = for_each_sample(NULL, NULL), shown = 0;
+    const char *name;
+    addr_t start;
+
+    dump_header(held);
+
+    if (!held) {
+        return;
+    }
+
+    if (!nk_ksyms_count()) {
+        nk_vc_printf("No kernel symbols, functions are shown as addresses\n");
+    }
+
+    if (agg_init(&t, held)) {
+        return;
+    }
+
+    for_each_sample(add_func, &t);
+
+    nk_vc_printf("  samples      %%  function\n");
+
+    while (shown < n && !agg_take_max(&t, &a)) {
+        name = nk_ksym_lookup(a.key, &start);
+        if (name && start == a.key) {
+            nk_vc_printf("%9lu %3lu.%02lu%%  %s\n", a.count,
+                         a.count * 100 / held, a.count * 10000 / held % 100, name);
+        } else {
+            nk_vc_printf("%9lu %3lu.%02lu%%  0x%lx\n", a.count,
+                         a.count * 100 / held, a.count * 10000 / held % 100, a.key);
+        }
+        shown++;
+    }
+
+    if (t.other) {
+        nk_vc_printf("%9lu samples at addresses not aggregated\n", t.other);
+    }
+
+    free(t.e);
+}
+
+
+void
+nk_sampler_dump_threads (void)
+{
+    struct agg_table t;
+    struct agg a;
+    uint64_t held = for_each_sample(NULL, NULL);
+
+    dump_header(held);
+
+    if (!held || agg_init(&t, held)) {
+        return;
+    }
+
+    for_each_sample(add_thread, &t);
+
+    nk_vc_printf("  samples      %%       tid     group\n");
+
+    while (!agg_take_max(&t, &a)) {
+        if (a.aux == NK_SAMPLE_NO_GROUP) {
+            nk_vc_printf("%9lu %3lu.%02lu%% %9lu         -\n", a.count,
+                         a.count * 100 / held, a.count * 10000 / held % 100, a.key - 1);
+        } else {
+            nk_vc_printf("%9lu %3lu.%02lu%% %9lu %9lu\n", a.count,
+                         a.count * 100 / held, a.count * 10000 / held % 100, a.key - 1, a.aux);
+        }
+    }
+
+    free(t.e);
+}
@@ -49,6 +49,10 @@
 #include <nautilus/cpuid.h>
 #include <nautilus/random.h>
 #include <nautilus/backtrace.h>
+#include <nautilus/tsc.h>
+#include <nautilus/histogram.h>
+#include <nautilus/group.h>
+#include <nautilus/trace.h>
 #include <dev/apic.h>
 
 #define INSTRUMENT    1
@@ -130,7 +134,6 @@ struct nk_sched_global_state {
 };
 
 static volatile uint64_t sync_count=0;
-static volatile uint64_t tsc_start=-1ULL;
 
 static struct nk_sched_global_state global_sched_state;
 
@@ -243,6 +246,11 @@ typedef struct nk_sched_percpu_state {
 
     uint64_t num_thefts;   // how many threads I've successfully stolen
 
+    // latency histograms, see nk_sched_latency_dump()
+    struct nk_hist lat[NK_SCHED_LAT_NUM];
+    uint64_t irq_stamp;     // TSC at entry to the latest interrupt
+    uint64_t switch_stamp;  // TSC at start of the current switch
+
 #if INSTRUMENT
     uint64_t resched_fast_num;
     uint64_t resched_fast_sum;
@@ -420,6 +428,8 @@ typedef struct nk_sched_thread_state {
                            // priority
     uint64_t exit_time;    // time of actual completion / arrival
 
+    uint64_t ready_time;   // when last made runnable, until it runs
+
     // Statistics are reset when the constraints are changed
     uint64_t arrival_count;   // how many times it has arrived (1 for aperiodic/sporadic)
     uint64_t resched_count;   // how many times resched was invoked on this thread
@@ -428,6 +438,8 @@ typedef struct nk_sched_thread_state {
     uint64_t miss_count;      // number of deadline misses
     uint64_t miss_time_sum;   // sum of missed time
     uint64_t miss_time_sum2;  // sum of squares of missed time
+    uint64_t jitter_arrival;  // arrival_count when jitter was last recorded
+    struct nk_hist lat[NK_SCHED_LAT_NUM];
 
     // the thread context itself
     struct nk_thread *thread;
@@ -484,16 +496,11 @@ static inline uint64_t get_random();
 
 uint64_t collect_time_stamp;
 uint64_t observe_scheduler;
-uint64_t observe_context_switch;
 
 uint64_t interrupt_count = 0;
 uint64_t start_time_stamp_index[CPU_NUM];
 uint64_t end_time_stamp_index[CPU_NUM];
 
-uint64_t irq_time_stamp_index[CPU_NUM];
-uint64_t resched_time_stamp_index[CPU_NUM];
-uint64_t switch_time_stamp_index[CPU_NUM];
-
 uint64_t global_step_array[CPU_NUM][SAMPLE_NUM];
 uint64_t global_start_array[CPU_NUM][SAMPLE_NUM];
 uint64_t global_end_array[CPU_NUM][SAMPLE_NUM];
@@ -502,14 +509,6 @@ uint64_t global_ipi_array[CPU_NUM];
 uint64_t global_step_array[CPU_NUM][SAMPLE_NUM];
 uint64_t global_start_array[CPU_NUM][SAMPLE_NUM];
 
-uint64_t global_irp_array[CPU_NUM][SAMPLE_NUM];
-uint64_t global_resched_array[CPU_NUM][SAMPLE_NUM];
-uint64_t global_switch_array[CPU_NUM][SAMPLE_NUM];
-
-uint64_t irq_stamp[CPU_NUM];
-uint64_t resched_stamp[CPU_NUM];
-uint64_t switch_stamp[CPU_NUM];
-
 int nk_sched_collect_time_stamp(void) {
   collect_time_stamp = 1;
 
@@ -522,18 +521,11 @@ int nk_sched_observe_scheduler(void) {
   return 0;
 }
 
-int nk_sched_observe_context_switch(void) {
-  observe_context_switch = 1;
-
-  return 0;
-}
-
 int time_stamp_init(void) {
   printk("time_stamp_init\n");
 
   collect_time_stamp = 0;
   observe_scheduler = 0;
-  observe_context_switch = 0;
 
   if (memset(start_time_stamp_index, 0, CPU_NUM*sizeof(uint64_t)) == NULL) {
       ERROR("Fail to clear memory for start_time_stamp_index\n");
@@ -545,21 +537,6 @@ int time_stamp_init(void) {
       return -1;
   }
 
-  if (memset(irq_time_stamp_index, 0, CPU_NUM*sizeof(uint64_t)) == NULL) {
-    ERROR("Fail to clear memory for irp_time_stamp_index\n");
-    return -1;
-  }
-
-  if (memset(resched_time_stamp_index, 0, CPU_NUM*sizeof(uint64_t)) == NULL) {
-    ERROR("Fail to clear memory for resched_time_stamp_index\n");
-    return -1;
-  }
-
-  if (memset(switch_time_stamp_index, 0, CPU_NUM*sizeof(uint64_t)) == NULL) {
-    ERROR("Fail to clear memory for switch_time_stamp_index\n");
-    return -1;
-  }
-
   if (memset(global_start_array, 0, CPU_NUM*SAMPLE_NUM*sizeof(uint64_t)) == NULL) {
       ERROR("Fail to clear memory for global_start_array\n");
       return -1;
@@ -575,36 +552,6 @@ int time_stamp_init(void) {
     return -1;
   }
 
-  if (memset(global_irp_array, 0, CPU_NUM*SAMPLE_NUM*sizeof(uint64_t)) == NULL) {
-    ERROR("Fail to clear memory for global_end_array\n");
-    return -1;
-  }
-
-  if (memset(global_resched_array, 0, CPU_NUM*SAMPLE_NUM*sizeof(uint64_t)) == NULL) {
-    ERROR("Fail to clear memory for global_end_array\n");
-    return -1;
-  }
-
-  if (memset(global_switch_array, 0, CPU_NUM*SAMPLE_NUM*sizeof(uint64_t)) == NULL) {
-    ERROR("Fail to clear memory for global_end_array\n");
-    return -1;
-  }
-
-  if (memset(irq_stamp, 0, CPU_NUM*sizeof(uint64_t)) == NULL) {
-    ERROR("Fail to clear memory for irq_stamp\n");
-    return -1;
-  }
-
-  if (memset(resched_stamp, 0, CPU_NUM*sizeof(uint64_t)) == NULL) {
-    ERROR("Fail to clear memory for resched_stamp\n");
-    return -1;
-  }
-
-  if (memset(switch_stamp, 0, CPU_NUM*sizeof(uint64_t)) == NULL) {
-    ERROR("Fail to clear memory for switch_stamp\n");
-    return -1;
-  }
-
   return 0;
 }
 
@@ -651,46 +598,6 @@ int nk_sched_global_stamp_dump(void) {
     return 0;
 }
 
-int nk_sched_context_switch_stamp_dump(void) {
-  printk("\nIRQ Overhead:\n");
-
-  for (int i = 1; i < SAMPLE_NUM; i++) {
-    for (int j = 0; j < CPU_NUM; j++) {
-      if (j < CPU_NUM - 1) {
-        printk("%llu, ", global_irp_array[j][i]);
-      } else {
-        printk("%llu\n", global_irp_array[j][i]);
-      }
-    }
-  }
-
-  printk("\nResched Overhead:\n");
-
-  for (int i = 1; i < SAMPLE_NUM; i++) {
-    for (int j = 0; j < CPU_NUM; j++) {
-      if (j < CPU_NUM - 1) {
-        printk("%llu, ", global_resched_array[j][i]);
-      } else {
-        printk("%llu\n", global_resched_array[j][i]);
-      }
-    }
-  }
-
-  printk("\nSwitch Overhead:\n");
-
-  for (int i = 1; i < SAMPLE_NUM; i++) {
-    for (int j = 0; j < CPU_NUM; j++) {
-      if (j < CPU_NUM - 1) {
-        printk("%llu, ", global_switch_array[j][i]);
-      } else {
-        printk("%llu\n", global_switch_array[j][i]);
-      }
-    }
-  }
-
-  return 0;
-}
-
 void sample_time_stamp(void) {
   uint64_t stamp = rdtsc();
   uint64_t my_cpu_id = my_cpu_id();
@@ -763,47 +670,197 @@ void interrupt_dump() {
   printk("interrupt_count = %llu\n", interrupt_count);
 }
 
-void irp_enter() {
-  irq_stamp[my_cpu_id()] = rdtsc();
+#endif
+// Parallel Thread Project
+
+/*
+  Latency histograms, always on, per CPU and per thread, in ns.
+  The interrupt and switch stamps come from the low-level entry
+  paths (excp_early.S, thread_lowlevel.S), with interrupts off.
+*/
+
+static const char *lat_names[NK_SCHED_LAT_NUM] = {
+    [NK_SCHED_LAT_WAKEUP] = "wakeup",
+    [NK_SCHED_LAT_IRQ]    = "irq-resched",
+    [NK_SCHED_LAT_SWITCH] = "switch",
+    [NK_SCHED_LAT_JITTER] = "arrival-jitter",
+    [NK_SCHED_LAT_MISS]   = "deadline-miss",
+};
+
+static inline void lat_add(rt_scheduler *s, rt_thread *t, enum nk_sched_lat which, uint64_t ns)
+{
+    if (s) {
+	nk_hist_add(&s->lat[which], ns);
+    }
+    if (t) {
+	nk_hist_add(&t->lat[which], ns);
+    }
 }
 
-void irq_exit() {
-  uint64_t stamp = rdtsc();
-  uint64_t my_cpu_id = my_cpu_id();
-  if (observe_context_switch) {
-    if (irq_time_stamp_index[my_cpu_id] < SAMPLE_NUM) {
-      global_irp_array[my_cpu_id][irq_time_stamp_index[my_cpu_id]++] = stamp - irq_stamp[my_cpu_id];
+// t has been chosen to run at time now
+static inline void lat_note_run(rt_scheduler *s, rt_thread *t, uint64_t now)
+{
+    if (t->ready_time) {
+	lat_add(s, t, NK_SCHED_LAT_WAKEUP, now - t->ready_time);
+	t->ready_time = 0;
     }
+    if (t->constraints.type == PERIODIC && t->jitter_arrival != t->arrival_count) {
+	// the deadline is the end of the period that began at the arrival
+	uint64_t arrival = t->deadline - t->constraints.periodic.period;
+	lat_add(s, t, NK_SCHED_LAT_JITTER, now > arrival ? now - arrival : 0);
+	t->jitter_arrival = t->arrival_count;
+	if (t->thread->group) {
+	    nk_thread_group_note_start(t->thread, t->arrival_count, now);
+	}
+    }
+}
 
-    resched_stamp[my_cpu_id()] = rdtsc();
-  }
+// periodic t is done with a period, report how much of its slice it used
+static inline void group_note_period(rt_thread *t)
+{
+    if (t->thread->group) {
+	nk_thread_group_note_period(t->thread, t->run_time, t->constraints.periodic.slice);
+    }
 }
 
-void resched_exit() {
-  uint64_t stamp = rdtsc();
-  uint64_t my_cpu_id = my_cpu_id();
-  if (observe_context_switch) {
-    if (resched_time_stamp_index[my_cpu_id] < SAMPLE_NUM) {
-      global_resched_array[my_cpu_id][resched_time_stamp_index[my_cpu_id]++] = stamp - resched_stamp[my_cpu_id];
+void irp_enter()
+{
+    rt_scheduler *s = per_cpu_get(sched_state);
+
+    if (s) {
+	s->irq_stamp = rdtsc();
     }
-  }
 }
 
-void switch_enter() {
-  switch_stamp[my_cpu_id()] = rdtsc();
+// an interrupt is about to switch to next
+void resched_exit(struct nk_thread *next)
+{
+    rt_scheduler *s = per_cpu_get(sched_state);
+
+    if (s && s->irq_stamp) {
+	lat_add(s, next->sched_state, NK_SCHED_LAT_IRQ, nk_tsc_cycles_to_ns(rdtsc() - s->irq_stamp));
+    }
 }
 
-void switch_exit() {
-  uint64_t stamp = rdtsc();
-  uint64_t my_cpu_id = my_cpu_id();
-  if (observe_context_switch) {
-    if (switch_time_stamp_index[my_cpu_id] < SAMPLE_NUM) {
-      global_switch_array[my_cpu_id][switch_time_stamp_index[my_cpu_id]++] = stamp - switch_stamp[my_cpu_id];
+void switch_enter()
+{
+    rt_scheduler *s = per_cpu_get(sched_state);
+
+    if (s) {
+	s->switch_stamp = rdtsc();
     }
-  }
 }
-#endif
-// Parallel Thread Project
+
+void switch_exit()
+{
+    rt_scheduler *s = per_cpu_get(sched_state);
+
+    if (s && s->switch_stamp) {
+	lat_add(s, get_cur_thread()->sched_state, NK_SCHED_LAT_SWITCH,
+		nk_tsc_cycles_to_ns(rdtsc() - s->switch_stamp));
+	s->switch_stamp = 0;
+    }
+}
+
+const char *nk_sched_latency_name(enum nk_sched_lat which)
+{
+    return which < NK_SCHED_LAT_NUM ? lat_names[which] : "unknown";
+}
+
+int nk_sched_cpu_latency(int cpu, enum nk_sched_lat which, struct nk_hist *h)
+{
+    struct sys_info *sys = per_cpu_get(system);
+
+    if (cpu < 0 || cpu >= sys->num_cpus || which >= NK_SCHED_LAT_NUM || !sys->cpus[cpu]->sched_state) {
+	return -1;
+    }
+
+    *h = sys->cpus[cpu]->sched_state->lat[which];
+
+    return 0;
+}
+
+int nk_sched_thread_latency(struct nk_thread *t, enum nk_sched_lat which, struct nk_hist *h)
+{
+    if (which >= NK_SCHED_LAT_NUM || !t->sched_state) {
+	return -1;
+    }
+
+    *h = t->sched_state->lat[which];
+
+    return 0;
+}
+
+static void reset_thread_latency(rt_thread *r, void *priv)
+{
+    memset(r->lat, 0, sizeof(r->lat));
+}
+
+void nk_sched_latency_reset()
+{
+    GLOBAL_LOCK_CONF;
+    struct sys_info *sys = per_cpu_get(system);
+    int cpu;
+
+    GLOBAL_LOCK();
+
+    for (cpu=0;cpu<sys->num_cpus;cpu++) {
+	if (sys->cpus[cpu]->sched_state) {
+	    memset(sys->cpus[cpu]->sched_state->lat, 0, sizeof(sys->cpus[cpu]->sched_state->lat));
+	}
+    }
+
+    rt_list_map(global_sched_state.thread_list,reset_thread_latency,0);
+
+    GLOBAL_UNLOCK();
+}
+
+void nk_sched_latency_dump(int cpu_arg, int buckets)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    struct nk_hist h, c;
+    int cpu, i;
+
+    for (i=0;i<NK_SCHED_LAT_NUM;i++) {
+	nk_hist_reset(&h);
+	for (cpu=0;cpu<sys->num_cpus;cpu++) {
+	    if ((cpu_arg<0 || cpu_arg==cpu) && !nk_sched_cpu_latency(cpu,i,&c)) {
+		nk_hist_merge(&h,&c);
+	    }
+	}
+	nk_hist_print_summary(&h,(char*)lat_names[i]);
+	if (buckets) {
+	    nk_hist_print_buckets(&h);
+	}
+    }
+}
+
+void nk_sched_thread_latency_dump(struct nk_thread *t, int buckets)
+{
+    struct nk_hist h;
+    int i;
+
+    for (i=0;i<NK_SCHED_LAT_NUM;i++) {
+	if (!nk_sched_thread_latency(t,i,&h) && h.count) {
+	    nk_hist_print_summary(&h,(char*)lat_names[i]);
+	    if (buckets) {
+		nk_hist_print_buckets(&h);
+	    }
+	}
+    }
+}
+
+int nk_sched_observe_context_switch()
+{
+    nk_sched_latency_reset();
+    return 0;
+}
+
+int nk_sched_context_switch_stamp_dump()
+{
+    nk_sched_latency_dump(-1,0);
+    return 0;
+}
 
 static void print_thread(rt_thread *r, void *priv)
 {
@@ -961,6 +1018,8 @@ void nk_sched_dump_time(int cpu_arg)
     struct sys_info * sys = per_cpu_get(system);
     struct tsc_info *tsc0 = &sys->cpus[0]->sched_state->tsc;
 
+    nk_tsc_dump();
+
     for (cpu=0;cpu<sys->num_cpus;cpu++) {
 	if (cpu_arg<0 || cpu_arg==cpu) {
 
@@ -978,6 +1037,33 @@ void nk_sched_dump_time(int cpu_arg)
     }
 }
 
+struct map_state {
+    int cpu;
+    void (*func)(struct nk_thread *t, void *state);
+    void *state;
+};
+
+static void map_thread(rt_thread *r, void *priv)
+{
+    struct map_state *m = (struct map_state *)priv;
+
+    if (m->cpu==r->thread->current_cpu || m->cpu<0) {
+	m->func(r->thread, m->state);
+    }
+}
+
+void nk_sched_map_threads(int cpu, void (func)(struct nk_thread *t, void *state), void *state)
+{
+    GLOBAL_LOCK_CONF;
+    struct map_state m = { .cpu = cpu, .func = func, .state = state };
+
+    GLOBAL_LOCK();
+
+    rt_list_map(global_sched_state.thread_list,map_thread,(void*)&m);
+
+    GLOBAL_UNLOCK();
+}
+
 void nk_sched_dump_threads(int cpu)
 {
     GLOBAL_LOCK_CONF;
@@ -1350,6 +1436,7 @@ static int    _sched_make_runnable(struct nk_thread *thread, int cpu, int admit,
 	} else {
 	    thread->status = NK_THR_SUSPENDED;
 	    thread->sched_state->status = ADMITTED;
+	    t->ready_time = cur_time();
 
 	    DUMP_APERIODIC(s, "aperiodic after make runnable");
 	    goto out_good;
@@ -1375,6 +1462,9 @@ static int    _sched_make_runnable(struct nk_thread *thread, int cpu, int admit,
     }
     return -1;
  out_good:
+    NK_TRACE(NK_TRACE_WAKEUP,
+	     cpu <= CPU_ANY || cpu >= sys->num_cpus ? my_cpu_id() : cpu,
+	     thread->tid, 0);
     if (!have_lock) {
 	LOCAL_UNLOCK(s);
     }
@@ -2017,6 +2107,9 @@ struct nk_thread *_sched_need_resched(int have_lock, int force_resched)
 	    // the deadline is updated to be the end of the period,
 	    // relative to this arrival time (not the current time)
 	    rt_a->deadline = rt_a->deadline + rt_a->constraints.periodic.period;
+	    if (rt_a->arrival_count > 1) {
+		group_note_period(rt_a);
+	    }
 	    rt_a->run_time = 0;
 	} else { // SPORADIC
 	    // the deadline is absolutely the deadline given in the constraints
@@ -2253,6 +2346,7 @@ struct nk_thread *_sched_need_resched(int have_lock, int force_resched)
 		// deadline update here is relative to when this task
 		// SHOULD have completed, not relative to the current time
 		rt_c->deadline = rt_c->deadline + rt_c->constraints.periodic.period;
+		group_note_period(rt_c);
 		rt_c->run_time = 0;
 		// and it has immediately arrived again, so stash it
 		// into the EDF queue
@@ -2446,6 +2540,9 @@ struct nk_thread *_sched_need_resched(int have_lock, int force_resched)
 
     // set timer according to nature of thread
     set_timer(scheduler, rt_n, now);
+
+    lat_note_run(scheduler, rt_n, now);
+
     if (rt_n!=rt_c) {
 
 	//if (!rt_n->is_intr) {
@@ -2482,6 +2579,14 @@ struct nk_thread *_sched_need_resched(int have_lock, int force_resched)
 
 	rt_n->switch_in_count++;
 
+	NK_TRACE(NK_TRACE_SWITCH, rt_c->thread->status, rt_c->thread->tid, rt_n->thread->tid);
+
+	// every switch, preemptive or not, comes through here
+#ifdef NAUT_CONFIG_PROFILE
+	nk_instr_thread_switch(rt_c->thread, rt_n->thread);
+#endif
+	nk_pmc_thread_switch(rt_c->thread);
+
 	// we are switching threads, start accounting for the new one
 	rt_n->cur_run_time=0;
 
@@ -2568,6 +2673,8 @@ int nk_sched_thread_change_constraints(struct nk_sched_constraints *constraints)
 
     DEBUG("Changing constraints of %llu \"%s\"\n", t->tid,t->name);
 
+    NK_TRACE(NK_TRACE_CHANGE_BEGIN, constraints->type, t->tid, 0);
+
     LOCAL_LOCK(scheduler);
 
     if (r->constraints.type != APERIODIC && constraints->type != APERIODIC) {
@@ -2646,9 +2753,11 @@ int nk_sched_thread_change_constraints(struct nk_sched_constraints *constraints)
  out_bad:
     LOCAL_UNLOCK(scheduler);
  out_bad_no_unlock:
+    NK_TRACE(NK_TRACE_CHANGE_END, constraints->type, t->tid, 1);
     return -1;
 
  out_good_no_unlock:
+    NK_TRACE(NK_TRACE_CHANGE_END, constraints->type, t->tid, 0);
     return 0;
 }
 
@@ -2715,6 +2824,7 @@ int nk_sched_thread_move(struct nk_thread *t, int new_cpu, int block)
 
     // switch its cpu...
     t->current_cpu = new_cpu;
+    NK_TRACE(NK_TRACE_MIGRATE, old_cpu, t->tid, new_cpu);
     // we will make it runnable after we drop the lock
     rc = 0;
 
@@ -3053,6 +3163,7 @@ static int rt_thread_check_deadlines(rt_thread *t, rt_scheduler *s, uint64_t now
 	t->miss_count++;
 	t->miss_time_sum += now - t->deadline;
 	t->miss_time_sum2 += (now - t->deadline)*(now - t->deadline);
+	lat_add(s, t, NK_SCHED_LAT_MISS, now - t->deadline);
 	return 1;
     }
     return 0;
@@ -3142,11 +3253,7 @@ static inline void rt_thread_update_aperiodic(rt_thread *t, rt_scheduler *schedu
 // in nanoseconds
 static uint64_t cur_time()
 {
-    struct sys_info *sys = per_cpu_get(system);
-    struct apic_dev *apic = sys->cpus[my_cpu_id()]->apic;
-    uint64_t c = rdtsc();
-    uint64_t t = apic_cycles_to_realtime(apic, c);
-    return t;
+    return nk_tsc_get_ns();
 }
 
 uint64_t nk_sched_get_realtime()
@@ -3177,6 +3284,8 @@ static void reset_stats(rt_thread *thread)
     thread->miss_count=0;
     thread->miss_time_sum=0;
     thread->miss_time_sum2=0;
+    thread->jitter_arrival=0;
+    memset(thread->lat,0,sizeof(thread->lat));
 }
 
 // RMS schedulability test for a non-harmonic task set
@@ -3729,8 +3838,6 @@ void nk_sched_start()
 {
     uint64_t num_cpus = nk_get_num_cpus();
     struct cpu *my_cpu = get_cpu();
-    struct sys_info *sys = per_cpu_get(system);
-    struct apic_dev *apic = sys->cpus[my_cpu_id()]->apic;
     uint64_t cur_cycles;
 
     DEBUG("Scheduler startup - %s\n", my_cpu->is_bsp ? "bsp" : "ap");
@@ -3740,28 +3847,17 @@ void nk_sched_start()
     while (sync_count < num_cpus) {
 	// spin
     }
-    cur_cycles = rdtsc();
-    if (my_cpu->is_bsp) {
-	// everyone has started their local tsc at 0
-	// we will now use the BSP tsc, which has advanced
-	// the furthest, pick a point in the future to advance
-	// every one to. The + 1 here offsets the -1 init value
-	tsc_start = cur_cycles * 16ULL + 1ULL;
-    }  else {
-	while (tsc_start==-1ULL) {
-	    // spin;
-	}
-    }
-
-    msr_write(IA32_TIME_STAMP_COUNTER,tsc_start);
+    // everyone has started their local tsc at 0, now
+    // bring them all to a common point in time
+    nk_tsc_sync();
 
     cur_cycles = rdtsc();
 
     my_cpu->sched_state->tsc.sync_time_cycles = cur_cycles;
 
-    my_cpu->sched_state->tsc.sync_time = apic_cycles_to_realtime(apic,cur_cycles);
+    my_cpu->sched_state->tsc.sync_time = nk_tsc_cycles_to_ns(cur_cycles);
 
-    DEBUG("Time restarted at %lu cycles (currently %lu cycles / %lu ns)\n", tsc_start, cur_cycles, my_cpu->sched_state->tsc.sync_time);
+    DEBUG("Time restarted (currently %lu cycles / %lu ns)\n", cur_cycles, my_cpu->sched_state->tsc.sync_time);
 
     // with the schedulers now synchronized and running, we launch the
     // ancilary threads if needed
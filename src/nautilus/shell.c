@@ -29,10 +29,15 @@
 #include <nautilus/netdev.h>
 #include <nautilus/chardev.h>
 #include <nautilus/fs.h>
+#include <nautilus/blkcache.h>
+#include <nautilus/fs_aio.h>
+#include <nautilus/fs_stream.h>
 #include <nautilus/loader.h>
 #include <nautilus/cpuid.h>
 #include <nautilus/msr.h>
 #include <nautilus/backtrace.h>
+#include <nautilus/tsc.h>
+#include <nautilus/pmc.h>
 #include <test/ipi.h>
 #include <test/threads.h>
 #include <test/groups.h>
@@ -54,6 +59,34 @@
 #include <nautilus/isocore.h>
 #endif
 
+#ifdef NAUT_CONFIG_VIRTIO_NET
+#include <dev/virtio_net.h>
+#endif
+
+#ifdef NAUT_CONFIG_ATA
+#include <dev/ata.h>
+#endif
+
+#ifdef NAUT_CONFIG_AHCI
+#include <dev/ahci.h>
+#endif
+
+#ifdef NAUT_CONFIG_KLOG
+#include <nautilus/klog.h>
+#endif
+
+#ifdef NAUT_CONFIG_SAMPLER
+#include <nautilus/sampler.h>
+#endif
+
+#ifdef NAUT_CONFIG_TRACE
+#include <nautilus/trace.h>
+#endif
+
+#ifdef NAUT_CONFIG_BENCH
+#include <nautilus/bench.h>
+#endif
+
 // enable this to flip a GPIO periodically within
 // the main loop of test thread
 #define GPIO_OUTPUT 0
@@ -333,6 +366,596 @@ static int handle_blktest(char * buf)
     return 0;
 }
 
+/*
+ * Keep depth requests of bpr blocks each in flight against a block
+ * device until count requests have completed, and report the rate.
+ * Requests walk sequentially through the device, wrapping around.
+ */
+static uint64_t blkperf_failed;
+
+static void blkperf_done(void *context, int status)
+{
+    if (status) {
+	__sync_fetch_and_add(&blkperf_failed, 1);
+    }
+    *(volatile uint8_t *)context = 0;
+}
+
+static int handle_blkperf(char * buf)
+{
+    char name[32], rw[16];
+    uint64_t bpr, depth, count;
+    struct nk_block_dev *d;
+    struct nk_block_dev_characteristics c;
+    uint64_t issued = 0, next = 0, span, start, end, ns, i;
+    volatile uint8_t *busy;
+    uint8_t *data;
+
+    if ((sscanf(buf,"blkperf %s %s %lu %lu %lu",name,rw,&bpr,&depth,&count)!=5)
+	|| (*rw!='r' && *rw!='w') || !bpr || !depth) {
+	nk_vc_printf("Don't understand %s\n",buf);
+	return -1;
+    }
+
+    if (!(d=nk_block_dev_find(name))) {
+	nk_vc_printf("Can't find %s\n",name);
+	return -1;
+    }
+
+    if (nk_block_dev_get_characteristics(d,&c) || c.num_blocks < bpr) {
+	nk_vc_printf("Can't get usable characteristics of %s\n",name);
+	return -1;
+    }
+
+    data = malloc(depth*bpr*c.block_size);
+    busy = malloc(depth);
+
+    if (!data || !busy) {
+	nk_vc_printf("Can't allocate buffers\n");
+	free(data);
+	free((void*)busy);
+	return -1;
+    }
+
+    memset(data,0x5a,depth*bpr*c.block_size);
+    memset((void*)busy,0,depth);
+
+    span = (c.num_blocks / bpr) * bpr;
+    blkperf_failed = 0;
+
+    start = rdtsc();
+
+    while (issued < count) {
+	for (i=0;i<depth && issued<count;i++) {
+	    if (busy[i]) {
+		continue;
+	    }
+	    busy[i] = 1;
+	    if ((*rw=='r' ? nk_block_dev_read : nk_block_dev_write)
+		(d, next, bpr, data+i*bpr*c.block_size, NK_DEV_REQ_CALLBACK,
+		 blkperf_done, (void*)&busy[i])) {
+		nk_vc_printf("Failed to issue request %lu\n",issued);
+		busy[i] = 0;
+		count = issued;
+		break;
+	    }
+	    issued++;
+	    next = (next + bpr) % span;
+	}
+	asm volatile ("pause");
+    }
+
+    // drain
+    for (i=0;i<depth;i++) {
+	while (busy[i]) {
+	    asm volatile ("pause");
+	}
+    }
+
+    end = rdtsc();
+
+    ns = nk_tsc_cycles_to_ns(end - start);
+    if (!ns) {
+	ns = 1;
+    }
+
+    nk_vc_printf("%s %s: %lu requests of %lu blocks at depth %lu in %lu us\n",
+		 name, *rw=='r' ? "read" : "write", count, bpr, depth, ns/1000);
+    nk_vc_printf("  %lu IOPS, %lu KB/s\n",
+		 count*1000000000ULL/ns,
+		 (count*bpr*c.block_size/1024)*1000000000ULL/ns);
+    if (blkperf_failed) {
+	nk_vc_printf("  %lu requests failed\n", blkperf_failed);
+    }
+
+    free(data);
+    free((void*)busy);
+
+    return 0;
+}
+
+/*
+ * ARP the gateway of QEMU's user-mode network (10.0.2.2, with us
+ * as 10.0.2.15) count times, and time each round trip.   This needs
+ * nothing on the host side beyond -netdev user.
+ */
+#define NETTEST_RX   8
+#define NETTEST_WAIT 1000000000ULL
+
+static const uint8_t nettest_my_ip[4] = { 10, 0, 2, 15 };
+static const uint8_t nettest_gw_ip[4] = { 10, 0, 2, 2 };
+
+static void nettest_done(void *context)
+{
+    *(volatile uint8_t *)context = 1;
+}
+
+static int nettest_is_reply(uint8_t *p)
+{
+    // ethertype ARP, opcode reply, sender is the gateway
+    return p[12]==0x08 && p[13]==0x06 && p[20]==0x00 && p[21]==0x02 &&
+	!memcmp(p+28,nettest_gw_ip,4);
+}
+
+static int handle_nettest(char * buf)
+{
+    char name[32];
+    uint64_t count, i, j, start, ns, min=-1ULL, max=0, sum=0, got=0;
+    struct nk_net_dev *d;
+    struct nk_net_dev_characteristics c;
+    volatile uint8_t *done;
+    uint8_t *rx, tx[64];
+    int found;
+
+    if (sscanf(buf,"nettest %s %lu",name,&count)!=2 || !count) {
+	nk_vc_printf("Don't understand %s\n",buf);
+	return -1;
+    }
+
+    if (!(d=nk_net_dev_find(name))) {
+	nk_vc_printf("Can't find %s\n",name);
+	return -1;
+    }
+
+    if (nk_net_dev_get_characteristics(d,&c)) {
+	nk_vc_printf("Can't get characteristics of %s\n",name);
+	return -1;
+    }
+
+    // a posted receive cannot be withdrawn, so these are never freed
+    rx = malloc(NETTEST_RX*c.max_tu);
+    done = malloc(NETTEST_RX);
+
+    if (!rx || !done) {
+	nk_vc_printf("Can't allocate buffers\n");
+	free(rx);
+	free((void*)done);
+	return -1;
+    }
+
+    for (i=0;i<NETTEST_RX;i++) {
+	done[i] = 0;
+	if (nk_net_dev_receive_packet(d,rx+i*c.max_tu,c.max_tu,NK_DEV_REQ_CALLBACK,
+				      nettest_done,(void*)&done[i])) {
+	    nk_vc_printf("Can't post receive buffer\n");
+	    return -1;
+	}
+    }
+
+    memset(tx,0,sizeof(tx));
+    memset(tx,0xff,6);                     // broadcast
+    memcpy(tx+6,c.mac,6);
+    tx[12] = 0x08; tx[13] = 0x06;          // ARP
+    tx[15] = 0x01;                         // ethernet
+    tx[16] = 0x08; tx[17] = 0x00;          // IPv4
+    tx[18] = 6; tx[19] = 4;
+    tx[21] = 0x01;                         // request
+    memcpy(tx+22,c.mac,6);
+    memcpy(tx+28,nettest_my_ip,4);
+    memcpy(tx+38,nettest_gw_ip,4);
+
+    for (i=0;i<count;i++) {
+	start = rdtsc();
+	if (nk_net_dev_send_packet(d,tx,60,NK_DEV_REQ_BLOCKING,0,0)) {
+	    nk_vc_printf("Send %lu failed\n",i);
+	    break;
+	}
+	found = 0;
+	while (!found && nk_tsc_cycles_to_ns(rdtsc()-start) < NETTEST_WAIT) {
+	    for (j=0;j<NETTEST_RX;j++) {
+		if (!done[j]) {
+		    continue;
+		}
+		found |= nettest_is_reply(rx+j*c.max_tu);
+		done[j] = 0;
+		if (nk_net_dev_receive_packet(d,rx+j*c.max_tu,c.max_tu,NK_DEV_REQ_CALLBACK,
+					      nettest_done,(void*)&done[j])) {
+		    nk_vc_printf("Can't repost receive buffer\n");
+		    return -1;
+		}
+	    }
+	    asm volatile ("pause");
+	}
+	if (!found) {
+	    nk_vc_printf("No reply to request %lu\n",i);
+	    continue;
+	}
+	ns = nk_tsc_cycles_to_ns(rdtsc()-start);
+	min = ns<min ? ns : min;
+	max = ns>max ? ns : max;
+	sum += ns;
+	got++;
+    }
+
+    nk_vc_printf("%s: %lu of %lu ARP requests answered", name, got, count);
+    if (got) {
+	nk_vc_printf(", rtt min/avg/max = %lu/%lu/%lu ns", min, sum/got, max);
+    }
+    nk_vc_printf("\n");
+
+    return got==count ? 0 : -1;
+}
+
+#ifdef NAUT_CONFIG_VIRTIO_NET
+static int handle_vnetpoll(char * buf)
+{
+    char name[32], how[16];
+    int cpu;
+
+    if (sscanf(buf,"vnetpoll %s %s",name,how)!=2) {
+	nk_vc_printf("Don't understand %s\n",buf);
+	return -1;
+    }
+
+    cpu = !strncasecmp(how,"off",3) ? -1 : atoi(how);
+
+    return virtio_net_poll(name,cpu);
+}
+#endif
+
+/*
+ * Repeatedly stat, open, read through, and close a file, which is
+ * the small-file pattern the block cache is meant to help.  Run it
+ * against a ramdisk or a disk, and look at "bcache" afterwards.
+ */
+#define FSPERF_CHUNK 4096
+
+static int handle_fsperf(char * buf)
+{
+    char path[80];
+    uint64_t count, i, start, ns, bytes=0;
+    struct nk_fs_stat st;
+    nk_fs_fd_t fd;
+    uint8_t *data;
+    ssize_t ct;
+
+    if (sscanf(buf,"fsperf %s %lu",path,&count)!=2 || !count) {
+	nk_vc_printf("Don't understand %s\n",buf);
+	return -1;
+    }
+
+    if (!(data = malloc(FSPERF_CHUNK))) {
+	nk_vc_printf("Can't allocate buffer\n");
+	return -1;
+    }
+
+    start = rdtsc();
+
+    for (i=0;i<count;i++) {
+	if (nk_fs_stat(path,&st)) {
+	    nk_vc_printf("Can't stat %s\n",path);
+	    break;
+	}
+	fd = nk_fs_open(path,O_RDONLY,0);
+	if (FS_FD_ERR(fd)) {
+	    nk_vc_printf("Can't open %s\n",path);
+	    break;
+	}
+	while ((ct = nk_fs_read(fd,data,FSPERF_CHUNK)) > 0) {
+	    bytes += ct;
+	}
+	nk_fs_close(fd);
+	if (ct<0) {
+	    nk_vc_printf("Error reading %s\n",path);
+	    break;
+	}
+    }
+
+    ns = nk_tsc_cycles_to_ns(rdtsc()-start);
+
+    free(data);
+
+    if (!i) {
+	return -1;
+    }
+
+    nk_vc_printf("%s: %lu passes, %lu bytes in %lu us, %lu ns per pass\n",
+		 path, i, bytes, ns/1000, ns/i);
+
+    return i==count ? 0 : -1;
+}
+
+// fsstream                          - show tuning and statistics
+// fsstream ra_min_kb ra_max_kb wb_kb - retune, for files opened after
+static int handle_fsstream(char * buf)
+{
+    struct nk_fs_stream_tuning t;
+    uint64_t ra_min, ra_max, wb;
+
+    if (sscanf(buf,"fsstream %lu %lu %lu", &ra_min, &ra_max, &wb) == 3) {
+	nk_fs_stream_get_tuning(&t);
+	t.ra_min = ra_min * 1024;
+	t.ra_max = ra_max * 1024;
+	t.wb = wb * 1024;
+	if (nk_fs_stream_set_tuning(&t)) {
+	    nk_vc_printf("Cannot set that tuning\n");
+	    return -1;
+	}
+    }
+
+    nk_fs_stream_dump();
+
+    return 0;
+}
+
+/*
+ * Read up to AIOTEST_FILES files start to finish, all at once.  With
+ * workers>0, the chunks of every file are submitted in batches to an
+ * aio context, and "max in progress" shows how many reads actually
+ * overlapped.  With 0 workers, the files are instead read one after
+ * the other with nk_fs_read, for comparison.  Compare on a cold block
+ * cache (a fresh boot), on a ramdisk and on virtio-blk.
+ */
+#define AIOTEST_CHUNK (64*1024)
+#define AIOTEST_FILES 8
+#define AIOTEST_BATCH 16
+
+static int handle_aiotest(char * buf)
+{
+    char path[AIOTEST_FILES][80];
+    nk_fs_fd_t fd[AIOTEST_FILES];
+    uint64_t base[AIOTEST_FILES];   // of each file's part of data
+    uint64_t size[AIOTEST_FILES];
+    struct nk_fs_stat st;
+    struct nk_fs_aio_ctx *ctx = 0;
+    struct nk_fs_aio_op ops[AIOTEST_BATCH];
+    struct nk_fs_aio_cqe cqes[AIOTEST_BATCH];
+    uint64_t total=0, bytes=0, chunks=0, done=0, start, ns;
+    uint64_t f, off, cf, coff;
+    uint32_t workers;
+    uint8_t *data = 0;
+    int n, i, k, rc = -1;
+    ssize_t ct;
+
+    n = sscanf(buf,"aiotest %u %s %s %s %s %s %s %s %s", &workers,
+	       path[0],path[1],path[2],path[3],path[4],path[5],path[6],path[7]) - 1;
+
+    if (n<1) {
+	nk_vc_printf("Don't understand %s\n",buf);
+	return -1;
+    }
+
+    for (i=0;i<n;i++) {
+	fd[i] = FS_BAD_FD;
+    }
+
+    for (i=0;i<n;i++) {
+	if (nk_fs_stat(path[i],&st)) {
+	    nk_vc_printf("Can't stat %s\n",path[i]);
+	    goto out;
+	}
+	fd[i] = nk_fs_open(path[i],O_RDONLY,0);
+	if (FS_FD_ERR(fd[i])) {
+	    nk_vc_printf("Can't open %s\n",path[i]);
+	    goto out;
+	}
+	size[i] = st.st_size;
+	base[i] = total;
+	total += size[i];
+	chunks += (size[i] + AIOTEST_CHUNK - 1) / AIOTEST_CHUNK;
+    }
+
+    if (!(data = malloc(total ? total : 1))) {
+	nk_vc_printf("Can't allocate %lu bytes\n",total);
+	goto out;
+    }
+
+    if (workers && !(ctx = nk_fs_aio_create(4*AIOTEST_BATCH, workers, 0))) {
+	nk_vc_printf("Can't create aio context\n");
+	goto out;
+    }
+
+    start = rdtsc();
+
+    if (!workers) {
+	for (i=0;i<n;i++) {
+	    while ((ct = nk_fs_read(fd[i],data+bytes,AIOTEST_CHUNK)) > 0) {
+		bytes += ct;
+	    }
+	    if (ct<0) {
+		nk_vc_printf("Error reading %s\n",path[i]);
+		goto out;
+	    }
+	}
+    } else {
+	// the next chunk to submit is at offset off of file f
+	f = 0; off = 0;
+	while (f<n && !size[f]) { f++; }
+	while (done < chunks) {
+	    for (k=0, cf=f, coff=off; k<AIOTEST_BATCH && cf<n; k++) {
+		ops[k].opcode = NK_FS_AIO_READ;
+		ops[k].fd = fd[cf];
+		ops[k].buf = data + base[cf] + coff;
+		ops[k].len = size[cf] - coff < AIOTEST_CHUNK ? size[cf] - coff : AIOTEST_CHUNK;
+		ops[k].offset = coff;
+		ops[k].callback = 0;
+		ops[k].priv = 0;
+		ops[k].flags = 0;
+		coff += AIOTEST_CHUNK;
+		if (coff >= size[cf]) {
+		    coff = 0;
+		    for (cf++; cf<n && !size[cf]; cf++) {}
+		}
+	    }
+	    // the ring may take only some of the batch
+	    k = k ? nk_fs_aio_submit(ctx,ops,k) : 0;
+	    for (i=0;i<k;i++) {
+		off += AIOTEST_CHUNK;
+		if (off >= size[f]) {
+		    off = 0;
+		    for (f++; f<n && !size[f]; f++) {}
+		}
+	    }
+	    k = nk_fs_aio_reap(ctx,cqes,AIOTEST_BATCH,1);
+	    for (i=0;i<k;i++) {
+		if (cqes[i].result<0) {
+		    nk_vc_printf("Error in asynchronous read\n");
+		    goto out;
+		}
+		bytes += cqes[i].result;
+	    }
+	    done += k;
+	}
+    }
+
+    ns = nk_tsc_cycles_to_ns(rdtsc()-start);
+
+    nk_vc_printf("%d files, %lu bytes in %lu us (%lu MB/s), %u workers",
+		 n, bytes, ns/1000, ns ? (bytes*1000)/ns : 0, workers);
+    if (ctx) {
+	nk_vc_printf(", max %lu reads in progress", ctx->stats.max_inflight);
+    }
+    nk_vc_printf("\n");
+
+    rc = bytes==total ? 0 : -1;
+
+ out:
+    if (ctx) {
+	nk_fs_aio_destroy(ctx);
+    }
+    for (i=0;i<n;i++) {
+	if (!FS_FD_ERR(fd[i])) {
+	    nk_fs_close(fd[i]);
+	}
+    }
+    free(data);
+    return rc;
+}
+
+/*
+ * Many threads each repeatedly open, read a chunk of, and close the
+ * same file, first with every thread in the default file descriptor
+ * table, and then with each thread given a table of its own.  The
+ * difference is what the opens and closes of independent threads
+ * cost each other.  Use a file in the block cache, so that the
+ * table, rather than the disk, is what is measured.
+ */
+#define FSSCALE_MAX_THREADS 64
+#define FSSCALE_CHUNK 512
+
+struct fsscale_state {
+    char              path[80];
+    uint64_t          iters;
+    int               private_tables;
+    volatile int      ready;
+    volatile int      go;
+    volatile int      errors;
+};
+
+static void fsscale_thread(void *in, void **out)
+{
+    struct fsscale_state *s = (struct fsscale_state *)in;
+    struct nk_fs_fd_table *t = 0;
+    uint8_t data[FSSCALE_CHUNK];
+    nk_fs_fd_t fd;
+    uint64_t i;
+
+    if (s->private_tables && (t = nk_fs_fd_table_create())) {
+	nk_fs_fd_table_bind(t);
+    }
+
+    __sync_fetch_and_add(&s->ready,1);
+
+    while (!s->go) {
+	nk_yield();
+    }
+
+    for (i=0;i<s->iters;i++) {
+	fd = nk_fs_open(s->path,O_RDONLY,0);
+	if (FS_FD_ERR(fd)) {
+	    __sync_fetch_and_add(&s->errors,1);
+	    break;
+	}
+	if (nk_fs_read(fd,data,FSSCALE_CHUNK)<0) {
+	    __sync_fetch_and_add(&s->errors,1);
+	}
+	nk_fs_close(fd);
+    }
+
+    if (t) {
+	nk_fs_fd_table_destroy(t);
+    }
+}
+
+static int handle_fsscale(char * buf)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    nk_thread_id_t tids[FSSCALE_MAX_THREADS];
+    struct fsscale_state s;
+    uint32_t n, i, started;
+    uint64_t start, ns, ops;
+    int rc = 0;
+
+    memset(&s,0,sizeof(s));
+
+    if (sscanf(buf,"fsscale %u %lu %s",&n,&s.iters,s.path)!=3 ||
+	!n || n>FSSCALE_MAX_THREADS || !s.iters) {
+	nk_vc_printf("Don't understand %s\n",buf);
+	return -1;
+    }
+
+    for (s.private_tables=0; s.private_tables<2; s.private_tables++) {
+	s.ready = 0;
+	s.go = 0;
+	s.errors = 0;
+
+	for (started=0;started<n;started++) {
+	    if (nk_thread_start(fsscale_thread, &s, 0, 0, TSTACK_DEFAULT,
+				&tids[started], started % sys->num_cpus)) {
+		nk_vc_printf("Cannot start thread %u\n",started);
+		break;
+	    }
+	}
+
+	while (s.ready < started) {
+	    nk_yield();
+	}
+
+	start = rdtsc();
+	s.go = 1;
+
+	for (i=0;i<started;i++) {
+	    nk_join(tids[i],0);
+	}
+
+	ns = nk_tsc_cycles_to_ns(rdtsc()-start);
+	ops = started*s.iters;
+
+	nk_vc_printf("%s tables: %u threads x %lu open/read/close in %lu us, %lu ns per op, %lu ops/s%s\n",
+		     s.private_tables ? "private" : "shared", started, s.iters, ns/1000,
+		     ops ? ns/ops : 0,
+		     ns ? (ops*1000000000ULL)/ns : 0,
+		     s.errors ? " (errors)" : "");
+
+	if (started<n || s.errors) {
+	    rc = -1;
+	    break;
+	}
+    }
+
+    return rc;
+}
+
 static int handle_test(char *buf)
 {
     char what[80];
@@ -396,11 +1019,51 @@ static int handle_attach(char * buf)
 
 static int handle_benchmarks(char * buf)
 {
-    //extern void run_benchmarks();
+#ifdef NAUT_CONFIG_BENCH
+    struct nk_bench_config cfg;
+    char w[8][32];
+    int n, i;
+
+    n = sscanf(buf,"%*s %31s %31s %31s %31s %31s %31s %31s %31s",
+	       w[0],w[1],w[2],w[3],w[4],w[5],w[6],w[7]);
+
+    if (n<1 || !strcasecmp(w[0],"list")) {
+	nk_bench_list();
+	return 0;
+    }
 
-    //run_benchmarks();
+    if (strcasecmp(w[0],"run") || n<2) {
+	nk_vc_printf("Don't understand %s\n",buf);
+	return -1;
+    }
+
+    nk_bench_config_init(&cfg);
+
+    for (i=2;i<n;i++) {
+	if (!strcasecmp(w[i],"csv")) {
+	    cfg.format = NK_BENCH_CSV;
+	} else if (!strcasecmp(w[i],"json")) {
+	    cfg.format = NK_BENCH_JSON;
+	} else if (i+1<n && !strcasecmp(w[i],"iters")) {
+	    cfg.iters = atoi(w[++i]);
+	} else if (i+1<n && !strcasecmp(w[i],"warmup")) {
+	    cfg.warmup = atoi(w[++i]);
+	} else if (i+1<n && !strcasecmp(w[i],"cpus")) {
+	    if (nk_bench_parse_cpus(&cfg,w[++i])) {
+		nk_vc_printf("Bad cpu list %s\n",w[i]);
+		return -1;
+	    }
+	} else {
+	    nk_vc_printf("Don't understand %s\n",w[i]);
+	    return -1;
+	}
+    }
 
+    return nk_bench_run(w[1],&cfg);
+#else
+    nk_vc_printf("Benchmarks are not configured in\n");
     return 0;
+#endif
 }
 
 #ifdef NAUT_CONFIG_ISOCORE
@@ -503,6 +1166,272 @@ int handle_run(char *buf)
     return 0;
 }
 
+static void pmc_print_thread(struct nk_thread *t, void *state)
+{
+  struct nk_pmc_counts c;
+  int i;
+
+  nk_pmc_thread_read(t,&c);
+
+  nk_vc_printf("%lut %lur %-16s",t->tid,t->current_cpu,t->name);
+  for (i=0;i<NK_PMC_NUM_THREAD_EVENTS;i++) {
+    nk_vc_printf(" %lu",c.count[i]);
+  }
+  nk_vc_printf("\n");
+}
+
+#define PMC_MAX_GROUPS 32
+
+struct pmc_groups {
+  int num;
+  nk_thread_group_t *group[PMC_MAX_GROUPS];
+  char name[PMC_MAX_GROUPS][MAX_GROUP_NAME];
+};
+
+// only note the groups here, as this runs with the group list locked
+static void pmc_note_group(nk_thread_group_t *group, void *state)
+{
+  struct pmc_groups *g = (struct pmc_groups *)state;
+
+  if (g->num < PMC_MAX_GROUPS) {
+    g->group[g->num] = group;
+    strncpy(g->name[g->num],nk_thread_group_get_name(group),MAX_GROUP_NAME);
+    g->name[g->num][MAX_GROUP_NAME-1] = 0;
+    g->num++;
+  }
+}
+
+static void pmc_print_groups(void)
+{
+  struct pmc_groups *g = malloc(sizeof(*g));
+  struct nk_pmc_counts c;
+  int i, j, n;
+
+  if (!g) {
+    nk_vc_printf("Can't allocate group list\n");
+    return;
+  }
+
+  g->num = 0;
+  nk_thread_group_map(pmc_note_group,g);
+
+  for (i=0;i<g->num;i++) {
+    n = nk_pmc_group_read(g->group[i],&c);
+    nk_vc_printf("%-16s %3d",g->name[i],n);
+    for (j=0;j<NK_PMC_NUM_THREAD_EVENTS;j++) {
+      nk_vc_printf(" %lu",c.count[j]);
+    }
+    nk_vc_printf("\n");
+  }
+
+  free(g);
+}
+
+static int handle_pmc(char *buf)
+{
+  struct nk_pmc_info *p = nk_pmc_get_info();
+  char what[32];
+  int cpu = -1;
+  int i;
+
+  if (sscanf(buf,"pmc %31s %d",what,&cpu)<1) {
+    strcpy(what,"info");
+  }
+
+  if (!strcasecmp(what,"on")) {
+    return nk_pmc_thread_enable();
+  } else if (!strcasecmp(what,"off")) {
+    return nk_pmc_thread_disable();
+  } else if (!strcasecmp(what,"threads")) {
+    nk_vc_printf("tid cpu name");
+    for (i=0;i<NK_PMC_NUM_THREAD_EVENTS;i++) {
+      nk_vc_printf(" %s",nk_pmc_thread_event_name(i));
+    }
+    nk_vc_printf("%s\n", nk_pmc_thread_active ? "" : " (counting is off)");
+    nk_sched_map_threads(cpu,pmc_print_thread,0);
+  } else if (!strcasecmp(what,"groups")) {
+    nk_vc_printf("group members");
+    for (i=0;i<NK_PMC_NUM_THREAD_EVENTS;i++) {
+      nk_vc_printf(" %s",nk_pmc_thread_event_name(i));
+    }
+    nk_vc_printf("%s\n", nk_pmc_thread_active ? "" : " (counting is off)");
+    pmc_print_groups();
+  } else if (!strcasecmp(what,"info")) {
+    nk_vc_printf("%s version %u: %u general-purpose counters (%u bits), %u fixed (%u bits)\n",
+		 p->vendor==NK_PMC_INTEL ? "intel" : p->vendor==NK_PMC_AMD ? "amd" : "none",
+		 p->version, p->num_gp, p->gp_width, p->num_fixed, p->fixed_width);
+    nk_vc_printf("per-thread counting is %s\n", nk_pmc_thread_active ? "on" : "off");
+  } else {
+    nk_vc_printf("Don't understand %s\n",buf);
+  }
+  return 0;
+}
+
+static void schedlat_print_thread(struct nk_thread *t, void *state)
+{
+  nk_vc_printf("%lut %lur %s\n",t->tid,t->current_cpu,
+	       t->is_idle ? "(idle)" : t->name[0] ? t->name : "(noname)");
+  nk_sched_thread_latency_dump(t,0);
+}
+
+static int handle_schedlat(char *buf)
+{
+  char what[32];
+  uint64_t tid;
+  int cpu = -1;
+  int hist = strstr(buf," hist")!=0;
+
+  if (sscanf(buf,"schedlat %31s",what)!=1) {
+    strcpy(what,"all");
+  }
+
+  nk_vc_printf("(ns)\n");
+
+  if (!strcasecmp(what,"reset")) {
+    nk_sched_latency_reset();
+  } else if (!strcasecmp(what,"threads")) {
+    nk_sched_map_threads(-1,schedlat_print_thread,0);
+  } else if (!strcasecmp(what,"thread")) {
+    struct nk_thread *t;
+    if (sscanf(buf,"schedlat thread %lu",&tid)!=1 || !(t=nk_find_thread_by_tid(tid))) {
+      nk_vc_printf("No such thread\n");
+      return 0;
+    }
+    nk_sched_thread_latency_dump(t,hist);
+  } else if (!strcasecmp(what,"all") || !strcasecmp(what,"hist") ||
+	     (!strcasecmp(what,"cpu") && sscanf(buf,"schedlat cpu %d",&cpu)==1)) {
+    nk_sched_latency_dump(cpu,hist);
+  } else {
+    nk_vc_printf("Don't understand %s\n",buf);
+  }
+  return 0;
+}
+
+static void groupstat_print_group(nk_thread_group_t *group, void *state)
+{
+  nk_thread_group_dump_stats(group,0);
+}
+
+static int handle_groupstat(char *buf)
+{
+  char name[MAX_GROUP_NAME], what[32];
+  nk_thread_group_t *group;
+
+  if (sscanf(buf,"groupstat %31s",name)!=1) {
+    nk_thread_group_map(groupstat_print_group,0);
+    return 0;
+  }
+
+  if (!(group=nk_thread_group_find(name))) {
+    nk_vc_printf("No such group\n");
+    return 0;
+  }
+
+  if (sscanf(buf,"groupstat %*s %31s",what)==1 && !strcasecmp(what,"reset")) {
+    nk_thread_group_reset_stats(group);
+  } else {
+    nk_thread_group_dump_stats(group,1);
+  }
+  return 0;
+}
+
+#ifdef NAUT_CONFIG_SAMPLER
+static int handle_sample(char *buf)
+{
+  char what[32], src[32];
+  uint64_t period = 0;
+  int n = 20;
+
+  if (sscanf(buf,"sample %31s",what)!=1) {
+    strcpy(what,"dump");
+  }
+
+  if (!strcasecmp(what,"start")) {
+    if (sscanf(buf,"sample start %31s %lu",src,&period)<1) {
+      strcpy(src,"cycles");
+    }
+    if (!strcasecmp(src,"cycles")) {
+      return nk_sampler_start(NK_SAMPLER_CYCLES,period);
+    } else if (!strcasecmp(src,"misses")) {
+      return nk_sampler_start(NK_SAMPLER_CACHE_MISSES,period);
+    } else if (!strcasecmp(src,"timer")) {
+      return nk_sampler_start(NK_SAMPLER_TIMER,period);
+    } else {
+      nk_vc_printf("Unknown sample source %s\n",src);
+    }
+  } else if (!strcasecmp(what,"stop")) {
+    return nk_sampler_stop();
+  } else if (!strcasecmp(what,"dump")) {
+    sscanf(buf,"sample dump %d",&n);
+    nk_sampler_dump(n);
+  } else if (!strcasecmp(what,"threads")) {
+    nk_sampler_dump_threads();
+  } else {
+    nk_vc_printf("Don't understand %s\n",buf);
+  }
+  return 0;
+}
+#endif
+
+#ifdef NAUT_CONFIG_TRACE
+// "trace start" followed by event names, none meaning all of them
+static uint32_t trace_parse_events(char *s)
+{
+  char word[32];
+  uint32_t mask = 0;
+  int e, n, skip = 2;
+
+  while (*s) {
+    while (*s==' ' || *s=='\t') { s++; }
+    for (n=0; *s && *s!=' ' && *s!='\t'; s++) {
+      if (n<31) { word[n++]=*s; }
+    }
+    word[n]=0;
+    if (!n) {
+      break;
+    }
+    if (skip) {
+      skip--;
+      continue;
+    }
+    for (e=0; e<NK_TRACE_NUM_EVENTS; e++) {
+      if (!strcasecmp(word,nk_trace_event_name(e))) {
+        mask |= 1U<<e;
+        break;
+      }
+    }
+    if (e==NK_TRACE_NUM_EVENTS) {
+      nk_vc_printf("Unknown event %s\n",word);
+    }
+  }
+  return mask;
+}
+
+static int handle_trace(char *buf)
+{
+  char what[32], path[80];
+
+  if (sscanf(buf,"trace %31s",what)!=1) {
+    strcpy(what,"stats");
+  }
+
+  if (!strcasecmp(what,"start")) {
+    return nk_trace_start(trace_parse_events(buf));
+  } else if (!strcasecmp(what,"stop")) {
+    return nk_trace_stop();
+  } else if (!strcasecmp(what,"stats")) {
+    nk_trace_stats();
+  } else if (!strcasecmp(what,"serial")) {
+    return nk_trace_export_serial();
+  } else if (!strcasecmp(what,"save") && sscanf(buf,"trace save %79s",path)==1) {
+    return nk_trace_export_file(path);
+  } else {
+    nk_vc_printf("Don't understand %s\n",buf);
+  }
+  return 0;
+}
+#endif
+
 static int handle_cmd(char *buf, int n)
 {
   char name[MAX_CMD];
@@ -543,6 +1472,10 @@ static int handle_cmd(char *buf, int n)
   if (!strncasecmp(buf,"help",4)) {
     nk_vc_printf("help\nexit\nvcs\ncores [n]\ntime [n]\nthreads [n]\n");
     nk_vc_printf("devs | fses | ofs | cat [path]\n");
+    nk_vc_printf("bcache | sync | fsperf path count\n");
+    nk_vc_printf("aiotest workers path [path...]\n");
+    nk_vc_printf("fsstream [ra_min_kb ra_max_kb wb_kb]\n");
+    nk_vc_printf("fsscale threads iters path\n");
     nk_vc_printf("shell name\n");
     nk_vc_printf("regs [t]\npeek [bwdq] x | mem x n [s] | poke [bwdq] x y\nin [bwd] addr | out [bwd] addr data\nrdmsr x [n] | wrmsr x y\ncpuid f [n] | cpuidsub f s\n");
     nk_vc_printf("meminfo [detail]\n");
@@ -552,9 +1485,31 @@ static int handle_cmd(char *buf, int n)
     nk_vc_printf("burn p name size_ms tpr phase period slice\n");
     nk_vc_printf("real int [ax [bx [cx [dx]]]] [es:di]\n");
     nk_vc_printf("ipitest type (oneway | roundtrip | broadcast) trials [-f <filename>] [-s <src_id> | all] [-d <dst_id> | all]\n");
-    nk_vc_printf("bench\n");
-    nk_vc_printf("blktest dev r|w start count\n");
+    nk_vc_printf("bench list | bench run name|all [iters n] [warmup n] [cpus all|0-3,5] [csv|json]\n");
     nk_vc_printf("blktest dev r|w start count\n");
+    nk_vc_printf("blkperf dev r|w blocks_per_req depth count\n");
+    nk_vc_printf("nettest dev count\n");
+#ifdef NAUT_CONFIG_VIRTIO_NET
+    nk_vc_printf("vnetpoll dev cpu|off | vnetstats dev\n");
+#endif
+#ifdef NAUT_CONFIG_ATA
+    nk_vc_printf("ata\n");
+#endif
+#ifdef NAUT_CONFIG_AHCI
+    nk_vc_printf("ahci\n");
+#endif
+#ifdef NAUT_CONFIG_KLOG
+    nk_vc_printf("klog [dump | flush | hold | release]\n");
+#endif
+    nk_vc_printf("pmc [info | on | off | threads [cpu] | groups]\n");
+    nk_vc_printf("schedlat [cpu n | thread tid] [hist] | schedlat threads | schedlat reset\n");
+    nk_vc_printf("groupstat [name [reset]]\n");
+#ifdef NAUT_CONFIG_SAMPLER
+    nk_vc_printf("sample start [cycles|misses|timer] [period] | stop | dump [n] | threads\n");
+#endif
+#ifdef NAUT_CONFIG_TRACE
+    nk_vc_printf("trace start [event...] | stop | stats | serial | save path\n");
+#endif
     nk_vc_printf("isotest\n");
     nk_vc_printf("test threads|...\n");
     nk_vc_printf("vm name [embedded image]\n");
@@ -587,6 +1542,38 @@ static int handle_cmd(char *buf, int n)
     return 0;
   }
 
+  if (!strncasecmp(buf,"bcache",6)) {
+    nk_bcache_dump();
+    return 0;
+  }
+
+  if (!strncasecmp(buf,"sync",4)) {
+    if (nk_bcache_flush_all()) {
+      nk_vc_printf("Some blocks could not be written\n");
+    }
+    return 0;
+  }
+
+  if (!strncasecmp(buf,"fsstream",8)) {
+    handle_fsstream(buf);
+    return 0;
+  }
+
+  if (!strncasecmp(buf,"fsscale",7)) {
+    handle_fsscale(buf);
+    return 0;
+  }
+
+  if (!strncasecmp(buf,"aiotest",7)) {
+    handle_aiotest(buf);
+    return 0;
+  }
+
+  if (!strncasecmp(buf,"fsperf",6)) {
+    handle_fsperf(buf);
+    return 0;
+  }
+
   if (!strncasecmp(buf,"ipitest",7)) {
 	handle_ipitest(buf);
 	return 0;
@@ -602,6 +1589,98 @@ static int handle_cmd(char *buf, int n)
 	return 0;
   }
 
+  if (!strncasecmp(buf,"blkperf",7)) {
+	handle_blkperf(buf);
+	return 0;
+  }
+
+  if (!strncasecmp(buf,"nettest",7)) {
+	handle_nettest(buf);
+	return 0;
+  }
+
+#ifdef NAUT_CONFIG_VIRTIO_NET
+  if (!strncasecmp(buf,"vnetpoll",8)) {
+	handle_vnetpoll(buf);
+	return 0;
+  }
+
+  if (!strncasecmp(buf,"vnetstats",9)) {
+	char name[32];
+	if (sscanf(buf,"vnetstats %s",name)==1) {
+	    virtio_net_dump_stats(name);
+	} else {
+	    nk_vc_printf("Don't understand %s\n",buf);
+	}
+	return 0;
+  }
+#endif
+
+#ifdef NAUT_CONFIG_ATA
+  if (!strncasecmp(buf,"ata",3)) {
+    nk_ata_dump();
+    return 0;
+  }
+#endif
+
+#ifdef NAUT_CONFIG_AHCI
+  if (!strncasecmp(buf,"ahci",4)) {
+    nk_ahci_dump();
+    return 0;
+  }
+#endif
+
+#ifdef NAUT_CONFIG_KLOG
+  // dump moves what is in the rings to this console instead of the log
+  if (!strncasecmp(buf,"klog",4)) {
+    if (sscanf(buf,"klog %s",name)==1) {
+      if (!strcasecmp(name,"dump")) {
+	nk_vc_printf("%d records\n",nk_klog_dump());
+      } else if (!strcasecmp(name,"flush")) {
+	nk_klog_flush();
+      } else if (!strcasecmp(name,"hold")) {
+	nk_klog_hold(1);
+      } else if (!strcasecmp(name,"release")) {
+	nk_klog_hold(0);
+      } else {
+	nk_vc_printf("Don't understand %s\n",buf);
+	return 0;
+      }
+    }
+    nk_klog_stats();
+    return 0;
+  }
+#endif
+
+  if (!strncasecmp(buf,"pmc",3)) {
+    handle_pmc(buf);
+    return 0;
+  }
+
+  if (!strncasecmp(buf,"schedlat",8)) {
+    handle_schedlat(buf);
+    return 0;
+  }
+
+  if (!strncasecmp(buf,"groupstat",9)) {
+    handle_groupstat(buf);
+    return 0;
+  }
+
+#ifdef NAUT_CONFIG_SAMPLER
+  if (!strncasecmp(buf,"sample",6)) {
+    handle_sample(buf);
+    return 0;
+  }
+#endif
+
+#ifdef NAUT_CONFIG_TRACE
+  if (!strncasecmp(buf,"trace",5)) {
+    handle_trace(buf);
+    return 0;
+  }
+#endif
+
   if (!strncasecmp(buf,"test",4)) {
       handle_test(buf);
       return 0;
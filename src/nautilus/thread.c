@@ -180,6 +180,7 @@ _nk_thread_init (nk_thread_t * t,
     t->tid        = atomic_inc(next_tid) + 1;
     t->refcount   = is_detached ? 1 : 2; // thread references itself as well
     t->parent     = parent;
+    t->fd_table   = parent ? parent->fd_table : 0;
     t->bound_cpu  = bound_cpu;
     t->fpu_state_offset = offsetof(struct nk_thread, fpu_state);
 
@@ -29,6 +29,7 @@
 #include <nautilus/timer.h>
 #include <nautilus/scheduler.h>
 #include <nautilus/spinlock.h>
+#include <nautilus/trace.h>
 
 #include <stddef.h>
 
@@ -172,7 +173,7 @@ static int _sleep(uint64_t ns, int spin)
     }
 
     if (nk_set_timer(t, 
-		     nk_sched_get_realtime() + ns,
+		     ns,
 		     spin ? TIMER_SPIN : 0,
 		     0,
 		     0,
@@ -212,6 +213,7 @@ uint64_t nk_timer_handler (void)
     list_for_each_entry_safe(cur, temp, &timer_list, node) {
 	if (now >= cur->time_ns) { 
 	    DEBUG("Found expired timer %p\n",cur);
+	    NK_TRACE(NK_TRACE_TIMER, 1, (uint64_t)cur, 0);
 	    cur->signaled = 1;
 	    list_del_init(&cur->node);
 	    if (!(cur->flags & TIMER_SPIN)) { 
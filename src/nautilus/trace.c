@@ -0,0 +1,448 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/thread.h>
+#include <nautilus/scheduler.h>
+#include <nautilus/smp.h>
+#include <nautilus/tsc.h>
+#include <nautilus/fs.h>
+#include <nautilus/vc.h>
+#include <nautilus/trace.h>
+#include <dev/serial.h>
+#ifdef NAUT_CONFIG_KLOG
+#include <nautilus/klog.h>
+#endif
+
+#define INFO(fmt, args...)  INFO_PRINT("trace: " fmt, ##args)
+#define ERROR(fmt, args...) ERROR_PRINT("trace: " fmt, ##args)
+
+#define RING_ENTRIES (1UL << NAUT_CONFIG_TRACE_RING_ORDER)
+
+// bytes per line of hex over serial
+#define SERIAL_CHUNK 32
+
+volatile uint32_t nk_trace_mask = 0;
+
+static struct trace_cpu {
+    struct nk_trace_rec *ring;
+    uint64_t             count;   // records written, the ring holds the last of them
+} __attribute__((aligned(64))) trace_cpu[NAUT_CONFIG_MAX_CPUS];
+
+static struct {
+    uint32_t mask;
+    int      active;
+    uint64_t start;
+    uint64_t stop;
+} trace;
+
+static const char *event_names[NK_TRACE_NUM_EVENTS] = {
+    [NK_TRACE_NAME]          = "name",
+    [NK_TRACE_SWITCH]        = "switch",
+    [NK_TRACE_WAKEUP]        = "wakeup",
+    [NK_TRACE_MIGRATE]       = "migrate",
+    [NK_TRACE_IPI]           = "ipi",
+    [NK_TRACE_TIMER]         = "timer",
+    [NK_TRACE_BARRIER_ENTER] = "barrier-enter",
+    [NK_TRACE_BARRIER_EXIT]  = "barrier-exit",
+    [NK_TRACE_CHANGE_BEGIN]  = "change-begin",
+    [NK_TRACE_CHANGE_END]    = "change-end",
+};
+
+
+const char *
+nk_trace_event_name (enum nk_trace_event event)
+{
+    return event < NK_TRACE_NUM_EVENTS ? event_names[event] : "unknown";
+}
+
+
+// any context
+void
+_nk_trace_record (enum nk_trace_event event, uint32_t a0, uint64_t a1, uint64_t a2)
+{
+    uint8_t flags = irq_disable_save();
+    struct trace_cpu *tc;
+    struct nk_trace_rec *r;
+    int cpu;
+
+    // nk_trace_stop() waits out anyone who gets past this
+    if (!(nk_trace_mask & (1U << event))) {
+        irq_enable_restore(flags);
+        return;
+    }
+
+    cpu = my_cpu_id();
+    tc = &trace_cpu[cpu];
+    r = &tc->ring[tc->count++ & (RING_ENTRIES - 1)];
+
+    r->tsc   = rdtsc();
+    r->event = event;
+    r->cpu   = cpu;
+    r->a0    = a0;
+    r->a1    = a1;
+    r->a2    = a2;
+
+    irq_enable_restore(flags);
+}
+
+
+int
+nk_trace_start (uint32_t mask)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    int i;
+
+    if (trace.active) {
+        ERROR("Already tracing\n");
+        return -1;
+    }
+
+    for (i = 0; i < sys->num_cpus; i++) {
+        if (!trace_cpu[i].ring) {
+            trace_cpu[i].ring = malloc(RING_ENTRIES * sizeof(struct nk_trace_rec));
+            if (!trace_cpu[i].ring) {
+                ERROR("Could not allocate trace ring for cpu %d\n", i);
+                return -1;
+            }
+        }
+        trace_cpu[i].count = 0;
+    }
+
+    trace.mask   = (mask ? mask : NK_TRACE_ALL) & ~(1U << NK_TRACE_NAME);
+    trace.start  = rdtsc();
+    trace.stop   = 0;
+    trace.active = 1;
+
+    __sync_synchronize();
+
+    nk_trace_mask = trace.mask;
+
+    INFO("Tracing events 0x%x, %lu records per cpu\n", trace.mask, RING_ENTRIES);
+
+    return 0;
+}
+
+
+static void
+trace_quiesce (void *arg)
+{
+    // nothing, arriving here means this cpu is not mid-record
+}
+
+
+int
+nk_trace_stop (void)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    int i;
+
+    if (!trace.active) {
+        return 0;
+    }
+
+    nk_trace_mask = 0;
+    __sync_synchronize();
+
+    // records are written with interrupts off, so once every
+    // cpu has taken an xcall, nobody is still writing one
+    for (i = 0; i < sys->num_cpus; i++) {
+        smp_xcall(i, trace_quiesce, 0, 1);
+    }
+
+    trace.stop   = rdtsc();
+    trace.active = 0;
+
+    INFO("Tracing stopped\n");
+
+    return 0;
+}
+
+
+void
+nk_trace_stats (void)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    uint64_t total = 0, lost = 0, n;
+    int i, e;
+
+    nk_vc_printf("trace is %s, events:", trace.active ? "active" : "stopped");
+    for (e = 0; e < NK_TRACE_NUM_EVENTS; e++) {
+        if (trace.mask & (1U << e)) {
+            nk_vc_printf(" %s", event_names[e]);
+        }
+    }
+    nk_vc_printf("\n");
+
+    for (i = 0; i < sys->num_cpus; i++) {
+        n = trace_cpu[i].count;
+        if (!n) {
+            continue;
+        }
+        nk_vc_printf("cpu %3d: %lu records, %lu overwritten\n",
+                     i, n, n > RING_ENTRIES ? n - RING_ENTRIES : 0);
+        total += n;
+        lost += n > RING_ENTRIES ? n - RING_ENTRIES : 0;
+    }
+
+    nk_vc_printf("%lu records, %lu overwritten, over %lu ns\n", total, lost,
+                 nk_tsc_cycles_to_ns((trace.active ? rdtsc() : trace.stop) - trace.start));
+}
+
+
+/*
+ * Export
+ */
+
+struct name_state {
+    struct nk_trace_rec *recs;
+    uint64_t             num;
+    uint64_t             max;
+};
+
+static void
+count_thread (struct nk_thread *t, void *state)
+{
+    ((struct name_state *)state)->max++;
+}
+
+static void
+name_thread (struct nk_thread *t, void *state)
+{
+    struct name_state *s = (struct name_state *)state;
+    struct nk_trace_rec *r;
+    char name[16];
+
+    if (s->num >= s->max) {
+        return;
+    }
+
+    memset(name, 0, sizeof(name));
+    strncpy(name, t->is_idle ? "idle" : t->name, sizeof(name));
+
+    r = &s->recs[s->num++];
+    memset(r, 0, sizeof(*r));
+    r->event = NK_TRACE_NAME;
+    r->cpu   = t->current_cpu;
+    r->a0    = t->tid;
+    memcpy(&r->a1, name, 8);
+    memcpy(&r->a2, name + 8, 8);
+}
+
+
+// sink returns 0 if it took all len bytes
+typedef int (*trace_sink_t)(void *state, void *buf, uint64_t len);
+
+static int
+trace_export (trace_sink_t sink, void *state)
+{
+    struct sys_info *sys = per_cpu_get(system);
+    struct nk_trace_header h;
+    struct name_state names;
+    struct trace_cpu *tc;
+    uint64_t first, n, pos, len;
+    int i, rc = -1;
+
+    if (trace.active) {
+        ERROR("Stop tracing before exporting\n");
+        return -1;
+    }
+
+    // threads may come and go between the two passes
+    memset(&names, 0, sizeof(names));
+    nk_sched_map_threads(-1, count_thread, &names);
+    names.max += 16;
+    names.recs = malloc(names.max * sizeof(struct nk_trace_rec));
+    if (!names.recs) {
+        ERROR("Could not allocate thread names\n");
+        return -1;
+    }
+    nk_sched_map_threads(-1, name_thread, &names);
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, NK_TRACE_MAGIC, sizeof(h.magic));
+    h.version  = NK_TRACE_VERSION;
+    h.rec_size = sizeof(struct nk_trace_rec);
+    h.num_cpus = sys->num_cpus;
+    h.mask     = trace.mask;
+    h.tsc_hz   = nk_tsc_info.hz;
+    h.tsc_mult = nk_tsc_info.mult;
+    h.num_recs = names.num;
+
+    for (i = 0; i < sys->num_cpus; i++) {
+        n = trace_cpu[i].count;
+        h.num_recs += n > RING_ENTRIES ? RING_ENTRIES : n;
+        h.lost += n > RING_ENTRIES ? n - RING_ENTRIES : 0;
+    }
+
+    if (sink(state, &h, sizeof(h)) ||
+        sink(state, names.recs, names.num * sizeof(struct nk_trace_rec))) {
+        goto out;
+    }
+
+    // each cpu's records, oldest first, in at most two pieces
+    for (i = 0; i < sys->num_cpus; i++) {
+        tc = &trace_cpu[i];
+        first = tc->count > RING_ENTRIES ? tc->count - RING_ENTRIES : 0;
+        for (n = first; n < tc->count; n += len) {
+            pos = n & (RING_ENTRIES - 1);
+            len = tc->count - n;
+            if (pos + len > RING_ENTRIES) {
+                len = RING_ENTRIES - pos;
+            }
+            if (sink(state, &tc->ring[pos], len * sizeof(struct nk_trace_rec))) {
+                goto out;
+            }
+        }
+    }
+
+    rc = 0;
+
+ out:
+    free(names.recs);
+    return rc;
+}
+
+
+struct serial_sink_state {
+    uint64_t offset;
+    uint8_t  line[SERIAL_CHUNK];
+    uint64_t fill;
+};
+
+static void
+serial_sink_line (struct serial_sink_state *s)
+{
+    static const char hex[] = "0123456789abcdef";
+    char buf[32 + 2 * SERIAL_CHUNK + 2];
+    uint64_t i;
+    int n;
+
+    if (!s->fill) {
+        return;
+    }
+
+    // the offset lets the host notice a mangled or missing line
+    n = snprintf(buf, 32, "NKT %lx ", s->offset);
+    for (i = 0; i < s->fill; i++) {
+        buf[n++] = hex[s->line[i] >> 4];
+        buf[n++] = hex[s->line[i] & 0xf];
+    }
+    buf[n++] = '\n';
+    buf[n] = 0;
+
+    serial_write(buf);
+
+    s->offset += s->fill;
+    s->fill = 0;
+}
+
+static int
+serial_sink (void *state, void *buf, uint64_t len)
+{
+    struct serial_sink_state *s = (struct serial_sink_state *)state;
+    uint8_t *p = (uint8_t *)buf;
+
+    while (len--) {
+        s->line[s->fill++] = *p++;
+        if (s->fill == SERIAL_CHUNK) {
+            serial_sink_line(s);
+        }
+    }
+
+    return 0;
+}
+
+
+int
+nk_trace_export_serial (void)
+{
+    struct serial_sink_state s;
+    int rc;
+
+    memset(&s, 0, sizeof(s));
+
+#ifdef NAUT_CONFIG_KLOG
+    // keep log output from landing in the middle of a line
+    nk_klog_hold(1);
+#endif
+
+    serial_write("\nNKTRACE-BEGIN\n");
+    rc = trace_export(serial_sink, &s);
+    serial_sink_line(&s);
+    serial_write(rc ? "NKTRACE-ABORT\n" : "NKTRACE-END\n");
+    serial_flush();
+
+#ifdef NAUT_CONFIG_KLOG
+    nk_klog_hold(0);
+#endif
+
+    if (!rc) {
+        INFO("Exported %lu bytes over serial\n", s.offset);
+    }
+
+    return rc;
+}
+
+
+static int
+file_sink (void *state, void *buf, uint64_t len)
+{
+    nk_fs_fd_t fd = (nk_fs_fd_t)state;
+    ssize_t n;
+
+    while (len) {
+        n = nk_fs_write(fd, buf, len);
+        if (n <= 0) {
+            ERROR("Write failed\n");
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+
+int
+nk_trace_export_file (char *path)
+{
+    nk_fs_fd_t fd;
+    int rc;
+
+    fd = nk_fs_open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (FS_FD_ERR(fd)) {
+        ERROR("Cannot open %s\n", path);
+        return -1;
+    }
+
+    rc = trace_export(file_sink, (void *)fd);
+
+    if (nk_fs_close(fd)) {
+        ERROR("Cannot close %s\n", path);
+        rc = -1;
+    }
+
+    if (!rc) {
+        INFO("Exported to %s\n", path);
+    }
+
+    return rc;
+}
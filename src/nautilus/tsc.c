@@ -0,0 +1,270 @@
+/*
+ * This file is part of the Nautilus AeroKernel developed
+ * by the Hobbes and V3VEE Projects with funding from the
+ * United States National  Science Foundation and the Department of Energy.
+ *
+ * The V3VEE Project is a joint project between Northwestern University
+ * and the University of New Mexico.  The Hobbes Project is a collaboration
+ * led by Sandia National Laboratories that includes several national
+ * laboratories and universities. You can find out more at:
+ * http://www.v3vee.org  and
+ * http://xtack.sandia.gov/hobbes
+ *
+ * Copyright (c) 2017, The V3VEE Project  <http://www.v3vee.org>
+ *                     The Hobbes Project <http://xstack.sandia.gov/hobbes>
+ * All rights reserved.
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "LICENSE.txt".
+ */
+#include <nautilus/nautilus.h>
+#include <nautilus/cpu.h>
+#include <nautilus/cpuid.h>
+#include <nautilus/msr.h>
+#include <nautilus/spinlock.h>
+#include <nautilus/tsc.h>
+#include <dev/apic.h>
+#include <dev/i8254.h>
+
+#ifndef NAUT_CONFIG_DEBUG_TIMERS
+#undef DEBUG_PRINT
+#define DEBUG_PRINT(fmt, args...)
+#endif
+
+#define INFO(fmt, args...)  INFO_PRINT("tsc: " fmt, ##args)
+#define WARN(fmt, args...)  WARN_PRINT("tsc: " fmt, ##args)
+#define ERROR(fmt, args...) ERROR_PRINT("tsc: " fmt, ##args)
+#define DEBUG(fmt, args...) DEBUG_PRINT("tsc: " fmt, ##args)
+
+// calibration window is 1/CALIB_RECIP seconds (50 ms)
+#define CALIB_RECIP  20
+#define CALIB_TRIALS 5
+
+// iterations each core makes through the warp check
+#define WARP_CHECK_ITERS 10000
+
+// cross-core backward steps up to this are tolerated
+#define MAX_WARP_NS 1000ULL
+
+// leaf 0x80000007, EDX[8]
+#define CPUID_INV_TSC_BIT (1U<<8)
+
+struct nk_tsc_info nk_tsc_info;
+
+static volatile uint64_t sync_start = -1ULL;
+static volatile uint64_t sync_done = 0;
+
+static spinlock_t        warp_lock;
+static uint64_t          warp_last;
+static volatile uint64_t warp_max;
+
+
+static int
+tsc_is_invariant (void)
+{
+    cpuid_ret_t ret;
+
+    cpuid(CPUID_EXT_FUNC_MAXVAL, &ret);
+    if (ret.a < CPUID_EXT_FUNC_INV_TSC) {
+        return 0;
+    }
+
+    cpuid(CPUID_EXT_FUNC_INV_TSC, &ret);
+    return !!(ret.d & CPUID_INV_TSC_BIT);
+}
+
+
+#ifdef NAUT_CONFIG_X86_64_HOST
+/*
+ * Count TSC cycles across one PIT channel 2 countdown.
+ * Interrupts must be off.
+ */
+static uint64_t
+pit_calibrate_once (void)
+{
+    uint16_t latch = PIT_RATE / CALIB_RECIP;
+    uint64_t start, end;
+
+    // gate high, speaker off
+    outb((inb(KB_CTRL_PORT_B) & ~0x02) | 0x01, KB_CTRL_PORT_B);
+
+    // channel 2, interrupt on terminal count, binary
+    outb(PIT_MODE(0) | PIT_CHAN(PIT_CHAN_SEL_2) | PIT_ACC_MODE(PIT_ACC_MODE_BOTH),
+         PIT_CMD_REG);
+    outb(latch & 0xff, PIT_CHAN2_DATA);
+    outb(latch >> 8, PIT_CHAN2_DATA);
+
+    start = rdtsc();
+    while (!(inb(KB_CTRL_PORT_B) & 0x20)) {
+        // intentionally empty
+    }
+    end = rdtsc();
+
+    return (end - start) * CALIB_RECIP;
+}
+
+
+static uint64_t
+tsc_calibrate (void)
+{
+    uint64_t trial[CALIB_TRIALS];
+    uint64_t t;
+    int i, j;
+
+    for (i = 0; i < CALIB_TRIALS; i++) {
+        trial[i] = pit_calibrate_once();
+        DEBUG("Calibration trial %d: %lu Hz\n", i, trial[i]);
+    }
+
+    // an SMI or a descheduled vcpu stretches a trial, so take the median
+    for (i = 1; i < CALIB_TRIALS; i++) {
+        for (j = i; j > 0 && trial[j-1] > trial[j]; j--) {
+            t = trial[j];
+            trial[j] = trial[j-1];
+            trial[j-1] = t;
+        }
+    }
+
+    return trial[CALIB_TRIALS/2];
+}
+
+#else
+
+static uint64_t
+tsc_calibrate (void)
+{
+    // no PIT here, so trust the APIC timer calibration
+    struct apic_dev * apic = per_cpu_get(apic);
+
+    return apic->cycles_per_us * 1000000ULL;
+}
+
+#endif
+
+
+static void
+tsc_set_scale (uint64_t hz)
+{
+    nk_tsc_info.hz       = hz;
+    nk_tsc_info.mult     = (1000000000ULL << NK_TSC_SHIFT) / hz;
+    nk_tsc_info.inv_mult = (hz << NK_TSC_INV_SHIFT) / 1000000000ULL;
+}
+
+
+int
+nk_tsc_init (void)
+{
+    uint8_t flags;
+    uint64_t hz;
+
+    nk_tsc_info.invariant = tsc_is_invariant();
+
+    flags = irq_disable_save();
+    hz = tsc_calibrate();
+    irq_enable_restore(flags);
+
+    if (!hz) {
+        ERROR("Calibration failed\n");
+        return -1;
+    }
+
+    tsc_set_scale(hz);
+
+    nk_tsc_info.calibrated = 1;
+
+    // a single core is trivially synchronized with itself
+    nk_tsc_info.reliable = nk_tsc_info.invariant;
+
+    INFO("TSC at %lu.%06lu MHz, %sinvariant (mult=%lu)\n",
+         hz / 1000000, hz % 1000000,
+         nk_tsc_info.invariant ? "" : "NOT ",
+         nk_tsc_info.mult);
+
+    if (!nk_tsc_info.invariant) {
+        WARN("TSC is not invariant, it may not be used as a wall clock\n");
+    }
+
+    return 0;
+}
+
+
+/*
+ * Each core repeatedly reads its TSC inside a global critical
+ * section and compares against the last value read by any core.
+ * A reading smaller than the previous one is a cross-core warp.
+ */
+static void
+tsc_check_warp (void)
+{
+    uint64_t prev, now;
+    int i;
+
+    for (i = 0; i < WARP_CHECK_ITERS; i++) {
+        spin_lock(&warp_lock);
+        prev = warp_last;
+        now = rdtscp();
+        warp_last = now;
+        if (now < prev && (prev - now) > warp_max) {
+            warp_max = prev - now;
+        }
+        spin_unlock(&warp_lock);
+    }
+}
+
+
+/*
+ * Called by every CPU from the scheduler startup barrier with
+ * interrupts off.  Every core starts its TSC at about the same
+ * time, but the BSP's has advanced the furthest, so we pick a
+ * point in the future and jump every core's TSC to it.
+ */
+void
+nk_tsc_sync (void)
+{
+    struct cpu * my_cpu = get_cpu();
+    uint64_t num_cpus = nk_get_num_cpus();
+
+    if (my_cpu->is_bsp) {
+        // the + 1 here offsets the -1 init value
+        sync_start = rdtsc() * 16ULL + 1ULL;
+    } else {
+        while (sync_start == -1ULL) {
+            // spin
+        }
+    }
+
+    msr_write(IA32_TIME_STAMP_COUNTER, sync_start);
+
+    tsc_check_warp();
+
+    __sync_fetch_and_add(&sync_done, 1);
+
+    if (!my_cpu->is_bsp) {
+        return;
+    }
+
+    while (sync_done < num_cpus) {
+        // spin
+    }
+
+    nk_tsc_info.max_warp_cycles = warp_max;
+    nk_tsc_info.synced = 1;
+    nk_tsc_info.reliable = nk_tsc_info.invariant &&
+        nk_tsc_cycles_to_ns(warp_max) <= MAX_WARP_NS;
+
+    INFO("Synchronized %lu cores at %lu cycles, max warp %lu cycles (%lu ns)%s\n",
+         num_cpus, sync_start, warp_max, nk_tsc_cycles_to_ns(warp_max),
+         nk_tsc_info.reliable ? "" : " - TSC NOT RELIABLE AS CLOCK");
+}
+
+
+void
+nk_tsc_dump (void)
+{
+    nk_vc_printf("tsc: %luhz mult=%lu inv_mult=%lu %s%s%s warp=%lu cycles now=%lu ns\n",
+                 nk_tsc_info.hz, nk_tsc_info.mult, nk_tsc_info.inv_mult,
+                 nk_tsc_info.invariant ? "invariant " : "",
+                 nk_tsc_info.synced ? "synced " : "",
+                 nk_tsc_info.reliable ? "reliable" : "unreliable",
+                 nk_tsc_info.max_warp_cycles, nk_tsc_get_ns());
+}
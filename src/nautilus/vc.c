@@ -32,6 +32,7 @@
 #include <nautilus/vc.h>
 #include <nautilus/chardev.h>
 #include <nautilus/printk.h>
+#include <nautilus/klog.h>
 #include <dev/serial.h>
 #include <dev/vga.h>
 #ifdef NAUT_CONFIG_XEON_PHI
@@ -85,6 +86,7 @@ struct chardev_console {
     char   name[DEV_NAME_LEN]; // device name
     struct nk_char_dev *dev; // device for I/O
     struct nk_virtual_console *cur_vc; // current virtual console
+    uint64_t dropped;  // output lost because the device was backed up
     struct list_head chardev_node;  // for list of chardev consoles
 };
 
@@ -112,7 +114,15 @@ struct nk_virtual_console {
     nk_scancode_t s_queue[Scancode_QUEUE_SIZE];
     nk_keycode_t k_queue[Keycode_QUEUE_SIZE];
   } keyboard_queue;
-  uint16_t BUF[VGA_WIDTH * VGA_HEIGHT];
+  // Line store: a ring of nlines rows.  The live screen is the
+  // VGA_HEIGHT rows starting at top, and the hist rows before it
+  // are scrollback.  Scrolling just advances top.
+  uint16_t *lines;
+  uint32_t nlines, top, hist;
+  // rows back from the live screen that are being shown, 0 => live
+  uint32_t view;
+  // per screen row, the columns [lo,hi) not yet on the display
+  uint8_t dirty_lo[VGA_HEIGHT], dirty_hi[VGA_HEIGHT];
   uint8_t cur_x, cur_y, cur_attr, fill_attr;
   uint16_t head, tail;
   void    (*raw_noqueue_callback)(nk_scancode_t, void *priv);
@@ -133,29 +143,105 @@ struct nk_virtual_console * nk_get_cur_vc()
     return cur_vc;
 }
 
+#define VC_LINES (VGA_HEIGHT + NAUT_CONFIG_VIRTUAL_CONSOLE_SCROLLBACK)
+
+// row y of the live screen
+static inline uint16_t *vc_row(struct nk_virtual_console *vc, uint32_t y)
+{
+  return vc->lines + ((vc->top + y) % vc->nlines) * VGA_WIDTH;
+}
+
+// row y of the screen as shown, which differs while in the scrollback
+static inline uint16_t *vc_view_row(struct nk_virtual_console *vc, uint32_t y)
+{
+  return vc->lines + ((vc->top + vc->nlines - vc->view + y) % vc->nlines) * VGA_WIDTH;
+}
+
+static inline void vc_dirty(struct nk_virtual_console *vc, uint8_t x, uint8_t y, uint8_t n)
+{
+  if (x < vc->dirty_lo[y]) {
+    vc->dirty_lo[y] = x;
+  }
+  if (x+n > vc->dirty_hi[y]) {
+    vc->dirty_hi[y] = x+n;
+  }
+}
+
+static inline void vc_dirty_all(struct nk_virtual_console *vc)
+{
+  memset(vc->dirty_lo, 0, sizeof(vc->dirty_lo));
+  memset(vc->dirty_hi, VGA_WIDTH, sizeof(vc->dirty_hi));
+}
+
+static inline void vc_clean_all(struct nk_virtual_console *vc)
+{
+  memset(vc->dirty_lo, VGA_WIDTH, sizeof(vc->dirty_lo));
+  memset(vc->dirty_hi, 0, sizeof(vc->dirty_hi));
+}
+
+// new output always lands on the live screen
+static inline void vc_to_live(struct nk_virtual_console *vc)
+{
+  if (vc->view) {
+    vc->view = 0;
+    vc_dirty_all(vc);
+  }
+}
+
 static inline void copy_display_to_vc(struct nk_virtual_console *vc) 
 {
-#ifdef NAUT_CONFIG_X86_64_HOST
-  vga_copy_out((void *)vc->BUF,sizeof(vc->BUF));
-#endif
-#ifdef NAUT_CONFIG_XEON_PHI
-  vga_copy_out((void *)vc->BUF,sizeof(vc->BUF));
+#if defined(NAUT_CONFIG_X86_64_HOST) || defined(NAUT_CONFIG_XEON_PHI)
+  uint32_t y;
+  for (y=0;y<VGA_HEIGHT;y++) {
+    vga_read_span(0, y, vc_row(vc,y), VGA_WIDTH);
+  }
 #endif
 #ifdef NAUT_CONFIG_HVM_HRT
   // not supported
 #endif
 }
 
-static inline void copy_vc_to_display(struct nk_virtual_console *vc) 
-{ 
-#ifdef NAUT_CONFIG_X86_64_HOST
-  vga_copy_in((void*)vc->BUF,sizeof(vc->BUF));
-#endif
+/*
+  Write what has changed in the current vc to the display, and
+  then the cursor, if it moved.   This is done once at the end
+  of each operation, with the buf lock held, so a print that
+  scrolls many times costs at most one redraw and one cursor
+  update.  A vc that is not current stays dirty; it is redrawn 
+  in full when switched to.
+*/
+static void vc_flush(struct nk_virtual_console *vc)
+{
+  if (vc != cur_vc) {
+    return;
+  }
+#if defined(NAUT_CONFIG_X86_64_HOST) || defined(NAUT_CONFIG_XEON_PHI)
+  uint32_t y;
+  int full = 1;
+  
+  for (y=0;y<VGA_HEIGHT;y++) {
+    if (vc->dirty_lo[y] < vc->dirty_hi[y]) { 
+      vga_write_span(vc->dirty_lo[y], y,
+		     vc_view_row(vc,y) + vc->dirty_lo[y],
+		     vc->dirty_hi[y] - vc->dirty_lo[y]);
+      full &= vc->dirty_lo[y]==0 && vc->dirty_hi[y]==VGA_WIDTH;
+    } else {
+      full = 0;
+    }
+  }
+  vc_clean_all(vc);
 #ifdef NAUT_CONFIG_XEON_PHI
-  vga_copy_in((void*)vc->BUF,sizeof(vc->BUF));
+  if (full) {
+    phi_cons_notify_redraw();
+  }
+  phi_cons_set_cursor(vc->cur_x, vc->cur_y);
+#else
+  uint8_t x, y8;
+  (void)full;
+  vga_get_cursor(&x,&y8);
+  if (x!=vc->cur_x || y8!=vc->cur_y) {
+    vga_set_cursor(vc->cur_x, vc->cur_y);
+  }
 #endif
-#ifdef NAUT_CONFIG_HVM_HRT
-  // not supported
 #endif
 }
 
@@ -185,10 +271,20 @@ struct nk_virtual_console *nk_create_vc(char *name, enum nk_vc_type new_vc_type,
   new_vc->num_threads = 0;
   new_vc->waiting_threads = nk_thread_queue_create();
 
+  new_vc->nlines = VC_LINES;
+  new_vc->lines = malloc(sizeof(uint16_t)*VGA_WIDTH*new_vc->nlines);
+  if (!new_vc->lines) {
+    ERROR("Failed to allocate line store for new console\n");
+    nk_thread_queue_destroy(new_vc->waiting_threads);
+    free(new_vc);
+    return NULL;
+  }
+
   // clear to new attr
   for (i = 0; i < VGA_HEIGHT*VGA_WIDTH; i++) {
-    new_vc->BUF[i] = vga_make_entry(' ', new_vc->cur_attr);
+    new_vc->lines[i] = vga_make_entry(' ', new_vc->cur_attr);
   }
+  vc_dirty_all(new_vc);
 
   STATE_LOCK();
   list_add_tail(&new_vc->vc_node, &vc_list);
@@ -203,14 +299,14 @@ static int _switch_to_vc(struct nk_virtual_console *vc)
     return 0;
   }
   if (vc!=cur_vc) { 
-    copy_display_to_vc(cur_vc);
+    // the line store is authoritative, so there is nothing
+    // to copy back from the display for the old vc
+    BUF_LOCK_CONF;
+    BUF_LOCK(vc);
     cur_vc = vc;
-    copy_vc_to_display(cur_vc);
-#ifdef NAUT_CONFIG_X86_64_HOST
-    vga_set_cursor(cur_vc->cur_x, cur_vc->cur_y);
-#elif NAUT_CONFIG_XEON_PHI
-    phi_cons_set_cursor(cur_vc->cur_x, cur_vc->cur_y);
-#endif
+    vc_dirty_all(vc);
+    vc_flush(vc);
+    BUF_UNLOCK(vc);
   }
   return 0;
 }
@@ -229,6 +325,7 @@ static int _destroy_vc(struct nk_virtual_console *vc)
 
   list_del(&vc->vc_node);
   nk_thread_queue_destroy(vc->waiting_threads);
+  free(vc->lines);
   free(vc);
   return 0;
 }
@@ -328,25 +425,24 @@ static int _vc_scrollup_specific(struct nk_virtual_console *vc)
   }
 #endif
 
-  for (i=0;
-       i<VGA_WIDTH*(VGA_HEIGHT-1);
-       i++) {
-    vc->BUF[i] = vc->BUF[i+VGA_WIDTH];
-  }
+  vc_to_live(vc);
 
-  for (i = VGA_WIDTH*(VGA_HEIGHT-1);
-       i < VGA_WIDTH*VGA_HEIGHT; 
-       i++) {
-    vc->BUF[i] = vga_make_entry(' ', vc->fill_attr);
+  // the old top row becomes scrollback, and is reused as the
+  // new bottom row once the scrollback is full
+  vc->top = (vc->top + 1) % vc->nlines;
+  if (vc->hist < vc->nlines - VGA_HEIGHT) {
+    vc->hist++;
   }
 
-  if(vc == cur_vc) {
-    copy_vc_to_display(vc);
-#ifdef NAUT_CONFIG_XEON_PHI
-    phi_cons_notify_redraw();
-#endif
+  uint16_t *row = vc_row(vc, VGA_HEIGHT-1);
+  uint16_t val = vga_make_entry(' ', vc->fill_attr);
+  for (i=0;i<VGA_WIDTH;i++) {
+    row[i] = val;
   }
 
+  // every row on screen has moved
+  vc_dirty_all(vc);
+
   return 0;
 }
 
@@ -359,6 +455,7 @@ int nk_vc_scrollup_specific(struct nk_virtual_console *vc)
   }
   BUF_LOCK(vc);
   rc = _vc_scrollup_specific(vc);
+  vc_flush(vc);
   BUF_UNLOCK(vc);
   return rc;
 }
@@ -375,6 +472,7 @@ int nk_vc_scrollup()
     BUF_LOCK_CONF;
     BUF_LOCK(vc);
     rc = _vc_scrollup_specific(vc);
+    vc_flush(vc);
     BUF_UNLOCK(vc);
   }
 
@@ -392,18 +490,9 @@ static int _vc_display_char_specific(struct nk_virtual_console *vc, uint8_t c, u
   if(x >= VGA_WIDTH || y >= VGA_HEIGHT) {
     return -1;
   } else {
-    vc->BUF[y * VGA_WIDTH + x] = val;
-    if(vc == cur_vc) {
-#ifdef NAUT_CONFIG_X86_64_HOST
-      vga_write_screen(x,y,val);
-      vga_set_cursor(cur_vc->cur_x, cur_vc->cur_y);
-#endif
-#ifdef NAUT_CONFIG_XEON_PHI
-      vga_write_screen(x,y,val);
-      phi_cons_set_cursor(cur_vc->cur_x, cur_vc->cur_y);
-#endif
-
-    }
+    vc_to_live(vc);
+    vc_row(vc,y)[x] = val;
+    vc_dirty(vc,x,y,1);
   }
   return 0;
 }
@@ -430,6 +519,7 @@ int nk_vc_display_char_specific(struct nk_virtual_console *vc,
     BUF_LOCK_CONF;
     BUF_LOCK(vc);
     rc = _vc_display_char_specific(vc, c, attr, x, y);
+    vc_flush(vc);
     BUF_UNLOCK(vc);
   }
   return rc;
@@ -447,6 +537,7 @@ int nk_vc_display_char(uint8_t c, uint8_t attr, uint8_t x, uint8_t y)
     BUF_LOCK_CONF;
     BUF_LOCK(vc);
     rc = _vc_display_char(c,attr,x,y);
+    vc_flush(vc);
     BUF_UNLOCK(vc);
   }
 
@@ -465,11 +556,6 @@ static int _vc_setpos(uint8_t x, uint8_t y)
   if (vc) { 
     vc->cur_x = x;
     vc->cur_y = y;
-#ifdef NAUT_CONFIG_X86_64_HOST
-    if (vc==cur_vc) { 
-      vga_set_cursor(cur_vc->cur_x, cur_vc->cur_y);
-    }
-#endif
   }
   return 0;
 }
@@ -487,6 +573,7 @@ int nk_vc_setpos(uint8_t x, uint8_t y)
     BUF_LOCK_CONF;
     BUF_LOCK(vc);
     rc = _vc_setpos(x,y);
+    vc_flush(vc);
     BUF_UNLOCK(vc)
   }
 
@@ -500,11 +587,6 @@ static int _vc_setpos_specific(struct nk_virtual_console *vc, uint8_t x, uint8_t
   if (vc) { 
     vc->cur_x = x;
     vc->cur_y = y;
-#ifdef NAUT_CONFIG_X86_64_HOST
-    if (vc==cur_vc) { 
-      vga_set_cursor(cur_vc->cur_x, cur_vc->cur_y);
-    }
-#endif
   }
 
   return rc;
@@ -519,6 +601,7 @@ int nk_vc_setpos_specific(struct nk_virtual_console *vc, uint8_t x, uint8_t y)
     BUF_LOCK_CONF;
     BUF_LOCK(vc);
     rc = _vc_setpos_specific(vc,x,y);
+    vc_flush(vc);
     BUF_UNLOCK(vc);
   }
 
@@ -544,13 +627,6 @@ static int _vc_putchar_specific(struct nk_virtual_console *vc, uint8_t c)
       _vc_scrollup_specific(vc);
       vc->cur_y--;
     }
-    if (vc==cur_vc) {
-#ifdef NAUT_CONFIG_X86_64_HOST
-      vga_set_cursor(vc->cur_x,vc->cur_y);
-#elif NAUT_CONFIG_XEON_PHI
-      phi_cons_set_cursor(vc->cur_x,vc->cur_y);
-#endif
-    }
     return 0;
   }
   _vc_display_char_specific(vc, c, vc->cur_attr, vc->cur_x, vc->cur_y);
@@ -568,13 +644,6 @@ static int _vc_putchar_specific(struct nk_virtual_console *vc, uint8_t c)
       vc->cur_y--;
     }
   }
-  if (vc==cur_vc) { 
-#ifdef NAUT_CONFIG_X86_64_HOST
-    vga_set_cursor(vc->cur_x, vc->cur_y);
-#elif NAUT_CONFIG_XEON_PHI
-      phi_cons_set_cursor(vc->cur_x,vc->cur_y);
-#endif
-  }
   return 0;
 }
 
@@ -608,6 +677,7 @@ int nk_vc_putchar(uint8_t c)
       BUF_LOCK_CONF;
       BUF_LOCK(vc);
       _vc_putchar_specific(vc,c);
+      vc_flush(vc);
       BUF_UNLOCK(vc);
       chardev_consoles_putchar(vc, c);
     }
@@ -652,6 +722,7 @@ static int vc_print_specific(struct nk_virtual_console *vc, char *s)
     BUF_LOCK_CONF;
     BUF_LOCK(vc);
     _vc_print_specific(vc,s);
+    vc_flush(vc);
     BUF_UNLOCK(vc);
     chardev_consoles_print(vc,s);
 #ifdef NAUT_CONFIG_VIRTUAL_CONSOLE_SERIAL_MIRROR_ALL
@@ -673,6 +744,7 @@ int nk_vc_print(char *s)
       BUF_LOCK_CONF;
       BUF_LOCK(vc);
       _vc_print_specific(vc,s);
+      vc_flush(vc);
       BUF_UNLOCK(vc);
       chardev_consoles_print(vc, s);
     }
@@ -739,16 +811,34 @@ int nk_vc_log(char *fmt, ...)
   va_list args;
   int i;
   
+#ifdef NAUT_CONFIG_KLOG
+  // goes to a ring, and reaches nk_vc_log_print() later
+  va_start(args, fmt);
+  i=nk_klog_vwrite(NK_KLOG_LOG,fmt,args);
+  va_end(args);
+  if (i>=0) {
+    return i;
+  }
+#endif
+
   va_start(args, fmt);
   i=vsnprintf(buf,PRINT_MAX,fmt,args);
   va_end(args);
   
+  nk_vc_log_print(buf);
+  
+  return i;
+}
+
+int nk_vc_log_print(char *buf)
+{
   if (!log_vc) { 
     // no output to screen possible yet
   } else {
     BUF_LOCK_CONF;
     BUF_LOCK(log_vc);
     _vc_print_specific(log_vc, buf);
+    vc_flush(log_vc);
     BUF_UNLOCK(log_vc);
     chardev_consoles_print(log_vc, buf);
   }
@@ -756,7 +846,7 @@ int nk_vc_log(char *fmt, ...)
   serial_write(buf);
 #endif
   
-  return i;
+  return 0;
 }
 
 static int _vc_setattr_specific(struct nk_virtual_console *vc, uint8_t attr)
@@ -797,22 +887,30 @@ int nk_vc_setattr(uint8_t attr)
 
 static int _vc_clear_specific(struct nk_virtual_console *vc, uint8_t attr)
 {
-  int i;
+  int i, y;
   uint16_t val = vga_make_entry (' ', attr);
+  uint16_t *row;
 
   vc->cur_attr = attr;
   vc->fill_attr = attr;
-    
-  for (i = 0; i < VGA_HEIGHT*VGA_WIDTH; i++) {
-    vc->BUF[i] = val;
+
+  vc_to_live(vc);
+
+  // the cleared screen goes to the scrollback
+  vc->top = (vc->top + VGA_HEIGHT) % vc->nlines;
+  vc->hist += VGA_HEIGHT;
+  if (vc->hist > vc->nlines - VGA_HEIGHT) {
+    vc->hist = vc->nlines - VGA_HEIGHT;
   }
-  
-  if (vc==cur_vc) { 
-    copy_vc_to_display(vc);
-#ifdef NAUT_CONFIG_XEON_PHI
-    phi_cons_notify_redraw();
-#endif
+    
+  for (y = 0; y < VGA_HEIGHT; y++) {
+    row = vc_row(vc,y);
+    for (i = 0; i < VGA_WIDTH; i++) {
+      row[i] = val;
+    }
   }
+
+  vc_dirty_all(vc);
   
   vc->cur_x=0;
   vc->cur_y=0;
@@ -826,6 +924,7 @@ int nk_vc_clear_specific(struct nk_virtual_console *vc, uint8_t attr)
     BUF_LOCK_CONF;
     BUF_LOCK(vc);
     _vc_clear_specific(vc,attr);
+    vc_flush(vc);
     BUF_UNLOCK(vc);
   }
   return 0;
@@ -847,11 +946,53 @@ int nk_vc_clear(uint8_t attr)
      
   BUF_LOCK(vc);
   _vc_clear_specific(vc,attr);
+  vc_flush(vc);
   BUF_UNLOCK(vc);
   return 0;
 }
 
 
+static int _vc_scrollback_specific(struct nk_virtual_console *vc, int lines)
+{
+  sint64_t view = (sint64_t)vc->view + lines;
+
+  if (view < 0) {
+    view = 0;
+  }
+  if (view > vc->hist) {
+    view = vc->hist;
+  }
+  if (view != vc->view) {
+    vc->view = view;
+    vc_dirty_all(vc);
+  }
+  return 0;
+}
+
+int nk_vc_scrollback_specific(struct nk_virtual_console *vc, int lines)
+{
+  if (vc) { 
+    BUF_LOCK_CONF;
+    BUF_LOCK(vc);
+    _vc_scrollback_specific(vc,lines);
+    vc_flush(vc);
+    BUF_UNLOCK(vc);
+  }
+  return 0;
+}
+
+int nk_vc_scrollback(int lines)
+{
+  struct nk_thread *t = get_cur_thread();
+  struct nk_virtual_console *vc;
+
+  if (!t || !(vc = t->vc)) { 
+    vc = default_vc;
+  }
+
+  return nk_vc_scrollback_specific(vc,lines);
+}
+
 
 // called assuming lock is held
 static inline int next_index_on_queue(enum nk_vc_type type, int index) 
@@ -1115,6 +1256,13 @@ nk_scancode_t nk_vc_get_scancode(int wait)
 static int enqueue_scancode_as_keycode(struct nk_virtual_console *cur_vc, uint8_t scan)
 {
   nk_keycode_t key = kbd_translate(scan);
+  // shift-pgup/pgdn page through the scrollback
+  if ((key & ~KEY_CAPS_FLAG) == (KEY_SHIFT_FLAG | KEY_KPPGUP)) {
+    return nk_vc_scrollback_specific(cur_vc, VGA_HEIGHT/2);
+  }
+  if ((key & ~KEY_CAPS_FLAG) == (KEY_SHIFT_FLAG | KEY_KPPGDN)) {
+    return nk_vc_scrollback_specific(cur_vc, -VGA_HEIGHT/2);
+  }
   if(key != NO_KEY) {
     nk_enqueue_keycode(cur_vc, key);
   }
@@ -1237,9 +1385,38 @@ static int start_list()
 
 
 
+#define CHARDEV_CONSOLE_CHUNK 128
+#define CHARDEV_CONSOLE_MAX   8
+
+static int num_chardev_consoles = 0;
+
+// returns whether the device took all of it
+static int chardev_console_write(struct chardev_console *c, uint8_t *buf, uint64_t n)
+{
+    uint64_t rc = nk_char_dev_write(c->dev,n,buf,NK_DEV_REQ_NONBLOCKING);
+
+    if ((sint64_t)rc < 0) {
+	rc = 0;
+    }
+    if (rc < n) {
+	__sync_fetch_and_add(&c->dropped, n - rc);
+	return 0;
+    }
+    return 1;
+}
+
+/*
+  The device is written without the state lock, and without
+  waiting for it: output that does not fit is counted and dropped.
+  A serial port still polls when called with interrupts off.
+  Consoles are never removed, so they can be used after the lock
+  is released.
+*/
 static void _chardev_consoles_print(struct nk_virtual_console *vc, char *data, uint64_t len)
 {
+    struct chardev_console *targets[CHARDEV_CONSOLE_MAX];
     struct list_head *cur;
+    int num = 0, j;
 
     STATE_LOCK_CONF;
 
@@ -1248,18 +1425,36 @@ static void _chardev_consoles_print(struct nk_virtual_console *vc, char *data, u
     list_for_each(cur,&chardev_console_list) {
 	struct chardev_console *c = list_entry(cur,struct chardev_console, chardev_node);
 	if (c->cur_vc == vc) { 
-	    uint64_t i;
-	    // translate lf->crlf
-	    for (i=0;i<len;i++) {
-		if (data[i]=='\n') { 
-		    nk_char_dev_write(c->dev,1,"\r",NK_DEV_REQ_BLOCKING);
-		}
-		nk_char_dev_write(c->dev,1,&data[i],NK_DEV_REQ_BLOCKING);
-	    }
+	    targets[num++] = c;
 	}
     }
     
     STATE_UNLOCK();
+
+    for (j=0;j<num;j++) {
+	struct chardev_console *c = targets[j];
+	uint8_t buf[CHARDEV_CONSOLE_CHUNK];
+	uint64_t i, n=0;
+	// translate lf->crlf, and hand the device a chunk at a time
+	for (i=0;i<len;i++) {
+	    if (n+2 > CHARDEV_CONSOLE_CHUNK) {
+		if (!chardev_console_write(c,buf,n)) {
+		    // the device is full, so is the rest
+		    __sync_fetch_and_add(&c->dropped, len - i);
+		    n = 0;
+		    break;
+		}
+		n=0;
+	    }
+	    if (data[i]=='\n') { 
+		buf[n++]='\r';
+	    }
+	    buf[n++]=data[i];
+	}
+	if (n) {
+	    chardev_console_write(c,buf,n);
+	}
+    }
 }
 
 static void chardev_consoles_print(struct nk_virtual_console *vc, char *data)
@@ -1412,8 +1607,13 @@ static void chardev_console(void *in, void **out)
 		chardev_console_handle_input(c,data[2]);
 	    } else {
 		char buf[80];
+		uint64_t dropped = __sync_lock_test_and_set(&c->dropped,0);
 		
-		snprintf(buf,80,"\r\n*** %s ***\r\n",c->cur_vc->name);
+		if (dropped) {
+		    snprintf(buf,80,"\r\n*** %s (%lu bytes of output dropped) ***\r\n",c->cur_vc->name,dropped);
+		} else {
+		    snprintf(buf,80,"\r\n*** %s ***\r\n",c->cur_vc->name);
+		}
 		
 		nk_char_dev_write(c->dev,strlen(buf),buf,NK_DEV_REQ_BLOCKING);
 	    }
@@ -1430,10 +1630,23 @@ static void chardev_console(void *in, void **out)
 
 int nk_vc_start_chardev_console(char *chardev)
 {
+    STATE_LOCK_CONF;
+
+    // reserve our place among the consoles
+    STATE_LOCK();
+    if (num_chardev_consoles == CHARDEV_CONSOLE_MAX) {
+	STATE_UNLOCK();
+	ERROR("Too many chardev consoles to add %s\n",chardev);
+	return -1;
+    }
+    num_chardev_consoles++;
+    STATE_UNLOCK();
+
     struct chardev_console *c = malloc(sizeof(*c));
 				       
     if (!c) { 
 	ERROR("Cannot allocate chardev console for %s\n",chardev);
+	__sync_fetch_and_sub(&num_chardev_consoles,1);
 	return -1;
     }
 
@@ -1448,6 +1661,7 @@ int nk_vc_start_chardev_console(char *chardev)
     if (nk_thread_start(chardev_console, c, 0, 1, PAGE_SIZE_4KB, &c->tid, 0)) {
 	ERROR("Failed to launch chardev console handler for %s\n",c->name);
 	free(c);
+	__sync_fetch_and_sub(&num_chardev_consoles,1);
 	return -1;
     }
     
@@ -1456,8 +1670,6 @@ int nk_vc_start_chardev_console(char *chardev)
 	// wait for console thread to start
     }
     
-    STATE_LOCK_CONF;
-
     STATE_LOCK();
     list_add_tail(&c->chardev_node, &chardev_console_list);
     STATE_UNLOCK();
@@ -1501,6 +1713,7 @@ int nk_vc_init()
 
   cur_vc = default_vc;
   copy_display_to_vc(cur_vc);
+  vc_clean_all(cur_vc);
   
 #ifdef NAUT_CONFIG_X86_64_HOST
   vga_get_cursor(&(cur_vc->cur_x),&(cur_vc->cur_y));
@@ -46,10 +46,16 @@
 #include <nautilus/thread.h>
 #include <nautilus/condvar.h>
 #include <nautilus/spinlock.h>
+#include <nautilus/ticketlock.h>
+#include <nautilus/mutex.h>
+#include <nautilus/cohortlock.h>
+#include <nautilus/rwlock.h>
+#include <nautilus/brlock.h>
 #include <nautilus/percpu.h>
 #include <nautilus/numa.h>
 #include <nautilus/nemo.h>
 #include <nautilus/pmc.h>
+#include <nautilus/bench.h>
 
 #endif
 
@@ -500,6 +506,247 @@ void time_spinlock (void)
 }
 
 
+#ifndef __USER
+
+#define CONTEND_LOOPS     10000
+#define CONTEND_CS_LOOPS  1000   // critical section length (timing loop iterations)
+#define CONTEND_OUT_LOOPS 1000   // work between acquisitions
+
+typedef enum { CONTEND_SPIN, CONTEND_TICKET, CONTEND_COHORT, CONTEND_MUTEX } contend_kind_t;
+
+static const char * contend_names[] = { "spinlock", "ticketlock", "cohortlock", "nk_mutex" };
+
+static struct contend_state {
+    contend_kind_t    kind;
+    volatile int      go;
+    volatile uint64_t ready;
+    volatile uint64_t counter;
+    spinlock_t        spin;
+    nk_ticket_lock_t  ticket;
+    nk_cohort_lock_t  cohort;
+    nk_mutex_t        mutex;
+} contend;
+
+extern void nk_simple_timing_loop(uint64_t iter_count);
+
+static FUNC_TYPE
+contend_func FUNC_HDR
+{
+    int i;
+
+    __sync_fetch_and_add(&contend.ready, 1);
+
+    while (!contend.go) {
+        // spin
+    }
+
+    for (i = 0; i < CONTEND_LOOPS; i++) {
+        switch (contend.kind) {
+            case CONTEND_SPIN:   spin_lock(&contend.spin); break;
+            case CONTEND_TICKET: nk_ticket_lock(&contend.ticket); break;
+            case CONTEND_COHORT: nk_cohort_lock(&contend.cohort); break;
+            case CONTEND_MUTEX:  nk_mutex_lock(&contend.mutex); break;
+        }
+
+        nk_simple_timing_loop(CONTEND_CS_LOOPS);
+        contend.counter++;
+
+        switch (contend.kind) {
+            case CONTEND_SPIN:   spin_unlock(&contend.spin); break;
+            case CONTEND_TICKET: nk_ticket_unlock(&contend.ticket); break;
+            case CONTEND_COHORT: nk_cohort_unlock(&contend.cohort); break;
+            case CONTEND_MUTEX:  nk_mutex_unlock(&contend.mutex); break;
+        }
+
+        nk_simple_timing_loop(CONTEND_OUT_LOOPS);
+    }
+
+    RETURN;
+}
+
+
+/*
+ * Many threads hammering one lock with a non-trivial critical
+ * section.  Thread counts above the number of CPUs place more than
+ * one contender per CPU, which is where spinning hurts the most.
+ */
+void time_contended_lock (void);
+void
+time_contended_lock (void)
+{
+    THREAD_T t[NUM_THREADS];
+    int ncpus = nk_get_num_cpus();
+    int maxthr = 2*ncpus < NUM_THREADS ? 2*ncpus : NUM_THREADS;
+    int kind, n, j;
+    uint64_t start, end;
+
+    for (kind = CONTEND_SPIN; kind <= CONTEND_MUTEX; kind++) {
+        for (n = 1; n <= maxthr; n *= 2) {
+
+            spinlock_init(&contend.spin);
+            nk_ticket_lock_init(&contend.ticket);
+            nk_cohort_lock_init(&contend.cohort);
+            nk_mutex_init(&contend.mutex);
+            contend.kind = kind;
+            contend.go = 0;
+            contend.ready = 0;
+            contend.counter = 0;
+
+            for (j = 0; j < n; j++) {
+                nk_thread_start(contend_func, NULL, NULL, 0, TSTACK_DEFAULT, &t[j], j % ncpus);
+            }
+
+            while (contend.ready < n) {
+                // spin
+            }
+
+            rdtscll(start);
+            contend.go = 1;
+
+            for (j = 0; j < n; j++) {
+                JOIN_FUNC(t[j], NULL);
+            }
+            rdtscll(end);
+
+            if (contend.counter != (uint64_t)n * CONTEND_LOOPS) {
+                PRINT("CONTEND %s: LOST UPDATES (%llu of %llu)\n",
+                      contend_names[kind], contend.counter, (uint64_t)n * CONTEND_LOOPS);
+            }
+
+            PRINT("CONTEND %s THREADS %u CPUS %u %llu cycles %llu cycles/acquire\n",
+                  contend_names[kind], n, n < ncpus ? n : ncpus, end - start,
+                  (end - start) / ((uint64_t)n * CONTEND_LOOPS));
+        }
+    }
+}
+
+
+#define RW_LOOPS        100000
+#define RW_WRITE_EVERY  100      // one write per this many acquisitions
+#define RW_CS_LOOPS     100
+
+typedef enum { RW_RWLOCK, RW_BRLOCK, RW_BRLOCK_NODE } rw_kind_t;
+
+static const char * rw_names[] = { "nk_rwlock", "nk_brlock", "nk_brlock(node)" };
+
+static struct rw_state {
+    rw_kind_t         kind;
+    volatile int      go;
+    volatile uint64_t ready;
+    volatile uint64_t writes;
+    nk_rwlock_t       rw;
+    nk_brlock_t       br;
+} rwb;
+
+static FUNC_TYPE
+rw_func FUNC_HDR
+{
+    int i;
+
+    __sync_fetch_and_add(&rwb.ready, 1);
+
+    while (!rwb.go) {
+        // spin
+    }
+
+    for (i = 0; i < RW_LOOPS; i++) {
+        if (!(i % RW_WRITE_EVERY)) {
+            if (rwb.kind == RW_RWLOCK) {
+                nk_rwlock_wr_lock(&rwb.rw);
+            } else {
+                nk_brlock_wr_lock(&rwb.br);
+            }
+            rwb.writes++;
+            nk_simple_timing_loop(RW_CS_LOOPS);
+            if (rwb.kind == RW_RWLOCK) {
+                nk_rwlock_wr_unlock(&rwb.rw);
+            } else {
+                nk_brlock_wr_unlock(&rwb.br);
+            }
+        } else {
+            if (rwb.kind == RW_RWLOCK) {
+                nk_rwlock_rd_lock(&rwb.rw);
+            } else {
+                nk_brlock_rd_lock(&rwb.br);
+            }
+            nk_simple_timing_loop(RW_CS_LOOPS);
+            if (rwb.kind == RW_RWLOCK) {
+                nk_rwlock_rd_unlock(&rwb.rw);
+            } else {
+                nk_brlock_rd_unlock(&rwb.br);
+            }
+        }
+    }
+
+    RETURN;
+}
+
+
+/*
+ * Read-mostly throughput, one thread per CPU, for the original
+ * single-spinlock rwlock against the per-CPU and per-domain
+ * reader-indicator brlock.
+ */
+void time_rwlock (void);
+void
+time_rwlock (void)
+{
+    THREAD_T t[NUM_THREADS];
+    int ncpus = nk_get_num_cpus();
+    int maxthr = ncpus < NUM_THREADS ? ncpus : NUM_THREADS;
+    int kind, n, j;
+    uint64_t start, end, ops;
+
+    for (kind = RW_RWLOCK; kind <= RW_BRLOCK_NODE; kind++) {
+        for (n = 1; n <= maxthr; n *= 2) {
+
+            nk_rwlock_init(&rwb.rw);
+            if (kind != RW_RWLOCK &&
+                nk_brlock_init(&rwb.br, kind == RW_BRLOCK_NODE ? NK_BRLOCK_PER_NODE : 0)) {
+                PRINT("RWLOCK: cannot initialize brlock\n");
+                return;
+            }
+            rwb.kind = kind;
+            rwb.go = 0;
+            rwb.ready = 0;
+            rwb.writes = 0;
+
+            for (j = 0; j < n; j++) {
+                nk_thread_start(rw_func, NULL, NULL, 0, TSTACK_DEFAULT, &t[j], j);
+            }
+
+            while (rwb.ready < n) {
+                // spin
+            }
+
+            rdtscll(start);
+            rwb.go = 1;
+
+            for (j = 0; j < n; j++) {
+                JOIN_FUNC(t[j], NULL);
+            }
+            rdtscll(end);
+
+            ops = (uint64_t)n * RW_LOOPS;
+
+            if (rwb.writes != (uint64_t)n * (RW_LOOPS / RW_WRITE_EVERY)) {
+                PRINT("RWLOCK %s: LOST WRITES (%llu)\n", rw_names[kind], rwb.writes);
+            }
+
+            PRINT("RWLOCK %s THREADS %u %llu cycles %llu cycles/op %llu ops/Mcycle\n",
+                  rw_names[kind], n, end - start, (end - start) / ops,
+                  ops * 1000000ULL / (end - start));
+
+            if (kind != RW_RWLOCK) {
+                nk_brlock_deinit(&rwb.br);
+            }
+        }
+    }
+}
+
+#endif
+
+
 static FUNC_TYPE
 create_test_func FUNC_HDR
 {
@@ -1096,6 +1343,212 @@ malloc_test (void)
 
 }
 
+
+#ifdef NAUT_CONFIG_BENCH
+
+/*
+ * The same measurements as some of the above, in the form the
+ * harness (nautilus/bench.h) runs:  one iteration per call.
+ */
+
+static spinlock_t       bench_spin_lock;
+static nk_ticket_lock_t bench_ticket_lock;
+static nk_mutex_t       bench_mutex_lock;
+
+static int
+bench_locks_setup (struct nk_bench_ctx *ctx)
+{
+    spinlock_init(&bench_spin_lock);
+    nk_ticket_lock_init(&bench_ticket_lock);
+    nk_mutex_init(&bench_mutex_lock);
+    return 0;
+}
+
+static void
+bench_spinlock (struct nk_bench_ctx *ctx)
+{
+    spin_lock(&bench_spin_lock);
+    spin_unlock(&bench_spin_lock);
+}
+
+static void
+bench_ticketlock (struct nk_bench_ctx *ctx)
+{
+    nk_ticket_lock(&bench_ticket_lock);
+    nk_ticket_unlock(&bench_ticket_lock);
+}
+
+static void
+bench_mutex (struct nk_bench_ctx *ctx)
+{
+    nk_mutex_lock(&bench_mutex_lock);
+    nk_mutex_unlock(&bench_mutex_lock);
+}
+
+NK_BENCH(spinlock, "uncontended spin_lock+spin_unlock", bench_spinlock,
+         .setup = bench_locks_setup, .iters = 10000);
+NK_BENCH(ticketlock, "uncontended nk_ticket_lock+unlock", bench_ticketlock,
+         .setup = bench_locks_setup, .iters = 10000);
+NK_BENCH(mutex, "uncontended nk_mutex_lock+unlock", bench_mutex,
+         .setup = bench_locks_setup, .iters = 10000);
+
+
+static void
+bench_malloc (struct nk_bench_ctx *ctx)
+{
+    free(malloc(SIZE));
+}
+
+NK_BENCH(malloc_free, "malloc+free of a page", bench_malloc, .iters = 10000);
+
+
+struct bench_yield_state {
+    volatile int   stop;
+    nk_thread_id_t partner;
+};
+
+static FUNC_TYPE
+bench_yield_partner FUNC_HDR
+{
+    struct bench_yield_state *s = (struct bench_yield_state *)in;
+
+    while (!s->stop) {
+        YIELD();
+    }
+
+    RETURN;
+}
+
+static int
+bench_yield_setup (struct nk_bench_ctx *ctx)
+{
+    struct bench_yield_state *s = malloc(sizeof(*s));
+
+    if (!s) {
+        return -1;
+    }
+
+    s->stop = 0;
+
+    if (nk_thread_start(bench_yield_partner, s, NULL, 0, TSTACK_DEFAULT, &s->partner, ctx->cpu)) {
+        free(s);
+        return -1;
+    }
+
+    ctx->state = s;
+
+    return 0;
+}
+
+static void
+bench_yield (struct nk_bench_ctx *ctx)
+{
+    YIELD();
+}
+
+static void
+bench_yield_teardown (struct nk_bench_ctx *ctx)
+{
+    struct bench_yield_state *s = (struct bench_yield_state *)ctx->state;
+
+    s->stop = 1;
+    JOIN_FUNC(s->partner, NULL);
+    free(s);
+}
+
+NK_BENCH(ctx_switch, "nk_yield to a partner on the same cpu and back (2 switches)",
+         bench_yield, .setup = bench_yield_setup, .teardown = bench_yield_teardown);
+
+
+static FUNC_TYPE
+bench_nothing FUNC_HDR
+{
+    RETURN;
+}
+
+static void
+bench_thread_create (struct nk_bench_ctx *ctx)
+{
+    THREAD_T t;
+
+    if (!nk_thread_start(bench_nothing, NULL, NULL, 0, TSTACK_DEFAULT, &t, ctx->cpu)) {
+        JOIN_FUNC(t, NULL);
+    }
+}
+
+NK_BENCH(thread_create, "start a thread on the same cpu and join it",
+         bench_thread_create, .iters = 200, .warmup = 10);
+
+
+// the next cpu over, for the cross-cpu benchmarks
+static int
+bench_remote_setup (struct nk_bench_ctx *ctx)
+{
+    int n = nk_get_num_cpus();
+
+    if (n < 2) {
+        return -1;
+    }
+
+    ctx->state = (void *)(uint64_t)((ctx->cpu + 1) % n);
+
+    return 0;
+}
+
+static void
+bench_ipi_send (struct nk_bench_ctx *ctx)
+{
+    struct sys_info *sys = per_cpu_get(system);
+
+    apic_ipi(per_cpu_get(apic), sys->cpus[(uint64_t)ctx->state]->lapic_id, APIC_NULL_KICK_VEC);
+}
+
+NK_BENCH(ipi_send, "send a null IPI to the next cpu (sender side only)",
+         bench_ipi_send, .setup = bench_remote_setup);
+
+
+static void
+bench_xcall_noop (void *arg)
+{
+}
+
+static void
+bench_xcall (struct nk_bench_ctx *ctx)
+{
+    smp_xcall((uint64_t)ctx->state, bench_xcall_noop, NULL, 1);
+}
+
+NK_BENCH(xcall_rtt, "smp_xcall to the next cpu, waiting for it",
+         bench_xcall, .setup = bench_remote_setup);
+
+
+static volatile uint64_t bench_xcall_arrival;
+
+static void
+bench_xcall_stamp (void *arg)
+{
+    bench_xcall_arrival = rdtsc();
+}
+
+// ends on the other cpu, so it is timed here, relying on synchronized TSCs
+static uint64_t
+bench_xcall_oneway (struct nk_bench_ctx *ctx)
+{
+    uint64_t start;
+
+    bench_xcall_arrival = 0;
+    start = rdtsc();
+    smp_xcall((uint64_t)ctx->state, bench_xcall_stamp, NULL, 1);
+
+    return bench_xcall_arrival > start + ctx->tsc_overhead ?
+        bench_xcall_arrival - start - ctx->tsc_overhead : 0;
+}
+
+NK_BENCH_SELF_TIMED(xcall_oneway, "smp_xcall to the next cpu, until its function runs",
+                    bench_xcall_oneway, .setup = bench_remote_setup);
+
+#endif /* NAUT_CONFIG_BENCH */
+
 #endif
 
 void run_benchmarks(void);
@@ -0,0 +1,202 @@
+#!/usr/bin/env python3
+#
+# Converts a Nautilus event trace (see include/nautilus/trace.h) into
+# the Chrome trace event format, which chrome://tracing and
+# https://ui.perfetto.dev both open.
+#
+# The input is either a file written by "trace save path", or a capture
+# of the serial port containing the output of "trace serial", e.g. from
+#
+#   qemu-system-x86_64 -cdrom nautilus.iso -serial file:serial.out ...
+#   root-shell> trace start
+#   root-shell> (run the workload)
+#   root-shell> trace stop
+#   root-shell> trace serial
+#
+#   tools/nktrace2json.py serial.out > trace.json
+#
+# Other console output in the capture is ignored.  If it holds several
+# traces, the last complete one is used unless --index says otherwise.
+#
+# The result has a "cpus" process with a track per CPU showing what ran
+# there, and a "threads" process with a track per thread showing where
+# it ran, with its barrier waits and constraint changes alongside.
+#
+
+import argparse
+import json
+import struct
+import sys
+
+MAGIC = b"NKTRACE1"
+HEADER = struct.Struct("<8sIIIIQQQQ")
+RECORD = struct.Struct("<QHHIQQ")
+
+(NAME, SWITCH, WAKEUP, MIGRATE, IPI, TIMER,
+ BARRIER_ENTER, BARRIER_EXIT, CHANGE_BEGIN, CHANGE_END) = range(10)
+
+CONSTRAINTS = {0: "aperiodic", 1: "sporadic", 2: "periodic"}
+STATUS = {0: "init", 1: "running", 2: "waiting", 3: "suspended", 4: "exited"}
+
+CPU_PID = 0
+THREAD_PID = 1
+
+
+def from_serial(text, index):
+    traces = []
+    cur = None
+    for line in text.splitlines():
+        line = line.strip()
+        if line == "NKTRACE-BEGIN":
+            cur = bytearray()
+        elif cur is None:
+            continue
+        elif line == "NKTRACE-END":
+            traces.append(bytes(cur))
+            cur = None
+        elif line == "NKTRACE-ABORT":
+            cur = None
+        elif line.startswith("NKT "):
+            parts = line.split()
+            if len(parts) != 3:
+                raise ValueError("mangled line: %r" % line)
+            off = int(parts[1], 16)
+            if off != len(cur):
+                raise ValueError("expected offset %x, found %x" % (len(cur), off))
+            cur += bytes.fromhex(parts[2])
+    if not traces:
+        raise ValueError("no complete trace in the capture")
+    return traces[index]
+
+
+def parse(data):
+    (magic, version, rec_size, num_cpus, mask,
+     tsc_hz, tsc_mult, num_recs, lost) = HEADER.unpack_from(data, 0)
+    if magic != MAGIC:
+        raise ValueError("not a trace (magic %r)" % magic)
+    if rec_size != RECORD.size:
+        raise ValueError("record size %d, expected %d" % (rec_size, RECORD.size))
+    avail = (len(data) - HEADER.size) // rec_size
+    if avail < num_recs:
+        sys.stderr.write("warning: %d of %d records present\n" % (avail, num_recs))
+        num_recs = avail
+    recs = [RECORD.unpack_from(data, HEADER.size + i * rec_size)
+            for i in range(num_recs)]
+    hdr = dict(version=version, num_cpus=num_cpus, mask=mask, tsc_hz=tsc_hz,
+               tsc_mult=tsc_mult, lost=lost)
+    return hdr, recs
+
+
+def convert(hdr, recs):
+    mult = hdr["tsc_mult"]
+    names = {}
+    events = []
+
+    for tsc, ev, cpu, a0, a1, a2 in recs:
+        if ev == NAME:
+            names[a0] = struct.pack("<QQ", a1, a2).split(b"\0")[0].decode("ascii", "replace")
+    recs = sorted((r for r in recs if r[1] != NAME), key=lambda r: r[0])
+    if not recs:
+        return {"traceEvents": [], "otherData": hdr}
+
+    base = recs[0][0]
+
+    def us(tsc):
+        return (((tsc - base) * mult) >> 32) / 1000.0
+
+    def tname(tid):
+        return "%s (%d)" % (names.get(tid, "?"), tid)
+
+    def meta(pid, tid, name, sort):
+        events.append(dict(ph="M", pid=pid, tid=tid, name="thread_name", args=dict(name=name)))
+        events.append(dict(ph="M", pid=pid, tid=tid, name="thread_sort_index", args=dict(sort_index=sort)))
+
+    def instant(cpu, ts, name, args):
+        events.append(dict(ph="i", s="t", pid=CPU_PID, tid=cpu, ts=ts, name=name, args=args))
+
+    events.append(dict(ph="M", pid=CPU_PID, name="process_name", args=dict(name="cpus")))
+    events.append(dict(ph="M", pid=THREAD_PID, name="process_name", args=dict(name="threads")))
+
+    running = {}   # cpu -> (tid, start)
+    last = {}      # cpu -> last timestamp seen there
+    tids = set()
+
+    def run_slice(cpu, tid, start, end, why):
+        events.append(dict(ph="X", pid=CPU_PID, tid=cpu, ts=start, dur=end - start,
+                           name=tname(tid), args=dict(tid=tid, out=why)))
+        events.append(dict(ph="X", pid=THREAD_PID, tid=tid, ts=start, dur=end - start,
+                           name="cpu %d" % cpu, args=dict(cpu=cpu, out=why)))
+        tids.add(tid)
+
+    for tsc, ev, cpu, a0, a1, a2 in recs:
+        ts = us(tsc)
+        last[cpu] = ts
+        if ev == SWITCH:
+            if cpu in running:
+                tid, start = running[cpu]
+                run_slice(cpu, tid, start, ts, STATUS.get(a0, a0))
+            running[cpu] = (a2, ts)
+        elif ev == WAKEUP:
+            instant(cpu, ts, "wakeup " + tname(a1), dict(tid=a1, target_cpu=a0))
+        elif ev == MIGRATE:
+            instant(cpu, ts, "migrate " + tname(a1), dict(tid=a1, src=a0, dst=a2))
+        elif ev == IPI:
+            dest = "all" if a1 == (1 << 64) - 1 else a1
+            instant(cpu, ts, "ipi %d" % a0, dict(vector=a0, apic=dest))
+        elif ev == TIMER:
+            instant(cpu, ts, "apic timer" if a0 == 0 else "nk_timer", dict(timer=hex(a1)))
+        elif ev in (BARRIER_ENTER, BARRIER_EXIT):
+            events.append(dict(ph="b" if ev == BARRIER_ENTER else "e", cat="barrier",
+                               id="barrier-%d" % a2, pid=THREAD_PID, tid=a2, ts=ts,
+                               name="barrier g%d" % a1,
+                               args=dict(cpu=cpu, last=a0) if ev == BARRIER_EXIT else dict(cpu=cpu)))
+            tids.add(a2)
+        elif ev in (CHANGE_BEGIN, CHANGE_END):
+            args = dict(cpu=cpu)
+            if ev == CHANGE_END:
+                args["admitted"] = a2 == 0
+            events.append(dict(ph="b" if ev == CHANGE_BEGIN else "e", cat="constraints",
+                               id="change-%d" % a1, pid=THREAD_PID, tid=a1, ts=ts,
+                               name="change to " + CONSTRAINTS.get(a0, str(a0)), args=args))
+            tids.add(a1)
+
+    # whatever was running when tracing stopped
+    for cpu, (tid, start) in running.items():
+        run_slice(cpu, tid, start, last[cpu], "trace end")
+
+    for cpu in range(hdr["num_cpus"]):
+        meta(CPU_PID, cpu, "cpu %d" % cpu, cpu)
+    for tid in sorted(tids):
+        meta(THREAD_PID, tid, tname(tid), tid)
+
+    return {"traceEvents": events, "displayTimeUnit": "ns", "otherData": hdr}
+
+
+def main():
+    ap = argparse.ArgumentParser(description="Convert a Nautilus event trace to Chrome trace JSON")
+    ap.add_argument("input", help="trace file, or serial capture")
+    ap.add_argument("-o", "--output", help="output file (default stdout)")
+    ap.add_argument("--index", type=int, default=-1,
+                    help="which trace in a serial capture (default the last)")
+    args = ap.parse_args()
+
+    with open(args.input, "rb") as f:
+        data = f.read()
+
+    try:
+        if not data.startswith(MAGIC):
+            data = from_serial(data.decode("ascii", "replace"), args.index)
+        hdr, recs = parse(data)
+    except (ValueError, IndexError, struct.error) as e:
+        sys.exit("%s: %s" % (args.input, e))
+
+    if hdr["lost"]:
+        sys.stderr.write("warning: %d records were overwritten before export\n" % hdr["lost"])
+
+    out = open(args.output, "w") if args.output else sys.stdout
+    json.dump(convert(hdr, recs), out)
+    out.write("\n")
+
+
+if __name__ == "__main__":
+    main()